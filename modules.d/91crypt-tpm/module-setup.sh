@@ -19,4 +19,11 @@ installkernel() {
 install() {
     inst "$moddir/tpmkey" "/usr/bin/tpmkey"
     inst_script "$moddir/crypt-tpm-lib.sh" /lib/dracut-crypt-tpm-lib.sh
+    # without systemd tpmkey opens /dev/tpm0 itself
+    if dracut_module_included "systemd"; then
+        inst "$moddir/tpmkeyd" "/usr/bin/tpmkeyd"
+        inst_simple "$moddir/tpmkeyd.socket" "$systemdsystemunitdir/tpmkeyd.socket"
+        inst_simple "$moddir/tpmkeyd.service" "$systemdsystemunitdir/tpmkeyd.service"
+        $SYSTEMCTL -q --root "$initdir" enable tpmkeyd.socket
+    fi
 }
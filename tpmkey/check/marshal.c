@@ -0,0 +1,160 @@
+/*
+ * Check that the fixed layout request builders of marshal.h produce the
+ * same bytes as the TSS_buildbuff format strings they replaced, and time
+ * both.  Run with "make check".
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+
+#include <tpm.h>
+#include <tpmutil.h>
+#include <tpm_constants.h>
+#include <marshal.h>
+
+/* iterations of every timed builder */
+#define ROUNDS 1000000
+
+static unsigned char blob[300];
+static uint32_t bloblen;        /* not a constant, like in TPM_Unseal */
+static unsigned char nonce1[TPM_NONCE_SIZE], nonce2[TPM_NONCE_SIZE];
+static unsigned char auth1[TPM_HASH_SIZE], auth2[TPM_HASH_SIZE];
+static unsigned char subcap[4] = { 0x00, 0x00, 0x01, 0x15 };
+
+static uint32_t build_oiap(struct tpm_buffer* tb, int fixed) {
+        if (fixed)
+                return TSS_MarshalOIAP(tb);
+        return TSS_buildbuff("00 C1 T 00 00 00 0A", tb);
+}
+
+static uint32_t build_osap(struct tpm_buffer* tb, int fixed) {
+        if (fixed)
+                return TSS_MarshalOSAP(tb, TPM_ET_KEYHANDLE, 0x40000000, nonce1);
+        return TSS_buildbuff("00 C1 T 00 00 00 0B S L %", tb,
+                             TPM_ET_KEYHANDLE, 0x40000000,
+                             TPM_NONCE_SIZE, nonce1);
+}
+
+static uint32_t build_pcrread(struct tpm_buffer* tb, int fixed) {
+        if (fixed)
+                return TSS_MarshalPcrRead(tb, 7);
+        return TSS_buildbuff("00 c1 T 00 00 00 15 L", tb, 7);
+}
+
+static uint32_t build_flushspecific(struct tpm_buffer* tb, int fixed) {
+        if (fixed)
+                return TSS_MarshalFlushSpecific(tb, 0x02000001, TPM_RT_AUTH);
+        return TSS_buildbuff("00 c1 T l l l", tb,
+                             htonl(TPM_ORD_FlushSpecific),
+                             htonl(0x02000001), htonl(TPM_RT_AUTH));
+}
+
+static uint32_t build_nvreadvalue(struct tpm_buffer* tb, int fixed) {
+        if (fixed)
+                return TSS_MarshalNVReadValue(tb, 0x00011000, 128, 512);
+        return TSS_buildbuff("00 c1 T l l l l", tb,
+                             htonl(TPM_ORD_NV_ReadValue),
+                             htonl(0x00011000), htonl(128), htonl(512));
+}
+
+static uint32_t build_getcapability(struct tpm_buffer* tb, int fixed) {
+        if (fixed)
+                return TSS_MarshalGetCapability(tb, TPM_CAP_PROPERTY, subcap, sizeof(subcap));
+        return TSS_buildbuff("00 c1 T l L @", tb,
+                             htonl(TPM_ORD_GetCapability), TPM_CAP_PROPERTY,
+                             sizeof(subcap), subcap);
+}
+
+static uint32_t build_unseal1(struct tpm_buffer* tb, int fixed) {
+        if (fixed)
+                return TSS_MarshalUnseal(tb, TPM_KH_SRK, blob, bloblen,
+                                         0x02000002, nonce2, auth2, 0, NULL, NULL);
+        return TSS_buildbuff("00 C2 T l l % L % o %", tb,
+                             htonl(TPM_ORD_Unseal), htonl(TPM_KH_SRK),
+                             bloblen, blob,
+                             0x02000002, TPM_NONCE_SIZE, nonce2, 0,
+                             TPM_HASH_SIZE, auth2);
+}
+
+static uint32_t build_unseal2(struct tpm_buffer* tb, int fixed) {
+        if (fixed)
+                return TSS_MarshalUnseal(tb, TPM_KH_SRK, blob, bloblen,
+                                         0x02000001, nonce1, auth1,
+                                         0x02000002, nonce2, auth2);
+        return TSS_buildbuff("00 C3 T l l % L % o % L % o %", tb,
+                             htonl(TPM_ORD_Unseal), htonl(TPM_KH_SRK),
+                             bloblen, blob,
+                             0x02000001, TPM_NONCE_SIZE, nonce1, 0,
+                             TPM_HASH_SIZE, auth1,
+                             0x02000002, TPM_NONCE_SIZE, nonce2, 0,
+                             TPM_HASH_SIZE, auth2);
+}
+
+static const struct {
+        const char* name;
+        uint32_t (*build)(struct tpm_buffer* tb, int fixed);
+} builders[] = {
+        { "OIAP", build_oiap },
+        { "OSAP", build_osap },
+        { "PcrRead", build_pcrread },
+        { "FlushSpecific", build_flushspecific },
+        { "NV_ReadValue", build_nvreadvalue },
+        { "GetCapability", build_getcapability },
+        { "Unseal (AUTH1)", build_unseal1 },
+        { "Unseal (AUTH2)", build_unseal2 },
+};
+
+static double time_builder(uint32_t (*build)(struct tpm_buffer* tb, int fixed), int fixed) {
+        struct timespec start, end;
+        volatile uint32_t sink = 0;
+        STACK_TPM_BUFFER(tb)
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < ROUNDS; i++) {
+                sink += build(&tb, fixed);
+                /* keep the compiler from dropping the stores */
+                __asm__ volatile("" : : "r" (tb.buffer) : "memory");
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        (void) sink;
+        return ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / ROUNDS;
+}
+
+int main(void) {
+        int failed = 0;
+
+        bloblen = sizeof(blob);
+        for (unsigned int i = 0; i < bloblen; i++)
+                blob[i] = i * 7;
+        for (unsigned int i = 0; i < TPM_NONCE_SIZE; i++) {
+                nonce1[i] = 0x10 + i;
+                nonce2[i] = 0x40 + i;
+                auth1[i] = 0x80 + i;
+                auth2[i] = 0xc0 + i;
+        }
+
+        printf("%-16s %6s %12s %12s\n", "request", "bytes", "buildbuff", "fixed");
+        for (unsigned int i = 0; i < sizeof(builders) / sizeof(builders[0]); i++) {
+                STACK_TPM_BUFFER(generic)
+                STACK_TPM_BUFFER(fixed)
+                uint32_t ret1, ret2;
+
+                /* stale bytes from a previous request must not hide a gap */
+                memset(generic.buffer, 0xaa, generic.size);
+                memset(fixed.buffer, 0x55, fixed.size);
+                ret1 = builders[i].build(&generic, 0);
+                ret2 = builders[i].build(&fixed, 1);
+                if ((ret1 & ERR_MASK) || ret1 != ret2 || generic.used != fixed.used ||
+                    memcmp(generic.buffer, fixed.buffer, generic.used) != 0) {
+                        printf("%-16s differs: %u/%u bytes, returned %08x/%08x\n", builders[i].name,
+                               generic.used, fixed.used, ret1, ret2);
+                        failed = 1;
+                        continue;
+                }
+                printf("%-16s %6u %9.1f ns %9.1f ns\n", builders[i].name, fixed.used,
+                       time_builder(builders[i].build, 0), time_builder(builders[i].build, 1));
+        }
+        return failed;
+}
@@ -0,0 +1,204 @@
+/*
+ * Check the views of serialize.h on hand built TPM_KEY12,
+ * TPM_PCR_INFO_LONG and TPM_NV_DATA_PUBLIC blobs: every field must read
+ * back as written, and every truncated or oversized blob must be refused
+ * instead of being read past its end.  Run with "make check".
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <tpm.h>
+#include <tpmutil.h>
+#include <tpmfunc.h>
+#include <tpm_constants.h>
+#include <serialize.h>
+
+static int failed;
+
+#define CHECK(cond)                                                             \
+        do {                                                                    \
+                if (!(cond)) {                                                  \
+                        printf("%s:%d: %s\n", __FILE__, __LINE__, #cond);       \
+                        failed = 1;                                             \
+                }                                                               \
+        } while (0)
+
+static unsigned char parms[12], pubkey[256], encdata[300];
+
+static void build_pcr_info_long(struct tpm_buffer* tb) {
+        TPM_PCR_INFO_LONG info;
+
+        memset(&info, 0, sizeof(info));
+        info.tag = TPM_TAG_PCR_INFO_LONG;
+        info.localityAtCreation = 0x01;
+        info.localityAtRelease = 0x1f;
+        info.creationPCRSelection.sizeOfSelect = 3;
+        info.creationPCRSelection.pcrSelect[0] = 0x81;
+        info.releasePCRSelection.sizeOfSelect = 3;
+        info.releasePCRSelection.pcrSelect[2] = 0x40;
+        memset(info.digestAtCreation, 0x11, TPM_DIGEST_SIZE);
+        memset(info.digestAtRelease, 0x22, TPM_DIGEST_SIZE);
+        TPM_WritePCRInfoLong(tb, &info);
+}
+
+static void build_key(struct tpm_buffer* tb, const struct tpm_buffer* pcrinfo) {
+        TSS_buildbuff("S S S L o L S S @ @ @ @", tb,
+                      TPM_TAG_KEY12, 0, TPM_KEY_STORAGE, 0x00000004UL, TPM_AUTH_ALWAYS,
+                      (unsigned long) TPM_ALG_RSA, TPM_ES_RSAESOAEP_SHA1_MGF1, TPM_SS_NONE,
+                      sizeof(parms), parms,
+                      pcrinfo->used, pcrinfo->buffer,
+                      sizeof(pubkey), pubkey,
+                      sizeof(encdata), encdata);
+}
+
+static void build_nv_public(struct tpm_buffer* tb) {
+        TPM_NV_DATA_PUBLIC pub;
+
+        memset(&pub, 0, sizeof(pub));
+        pub.tag = TPM_TAG_NV_DATA_PUBLIC;
+        pub.nvIndex = 0x00011000;
+        pub.pcrInfoRead.pcrSelection.sizeOfSelect = 3;
+        pub.pcrInfoRead.pcrSelection.pcrSelect[0] = 0x80;
+        pub.pcrInfoRead.localityAtRelease = 0x1f;
+        memset(pub.pcrInfoRead.digestAtRelease, 0x33, TPM_DIGEST_SIZE);
+        pub.pcrInfoWrite.pcrSelection.sizeOfSelect = 3;
+        pub.pcrInfoWrite.localityAtRelease = 0x01;
+        memset(pub.pcrInfoWrite.digestAtRelease, 0x44, TPM_DIGEST_SIZE);
+        pub.permission.tag = TPM_TAG_NV_ATTRIBUTES;
+        pub.permission.attributes = TPM_NV_PER_AUTHREAD | TPM_NV_PER_OWNERWRITE;
+        pub.bWriteDefine = 1;
+        pub.dataSize = 1234;
+        TPM_WritePubInfo(&pub, tb);
+}
+
+static void check_pcr_info_long(void) {
+        struct tpm_pcr_info_long_view v;
+        STACK_TPM_BUFFER(tb)
+        uint16_t size;
+        const unsigned char* select;
+
+        build_pcr_info_long(&tb);
+        CHECK(TPM_ViewPCRInfoLong(&tb, 0, &v) == tb.used);
+        CHECK(TPM_PCRInfoLongView_Tag(&v) == TPM_TAG_PCR_INFO_LONG);
+        CHECK(TPM_PCRInfoLongView_LocalityAtCreation(&v) == 0x01);
+        CHECK(TPM_PCRInfoLongView_LocalityAtRelease(&v) == 0x1f);
+        select = TPM_PCRInfoLongView_CreationSelect(&v, &size);
+        CHECK(size == 3 && select[0] == 0x81);
+        select = TPM_PCRInfoLongView_ReleaseSelect(&v, &size);
+        CHECK(size == 3 && select[2] == 0x40);
+        CHECK(TPM_PCRInfoLongView_DigestAtCreation(&v)[0] == 0x11);
+        CHECK(TPM_PCRInfoLongView_DigestAtRelease(&v)[TPM_DIGEST_SIZE - 1] == 0x22);
+
+        for (uint32_t used = tb.used, n = 0; n < used; n++) {
+                tb.used = n;
+                CHECK(TPM_ViewPCRInfoLong(&tb, 0, &v) == ERR_BUFFER);
+                tb.used = used;
+        }
+        CHECK(TPM_ViewPCRInfoLong(&tb, tb.used + 1, &v) == ERR_BUFFER);
+}
+
+static void check_key(void) {
+        struct tpm_key_view v;
+        struct tpm_pcr_info_long_view pv;
+        STACK_TPM_BUFFER(pcrinfo)
+        STACK_TPM_BUFFER(tb)
+        const unsigned char* p;
+        uint32_t size, used;
+
+        build_pcr_info_long(&pcrinfo);
+        build_key(&tb, &pcrinfo);
+        CHECK(TPM_ViewKey(&tb, 0, &v) == tb.used);
+        CHECK(TPM_KeyView_Tag(&v) == TPM_TAG_KEY12);
+        CHECK(TPM_KeyView_KeyUsage(&v) == TPM_KEY_STORAGE);
+        CHECK(TPM_KeyView_KeyFlags(&v) == 0x00000004);
+        CHECK(TPM_KeyView_AuthDataUsage(&v) == TPM_AUTH_ALWAYS);
+        CHECK(TPM_KeyView_AlgorithmID(&v) == TPM_ALG_RSA);
+        CHECK(TPM_KeyView_EncScheme(&v) == TPM_ES_RSAESOAEP_SHA1_MGF1);
+        CHECK(TPM_KeyView_SigScheme(&v) == TPM_SS_NONE);
+        p = TPM_KeyView_Parms(&v, &size);
+        CHECK(size == sizeof(parms) && memcmp(p, parms, size) == 0);
+        p = TPM_KeyView_PCRInfo(&v, &size);
+        CHECK(size == pcrinfo.used && memcmp(p, pcrinfo.buffer, size) == 0);
+        p = TPM_KeyView_PubKey(&v, &size);
+        CHECK(size == sizeof(pubkey) && memcmp(p, pubkey, size) == 0);
+        p = TPM_KeyView_EncData(&v, &size);
+        CHECK(size == sizeof(encdata) && memcmp(p, encdata, size) == 0);
+        CHECK(TPM_ViewKeyPCRInfoLong(&v, &pv) == pcrinfo.used);
+        CHECK(TPM_PCRInfoLongView_LocalityAtRelease(&pv) == 0x1f);
+
+        used = tb.used;
+        for (uint32_t n = 0; n < used; n++) {
+                tb.used = n;
+                CHECK(TPM_ViewKey(&tb, 0, &v) == ERR_BUFFER);
+        }
+        tb.used = used;
+
+        /* an encDataSize running past the blob */
+        STORE32(tb.buffer, used - sizeof(encdata) - TPM_U32_SIZE, sizeof(encdata) + 1);
+        CHECK(TPM_ViewKey(&tb, 0, &v) == ERR_BUFFER);
+
+        /* PCR info that does not fill its PCRInfoSize, and none at all */
+        RESET_TPM_BUFFER(&tb);
+        pcrinfo.buffer[pcrinfo.used++] = 0;
+        build_key(&tb, &pcrinfo);
+        CHECK(TPM_ViewKey(&tb, 0, &v) == tb.used);
+        CHECK(TPM_ViewKeyPCRInfoLong(&v, &pv) == ERR_STRUCTURE);
+        RESET_TPM_BUFFER(&tb);
+        pcrinfo.used = 0;
+        build_key(&tb, &pcrinfo);
+        CHECK(TPM_ViewKey(&tb, 0, &v) == tb.used);
+        CHECK(TPM_ViewKeyPCRInfoLong(&v, &pv) == ERR_NOT_FOUND);
+}
+
+static void check_nv_public(void) {
+        struct tpm_nv_data_public_view v;
+        TPM_NV_DATA_PUBLIC pub, ref;
+        STACK_TPM_BUFFER(tb)
+        uint32_t used;
+
+        build_nv_public(&tb);
+        CHECK(TPM_ViewNVDataPublic(&tb, 0, &v) == tb.used);
+        CHECK(TPM_NVDataPublicView_Tag(&v) == TPM_TAG_NV_DATA_PUBLIC);
+        CHECK(TPM_NVDataPublicView_NVIndex(&v) == 0x00011000);
+        CHECK(TPM_NVDataPublicView_ReadLocality(&v) == 0x1f);
+        CHECK(TPM_NVDataPublicView_ReadDigest(&v)[0] == 0x33);
+        CHECK(TPM_NVDataPublicView_WriteLocality(&v) == 0x01);
+        CHECK(TPM_NVDataPublicView_WriteDigest(&v)[0] == 0x44);
+        CHECK(TPM_NVDataPublicView_PermissionTag(&v) == TPM_TAG_NV_ATTRIBUTES);
+        CHECK(TPM_NVDataPublicView_Attributes(&v) == (TPM_NV_PER_AUTHREAD | TPM_NV_PER_OWNERWRITE));
+        CHECK(TPM_NVDataPublicView_WriteDefine(&v) == 1);
+        CHECK(TPM_NVDataPublicView_DataSize(&v) == 1234);
+
+        /* TPM_ReadNVDataPublic reads what the generic parser reads */
+        memset(&pub, 0, sizeof(pub));
+        memset(&ref, 0, sizeof(ref));
+        CHECK(TPM_ReadNVDataPublic(&tb, 0, &pub) == tb.used);
+        CHECK(TSS_parsebuff(FORMAT_TPM_NV_DATA_PUBLIC, &tb, 0, PARAMS_TPM_NV_DATA_PUBLIC_R(&ref)) == tb.used);
+        CHECK(memcmp(&pub, &ref, sizeof(pub)) == 0);
+
+        used = tb.used;
+        for (uint32_t n = 0; n < used; n++) {
+                tb.used = n;
+                CHECK(TPM_ViewNVDataPublic(&tb, 0, &v) == ERR_BUFFER);
+                CHECK(TPM_ReadNVDataPublic(&tb, 0, &pub) == ERR_BUFFER);
+        }
+        tb.used = used;
+
+        /* a selection larger than TPM_PCR_SELECTION holds */
+        STORE16(tb.buffer, TPM_U16_SIZE + TPM_U32_SIZE, sizeof(pub.pcrInfoRead.pcrSelection.pcrSelect) + 1);
+        CHECK(TPM_ReadNVDataPublic(&tb, 0, &pub) == ERR_BUFFER);
+}
+
+int main(void) {
+        for (unsigned int i = 0; i < sizeof(encdata); i++)
+                encdata[i] = i * 7;
+        memset(parms, 0x5a, sizeof(parms));
+        memset(pubkey, 0xa5, sizeof(pubkey));
+
+        check_pcr_info_long();
+        check_key();
+        check_nv_public();
+        printf("views %s\n", failed ? "FAILED" : "ok");
+        return failed;
+}
@@ -44,6 +44,9 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/file.h>
 #include <netinet/in.h>
 #include <tpm.h>
 #include <tpmfunc.h>
@@ -55,79 +58,179 @@
 #include <tpm_error.h>
 
 
+/*
+ * Delegation blobs are stored in /run/.delegation-<instance>, or in the
+ * directory TPM_DELEGATION_DIR if that is set: a header
+ * with a hash index on (etype, keyhandle) followed by the entries, each
+ * chained to the next one in its bucket.  Lookups map the file and
+ * follow one chain.  Adding a blob writes a new file and renames it over
+ * the old one, so a reader always sees a complete store.  Writers hold a
+ * lock on <store>.lock from reading the old store to the rename, the store
+ * itself is replaced and cannot carry the lock.
+ */
+#define DELEGATION_MAGIC   0x544b4453   /* "TKDS" */
+#define DELEGATION_VERSION 1
+#define DELEGATION_BUCKETS 64
+#define DELEGATION_DIR     "/run"
+
+/* room for the store's name and the ".lock" or ".XXXXXX" suffix */
+#define DELEGATION_NAME_MAX 256
+
+struct delegation_header
+{
+        uint32_t magic;
+        uint32_t version;
+        uint32_t entries;
+        uint32_t index[DELEGATION_BUCKETS];    /* offset of first entry, 0 if none */
+};
+
 struct delegation_blob
 {
         uint32_t etype;
         uint32_t keyhandle;
-        unsigned char keyDigest[TPM_DIGEST_SIZE];
+        uint32_t next;                          /* offset of next entry in bucket */
         uint32_t blobSize;
         unsigned char passHash[TPM_HASH_SIZE];
         unsigned char oldPassHash[TPM_HASH_SIZE];
+        /* blob, padded to 4 bytes */
 };
 
-static
-char* getDelegationFile(void)
+struct delegation_store
+{
+        unsigned char* data;
+        size_t size;
+};
+
+#define DELEGATION_ENTRY_SIZE(blobSize) \
+        (sizeof(struct delegation_blob) + (((blobSize) + 3) & ~3u))
+
+/* returns -1 if the name does not fit */
+static int getDelegationFile(char* filename, size_t len)
 {
-        char* filename;
         char* inst = getenv("TPM_INSTANCE");
+        char* dir = getenv("TPM_DELEGATION_DIR");
+        int n;
 
         if (NULL == inst) {
                 inst = "0";
         }
-        filename = malloc(strlen(inst) + strlen("/tmp/.delegation-") + 2);
-        sprintf(filename, "/tmp/.delegation-%s", inst);
-        return filename;
+        if (NULL == dir) {
+                dir = DELEGATION_DIR;
+        }
+        n = snprintf(filename, len, "%s/.delegation-%s", dir, inst);
+        return (n < 0 || (size_t)n >= len) ? -1 : 0;
 }
 
-static
-TPM_BOOL TPM_FindDelegationBlob(uint32_t etype,
-                                uint32_t keyhandle,
-                                int* fd)
-{
-        unsigned int entry = 0;
-        TPM_BOOL rc = FALSE;
-        char* filename = getDelegationFile();
-
-        *fd = open(filename,O_RDWR | O_CREAT,S_IRWXU);
-        free(filename);
-        if (*fd > 0) {
-                while (1) {
-                        struct delegation_blob db;
-                        int n;
-
-                        if (sizeof(db) == read(*fd, &db, sizeof(db))) {
-                                if (db.etype == etype &&
-                                    db.keyhandle == keyhandle) {
-                                        /* found it */
-                                        n = lseek(*fd, -sizeof(db), SEEK_CUR);
-#ifdef __CYGWIN__
-                                        lseek(*fd, n, SEEK_SET);
-                                        rc = TRUE;
-#else
-                                        if (n >= 0) {
-                                                rc = TRUE;
-                                        }
-#endif
-                                        break;
-                                }
-                                /* Not the right one. */
-                                /* Jump over the blob */
-                                n = lseek(*fd, db.blobSize, SEEK_CUR);
-#ifdef __CYGWIN__
-                                lseek(*fd, n, SEEK_SET);
-#endif
-                                entry++;
-                        } else {
-                                /* Read failed. Assuming I am at the end of the
-                                   file
-                                 */
-                                rc = FALSE;
-                                break;
-                        }
+static int lockDelegationStore(const char* filename)
+{
+        char lockname[DELEGATION_NAME_MAX + 8];
+        int fd;
+
+        snprintf(lockname, sizeof(lockname), "%s.lock", filename);
+        fd = open(lockname, O_RDWR | O_CREAT | O_CLOEXEC | O_NOFOLLOW, 0600);
+        if (fd < 0) {
+                return -1;
+        }
+        while (flock(fd, LOCK_EX) < 0) {
+                if (errno != EINTR) {
+                        close(fd);
+                        return -1;
                 }
         }
+        return fd;
+}
+
+static void unlockDelegationStore(int fd)
+{
+        flock(fd, LOCK_UN);
+        close(fd);
+}
 
-        return rc;
+static unsigned int delegationBucket(uint32_t etype, uint32_t keyhandle)
+{
+        return ((etype * 0x9e3779b1) ^ keyhandle ^ (keyhandle >> 16)) % DELEGATION_BUCKETS;
+}
+
+/*
+ * Map the store read-only; the file descriptor is closed right away.
+ * Returns ERR_NOT_FOUND if there is no store or it has another format.
+ */
+static uint32_t mapDelegationStore(struct delegation_store* ds)
+{
+        char filename[DELEGATION_NAME_MAX];
+        struct stat _stat;
+        const struct delegation_header* hdr;
+        int fd;
+
+        if (getDelegationFile(filename, sizeof(filename)) != 0) {
+                return ERR_NOT_FOUND;
+        }
+        fd = open(filename, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+        if (fd < 0) {
+                return ERR_NOT_FOUND;
+        }
+        if (fstat(fd, &_stat) != 0 || !S_ISREG(_stat.st_mode) ||
+            (size_t)_stat.st_size < sizeof(struct delegation_header)) {
+                close(fd);
+                return ERR_NOT_FOUND;
+        }
+        ds->size = _stat.st_size;
+        ds->data = mmap(NULL, ds->size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (ds->data == MAP_FAILED) {
+                return ERR_BAD_FILE;
+        }
+        hdr = (const struct delegation_header*)ds->data;
+        if (hdr->magic != DELEGATION_MAGIC || hdr->version != DELEGATION_VERSION) {
+                munmap(ds->data, ds->size);
+                return ERR_NOT_FOUND;
+        }
+        return 0;
+}
+
+static void unmapDelegationStore(struct delegation_store* ds)
+{
+        munmap(ds->data, ds->size);
+}
+
+/* returns the entry at offset, NULL if it does not lie within the store */
+static const struct delegation_blob* delegationEntry(const struct delegation_store* ds,
+                                                     uint32_t offset)
+{
+        const struct delegation_blob* db;
+
+        if (offset < sizeof(struct delegation_header) ||
+            offset > ds->size - sizeof(struct delegation_blob)) {
+                return NULL;
+        }
+        db = (const struct delegation_blob*)(ds->data + offset);
+        if (db->blobSize > ds->size - offset - sizeof(struct delegation_blob)) {
+                return NULL;
+        }
+        return db;
+}
+
+static const struct delegation_blob* TPM_FindDelegationBlob(const struct delegation_store* ds,
+                                                            uint32_t etype,
+                                                            uint32_t keyhandle)
+{
+        const struct delegation_header* hdr = (const struct delegation_header*)ds->data;
+        const struct delegation_blob* db;
+        uint32_t offset = hdr->index[delegationBucket(etype, keyhandle)];
+        uint32_t n;
+
+        /* a damaged chain must not loop */
+        for (n = 0; n <= hdr->entries && offset != 0; n++) {
+                db = delegationEntry(ds, offset);
+                if (db == NULL) {
+                        return NULL;
+                }
+                if (db->etype == etype && db->keyhandle == keyhandle) {
+                        return db;
+                }
+                offset = db->next;
+        }
+        return NULL;
 }
 
 static
@@ -150,12 +253,12 @@ uint32_t TPM_GetDelegationBlobFromFile(uint32_t etype,
         if (name) {
                 int fd = 0;
 
-                fd = open(name, O_RDONLY);
-                if (fd > 0) {
+                fd = open(name, O_RDONLY | O_CLOEXEC);
+                if (fd >= 0) {
                         struct stat _stat;
 
                         fstat(fd, &_stat);
-                        if ((off_t)*bufferSize <= _stat.st_size) {
+                        if (_stat.st_size <= (off_t)*bufferSize) {
                                 *bufferSize = read(fd, buffer, _stat.st_size);
                         } else {
                                 ret = ERR_BUFFER;
@@ -174,8 +277,9 @@ uint32_t TPM_GetDelegationBlob(uint32_t etype,
                                unsigned char* newPassHash,
                                unsigned char* buffer, uint32_t* bufferSize)
 {
-        int fd = 0;
-        TPM_BOOL found;
+        struct delegation_store ds;
+        const struct delegation_blob* db;
+        uint32_t ret;
 
         (void)newPassHash;
 
@@ -184,31 +288,192 @@ uint32_t TPM_GetDelegationBlob(uint32_t etype,
                 return 0;
         }
 
-        found = TPM_FindDelegationBlob(etype,
-                                       keyhandle,
-                                       &fd);
-        if (TRUE == found) {
-                if (fd > 0) {
-                        struct delegation_blob db;
+        ret = mapDelegationStore(&ds);
+        if (ret != 0) {
+                return ret;
+        }
+        db = TPM_FindDelegationBlob(&ds, etype, keyhandle);
+        if (db == NULL) {
+                ret = ERR_NOT_FOUND;
+        } else if (*bufferSize < db->blobSize) {
+                ret = ERR_BUFFER;
+        } else {
+                memcpy(buffer, db + 1, db->blobSize);
+                *bufferSize = db->blobSize;
+        }
+        unmapDelegationStore(&ds);
+        return ret;
+}
 
-                        if (sizeof(db) == read(fd, &db, sizeof(db))) {
-                                if (*bufferSize < db.blobSize) {
-                                        return ERR_BUFFER;
-                                }
-                                if ((int)db.blobSize == read(fd, buffer, db.blobSize)) {
-                                        *bufferSize = db.blobSize;
-                                        return 0;
-                                } else {
-                                        return ERR_BAD_FILE;
+/* append an entry to the store being built in data */
+static uint32_t appendDelegationBlob(unsigned char* data, uint32_t offset,
+                                     uint32_t etype, uint32_t keyhandle,
+                                     const unsigned char* passHash,
+                                     const unsigned char* oldPassHash,
+                                     const unsigned char* blob, uint32_t blobSize)
+{
+        struct delegation_header* hdr = (struct delegation_header*)data;
+        struct delegation_blob* db = (struct delegation_blob*)(data + offset);
+        unsigned int bucket = delegationBucket(etype, keyhandle);
+
+        memset(db, 0, DELEGATION_ENTRY_SIZE(blobSize));
+        db->etype = etype;
+        db->keyhandle = keyhandle;
+        db->blobSize = blobSize;
+        if (passHash) {
+                memcpy(db->passHash, passHash, TPM_HASH_SIZE);
+        }
+        if (oldPassHash) {
+                memcpy(db->oldPassHash, oldPassHash, TPM_HASH_SIZE);
+        }
+        memcpy(db + 1, blob, blobSize);
+        db->next = hdr->index[bucket];
+        hdr->index[bucket] = offset;
+        hdr->entries++;
+        return offset + DELEGATION_ENTRY_SIZE(blobSize);
+}
+
+/****************************************************************************/
+/*                                                                          */
+/* Add a delegation blob to the store, replacing the one with the same      */
+/* etype and keyhandle                                                      */
+/*                                                                          */
+/* A store whose chains do not hold exactly its entries, each once, is      */
+/* damaged and rejected with ERR_BAD_DATA; TPM_ResetDelegation removes it.  */
+/*                                                                          */
+/****************************************************************************/
+uint32_t TPM_AddDelegationBlob(uint32_t etype,
+                               uint32_t keyhandle,
+                               unsigned char* oldPassHash,
+                               unsigned char* newPassHash,
+                               unsigned char* buffer, uint32_t bufferSize)
+{
+        char filename[DELEGATION_NAME_MAX];
+        char tmpname[DELEGATION_NAME_MAX + 8];
+        struct delegation_store ds = { NULL, 0 };
+        const struct delegation_header* old = NULL;
+        unsigned char* data;
+        size_t size = sizeof(struct delegation_header) + DELEGATION_ENTRY_SIZE(bufferSize);
+        uint32_t offset = sizeof(struct delegation_header);
+        uint32_t seen = 0;
+        uint32_t ret = 0;
+        unsigned int i;
+        int fd, lockfd;
+
+        if (buffer == NULL) {
+                return ERR_NULL_ARG;
+        }
+        if (bufferSize > TPM_MAX_BUFF_SIZE) {
+                return ERR_BAD_SIZE;
+        }
+        if (getDelegationFile(filename, sizeof(filename)) != 0) {
+                return ERR_BAD_FILE;
+        }
+        lockfd = lockDelegationStore(filename);
+        if (lockfd < 0) {
+                return ERR_BAD_FILE;
+        }
+        if (mapDelegationStore(&ds) == 0) {
+                old = (const struct delegation_header*)ds.data;
+                size += ds.size - sizeof(struct delegation_header);
+        }
+        data = calloc(1, size);
+        if (data == NULL) {
+                ret = ERR_MEM_ERR;
+                goto exit;
+        }
+        ((struct delegation_header*)data)->magic = DELEGATION_MAGIC;
+        ((struct delegation_header*)data)->version = DELEGATION_VERSION;
+
+        /*
+         * Copy all other entries, bucket by bucket.  Entries are appended,
+         * so a sound chain only holds entries of its bucket at falling
+         * offsets; that rules out loops and chains sharing entries.
+         */
+        for (i = 0; old && i < DELEGATION_BUCKETS && ret == 0; i++) {
+                const struct delegation_blob* db;
+                uint32_t o = old->index[i];
+                uint32_t prev = UINT32_MAX;
+
+                for (; o != 0; o = db->next) {
+                        db = delegationEntry(&ds, o);
+                        if (db == NULL || o >= prev ||
+                            delegationBucket(db->etype, db->keyhandle) != i ||
+                            ++seen > old->entries) {
+                                ret = ERR_BAD_DATA;
+                                break;
+                        }
+                        if (db->etype != etype || db->keyhandle != keyhandle) {
+                                if (offset + DELEGATION_ENTRY_SIZE(db->blobSize) +
+                                    DELEGATION_ENTRY_SIZE(bufferSize) > size) {
+                                        ret = ERR_BAD_DATA;
+                                        break;
                                 }
-                        } else {
-                                return ERR_BAD_FILE;
+                                offset = appendDelegationBlob(data, offset,
+                                                              db->etype, db->keyhandle,
+                                                              db->passHash, db->oldPassHash,
+                                                              (const unsigned char*)(db + 1),
+                                                              db->blobSize);
                         }
-                } else {
-                        return ERR_BAD_FILE;
+                        prev = o;
                 }
-        } else {
-                return ERR_NOT_FOUND;
         }
-        return ERR_NOT_FOUND;
+        if (old && ret == 0 && seen != old->entries) {
+                ret = ERR_BAD_DATA;
+        }
+        if (ret != 0) {
+                goto exit;
+        }
+        offset = appendDelegationBlob(data, offset, etype, keyhandle,
+                                      newPassHash, oldPassHash,
+                                      buffer, bufferSize);
+
+        snprintf(tmpname, sizeof(tmpname), "%s.XXXXXX", filename);
+        fd = mkstemp(tmpname);
+        if (fd < 0) {
+                ret = ERR_BAD_FILE;
+                goto exit;
+        }
+        if (write(fd, data, offset) != (ssize_t)offset) {
+                ret = ERR_BAD_FILE_WRITE;
+        }
+        if (close(fd) != 0 && ret == 0) {
+                ret = ERR_BAD_FILE_CLOSE;
+        }
+        if (ret == 0 && rename(tmpname, filename) != 0) {
+                ret = ERR_BAD_FILE;
+        }
+        if (ret != 0) {
+                unlink(tmpname);
+        }
+exit:
+        if (old) {
+                unmapDelegationStore(&ds);
+        }
+        free(data);
+        unlockDelegationStore(lockfd);
+        return ret;
+}
+
+/*
+ * Remove all delegation blobs of the current TPM_INSTANCE
+ */
+uint32_t TPM_ResetDelegation(void)
+{
+        char filename[DELEGATION_NAME_MAX];
+        uint32_t ret = 0;
+        int lockfd;
+
+        if (getDelegationFile(filename, sizeof(filename)) != 0) {
+                return ERR_BAD_FILE;
+        }
+        lockfd = lockDelegationStore(filename);
+        if (lockfd < 0) {
+                return ERR_BAD_FILE;
+        }
+        if (unlink(filename) != 0 && errno != ENOENT) {
+                ret = ERR_BAD_FILE;
+        }
+        unlockDelegationStore(lockfd);
+        return ret;
 }
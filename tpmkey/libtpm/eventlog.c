@@ -0,0 +1,234 @@
+/********************************************************************************/
+/*										*/
+/*                             TPM Event Log Replay                             */
+/*										*/
+/********************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tpm.h>
+#include <tpmfunc.h>
+#include <tpmutil.h>
+#include <eventlog.h>
+
+#define TPM_EVENT_HEADER_SIZE (3 * TPM_U32_SIZE + TPM_HASH_SIZE)
+
+static uint32_t load32le(const unsigned char* p)
+{
+        uint32_t v;
+
+        /* the log is written in the byte order of the platform */
+        memcpy(&v, p, sizeof(v));
+        return v;
+}
+
+/****************************************************************************/
+/*                                                                          */
+/* Read and index a SHA1 (TPM 1.2) measurement log                          */
+/*                                                                          */
+/* The arguments are...                                                     */
+/*                                                                          */
+/* filename is the log to read, NULL for TPM_EVENTLOG_FILE                  */
+/* log      receives the log; release it with TSS_EventLogFree             */
+/*                                                                          */
+/* securityfs reports a size of 0 for the log, so it is read in chunks.     */
+/****************************************************************************/
+uint32_t TSS_EventLogRead(const char* filename, struct tpm_eventlog* log)
+{
+        uint32_t ret = 0;
+        uint32_t offset;
+        uint32_t i;
+        size_t allocated = 0;
+        size_t n;
+        unsigned char* tmp;
+        FILE* f;
+
+        if (log == NULL) return ERR_NULL_ARG;
+        memset(log, 0, sizeof(*log));
+
+        f = fopen(filename ? filename : TPM_EVENTLOG_FILE, "r");
+        if (f == NULL) return ERR_BAD_FILE;
+
+        do {
+                if (log->size == allocated) {
+                        allocated += 64 * 1024;
+                        tmp = realloc(log->data, allocated);
+                        if (tmp == NULL) {
+                                ret = ERR_MEM_ERR;
+                                break;
+                        }
+                        log->data = tmp;
+                }
+                n = fread(log->data + log->size, 1, allocated - log->size, f);
+                log->size += n;
+        } while (n > 0);
+        if (ret == 0 && ferror(f))
+                ret = ERR_BAD_FILE_READ;
+        fclose(f);
+
+        /* count the events and check that they are all complete */
+        for (offset = 0; ret == 0 && offset < log->size; ++log->numEvents) {
+                if (log->size - offset < TPM_EVENT_HEADER_SIZE ||
+                    log->size - offset - TPM_EVENT_HEADER_SIZE <
+                    load32le(&log->data[offset + TPM_EVENT_HEADER_SIZE - TPM_U32_SIZE])) {
+                        ret = ERR_BAD_DATA;
+                        break;
+                }
+                offset += TPM_EVENT_HEADER_SIZE +
+                          load32le(&log->data[offset + TPM_EVENT_HEADER_SIZE - TPM_U32_SIZE]);
+        }
+
+        if (ret == 0 && log->numEvents > 0) {
+                log->events = calloc(log->numEvents, sizeof(struct tpm_event));
+                if (log->events == NULL)
+                        ret = ERR_MEM_ERR;
+        }
+
+        for (i = 0, offset = 0; ret == 0 && i < log->numEvents; ++i) {
+                struct tpm_event* ev = &log->events[i];
+
+                ev->pcrIndex = load32le(&log->data[offset]);
+                ev->eventType = load32le(&log->data[offset + TPM_U32_SIZE]);
+                memcpy(ev->digest, &log->data[offset + 2 * TPM_U32_SIZE], TPM_HASH_SIZE);
+                ev->eventSize = load32le(&log->data[offset + 2 * TPM_U32_SIZE + TPM_HASH_SIZE]);
+                ev->event = &log->data[offset + TPM_EVENT_HEADER_SIZE];
+                offset += TPM_EVENT_HEADER_SIZE + ev->eventSize;
+
+                if (ev->pcrIndex >= TPM_NUM_PCR)
+                        ret = ERR_BAD_DATA;
+                /* crypto agile logs belong to TPM 2.0 */
+                if (i == 0 && ev->eventType == TPM_EV_NO_ACTION &&
+                    ev->eventSize >= 16 &&
+                    !memcmp(ev->event, "Spec ID Event03", 16))
+                        ret = ERR_STRUCTURE;
+        }
+
+        if (ret != 0)
+                TSS_EventLogFree(log);
+        return ret;
+}
+
+void TSS_EventLogFree(struct tpm_eventlog* log)
+{
+        if (log == NULL) return;
+        free(log->events);
+        free(log->data);
+        memset(log, 0, sizeof(*log));
+}
+
+/****************************************************************************/
+/*                                                                          */
+/* Replace the digest of measured components                                */
+/*                                                                          */
+/* The arguments are...                                                     */
+/*                                                                          */
+/* pcrIndex  is the PCR whose events are searched                           */
+/* olddigest is the digest of the component as measured in this boot       */
+/* newdigest is the digest the component will have in the next boot         */
+/* count     receives the number of replaced events (may be NULL)           */
+/*                                                                          */
+/* A kernel, initrd or command line is identified by its current digest,    */
+/* which is the SHA1 of the file or string that was measured.               */
+/****************************************************************************/
+uint32_t TSS_EventLogSubstitute(struct tpm_eventlog* log,
+                                uint32_t pcrIndex,
+                                const unsigned char* olddigest,
+                                const unsigned char* newdigest,
+                                uint32_t* count)
+{
+        uint32_t i;
+        uint32_t n = 0;
+
+        if (log == NULL || olddigest == NULL || newdigest == NULL) return ERR_NULL_ARG;
+
+        for (i = 0; i < log->numEvents; ++i) {
+                struct tpm_event* ev = &log->events[i];
+
+                if (ev->pcrIndex != pcrIndex ||
+                    ev->eventType == TPM_EV_NO_ACTION ||
+                    memcmp(ev->digest, olddigest, TPM_HASH_SIZE))
+                        continue;
+                memcpy(ev->digest, newdigest, TPM_HASH_SIZE);
+                ++n;
+        }
+
+        if (count != NULL)
+                *count = n;
+        if (n == 0)
+                return ERR_NOT_FOUND;
+        return 0;
+}
+
+/****************************************************************************/
+/*                                                                          */
+/* Replay the extends of the log in software                                */
+/*                                                                          */
+/* pcrs receives the values all PCRs have after the logged extends, based   */
+/* on their power-on state.  Registers that are also extended by parties    */
+/* that do not log to this file (IMA, applications) are not predictable.    */
+/****************************************************************************/
+uint32_t TSS_EventLogReplay(const struct tpm_eventlog* log,
+                            unsigned char pcrs[TPM_NUM_PCR][TPM_HASH_SIZE])
+{
+        unsigned char work[2 * TPM_HASH_SIZE];
+        uint32_t i;
+
+        if (log == NULL || pcrs == NULL) return ERR_NULL_ARG;
+
+        /* the PC Client dynamic PCRs 17 - 22 come up as all ones */
+        for (i = 0; i < TPM_NUM_PCR; ++i)
+                memset(pcrs[i], (i >= 17 && i <= 22) ? 0xff : 0x00, TPM_HASH_SIZE);
+
+        for (i = 0; i < log->numEvents; ++i) {
+                const struct tpm_event* ev = &log->events[i];
+
+                if (ev->eventType == TPM_EV_NO_ACTION)
+                        continue;
+                memcpy(work, pcrs[ev->pcrIndex], TPM_HASH_SIZE);
+                memcpy(work + TPM_HASH_SIZE, ev->digest, TPM_HASH_SIZE);
+                TSS_sha1(work, sizeof(work), pcrs[ev->pcrIndex]);
+        }
+        return 0;
+}
+
+/****************************************************************************/
+/*                                                                          */
+/* Create a PCR_INFO structure from the replayed log                        */
+/*                                                                          */
+/* The arguments are...                                                     */
+/*                                                                          */
+/* selection is the selection of PCRs to bind to                            */
+/* info      receives the TPM_PCR_INFO, with digestAtRelease computed from  */
+/*           the predicted values; serialize it with TPM_WritePCRInfo       */
+/*           to hand it to TPM_Seal                                         */
+/****************************************************************************/
+uint32_t TSS_EventLogPCRInfo(const struct tpm_eventlog* log,
+                             const TPM_PCR_SELECTION* selection,
+                             TPM_PCR_INFO* info)
+{
+        unsigned char pcrs[TPM_NUM_PCR][TPM_HASH_SIZE];
+        unsigned char values[TPM_NUM_PCR * TPM_HASH_SIZE];
+        uint32_t ret;
+        uint32_t i;
+        uint32_t n = 0;
+
+        if (log == NULL || selection == NULL || info == NULL) return ERR_NULL_ARG;
+        if (selection->sizeOfSelect > sizeof(selection->pcrSelect)) return ERR_BAD_ARG;
+
+        ret = TSS_EventLogReplay(log, pcrs);
+        if (ret != 0) return ret;
+
+        for (i = 0; i < selection->sizeOfSelect * 8u; ++i) {
+                if (!(selection->pcrSelect[i / 8] & (1 << (i % 8)))) continue;
+                memcpy(&values[n * TPM_HASH_SIZE], pcrs[i], TPM_HASH_SIZE);
+                ++n;
+        }
+
+        memset(info, 0, sizeof(*info));
+        info->pcrSelection = *selection;
+        ret = TSS_PCRComposite(selection, values, info->digestAtRelease);
+        if (ret != 0) return ret;
+        memcpy(info->digestAtCreation, info->digestAtRelease, TPM_HASH_SIZE);
+        return 0;
+}
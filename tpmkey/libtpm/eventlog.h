@@ -0,0 +1,58 @@
+/********************************************************************************/
+/*										*/
+/*                             TPM Event Log Replay                             */
+/*										*/
+/********************************************************************************/
+
+#ifndef EVENTLOG_H
+#define EVENTLOG_H
+
+#include <stdint.h>
+#include <tpm.h>
+#include <tpm_structures.h>
+
+#define TPM_EVENTLOG_FILE "/sys/kernel/security/tpm0/binary_bios_measurements"
+
+#define TPM_EV_NO_ACTION  0x00000003 /* event that is logged but not extended */
+
+/* one TCG_PCR_EVENT of the SHA1 event log, event data points into the log */
+struct tpm_event
+{
+        uint32_t pcrIndex;
+        uint32_t eventType;
+        unsigned char digest[TPM_HASH_SIZE];
+        uint32_t eventSize;
+        const unsigned char* event;
+};
+
+struct tpm_eventlog
+{
+        unsigned char* data;
+        uint32_t size;
+        uint32_t numEvents;
+        struct tpm_event* events;
+};
+
+
+uint32_t TSS_EventLogRead(const char* filename, struct tpm_eventlog* log);
+
+
+void TSS_EventLogFree(struct tpm_eventlog* log);
+
+
+uint32_t TSS_EventLogSubstitute(struct tpm_eventlog* log,
+                                uint32_t pcrIndex,
+                                const unsigned char* olddigest,
+                                const unsigned char* newdigest,
+                                uint32_t* count);
+
+
+uint32_t TSS_EventLogReplay(const struct tpm_eventlog* log,
+                            unsigned char pcrs[TPM_NUM_PCR][TPM_HASH_SIZE]);
+
+
+uint32_t TSS_EventLogPCRInfo(const struct tpm_eventlog* log,
+                             const TPM_PCR_SELECTION* selection,
+                             TPM_PCR_INFO* info);
+
+#endif
@@ -42,6 +42,7 @@
 #include <string.h>
 #include <netinet/in.h>
 #include <tpm.h>
+#include <marshal.h>
 #include <tpmfunc.h>
 #include <tpmutil.h>
 #include <oiaposap.h>
@@ -53,21 +54,20 @@ uint32_t TPM_FlushSpecific(uint32_t handle,
                            uint32_t resourceType)
 {
         uint32_t ret;
-        uint32_t ordinal_no = htonl(TPM_ORD_FlushSpecific);
-        uint32_t handle_no  = htonl(handle);
-        uint32_t resourceType_no = htonl(resourceType);
 
         STACK_TPM_BUFFER(tpmdata)
 
-        ret = TSS_buildbuff("00 c1 T l l l",&tpmdata,
-                            ordinal_no,
-                            handle_no,
-                            resourceType_no);
+        ret = TSS_MarshalFlushSpecific(&tpmdata,
+                                       handle,
+                                       resourceType);
         if ((ret & ERR_MASK)) {
                 return ret;
         }
 
         ret = TPM_Transmit(&tpmdata,"FlushSpecific");
+        if (ret == 0 && resourceType == TPM_RT_KEY) {
+                TSS_KeyCache_Evicted(handle);
+        }
 
         return ret;
 }
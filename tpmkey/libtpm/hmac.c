@@ -40,18 +40,173 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
 #include <netinet/in.h>
 #include <tpm.h>
 #include <tpmutil.h>
 #include <oiaposap.h>
 #include <hmac.h>
 
-#include <gcrypt.h>
+#include <tpmcrypto.h>
 
 #define TPM_TAG_RSP_COMMAND       0x00C4
 #define TPM_TAG_RSP_AUTH1_COMMAND 0x00C5
 #define TPM_TAG_RSP_AUTH2_COMMAND 0x00C6
 
+/*
+ * The same HMAC key is used over and over: the shared secret or usage
+ * auth of a session authorizes every request and checks every response.
+ * Each context keeps the keyed HMAC state of the HMAC_KEYS most recently
+ * used keys, so an HMAC is two hashes over gathered buffers that start
+ * from the precomputed key blocks.
+ */
+#define HMAC_KEYS       4
+#define HMAC_MAX_PARTS  16
+
+struct hmac_key
+{
+        unsigned int keylen;
+        unsigned char key[TPM_HASH_SIZE];
+        struct tss_hmac_sha1 state;
+        uint64_t last_use;                      /* 0 if unused */
+};
+
+struct tss_hmac_keys
+{
+        uint64_t clock;
+        struct hmac_key key[HMAC_KEYS];
+};
+
+/* returns NULL for keys longer than a digest, which are not cached */
+static struct hmac_key* getHMACKey(const unsigned char* key, unsigned int keylen)
+{
+        struct tss_ctx* ctx = TSS_Ctx_Get();
+        struct tss_hmac_keys* keys = ctx->hmac_keys;
+        struct hmac_key* hk;
+        unsigned int i;
+
+        if (keylen > TPM_HASH_SIZE) {
+                return NULL;
+        }
+        if (keys == NULL) {
+                keys = calloc(1, sizeof(struct tss_hmac_keys));
+                if (keys == NULL) {
+                        return NULL;
+                }
+                ctx->hmac_keys = keys;
+        }
+        hk = &keys->key[0];
+        for (i = 0; i < HMAC_KEYS; i++) {
+                struct hmac_key* k = &keys->key[i];
+
+                if (k->last_use != 0 && k->keylen == keylen &&
+                    memcmp(k->key, key, keylen) == 0) {
+                        k->last_use = ++keys->clock;
+                        return k;
+                }
+                if (k->last_use < hk->last_use) {
+                        hk = k;
+                }
+        }
+        hk->keylen = keylen;
+        memcpy(hk->key, key, keylen);
+        TSS_Crypto_Get()->hmac_sha1_setkey(&hk->state, key, keylen);
+        hk->last_use = ++keys->clock;
+        return hk;
+}
+
+void TSS_HMAC_Free(struct tss_hmac_keys* keys)
+{
+        if (keys == NULL) {
+                return;
+        }
+        explicit_bzero(keys, sizeof(struct tss_hmac_keys));
+        free(keys);
+}
+
+/* HMAC-SHA1 over parts[0] .. parts[nparts - 1] */
+static uint32_t hmacParts(unsigned char* digest,
+                          const unsigned char* key, unsigned int keylen,
+                          const struct tss_iovec* parts, unsigned int nparts)
+{
+        const struct tss_crypto* crypto = TSS_Crypto_Get();
+        struct hmac_key* hk = getHMACKey(key, keylen);
+        struct tss_hmac_sha1 state;
+        unsigned char keydigest[TPM_HASH_SIZE];
+        uint32_t ret;
+
+        if (hk != NULL) {
+                return crypto->hmac_sha1(&hk->state, digest, parts, nparts);
+        }
+        /* uncached key, keys longer than a block are replaced by their hash */
+        if (keylen > TSS_SHA1_BLOCK_SIZE) {
+                TSS_sha1((void*)key, keylen, keydigest);
+                key = keydigest;
+                keylen = TPM_HASH_SIZE;
+        }
+        crypto->hmac_sha1_setkey(&state, key, keylen);
+        ret = crypto->hmac_sha1(&state, digest, parts, nparts);
+        explicit_bzero(&state, sizeof(state));
+        explicit_bzero(keydigest, sizeof(keydigest));
+        return ret;
+}
+
+/* HMAC of an authorization section: paramdigest, even and odd nonce, continue flag */
+static uint32_t authDigest(unsigned char* digest,
+                           const unsigned char* key, unsigned int keylen,
+                           const unsigned char* paramdigest,
+                           const unsigned char* enonce,
+                           const unsigned char* ononce,
+                           const unsigned char* continueflag)
+{
+        const struct tss_iovec parts[4] = {
+                { paramdigest, TPM_HASH_SIZE },
+                { enonce, TPM_NONCE_SIZE },
+                { ononce, TPM_NONCE_SIZE },
+                { continueflag, 1 }
+        };
+
+        return hmacParts(digest, key, keylen, parts, 4);
+}
+
+/*
+ * Digest over result code, ordinal and the (length, offset) pairs of
+ * response fields in argp
+ */
+static uint32_t responseParamDigest(const struct tpm_buffer* tb,
+                                    uint32_t* result, uint32_t* ordinal,
+                                    va_list argp,
+                                    unsigned char* paramdigest)
+{
+        struct tss_iovec parts[HMAC_MAX_PARTS];
+        unsigned int nparts = 2;
+        unsigned int dlen;
+        unsigned int dpos;
+
+        parts[0].data = result;
+        parts[0].len = TPM_U32_SIZE;
+        parts[1].data = ordinal;
+        parts[1].len = TPM_U32_SIZE;
+        for (;;) {
+                dlen = (unsigned int)va_arg(argp,unsigned int);
+                if (dlen == 0) break;
+                dpos = (unsigned int)va_arg(argp,unsigned int);
+                if (dpos + dlen > tb->used) {
+                        return ERR_BUFFER;
+                }
+                if (nparts == HMAC_MAX_PARTS) {
+                        return ERR_BAD_ARG;
+                }
+                parts[nparts].data = tb->buffer + dpos;
+                parts[nparts].len = dlen;
+                nparts++;
+        }
+        if (TSS_Crypto_Get()->sha1(paramdigest, parts, nparts) != 0) {
+                return ERR_CRYPT_ERR;
+        }
+        return 0;
+}
+
 /****************************************************************************/
 /*                                                                          */
 /* Validate the HMAC in an AUTH1 response                                   */
@@ -89,9 +244,6 @@ uint32_t TSS_checkhmac1(const struct tpm_buffer* tb, uint32_t command, unsigned
         const unsigned char* authdata;
         unsigned char testhmac[20];
         unsigned char paramdigest[20];
-        gcry_md_hd_t sha;
-        unsigned int dlen;
-        unsigned int dpos;
         va_list argp;
         const unsigned char* buffer = tb->buffer;
         uint32_t ret;
@@ -113,29 +265,16 @@ uint32_t TSS_checkhmac1(const struct tpm_buffer* tb, uint32_t command, unsigned
         continueflag = authdata - 1;
         enonce       = continueflag - TPM_NONCE_SIZE;
 
-        gcry_md_open(&sha, GCRY_MD_SHA1, 0);
-        gcry_md_write(sha,&result,4);
-        gcry_md_write(sha,&ordinal,4);
         va_start(argp,keylen);
-        for (;;) {
-                dlen = (unsigned int)va_arg(argp,unsigned int);
-                if (dlen == 0) break;
-                dpos = (unsigned int)va_arg(argp,unsigned int);
-                if (dpos + dlen > tb->used) {
-                        return ERR_BUFFER;
-                }
-                gcry_md_write(sha,buffer + dpos,dlen);
-        }
+        ret = responseParamDigest(tb, &result, &ordinal, argp, paramdigest);
         va_end(argp);
-        unsigned char* tmp = gcry_md_read(sha, 0);
-
-        memcpy(paramdigest, tmp, 20);
-        gcry_md_close(sha);
-        TSS_rawhmac(testhmac,key,keylen,TPM_HASH_SIZE,paramdigest,
-                    TPM_NONCE_SIZE,enonce,
-                    TPM_NONCE_SIZE,ononce,
-                    1,continueflag,
-                    0,0);
+        if (ret != 0) {
+                return ret;
+        }
+        ret = authDigest(testhmac,key,keylen,paramdigest,enonce,ononce,continueflag);
+        if (ret != 0) {
+                return ret;
+        }
         if (memcmp(testhmac,authdata,TPM_HASH_SIZE) != 0) return ERR_HMAC_FAIL;
         return 0;
 }
@@ -152,9 +291,6 @@ uint32_t TSS_checkhmac1New(const struct tpm_buffer* tb, uint32_t command, sessio
         const unsigned char* authdata;
         unsigned char testhmac[20];
         unsigned char paramdigest[20];
-        gcry_md_hd_t sha;
-        unsigned int dlen;
-        unsigned int dpos;
         va_list argp;
         const unsigned char* buffer = tb->buffer;
         uint32_t ret;
@@ -175,27 +311,17 @@ uint32_t TSS_checkhmac1New(const struct tpm_buffer* tb, uint32_t command, sessio
         authdata     = buffer + bufsize - TPM_HASH_SIZE;
         continueflag = authdata - 1;
         enonce       = continueflag - TPM_NONCE_SIZE;
-        gcry_md_open(&sha, GCRY_MD_SHA1, 0);
-        gcry_md_write(sha,&result,4);
-        gcry_md_write(sha,&ordinal,4);
+
         va_start(argp,keylen);
-        for (;;)
-        {
-                dlen = (unsigned int)va_arg(argp,unsigned int);
-                if (dlen == 0) break;
-                dpos = (unsigned int)va_arg(argp,unsigned int);
-                gcry_md_write(sha,buffer + dpos,dlen);
-        }
+        ret = responseParamDigest(tb, &result, &ordinal, argp, paramdigest);
         va_end(argp);
-        unsigned char* tmp = gcry_md_read(sha, 0);
-
-        memcpy(paramdigest, tmp, 20);
-        gcry_md_close(sha);
-        TSS_rawhmac(testhmac,key,keylen,TPM_HASH_SIZE,paramdigest,
-                    TPM_NONCE_SIZE,enonce,
-                    TPM_NONCE_SIZE,ononce,
-                    1,continueflag,
-                    0,0);
+        if (ret != 0) {
+                return ret;
+        }
+        ret = authDigest(testhmac,key,keylen,paramdigest,enonce,ononce,continueflag);
+        if (ret != 0) {
+                return ret;
+        }
         if (memcmp(testhmac,authdata,TPM_HASH_SIZE) != 0) return ERR_HMAC_FAIL;
         TSS_Session_SetENonce(sess,enonce);
         return 0;
@@ -247,9 +373,6 @@ uint32_t TSS_checkhmac2(const struct tpm_buffer* tb, uint32_t command,
         unsigned char testhmac1[20];
         unsigned char paramdigest[20];
         unsigned char testhmac2[20];
-        gcry_md_hd_t sha;
-        unsigned int dlen;
-        unsigned int dpos;
         va_list argp;
         const unsigned char* buffer = tb->buffer;
         uint32_t ret;
@@ -273,39 +396,200 @@ uint32_t TSS_checkhmac2(const struct tpm_buffer* tb, uint32_t command,
         continueflag2 = authdata2 - 1;
         enonce1      = continueflag1 - TPM_NONCE_SIZE;
         enonce2      = continueflag2 - TPM_NONCE_SIZE;
-        gcry_md_open(&sha, GCRY_MD_SHA1, 0);
-        gcry_md_write(sha,&result,4);
-        gcry_md_write(sha,&ordinal,4);
+
         va_start(argp,keylen2);
-        for (;;)
-        {
-                dlen = (unsigned int)va_arg(argp,unsigned int);
-                if (dlen == 0) break;
-                dpos = (unsigned int)va_arg(argp,unsigned int);
-                if (dpos + dlen > tb->used) {
-                        return ERR_BUFFER;
-                }
-                gcry_md_write(sha,buffer + dpos,dlen);
-        }
-        unsigned char* tmp = gcry_md_read(sha, 0);
-
-        memcpy(paramdigest, tmp, 20);
-        gcry_md_close(sha);
-        TSS_rawhmac(testhmac1,key1,keylen1,TPM_HASH_SIZE,paramdigest,
-                    TPM_NONCE_SIZE,enonce1,
-                    TPM_NONCE_SIZE,ononce1,
-                    1,continueflag1,
-                    0,0);
-        TSS_rawhmac(testhmac2,key2,keylen2,TPM_HASH_SIZE,paramdigest,
-                    TPM_NONCE_SIZE,enonce2,
-                    TPM_NONCE_SIZE,ononce2,
-                    1,continueflag2,
-                    0,0);
+        ret = responseParamDigest(tb, &result, &ordinal, argp, paramdigest);
+        va_end(argp);
+        if (ret != 0) {
+                return ret;
+        }
+        ret = authDigest(testhmac1,key1,keylen1,paramdigest,enonce1,ononce1,continueflag1);
+        if (ret == 0) {
+                ret = authDigest(testhmac2,key2,keylen2,paramdigest,enonce2,ononce2,continueflag2);
+        }
+        if (ret != 0) {
+                return ret;
+        }
         if (memcmp(testhmac1,authdata1,TPM_HASH_SIZE) != 0) return ERR_HMAC_FAIL;
         if (memcmp(testhmac2,authdata2,TPM_HASH_SIZE) != 0) return ERR_HMAC_FAIL;
         return 0;
 }
 
+/****************************************************************************/
+/*                                                                          */
+/* Start single pass parsing of a response                                  */
+/*                                                                          */
+/* command is the ordinal of the request in network byte order, like for    */
+/* TSS_checkhmac1. The result code and ordinal go into the paramdigest      */
+/* here, the output parameters as TSS_RspParse_Load32 and                   */
+/* TSS_RspParse_Bytes decode them.                                          */
+/* auths is the number of authorization sessions of the request; a          */
+/* successful response without as many is rejected with ERR_BADRESPONSETAG  */
+/*                                                                          */
+/****************************************************************************/
+uint32_t TSS_RspParse_Start(struct tss_rsp_parser* rp,
+                            const struct tpm_buffer* tb, uint32_t command,
+                            uint32_t auths)
+{
+        const struct tss_crypto* crypto = TSS_Crypto_Get();
+        uint32_t bufsize;
+        uint16_t tag;
+        uint32_t ret;
+
+        memset(rp, 0, sizeof(*rp));
+        rp->tb = tb;
+        ret = tpm_buffer_load32(tb, TPM_U16_SIZE, &bufsize);
+        if ((ret & ERR_MASK)) {
+                return ret;
+        }
+        switch (auths) {
+        case 0:
+                tag = TPM_TAG_RSP_COMMAND;
+                break;
+        case 1:
+                tag = TPM_TAG_RSP_AUTH1_COMMAND;
+                break;
+        case 2:
+                tag = TPM_TAG_RSP_AUTH2_COMMAND;
+                break;
+        default:
+                return ERR_BAD_ARG;
+        }
+        /* an unauthenticated answer to an authorized command is not trusted */
+        rp->tag = LOAD16(tb->buffer, 0);
+        if (rp->tag != tag) {
+                return ERR_BADRESPONSETAG;
+        }
+        if (bufsize > tb->used ||
+            bufsize < TPM_DATA_OFFSET + auths * (TPM_NONCE_SIZE + 1 + TPM_HASH_SIZE)) {
+                return ERR_BAD_RESP;
+        }
+        rp->pos = TPM_DATA_OFFSET;
+        rp->end = bufsize - auths * (TPM_NONCE_SIZE + 1 + TPM_HASH_SIZE);
+        if (crypto->sha1_init(&rp->paramdigest) != 0) {
+                return ERR_CRYPT_ERR;
+        }
+        crypto->sha1_update(&rp->paramdigest, tb->buffer + TPM_RETURN_OFFSET, TPM_U32_SIZE);
+        crypto->sha1_update(&rp->paramdigest, &command, TPM_U32_SIZE);
+        return 0;
+}
+
+/****************************************************************************/
+/*                                                                          */
+/* Decode and hash the next output parameter                                */
+/*                                                                          */
+/* TSS_RspParse_Bytes returns a pointer into the response, or NULL if the   */
+/* parameter does not fit; the error is reported by TSS_RspParse_Verify,    */
+/* which must be called once parsing started.                               */
+/*                                                                          */
+/****************************************************************************/
+const unsigned char* TSS_RspParse_Bytes(struct tss_rsp_parser* rp, uint32_t len)
+{
+        const unsigned char* data;
+
+        if (rp->ret != 0) {
+                return NULL;
+        }
+        if (len > rp->end - rp->pos) {
+                rp->ret = ERR_BAD_RESP;
+                return NULL;
+        }
+        data = rp->tb->buffer + rp->pos;
+        rp->pos += len;
+        TSS_Crypto_Get()->sha1_update(&rp->paramdigest, data, len);
+        return data;
+}
+
+uint32_t TSS_RspParse_Load32(struct tss_rsp_parser* rp, uint32_t* value)
+{
+        const unsigned char* data = TSS_RspParse_Bytes(rp, TPM_U32_SIZE);
+
+        if (data == NULL) {
+                return rp->ret;
+        }
+        *value = LOAD32(data, 0);
+        return 0;
+}
+
+/* finish the paramdigest; all output parameters must have been parsed */
+static uint32_t rspParseDigest(struct tss_rsp_parser* rp, unsigned char* paramdigest)
+{
+        TSS_Crypto_Get()->sha1_final(&rp->paramdigest, paramdigest);
+        if (rp->ret != 0) {
+                return rp->ret;
+        }
+        if (rp->pos != rp->end) {
+                return ERR_BAD_RESP;
+        }
+        return 0;
+}
+
+/* check one authorization section, which starts at pos */
+static uint32_t rspParseAuth(const struct tss_rsp_parser* rp, uint32_t pos,
+                             const unsigned char* paramdigest,
+                             const unsigned char* ononce,
+                             const unsigned char* key, unsigned int keylen)
+{
+        const unsigned char* enonce = rp->tb->buffer + pos;
+        const unsigned char* continueflag = enonce + TPM_NONCE_SIZE;
+        const unsigned char* authdata = continueflag + 1;
+        unsigned char testhmac[TPM_HASH_SIZE];
+        uint32_t ret;
+
+        ret = authDigest(testhmac, key, keylen, paramdigest, enonce, ononce, continueflag);
+        if (ret != 0) {
+                return ret;
+        }
+        if (memcmp(testhmac, authdata, TPM_HASH_SIZE) != 0) return ERR_HMAC_FAIL;
+        return 0;
+}
+
+/****************************************************************************/
+/*                                                                          */
+/* Verify the HMAC of an AUTH1 response after parsing it                    */
+/*                                                                          */
+/****************************************************************************/
+uint32_t TSS_RspParse_Verify1(struct tss_rsp_parser* rp, const unsigned char* ononce,
+                              const unsigned char* key, unsigned int keylen)
+{
+        unsigned char paramdigest[TPM_HASH_SIZE];
+        uint32_t ret;
+
+        ret = rspParseDigest(rp, paramdigest);
+        if (ret != 0) {
+                return ret;
+        }
+        if (rp->tag != TPM_TAG_RSP_AUTH1_COMMAND) return ERR_HMAC_FAIL;
+        return rspParseAuth(rp, rp->end, paramdigest, ononce, key, keylen);
+}
+
+/****************************************************************************/
+/*                                                                          */
+/* Verify the HMACs of an AUTH2 response after parsing it                   */
+/*                                                                          */
+/****************************************************************************/
+uint32_t TSS_RspParse_Verify2(struct tss_rsp_parser* rp,
+                              const unsigned char* ononce1,
+                              const unsigned char* key1, unsigned int keylen1,
+                              const unsigned char* ononce2,
+                              const unsigned char* key2, unsigned int keylen2)
+{
+        unsigned char paramdigest[TPM_HASH_SIZE];
+        uint32_t ret;
+
+        ret = rspParseDigest(rp, paramdigest);
+        if (ret != 0) {
+                return ret;
+        }
+        if (rp->tag != TPM_TAG_RSP_AUTH2_COMMAND) return ERR_HMAC_FAIL;
+        ret = rspParseAuth(rp, rp->end, paramdigest, ononce1, key1, keylen1);
+        if (ret == 0) {
+                ret = rspParseAuth(rp, rp->end + TPM_NONCE_SIZE + 1 + TPM_HASH_SIZE,
+                                   paramdigest, ononce2, key2, keylen2);
+        }
+        return ret;
+}
+
 /****************************************************************************/
 /*                                                                          */
 /* Calculate HMAC value for an AUTH1 command                                */
@@ -335,14 +619,14 @@ uint32_t TSS_authhmac(unsigned char* digest, unsigned char* key, unsigned int ke
                       unsigned char* h1, unsigned char* h2, unsigned char h3,...)
 {
         unsigned char paramdigest[TPM_HASH_SIZE];
-        gcry_md_hd_t sha;
+        struct tss_iovec parts[HMAC_MAX_PARTS];
+        unsigned int nparts = 0;
         unsigned int dlen;
         unsigned char* data;
         unsigned char c;
 
         va_list argp;
 
-        gcry_md_open(&sha, GCRY_MD_SHA1, 0);
         if (h1 == NULL || h2 == NULL) return ERR_NULL_ARG;
         c = h3;
         va_start(argp,h3);
@@ -351,22 +635,20 @@ uint32_t TSS_authhmac(unsigned char* digest, unsigned char* key, unsigned int ke
                 dlen = (unsigned int)va_arg(argp,unsigned int);
                 if (dlen == 0) break;
                 data = (unsigned char*)va_arg(argp,unsigned char*);
-                if (data == NULL) return ERR_NULL_ARG;
-
-                gcry_md_write(sha,data,dlen);
+                if (data == NULL || nparts == HMAC_MAX_PARTS) {
+                        va_end(argp);
+                        return (data == NULL) ? ERR_NULL_ARG : ERR_BAD_ARG;
+                }
+                parts[nparts].data = data;
+                parts[nparts].len = dlen;
+                nparts++;
         }
         va_end(argp);
-        const unsigned char* tmp = gcry_md_read(sha, 0);
-
-        memcpy(paramdigest, tmp, 20);
-        gcry_md_close(sha);
+        if (TSS_Crypto_Get()->sha1(paramdigest, parts, nparts) != 0) {
+                return ERR_CRYPT_ERR;
+        }
 
-        TSS_rawhmac(digest,key,keylen,TPM_HASH_SIZE,paramdigest,
-                    TPM_NONCE_SIZE,h1,
-                    TPM_NONCE_SIZE,h2,
-                    1,&c,
-                    0,0);
-        return 0;
+        return authDigest(digest,key,keylen,paramdigest,h1,h2,&c);
 }
 
 /****************************************************************************/
@@ -392,27 +674,27 @@ uint32_t TSS_authhmac(unsigned char* digest, unsigned char* key, unsigned int ke
 /****************************************************************************/
 uint32_t TSS_rawhmac(unsigned char* digest, const unsigned char* key, unsigned int keylen, ...)
 {
-        gcry_mac_hd_t hmac;
+        struct tss_iovec parts[HMAC_MAX_PARTS];
+        unsigned int nparts = 0;
         size_t dlen;
         unsigned char* data;
         va_list argp;
 
-        gcry_mac_open(&hmac, GCRY_MAC_HMAC_SHA1, 0, NULL);
-        gcry_mac_setkey(hmac, key, keylen);
-
         va_start(argp,keylen);
         for (;;)
         {
                 dlen = (size_t)va_arg(argp,unsigned int);
                 if (dlen == 0) break;
                 data = (unsigned char*)va_arg(argp,unsigned char*);
-                if (data == NULL) return ERR_NULL_ARG;
-                gcry_mac_write(hmac,data,dlen);
+                if (data == NULL || nparts == HMAC_MAX_PARTS) {
+                        va_end(argp);
+                        return (data == NULL) ? ERR_NULL_ARG : ERR_BAD_ARG;
+                }
+                parts[nparts].data = data;
+                parts[nparts].len = dlen;
+                nparts++;
         }
-        dlen = 20;
-        gcry_mac_read(hmac, digest, &dlen);
-
-        gcry_mac_close(hmac);
         va_end(argp);
-        return 0;
+
+        return hmacParts(digest, key, keylen, parts, nparts);
 }
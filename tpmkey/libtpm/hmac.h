@@ -41,6 +41,22 @@
 #define HMAC_H
 
 #include <oiaposap.h>
+#include <tpmcrypto.h>
+
+/*
+ * Parser of an authorized response that hashes the output parameters
+ * into the parameter digest while decoding them.  Nothing decoded may
+ * be used before TSS_RspParse_Verify1/2 returned 0.
+ */
+struct tss_rsp_parser
+{
+        const struct tpm_buffer* tb;
+        uint16_t tag;
+        uint32_t pos;                           /* next output parameter */
+        uint32_t end;                           /* start of the auth sections */
+        uint32_t ret;                           /* first decoding error */
+        struct tss_sha1 paramdigest;
+};
 
 
 uint32_t TSS_authhmac(unsigned char* digest, unsigned char* key, unsigned int keylen,
@@ -62,6 +78,28 @@ uint32_t TSS_checkhmac2(const struct tpm_buffer* tb, uint32_t command,
                         unsigned char* key2, unsigned int keylen2, ...);
 
 
+uint32_t TSS_RspParse_Start(struct tss_rsp_parser* rp,
+                            const struct tpm_buffer* tb, uint32_t command,
+                            uint32_t auths);
+
+
+uint32_t TSS_RspParse_Load32(struct tss_rsp_parser* rp, uint32_t* value);
+
+
+const unsigned char* TSS_RspParse_Bytes(struct tss_rsp_parser* rp, uint32_t len);
+
+
+uint32_t TSS_RspParse_Verify1(struct tss_rsp_parser* rp, const unsigned char* ononce,
+                              const unsigned char* key, unsigned int keylen);
+
+
+uint32_t TSS_RspParse_Verify2(struct tss_rsp_parser* rp,
+                              const unsigned char* ononce1,
+                              const unsigned char* key1, unsigned int keylen1,
+                              const unsigned char* ononce2,
+                              const unsigned char* key2, unsigned int keylen2);
+
+
 uint32_t TSS_rawhmac(unsigned char* digest, const unsigned char* key, unsigned int keylen, ...);
 
 
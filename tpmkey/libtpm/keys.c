@@ -51,8 +51,6 @@
 #include <hmac.h>
 #include <serialize.h>
 
-#include <gcrypt.h>
-
 
 /****************************************************************************/
 /*                                                                          */
@@ -85,9 +83,17 @@ static uint32_t TPM_EvictKey_Internal(uint32_t keyhandle, int allowTransport)
         } else {
                 ret = TPM_FlushSpecific(keyhandle, TPM_RT_KEY);
         }
+        if (ret == 0) {
+                TSS_KeyCache_Evicted(keyhandle);
+        }
         return ret;
 }
 
+uint32_t TPM_EvictKey(uint32_t keyhandle)
+{
+        return TPM_EvictKey_Internal(keyhandle, 1);
+}
+
 uint32_t TPM_EvictKey_UseRoom(uint32_t keyhandle)
 {
         uint32_t ret;
@@ -110,3 +116,111 @@ uint32_t TPM_EvictKey_UseRoom(uint32_t keyhandle)
 
         return ret;
 }
+
+/****************************************************************************/
+/*                                                                          */
+/* Load a wrapped key blob into the TPM                                     */
+/*                                                                          */
+/* The arguments are...                                                     */
+/*                                                                          */
+/* keyhandle is the handle of the parent key, 0x40000000 for the SRK        */
+/* keyauth   is the authorization data (password) for the parent key        */
+/*           or NULL if the parent key needs no authorization               */
+/* keyblob   is the serialized TPM_KEY12 (or TPM_KEY) as returned by        */
+/*           TPM_CreateWrapKey                                              */
+/* newhandle receives the handle of the loaded key                          */
+/*                                                                          */
+/* Keys are remembered by parent and SHA-1 of the blob as long as they are  */
+/* resident or swapped out; loading the same blob again returns the handle  */
+/* of the key already loaded instead of doing another RSA decryption.       */
+/*                                                                          */
+/****************************************************************************/
+uint32_t TPM_LoadKey2Blob(uint32_t keyhandle, unsigned char* keyauth,
+                          const unsigned char* keyblob, uint32_t keybloblen,
+                          uint32_t* newhandle)
+{
+        uint32_t ret;
+
+        STACK_TPM_BUFFER(tpmdata)
+        unsigned char digest[TPM_HASH_SIZE];
+        unsigned char nonceodd[TPM_NONCE_SIZE];
+        unsigned char authdata[TPM_HASH_SIZE];
+        unsigned char c = 0;
+        uint32_t ordinal_no = htonl(TPM_ORD_LoadKey2);
+        session sess;
+
+        if (keyblob == NULL || newhandle == NULL) return ERR_NULL_ARG;
+
+        TSS_sha1((void*)keyblob, keybloblen, digest);
+        if (TSS_KeyCache_Lookup(keyhandle, digest, newhandle) == 0) {
+                return 0;
+        }
+
+        ret = needKeysRoom(keyhandle, 0, 0, 1);
+        if (ret != 0) {
+                return ret;
+        }
+
+        if (keyauth != NULL) {
+                TSS_gennonce(nonceodd);
+                ret = TSS_SessionOpen(SESSION_OSAP | SESSION_OIAP | SESSION_DSAP,
+                                      &sess,
+                                      keyauth, TPM_ET_KEYHANDLE, keyhandle);
+                if (ret != 0) {
+                        return ret;
+                }
+                /* calculate authorization HMAC value */
+                ret = TSS_authhmac(authdata,TSS_Session_GetAuth(&sess),TPM_HASH_SIZE,TSS_Session_GetENonce(&sess),nonceodd,c,
+                                   TPM_U32_SIZE,&ordinal_no,
+                                   keybloblen,keyblob,
+                                   0,0);
+                if (ret != 0) {
+                        TSS_SessionClose(&sess);
+                        return ret;
+                }
+                /* build the request buffer */
+                ret = TSS_buildbuff("00 c2 T l L % L % o %",&tpmdata,
+                                    ordinal_no,
+                                    keyhandle,
+                                    keybloblen,keyblob,
+                                    TSS_Session_GetHandle(&sess),
+                                    TPM_NONCE_SIZE,nonceodd,
+                                    c,
+                                    TPM_HASH_SIZE,authdata);
+                if ((ret & ERR_MASK) != 0) {
+                        TSS_SessionClose(&sess);
+                        return ret;
+                }
+                /* transmit the request buffer to the TPM device and read the reply */
+                ret = TPM_Transmit(&tpmdata,"LoadKey2 - AUTH1");
+                TSS_SessionClose(&sess);
+                if (ret != 0) {
+                        return ret;
+                }
+                /* the key handle is not part of the response HMAC */
+                ret = TSS_checkhmac1(&tpmdata,ordinal_no,nonceodd,TSS_Session_GetAuth(&sess),TPM_HASH_SIZE,
+                                     0,0);
+                if (ret != 0) {
+                        return ret;
+                }
+        } else {
+                ret = TSS_buildbuff("00 c1 T l L %",&tpmdata,
+                                    ordinal_no,
+                                    keyhandle,
+                                    keybloblen,keyblob);
+                if ((ret & ERR_MASK) != 0) {
+                        return ret;
+                }
+                ret = TPM_Transmit(&tpmdata,"LoadKey2");
+                if (ret != 0) {
+                        return ret;
+                }
+        }
+
+        ret = tpm_buffer_load32(&tpmdata,TPM_DATA_OFFSET,newhandle);
+        if ((ret & ERR_MASK)) {
+                return ret;
+        }
+        TSS_KeyCache_Add(keyhandle, digest, *newhandle);
+        return 0;
+}
@@ -52,19 +52,380 @@
 #include "tpm_error.h"
 #include "tpm_lowlevel.h"
 
-extern uint32_t g_num_transports;
-
 
 static int IsKeyInTPM(struct tpm_buffer* capabilities, uint32_t shandle);
 
 
-static char* createKeyFilename(uint32_t keyhandle)
+static int isKeySwapable(uint32_t shandle);
+
+
+/*
+ * Contexts of swapped out keys are kept in memory, hashed by key handle.
+ * With TPM_KEY_SWAP_DIR set (e.g. to /run) they are also written to
+ * <dir>/.key-<handle>-<instance> so that another process using the same
+ * TPM can swap them back in.
+ *
+ * For the choice of keys to swap out the recency of use of up to
+ * KEYSWAP_TRACKED keys is recorded; keys are used whenever a command
+ * makes room for them with needKeysRoom.  Pinned keys are only swapped
+ * out when nothing else can make room.
+ *
+ * Keys loaded with TPM_LoadKey2Blob are remembered by parent handle and
+ * SHA-1 of their blob in a table of KEYCACHE_ENTRIES until they are
+ * evicted; being swapped out does not count since the handle is kept.
+ */
+#define KEYSWAP_BUCKETS 32
+#define KEYSWAP_TRACKED 32
+#define KEYCACHE_ENTRIES 16
+
+struct swapped_key
+{
+        uint32_t handle;
+        struct swapped_key* next;
+        uint32_t size;
+        unsigned char blob[];
+};
+
+struct key_usage
+{
+        uint32_t handle;
+        uint32_t pinned;                        /* pin count */
+        uint64_t last_use;
+};
+
+struct resident_key
+{
+        uint32_t handle;                        /* 0 if unused */
+        uint32_t parent;
+        unsigned char digest[TPM_HASH_SIZE];    /* SHA-1 of the key blob */
+};
+
+struct tss_keyswap
+{
+        struct swapped_key* bucket[KEYSWAP_BUCKETS];
+        const char* mirror_dir;
+        const char* instance;
+        uint64_t clock;
+        struct key_usage usage[KEYSWAP_TRACKED];
+        struct tss_keyswap_stats stats;
+        struct resident_key resident[KEYCACHE_ENTRIES];
+        unsigned int resident_next;             /* entry to replace when full */
+};
+
+static struct tss_keyswap* getKeySwap(void)
+{
+        struct tss_ctx* ctx = TSS_Ctx_Get();
+        struct tss_keyswap* ks = ctx->keyswap;
+
+        if (ks == NULL) {
+                ks = calloc(1, sizeof(struct tss_keyswap));
+                if (ks == NULL) {
+                        return NULL;
+                }
+                ks->mirror_dir = getenv("TPM_KEY_SWAP_DIR");
+                ks->instance = getenv("TPM_INSTANCE");
+                if (ks->instance == NULL) {
+                        ks->instance = "0";
+                }
+                ctx->keyswap = ks;
+        }
+        return ks;
+}
+
+static struct swapped_key** findSwappedKey(struct tss_keyswap* ks, uint32_t handle)
+{
+        struct swapped_key** pp = &ks->bucket[(handle ^ (handle >> 16)) % KEYSWAP_BUCKETS];
+
+        while (*pp != NULL && (*pp)->handle != handle) {
+                pp = &(*pp)->next;
+        }
+        return pp;
+}
+
+static void mirrorFilename(struct tss_keyswap* ks, uint32_t handle,
+                           char* buffer, size_t len)
+{
+        snprintf(buffer, len, "%s/.key-%08X-%s", ks->mirror_dir, handle, ks->instance);
+}
+
+static uint32_t storeKeyContext(uint32_t handle, const struct tpm_buffer* context)
+{
+        struct tss_keyswap* ks = getKeySwap();
+        struct swapped_key** pp;
+        struct swapped_key* sk;
+
+        if (ks == NULL) {
+                return ERR_MEM_ERR;
+        }
+        pp = findSwappedKey(ks, handle);
+        sk = realloc(*pp, sizeof(struct swapped_key) + context->used);
+        if (sk == NULL) {
+                return ERR_MEM_ERR;
+        }
+        if (*pp == NULL) {
+                sk->next = NULL;
+        }
+        *pp = sk;
+        sk->handle = handle;
+        sk->size = context->used;
+        memcpy(sk->blob, context->buffer, context->used);
+
+        if (ks->mirror_dir) {
+                char filename[256];
+                FILE* f;
+
+                mirrorFilename(ks, handle, filename, sizeof(filename));
+                f = fopen(filename, "w");
+                if (f) {
+                        fwrite(context->buffer, context->used, 1, f);
+                        fclose(f);
+                }
+        }
+        return 0;
+}
+
+/* returns ERR_NOT_FOUND if the key was not swapped out by us */
+static uint32_t loadKeyContext(uint32_t handle, struct tpm_buffer* context)
+{
+        struct tss_keyswap* ks = getKeySwap();
+        struct swapped_key* sk;
+
+        if (ks == NULL) {
+                return ERR_MEM_ERR;
+        }
+        sk = *findSwappedKey(ks, handle);
+        if (sk != NULL) {
+                TSS_SetTPMBuffer(context, sk->blob, sk->size);
+                return 0;
+        }
+        if (ks->mirror_dir) {
+                char filename[256];
+                unsigned char* mycontext = NULL;
+                uint32_t contextSize;
+                uint32_t ret;
+
+                mirrorFilename(ks, handle, filename, sizeof(filename));
+                ret = TPM_ReadFile(filename, &mycontext, &contextSize);
+                if ((ret & ERR_MASK) == 0) {
+                        TSS_SetTPMBuffer(context, mycontext, contextSize);
+                        free(mycontext);
+                        return 0;
+                }
+        }
+        return ERR_NOT_FOUND;
+}
+
+static void dropKeyContext(uint32_t handle)
+{
+        struct tss_keyswap* ks = getKeySwap();
+        struct swapped_key** pp;
+        struct swapped_key* sk;
+
+        if (ks == NULL) {
+                return;
+        }
+        pp = findSwappedKey(ks, handle);
+        sk = *pp;
+        if (sk != NULL) {
+                *pp = sk->next;
+                free(sk);
+        }
+        if (ks->mirror_dir) {
+                char filename[256];
+
+                mirrorFilename(ks, handle, filename, sizeof(filename));
+                unlink(filename);
+        }
+}
+
+static struct key_usage* findKeyUsage(struct tss_keyswap* ks, uint32_t handle)
+{
+        unsigned int i;
+
+        for (i = 0; i < KEYSWAP_TRACKED; i++) {
+                if (ks->usage[i].handle == handle && ks->usage[i].last_use != 0) {
+                        return &ks->usage[i];
+                }
+        }
+        return NULL;
+}
+
+/* record the use of a key, replacing the least recently used unpinned entry */
+static struct key_usage* touchKey(struct tss_keyswap* ks, uint32_t handle)
+{
+        struct key_usage* ku = findKeyUsage(ks, handle);
+        unsigned int i;
+
+        if (ku == NULL) {
+                for (i = 0; i < KEYSWAP_TRACKED; i++) {
+                        if (ks->usage[i].pinned) {
+                                continue;
+                        }
+                        if (ku == NULL || ks->usage[i].last_use < ku->last_use) {
+                                ku = &ks->usage[i];
+                        }
+                }
+                if (ku == NULL) {
+                        return NULL;
+                }
+                ku->handle = handle;
+                ku->pinned = 0;
+        }
+        ku->last_use = ++ks->clock;
+        return ku;
+}
+
+/****************************************************************************/
+/*                                                                          */
+/* Pin a key                                                                */
+/*                                                                          */
+/* A pinned key is swapped out only if no unpinned key can make room, e.g.  */
+/* the parent key of a batch of seals.  Pins nest and must be released      */
+/* with TSS_KeyUnpin.                                                       */
+/*                                                                          */
+/****************************************************************************/
+uint32_t TSS_KeyPin(uint32_t keyhandle)
+{
+        struct tss_keyswap* ks = getKeySwap();
+        struct key_usage* ku;
+
+        if (ks == NULL) {
+                return ERR_MEM_ERR;
+        }
+        if (!isKeySwapable(keyhandle)) {
+                return 0;
+        }
+        ku = touchKey(ks, keyhandle);
+        if (ku == NULL) {
+                return ERR_BUFFER;
+        }
+        ku->pinned++;
+        return 0;
+}
+
+uint32_t TSS_KeyUnpin(uint32_t keyhandle)
+{
+        struct tss_keyswap* ks = getKeySwap();
+        struct key_usage* ku;
+
+        if (ks == NULL) {
+                return ERR_MEM_ERR;
+        }
+        if (!isKeySwapable(keyhandle)) {
+                return 0;
+        }
+        ku = findKeyUsage(ks, keyhandle);
+        if (ku == NULL || ku->pinned == 0) {
+                return ERR_NOT_FOUND;
+        }
+        ku->pinned--;
+        return 0;
+}
+
+/*
+ * Get the number of key swaps done in the current context.
+ */
+uint32_t TSS_KeySwapStats(struct tss_keyswap_stats* stats)
+{
+        struct tss_keyswap* ks = getKeySwap();
+
+        if (stats == NULL) {
+                return ERR_NULL_ARG;
+        }
+        if (ks == NULL) {
+                return ERR_MEM_ERR;
+        }
+        *stats = ks->stats;
+        return 0;
+}
+
+/****************************************************************************/
+/*                                                                          */
+/* Find a loaded key by its parent and the SHA-1 of its blob                */
+/*                                                                          */
+/* Returns ERR_NOT_FOUND if the key is not loaded.                          */
+/*                                                                          */
+/****************************************************************************/
+uint32_t TSS_KeyCache_Lookup(uint32_t parent, const unsigned char* digest,
+                             uint32_t* handle)
+{
+        struct tss_keyswap* ks = getKeySwap();
+        unsigned int i;
+
+        if (ks == NULL) {
+                return ERR_MEM_ERR;
+        }
+        for (i = 0; i < KEYCACHE_ENTRIES; i++) {
+                if (ks->resident[i].handle != 0 &&
+                    ks->resident[i].parent == parent &&
+                    memcmp(ks->resident[i].digest, digest, TPM_HASH_SIZE) == 0) {
+                        *handle = ks->resident[i].handle;
+                        return 0;
+                }
+        }
+        return ERR_NOT_FOUND;
+}
+
+void TSS_KeyCache_Add(uint32_t parent, const unsigned char* digest,
+                      uint32_t handle)
 {
-        char buffer[200];
-        char* inst = getenv("TPM_INSTANCE");
+        struct tss_keyswap* ks = getKeySwap();
+        struct resident_key* rk = NULL;
+        unsigned int i;
 
-        sprintf(buffer,"/tmp/.key-%08X-%s",keyhandle,inst);
-        return strdup(buffer);
+        if (ks == NULL) {
+                return;
+        }
+        for (i = 0; i < KEYCACHE_ENTRIES && rk == NULL; i++) {
+                if (ks->resident[i].handle == 0 || ks->resident[i].handle == handle) {
+                        rk = &ks->resident[i];
+                }
+        }
+        if (rk == NULL) {
+                /* the key stays loaded, it is just not found again */
+                rk = &ks->resident[ks->resident_next];
+                ks->resident_next = (ks->resident_next + 1) % KEYCACHE_ENTRIES;
+        }
+        rk->handle = handle;
+        rk->parent = parent;
+        memcpy(rk->digest, digest, TPM_HASH_SIZE);
+}
+
+/*
+ * Called whenever a key is evicted or flushed.  Keys we swap out keep
+ * their handle, their context is stored before the eviction.
+ */
+void TSS_KeyCache_Evicted(uint32_t handle)
+{
+        struct tss_keyswap* ks = TSS_Ctx_Get()->keyswap;
+        unsigned int i;
+
+        if (ks == NULL || *findSwappedKey(ks, handle) != NULL) {
+                return;
+        }
+        for (i = 0; i < KEYCACHE_ENTRIES; i++) {
+                if (ks->resident[i].handle == handle) {
+                        ks->resident[i].handle = 0;
+                }
+        }
+}
+
+void TSS_KeySwap_Free(struct tss_keyswap* ks)
+{
+        unsigned int i;
+
+        if (ks == NULL) {
+                return;
+        }
+        for (i = 0; i < KEYSWAP_BUCKETS; i++) {
+                while (ks->bucket[i] != NULL) {
+                        struct swapped_key* sk = ks->bucket[i];
+
+                        ks->bucket[i] = sk->next;
+                        free(sk);
+                }
+        }
+        free(ks);
 }
 
 static int isKeySwapable(uint32_t shandle)
@@ -81,18 +442,16 @@ static int isKeySwapable(uint32_t shandle)
 static uint32_t swapOutKey(uint32_t handle)
 {
         unsigned char labelhash[20];
-        char* filename = createKeyFilename(handle);
 
-        STACK_TPM_BUFFER(context);
+        POOL_TPM_BUFFER(context, TPM_MAX_BUFF_SIZE)
         uint32_t ret = 0;
 
-        if (NULL == filename) {
-                ret = ERR_MEM_ERR;
-        }
-
 #if 0
         printf("Swapping OUT key with handle %08x\n",handle);
 #endif
+        if (context == NULL) {
+                return ERR_MEM_ERR;
+        }
 
         TSS_sha1("KEY",3,labelhash);
 
@@ -100,22 +459,15 @@ static uint32_t swapOutKey(uint32_t handle)
                 ret = TPM_SaveContext_UseRoom(handle,
                                               TPM_RT_KEY,
                                               (char*)labelhash,
-                                              &context);
+                                              context);
         }
 
         if (ret == 0) {
-                FILE* f = fopen(filename, "w+");
-
-                if (f) {
-                        fwrite(context.buffer, context.used, 1, f);
-                        if (fclose(f) != 0)
-                                ret = ERR_BAD_FILE_CLOSE;
-                } else {
-                        ret = ERR_BAD_FILE;
-                }
+                ret = storeKeyContext(handle, context);
         }
 
         if (ret == 0) {
+                getKeySwap()->stats.swap_outs++;
                 /*ret =*/ TPM_EvictKey_UseRoom(handle);
 #if 0
                 printf("Evicted key with handle 0x%08x\n",handle);
@@ -137,34 +489,24 @@ static uint32_t swapOutKey(uint32_t handle)
 
 static uint32_t swapInKey(uint32_t handle)
 {
-        char* filename = createKeyFilename(handle);
-
-        STACK_TPM_BUFFER(context);
-        unsigned char* mycontext = NULL;
-        uint32_t contextSize;
+        POOL_TPM_BUFFER(context, TPM_MAX_BUFF_SIZE)
         uint32_t newhandle;
         uint32_t ret;
 
-        if (NULL == filename) {
-                ret = ERR_MEM_ERR;
+        if (context == NULL) {
+                return ERR_MEM_ERR;
         }
-
-        ret = TPM_ReadFile(filename,&mycontext,&contextSize);
+        ret = loadKeyContext(handle, context);
         if ((ret & ERR_MASK)) {
 #if 0
-                printf("level: %d\n",g_num_transports);
-#endif
-#if 0
-                fprintf(stderr,"Could not read from keyfile %s.\n",filename);
+                fprintf(stderr,"No saved context for key %08x.\n",handle);
 #endif
                 return ret;
         }
-        SET_TPM_BUFFER(&context, mycontext, contextSize);
-        free(mycontext);
 
         ret = TPM_LoadContext(handle,
                               1,
-                              &context,
+                              context,
                               &newhandle);
 
         if (ret != 0) {
@@ -178,9 +520,9 @@ static uint32_t swapInKey(uint32_t handle)
                        newhandle, handle);
         }
         if (ret == 0) {
-                unlink(filename);
+                dropKeyContext(handle);
+                getKeySwap()->stats.swap_ins++;
         }
-        free(filename);
 #if 0
         if (ret == 0) {
                 fprintf(stderr, "SWAP IN Swapped in key with handle %08x.\n",handle);
@@ -192,43 +534,86 @@ static uint32_t swapInKey(uint32_t handle)
         return ret;
 }
 
+/*
+ * Find the key in the capabilities list to swap out next: the least
+ * recently used one that is not needed, pinned keys only if allowed.
+ * Returns the offset of the handle in the list, 0 if there is none.
+ */
+static uint32_t pickVictim(struct tss_keyswap* ks,
+                           struct tpm_buffer* capabilities,
+                           uint32_t key1, uint32_t key2, uint32_t key3,
+                           int allowPinned)
+{
+        uint32_t ctr, best = 0;
+        uint64_t best_use = 0;
+        uint32_t handle;
+
+        for (ctr = 2; ctr + sizeof(handle) <= capabilities->used; ctr += sizeof(handle)) {
+                struct key_usage* ku;
+                uint64_t last_use = 0;
+
+                tpm_buffer_load32(capabilities, ctr, &handle);
+                if (!isKeySwapable(handle) ||
+                    handle == key1 ||
+                    handle == key2 ||
+                    handle == key3) {
+                        continue;
+                }
+                ku = findKeyUsage(ks, handle);
+                if (ku) {
+                        if (ku->pinned && !allowPinned) {
+                                continue;
+                        }
+                        last_use = ku->last_use;
+                }
+                if (best == 0 || last_use < best_use) {
+                        best = ctr;
+                        best_use = last_use;
+                }
+        }
+        return best;
+}
+
 static uint32_t swapOutKeys(uint32_t neededslots,
                             uint32_t key1, uint32_t key2, uint32_t key3,
                             struct tpm_buffer* capabilities,
                             uint32_t* orig_key1)
 {
+        struct tss_keyswap* ks = getKeySwap();
         uint32_t ret = 0;
         uint32_t ctr;
         uint32_t handle;
+        int allowPinned;
 
 #if 0
         fprintf(stderr,"%s: neededslots: %d\n", __FUNCTION__,neededslots);
 #endif
         if (orig_key1)
                 *orig_key1 = 0;
+        if (ks == NULL)
+                return ERR_MEM_ERR;
 
 #if 0
         fprintf(stderr,"must keep keys %08x %08x %08x   room=%d\n",
                 key1,key2,key3,neededslots);
 #endif
-        ctr = 2;
-
-        while (ctr < capabilities->used) {
-                tpm_buffer_load32(capabilities,
-                                  ctr,
-                                  &handle);
+        for (allowPinned = 0; allowPinned < 2 && neededslots > 0; allowPinned++) {
+                while (neededslots > 0) {
+                        ctr = pickVictim(ks, capabilities, key1, key2, key3, allowPinned);
+                        if (ctr == 0)
+                                break;
+                        tpm_buffer_load32(capabilities, ctr, &handle);
+                        /* never pick this handle again */
+                        STORE32(capabilities->buffer, ctr, 0);
 
-                if (handle != key1 &&
-                    handle != key2 &&
-                    handle != key3) {
                         ret = swapOutKey(handle);
                         if (ret == 0 && orig_key1 && *orig_key1 == 0) {
                                 *orig_key1 = handle;
                         }
                         if (ret == 0) {
+                                if (allowPinned)
+                                        ks->stats.pinned_swap_outs++;
                                 neededslots--;
-                                if (neededslots == 0)
-                                        break;
                         }
 #if 0
                         if (ret == 0)
@@ -236,13 +621,10 @@ static uint32_t swapOutKeys(uint32_t neededslots,
                         if (ret == TPM_OWNER_CONTROL)
                                 fprintf(stderr,"KEY UNDER OWNER CONTROL = 0x%08x\n", handle);
 #endif
+                        if (ret != 0 && ret != TPM_OWNER_CONTROL) {
+                                return ret;
+                        }
                 }
-
-                if (ret != 0 && ret != TPM_OWNER_CONTROL) {
-                        break;
-                }
-
-                ctr += sizeof(handle);
         }
 
         if (ret == TPM_OWNER_CONTROL)
@@ -302,13 +684,13 @@ needKeysRoom_General(uint32_t key1, uint32_t key2, uint32_t key3,
         uint32_t ret = 0;
         uint32_t scap_no;
 
-        STACK_TPM_BUFFER(context);
-        STACK_TPM_BUFFER(scap);
-        STACK_TPM_BUFFER(capabilities);
+        POOL_TPM_BUFFER(scap, TPM_U32_SIZE)
+        POOL_TPM_BUFFER(capabilities, TPM_MAX_BUFF_SIZE)
         uint32_t tpmkeyroom;
         uint32_t keysintpm;
         int intpm1, intpm2, intpm3;
         uint32_t neededslots;
+        struct tss_keyswap* ks;
         char* tmp1;
         char* tmp2;
         char* tmp3;
@@ -322,9 +704,22 @@ needKeysRoom_General(uint32_t key1, uint32_t key2, uint32_t key3,
             (tmp3 && !strcmp(tmp3,"1"))) {
                 return 0;
         }
+        if (scap == NULL || capabilities == NULL) {
+                return ERR_MEM_ERR;
+        }
+
+        ks = getKeySwap();
+        if (ks != NULL) {
+                if (isKeySwapable(key1))
+                        touchKey(ks, key1);
+                if (isKeySwapable(key2))
+                        touchKey(ks, key2);
+                if (isKeySwapable(key3))
+                        touchKey(ks, key3);
+        }
 
 #if 0
-        printf("level: %d\n",g_num_transports);
+        printf("level: %d\n",TSS_Ctx_Get()->num_transports);
 #endif
         /*
          * Support for 1.1 TPMs is not possible since the key handle
@@ -339,25 +734,25 @@ needKeysRoom_General(uint32_t key1, uint32_t key2, uint32_t key3,
          *  If necessary, swap as many keys out such that there's enough
          *  room for 'room' keys.
          */scap_no = htonl(TPM_CAP_PROP_MAX_KEYS); // 0x110
-        SET_TPM_BUFFER(&scap, &scap_no, sizeof(scap_no));
+        SET_TPM_BUFFER(scap, &scap_no, sizeof(scap_no));
         ret = TPM_GetCapability_NoTransport(TPM_CAP_PROPERTY, // 0x5
-                                            &scap,
-                                            &capabilities);
+                                            scap,
+                                            capabilities);
         if (ret != 0) {
                 /* call may fail at very beginning */
                 return 0;
         } else {
-                ret = tpm_buffer_load32(&capabilities, 0, &tpmkeyroom);
+                ret = tpm_buffer_load32(capabilities, 0, &tpmkeyroom);
                 if (ret != 0) {
                         return ret;
                 }
         }
 
         scap_no = ntohl(TPM_RT_KEY);
-        SET_TPM_BUFFER(&scap, &scap_no, sizeof(scap_no));
+        SET_TPM_BUFFER(scap, &scap_no, sizeof(scap_no));
         ret = TPM_GetCapability_NoTransport(TPM_CAP_KEY_HANDLE,
-                                            &scap,
-                                            &capabilities);
+                                            scap,
+                                            capabilities);
         if (ret != 0) {
                 printf("Error %s from TPM_GetCapability.\n",
                        TPM_GetErrMsg(ret));
@@ -366,21 +761,21 @@ needKeysRoom_General(uint32_t key1, uint32_t key2, uint32_t key3,
 
         neededslots = room;
 
-        intpm1 = IsKeyInTPM(&capabilities, key1);
+        intpm1 = IsKeyInTPM(capabilities, key1);
         if (!intpm1)
                 neededslots++;
-        intpm2 = IsKeyInTPM(&capabilities, key2);
+        intpm2 = IsKeyInTPM(capabilities, key2);
         if (!intpm2)
                 neededslots++;
-        intpm3 = IsKeyInTPM(&capabilities, key3);
+        intpm3 = IsKeyInTPM(capabilities, key3);
         if (!intpm3)
                 neededslots++;
 
 #if 0
         uint32_t ctr, handle;
 
-        for (ctr = 2; ctr < capabilities.used; ctr += sizeof(handle)) {
-                ret = tpm_buffer_load32(&capabilities,
+        for (ctr = 2; ctr < capabilities->used; ctr += sizeof(handle)) {
+                ret = tpm_buffer_load32(capabilities,
                                         ctr,
                                         &handle);
                 if (ret != 0) {
@@ -390,7 +785,7 @@ needKeysRoom_General(uint32_t key1, uint32_t key2, uint32_t key3,
         }
 #endif
 
-        keysintpm = (capabilities.used - 2) / 4;
+        keysintpm = (capabilities->used - 2) / 4;
 
 #if 0
         fprintf(stderr,"TPM has room for %d keys, holds %d keys. need %d slots\n",
@@ -404,7 +799,7 @@ needKeysRoom_General(uint32_t key1, uint32_t key2, uint32_t key3,
                                   key1,
                                   key2,
                                   key3,
-                                  &capabilities,
+                                  capabilities,
                                   orig_key1);
 #if 0
         } else {
@@ -441,13 +836,13 @@ uint32_t needKeysRoom(uint32_t key1, uint32_t key2, uint32_t key3,
 {
         char* trans = getenv("TPM_TRANSPORT");
         uint32_t transport = 0;
-        /* g_num_transport likely always 0 */
+        /* num_transports likely always 0 */
         uint32_t rm;
 
         if (trans && !strcmp("1", trans))
                 transport = 1;
 
-        rm = room + g_num_transports + 2 + transport;
+        rm = room + TSS_Ctx_Get()->num_transports + 2 + transport;
         if (room < 0)
                 rm = 0;
         else {
@@ -0,0 +1,177 @@
+/********************************************************************************/
+/*										*/
+/*                     TPM Fixed Layout Command Marshalling                     */
+/*										*/
+/********************************************************************************/
+
+#ifndef MARSHAL_H
+#define MARSHAL_H
+
+#include <stdint.h>
+#include <string.h>
+#include <tpm.h>
+#include <tpm_constants.h>
+
+/*
+ * Request builders for the ordinals on the unseal path.  They produce the
+ * same bytes as the TSS_buildbuff format strings they replace, but write
+ * every field at an offset that is fixed at compile time.  Like
+ * TSS_buildbuff they set tb->used and return the request length, or an
+ * error code.  Everything else keeps using TSS_buildbuff.
+ */
+
+#define TPM_REQ_HEADER_SIZE     (TPM_U16_SIZE + TPM_U32_SIZE + TPM_U32_SIZE)
+#define TPM_REQ_AUTH_SIZE       (TPM_U32_SIZE + TPM_NONCE_SIZE + 1 + TPM_HASH_SIZE)
+
+#define TPM_OIAP_REQ_SIZE               TPM_REQ_HEADER_SIZE
+#define TPM_OSAP_REQ_SIZE               (TPM_REQ_HEADER_SIZE + TPM_U16_SIZE + TPM_U32_SIZE + TPM_NONCE_SIZE)
+#define TPM_PCRREAD_REQ_SIZE            (TPM_REQ_HEADER_SIZE + TPM_U32_SIZE)
+#define TPM_FLUSHSPECIFIC_REQ_SIZE      (TPM_REQ_HEADER_SIZE + 2 * TPM_U32_SIZE)
+#define TPM_NVREADVALUE_REQ_SIZE        (TPM_REQ_HEADER_SIZE + 3 * TPM_U32_SIZE)
+#define TPM_GETCAPABILITY_REQ_SIZE      (TPM_REQ_HEADER_SIZE + 2 * TPM_U32_SIZE)   /* without subCap */
+#define TPM_UNSEAL_REQ_SIZE             (TPM_REQ_HEADER_SIZE + TPM_U32_SIZE)       /* without blob and auth */
+
+_Static_assert(TPM_OSAP_REQ_SIZE == 36, "OSAP request layout");
+_Static_assert(TPM_REQ_AUTH_SIZE == 45, "authorization section layout");
+_Static_assert(TPM_UNSEAL_REQ_SIZE + 2 * TPM_REQ_AUTH_SIZE <= TPM_MAX_BUFF_SIZE,
+               "Unseal request does not fit a stack buffer");
+_Static_assert(TPM_NVREADVALUE_REQ_SIZE + TPM_REQ_AUTH_SIZE <= TPM_MAX_BUFF_SIZE,
+               "NV_ReadValue request does not fit a stack buffer");
+
+static inline uint32_t TSS_MarshalHeader(struct tpm_buffer* tb,
+                                         uint16_t tag,
+                                         uint32_t size,
+                                         uint32_t ordinal)
+{
+        if (size > tb->size) return ERR_BUFFER;
+        store16(tb->buffer, 0, tag);
+        store32(tb->buffer, TPM_U16_SIZE, size);
+        store32(tb->buffer, TPM_U16_SIZE + TPM_U32_SIZE, ordinal);
+        tb->used = size;
+        return size;
+}
+
+/* authorization section at offset: handle, nonceOdd, continue, auth */
+static inline void TSS_MarshalAuth(struct tpm_buffer* tb,
+                                   uint32_t offset,
+                                   uint32_t authhandle,
+                                   const unsigned char* nonceodd,
+                                   unsigned char c,
+                                   const unsigned char* authdata)
+{
+        store32(tb->buffer, offset, authhandle);
+        memcpy(&tb->buffer[offset + TPM_U32_SIZE], nonceodd, TPM_NONCE_SIZE);
+        tb->buffer[offset + TPM_U32_SIZE + TPM_NONCE_SIZE] = c;
+        memcpy(&tb->buffer[offset + TPM_U32_SIZE + TPM_NONCE_SIZE + 1], authdata, TPM_HASH_SIZE);
+}
+
+static inline uint32_t TSS_MarshalOIAP(struct tpm_buffer* tb)
+{
+        return TSS_MarshalHeader(tb, TPM_TAG_RQU_COMMAND, TPM_OIAP_REQ_SIZE, TPM_ORD_OIAP);
+}
+
+static inline uint32_t TSS_MarshalOSAP(struct tpm_buffer* tb,
+                                       uint16_t etype,
+                                       uint32_t evalue,
+                                       const unsigned char* nonceOddOSAP)
+{
+        uint32_t ret = TSS_MarshalHeader(tb, TPM_TAG_RQU_COMMAND, TPM_OSAP_REQ_SIZE, TPM_ORD_OSAP);
+
+        if ((ret & ERR_MASK)) return ret;
+        store16(tb->buffer, TPM_REQ_HEADER_SIZE, etype);
+        store32(tb->buffer, TPM_REQ_HEADER_SIZE + TPM_U16_SIZE, evalue);
+        memcpy(&tb->buffer[TPM_REQ_HEADER_SIZE + TPM_U16_SIZE + TPM_U32_SIZE],
+               nonceOddOSAP, TPM_NONCE_SIZE);
+        return ret;
+}
+
+static inline uint32_t TSS_MarshalPcrRead(struct tpm_buffer* tb, uint32_t pcrindex)
+{
+        uint32_t ret = TSS_MarshalHeader(tb, TPM_TAG_RQU_COMMAND, TPM_PCRREAD_REQ_SIZE, TPM_ORD_PcrRead);
+
+        if ((ret & ERR_MASK)) return ret;
+        store32(tb->buffer, TPM_REQ_HEADER_SIZE, pcrindex);
+        return ret;
+}
+
+static inline uint32_t TSS_MarshalFlushSpecific(struct tpm_buffer* tb,
+                                                uint32_t handle,
+                                                uint32_t resourceType)
+{
+        uint32_t ret = TSS_MarshalHeader(tb, TPM_TAG_RQU_COMMAND, TPM_FLUSHSPECIFIC_REQ_SIZE, TPM_ORD_FlushSpecific);
+
+        if ((ret & ERR_MASK)) return ret;
+        store32(tb->buffer, TPM_REQ_HEADER_SIZE, handle);
+        store32(tb->buffer, TPM_REQ_HEADER_SIZE + TPM_U32_SIZE, resourceType);
+        return ret;
+}
+
+static inline uint32_t TSS_MarshalNVReadValue(struct tpm_buffer* tb,
+                                              uint32_t nvIndex,
+                                              uint32_t offset,
+                                              uint32_t datasize)
+{
+        uint32_t ret = TSS_MarshalHeader(tb, TPM_TAG_RQU_COMMAND, TPM_NVREADVALUE_REQ_SIZE, TPM_ORD_NV_ReadValue);
+
+        if ((ret & ERR_MASK)) return ret;
+        store32(tb->buffer, TPM_REQ_HEADER_SIZE, nvIndex);
+        store32(tb->buffer, TPM_REQ_HEADER_SIZE + TPM_U32_SIZE, offset);
+        store32(tb->buffer, TPM_REQ_HEADER_SIZE + 2 * TPM_U32_SIZE, datasize);
+        return ret;
+}
+
+static inline uint32_t TSS_MarshalGetCapability(struct tpm_buffer* tb,
+                                                uint32_t caparea,
+                                                const unsigned char* subcap,
+                                                uint32_t subcaplen)
+{
+        uint32_t ret;
+
+        if (subcaplen > 0 && subcap == NULL) return ERR_NULL_ARG;
+        if (tb->size < TPM_GETCAPABILITY_REQ_SIZE ||
+            subcaplen > tb->size - TPM_GETCAPABILITY_REQ_SIZE) return ERR_BUFFER;
+        ret = TSS_MarshalHeader(tb, TPM_TAG_RQU_COMMAND,
+                                TPM_GETCAPABILITY_REQ_SIZE + subcaplen,
+                                TPM_ORD_GetCapability);
+        if ((ret & ERR_MASK)) return ret;
+        store32(tb->buffer, TPM_REQ_HEADER_SIZE, caparea);
+        store32(tb->buffer, TPM_REQ_HEADER_SIZE + TPM_U32_SIZE, subcaplen);
+        if (subcaplen > 0)
+                memcpy(&tb->buffer[TPM_GETCAPABILITY_REQ_SIZE], subcap, subcaplen);
+        return ret;
+}
+
+/* Unseal with one (data) or two (key and data) authorization sections */
+static inline uint32_t TSS_MarshalUnseal(struct tpm_buffer* tb,
+                                         uint32_t keyhandle,
+                                         const unsigned char* blob,
+                                         uint32_t bloblen,
+                                         uint32_t authhandle1,
+                                         const unsigned char* nonceodd1,
+                                         const unsigned char* authdata1,
+                                         uint32_t authhandle2,
+                                         const unsigned char* nonceodd2,
+                                         const unsigned char* authdata2)
+{
+        uint32_t auths = (nonceodd2 != NULL) ? 2 : 1;
+        uint32_t fixed = TPM_UNSEAL_REQ_SIZE + auths * TPM_REQ_AUTH_SIZE;
+        uint32_t ret;
+
+        if (blob == NULL) return ERR_NULL_ARG;
+        if (tb->size < fixed || bloblen > tb->size - fixed) return ERR_BUFFER;
+        ret = TSS_MarshalHeader(tb,
+                                auths == 2 ? TPM_TAG_RQU_AUTH2_COMMAND : TPM_TAG_RQU_AUTH1_COMMAND,
+                                TPM_UNSEAL_REQ_SIZE + bloblen + auths * TPM_REQ_AUTH_SIZE,
+                                TPM_ORD_Unseal);
+        if ((ret & ERR_MASK)) return ret;
+        store32(tb->buffer, TPM_REQ_HEADER_SIZE, keyhandle);
+        memcpy(&tb->buffer[TPM_UNSEAL_REQ_SIZE], blob, bloblen);
+        TSS_MarshalAuth(tb, TPM_UNSEAL_REQ_SIZE + bloblen,
+                        authhandle1, nonceodd1, 0, authdata1);
+        if (auths == 2)
+                TSS_MarshalAuth(tb, TPM_UNSEAL_REQ_SIZE + bloblen + TPM_REQ_AUTH_SIZE,
+                                authhandle2, nonceodd2, 0, authdata2);
+        return ret;
+}
+
+#endif
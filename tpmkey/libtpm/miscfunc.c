@@ -42,6 +42,7 @@
 #include <string.h>
 #include <netinet/in.h>
 #include <tpm.h>
+#include <marshal.h>
 #include <tpmutil.h>
 #include <oiaposap.h>
 #include <tpmfunc.h>
@@ -143,7 +144,6 @@ static uint32_t TPM_GetCapability_Internal(uint32_t caparea,
 {
         uint32_t ret;
         uint32_t rlen;
-        uint32_t ordinal_no = htonl(TPM_ORD_GetCapability);
 
         STACK_TPM_BUFFER(tpmdata)       /* request/response buffer */
         uint32_t scaplen = 0;
@@ -157,10 +157,9 @@ static uint32_t TPM_GetCapability_Internal(uint32_t caparea,
         if (response == NULL)
                 return ERR_NULL_ARG;
 
-        ret = TSS_buildbuff("00 c1 T l L @",&tpmdata,
-                            ordinal_no,
-                            caparea,
-                            scaplen,buffer);
+        ret = TSS_MarshalGetCapability(&tpmdata,
+                                       caparea,
+                                       buffer,scaplen);
         if ((ret & ERR_MASK) != 0)
                 return ret;
 
@@ -603,6 +602,35 @@ char* TPM_GetErrMsg(uint32_t code)
         return msgs[0];
 }
 
+/* used as long as the TPM did not tell its input buffer size */
+#define TPM_INPUT_BUFFER_DEFAULT        (2 * 1024)
+#define TPM_INPUT_BUFFER_MIN            512
+
+/*
+ * The largest command that can be sent to the TPM in one piece: the
+ * TPM's input buffer, limited to what a tpm_buffer holds.  The TPM is
+ * asked once per context.
+ */
+uint32_t TSS_GetInputBufferSize(void)
+{
+        struct tss_ctx* ctx = TSS_Ctx_Get();
+        uint32_t size;
+
+        if (ctx->buf_len == -1) {
+                if (TPM_GetTPMInputBufferSize(&size) != 0) {
+                        /* try again with the next command */
+                        return TPM_INPUT_BUFFER_DEFAULT;
+                }
+                if (size > TPM_MAX_BUFF_SIZE) {
+                        size = TPM_MAX_BUFF_SIZE;
+                } else if (size < TPM_INPUT_BUFFER_MIN) {
+                        size = TPM_INPUT_BUFFER_MIN;
+                }
+                ctx->buf_len = size;
+        }
+        return ctx->buf_len;
+}
+
 /*
  * Allocate a TPM buffer that can be used to communicate
  * with the TPM. It will be of the size that the TPM
@@ -612,35 +640,8 @@ struct tpm_buffer* TSS_AllocTPMBuffer(int len)
 {
         struct tpm_buffer* buf = NULL;
 
-        STACK_TPM_BUFFER(scap)
-        STORE32(scap.buffer, 0, TPM_CAP_PROP_INPUT_BUFFER);
-        scap.used = 4;
-
         if (len <= 0) {
-                STACK_TPM_BUFFER(response)
-                static int buf_len = -1;
-
-                if (buf_len == -1) {
-                        uint32_t ret = -1;
-
-#if 0
-                        /* MUST check if GetCapability is audited... */
-                        _TPM_IsAuditedOrdinal(TPM_ORD_GetCapability,&ret);
-                        if (0 == ret) {
-                                /* Only do this once through usage of the static var. */
-                                ret = TPM_GetCapability(TPM_CAP_PROPERTY,
-                                                        &scap,
-                                                        &response);
-                        }
-#endif
-                        if (0 != ret) {
-                                buf_len = 2 * 1024;
-                        } else {
-                                buf_len = LOAD32(response.buffer, 0);
-                        }
-                } else {
-                        len = buf_len;
-                }
+                len = TSS_GetInputBufferSize();
         }
         if (len > 16 * 1024) {
                 len = 16 * 1024;
@@ -660,6 +661,139 @@ void TSS_FreeTPMBuffer(struct tpm_buffer* buf)
         free(buf);
 }
 
+/*
+ * The buffer arena of a context is a second stack for POOL_TPM_BUFFER:
+ * buffers are carved off the top and given back in reverse order when
+ * they go out of scope.  Unlike stack buffers they are neither zeroed
+ * nor rounded up to TPM_MAX_BUFF_SIZE.  If the arena is full, buffers
+ * come from the heap.
+ */
+#define BUFFER_ARENA_SIZE       (8 * TPM_MAX_BUFF_SIZE)
+#define BUFFER_ARENA_ALIGN      16
+
+struct tss_buffer_arena
+{
+        size_t top;                             /* first free byte */
+        size_t peak;                            /* highest top since the last report */
+        size_t heap;                            /* bytes from the heap since the last report */
+        unsigned char mem[BUFFER_ARENA_SIZE] __attribute__((aligned(BUFFER_ARENA_ALIGN)));
+};
+
+struct tpm_buffer* TSS_GetPoolBuffer(uint32_t len)
+{
+        struct tss_ctx* ctx = TSS_Ctx_Get();
+        struct tss_buffer_arena* arena = ctx->buffer_arena;
+        struct tpm_buffer* buf;
+        size_t need;
+
+        if (len > TPM_MAX_BUFF_SIZE) {
+                len = TPM_MAX_BUFF_SIZE;
+        }
+        need = ((size_t)&((struct tpm_buffer*)0)->buffer[len] + BUFFER_ARENA_ALIGN - 1) &
+               ~(size_t)(BUFFER_ARENA_ALIGN - 1);
+        if (arena == NULL) {
+                arena = malloc(sizeof(struct tss_buffer_arena));
+                if (arena != NULL) {
+                        arena->top = 0;
+                        arena->peak = 0;
+                        arena->heap = 0;
+                        ctx->buffer_arena = arena;
+                }
+        }
+        if (arena != NULL && need <= BUFFER_ARENA_SIZE - arena->top) {
+                buf = (struct tpm_buffer*)&arena->mem[arena->top];
+                arena->top += need;
+                if (arena->top > arena->peak) {
+                        arena->peak = arena->top;
+                }
+                buf->flags = BUFFER_FLAG_POOLED;
+        } else {
+                buf = malloc(need);
+                if (buf == NULL) {
+                        return NULL;
+                }
+                if (arena != NULL) {
+                        arena->heap += need;
+                }
+                buf->flags = 0;
+        }
+        buf->size = len;
+        buf->used = 0;
+        return buf;
+}
+
+void TSS_PutPoolBuffer(struct tpm_buffer** buf)
+{
+        struct tss_buffer_arena* arena = TSS_Ctx_Get()->buffer_arena;
+        struct tpm_buffer* b = *buf;
+
+        if (b == NULL) {
+                return;
+        }
+        if (!(b->flags & BUFFER_FLAG_POOLED)) {
+                free(b);
+                return;
+        }
+        /* everything above b was given back already */
+        arena->top = (unsigned char*)b - arena->mem;
+}
+
+void TSS_BufferArena_Free(struct tss_buffer_arena* arena)
+{
+        free(arena);
+}
+
+/*
+ * Paint the stack below the caller with a pattern, or measure how deep
+ * it was written since.  Both calls should come from the same function;
+ * the painted area is remembered because the caller's stack pointer may
+ * differ by a few bytes between the two calls.
+ */
+#define STACK_PAINT_SIZE        (128 * 1024)
+#define STACK_PAINT             0xa5
+
+static __thread uintptr_t stack_painted;
+
+__attribute__((noinline))
+size_t TSS_StackPaint(int measure)
+{
+        volatile unsigned char area[STACK_PAINT_SIZE];
+        volatile unsigned char* p;
+        size_t i;
+
+        if (!measure) {
+                for (i = 0; i < STACK_PAINT_SIZE; i++) {
+                        area[i] = STACK_PAINT;
+                }
+                stack_painted = (uintptr_t)area;
+                return 0;
+        }
+        p = (volatile unsigned char*)stack_painted;
+        if (p == NULL) {
+                return 0;
+        }
+        stack_painted = 0;
+        /* the area of this call overlaps the painted one */
+        for (i = 0; i < STACK_PAINT_SIZE && p[i] == STACK_PAINT; i++)
+                ;
+        return STACK_PAINT_SIZE - i;
+}
+
+void TSS_StackReport(const char* what, size_t stack)
+{
+        struct tss_buffer_arena* arena = TSS_Ctx_Get()->buffer_arena;
+        size_t pooled = 0, heap = 0;
+
+        if (arena != NULL) {
+                pooled = arena->peak;
+                heap = arena->heap;
+                arena->peak = arena->top;
+                arena->heap = 0;
+        }
+        fprintf(stderr, "%s: stack %zu bytes, buffer arena %zu bytes, heap buffers %zu bytes\n",
+                what, stack, pooled, heap);
+}
+
 uint32_t TSS_SetTPMBuffer(struct tpm_buffer* tb,
                           const unsigned char* buffer,
                           uint32_t buflen)
@@ -710,7 +844,7 @@ uint32_t TPM_GetTPMInputBufferSize(uint32_t* size)
                                 &scap,
                                 &response);
         if (0 != ret) {
-                *size = 2 * 1024;
+                *size = TPM_INPUT_BUFFER_DEFAULT;
         } else {
                 *size = LOAD32(response.buffer, 0);
         }
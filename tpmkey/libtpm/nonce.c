@@ -0,0 +1,187 @@
+/********************************************************************************/
+/*										*/
+/*                                TPM Nonce Pool                                */
+/*										*/
+/********************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/random.h>
+
+#include "tpm.h"
+#include "tpmutil.h"
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define TPM_NONCE_RDRAND 1
+#endif
+
+/*
+ * Every authorized command needs at least one fresh odd nonce.  Each
+ * context keeps a pool of random bytes that is refilled in bulk, so
+ * handing out a nonce is a copy and the random source is only asked
+ * once every NONCE_POOL_SIZE / TPM_NONCE_SIZE nonces.
+ *
+ * The pool is filled by getrandom().  Without it (old kernels, seccomp)
+ * RDRAND is used, with the retries Intel recommends and a check for the
+ * stuck outputs of broken implementations, and /dev/urandom last.
+ */
+#define NONCE_POOL_SIZE         1020    /* 51 nonces */
+#define RDRAND_RETRIES          10
+
+struct tss_nonce_pool
+{
+        unsigned int avail;                     /* unused bytes at the end */
+        unsigned int generation;                /* fork_generation at refill */
+        unsigned char bytes[NONCE_POOL_SIZE];
+};
+
+/* a forked child must not hand out the nonces of its parent */
+static unsigned int fork_generation;
+static pthread_once_t atfork_once = PTHREAD_ONCE_INIT;
+
+static void childAfterFork(void)
+{
+        fork_generation++;
+}
+
+static void registerAtFork(void)
+{
+        pthread_atfork(NULL, NULL, childAfterFork);
+}
+
+#ifdef TPM_NONCE_RDRAND
+
+static int hasRDRAND(void)
+{
+        unsigned int eax, ebx, ecx, edx;
+
+        return __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_RDRND);
+}
+
+__attribute__((target("rdrnd")))
+static int fillRDRAND(unsigned char* buffer, size_t len)
+{
+        unsigned long long rd, last = 0;
+        unsigned int retry;
+        size_t pos;
+
+        for (pos = 0; pos < len; pos += sizeof(rd)) {
+                for (retry = 0; retry < RDRAND_RETRIES; retry++) {
+                        if (_rdrand64_step(&rd)) {
+                                break;
+                        }
+                }
+                /* exhausted, or stuck at a constant like some AMD parts */
+                if (retry == RDRAND_RETRIES || rd == 0 || rd == ~0ULL || rd == last) {
+                        return -1;
+                }
+                last = rd;
+                memcpy(buffer + pos, &rd, MIN(sizeof(rd), len - pos));
+        }
+        return 0;
+}
+
+#endif
+
+static int fillURandom(unsigned char* buffer, size_t len)
+{
+        ssize_t n;
+        int fd;
+
+        fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+                return -1;
+        }
+        while (len > 0) {
+                n = read(fd, buffer, len);
+                if (n <= 0) {
+                        if (n < 0 && errno == EINTR) {
+                                continue;
+                        }
+                        close(fd);
+                        return -1;
+                }
+                buffer += n;
+                len -= n;
+        }
+        close(fd);
+        return 0;
+}
+
+static int fillRandom(unsigned char* buffer, size_t len)
+{
+        size_t pos = 0;
+        ssize_t n;
+
+        while (pos < len) {
+                n = getrandom(buffer + pos, len - pos, 0);
+                if (n < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        break;
+                }
+                pos += n;
+        }
+        if (pos == len) {
+                return 0;
+        }
+#ifdef TPM_NONCE_RDRAND
+        if (hasRDRAND() && fillRDRAND(buffer, len) == 0) {
+                return 0;
+        }
+#endif
+        return fillURandom(buffer, len);
+}
+
+/****************************************************************************/
+/*                                                                          */
+/* Generate a random nonce                                                  */
+/*                                                                          */
+/****************************************************************************/
+void TSS_gennonce(unsigned char* nonce)
+{
+        struct tss_ctx* ctx = TSS_Ctx_Get();
+        struct tss_nonce_pool* pool = ctx->nonces;
+
+        if (pool == NULL) {
+                pthread_once(&atfork_once, registerAtFork);
+                pool = calloc(1, sizeof(struct tss_nonce_pool));
+                if (pool == NULL) {
+                        /* no pool, fill the nonce directly */
+                        if (fillRandom(nonce, TPM_NONCE_SIZE) != 0) {
+                                abort();
+                        }
+                        return;
+                }
+                ctx->nonces = pool;
+        }
+        if (pool->avail < TPM_NONCE_SIZE || pool->generation != fork_generation) {
+                /* a predictable nonce would defeat the replay protection */
+                if (fillRandom(pool->bytes, NONCE_POOL_SIZE) != 0) {
+                        abort();
+                }
+                pool->avail = NONCE_POOL_SIZE;
+                pool->generation = fork_generation;
+        }
+        pool->avail -= TPM_NONCE_SIZE;
+        memcpy(nonce, pool->bytes + pool->avail, TPM_NONCE_SIZE);
+        /* a nonce handed out is not kept */
+        memset(pool->bytes + pool->avail, 0, TPM_NONCE_SIZE);
+}
+
+void TSS_Nonce_Free(struct tss_nonce_pool* pool)
+{
+        if (pool == NULL) {
+                return;
+        }
+        explicit_bzero(pool, sizeof(struct tss_nonce_pool));
+        free(pool);
+}
@@ -47,6 +47,7 @@
 #include <winsock2.h>
 #endif
 #include <tpm.h>
+#include <marshal.h>
 #include <tpmfunc.h>
 #include <tpmutil.h>
 #include <oiaposap.h>
@@ -239,6 +240,119 @@ uint32_t TPM_NV_DefineSpace2(unsigned char *ownauth,  // HMAC key
 
 
 
+/*
+ * Bytes of NV data that fit into one command next to the header, index,
+ * offset, size and one authorization.  Responses carry less overhead.
+ */
+#define NV_CHUNK_OVERHEAD (TPM_DATA_OFFSET + 4 * TPM_U32_SIZE + \
+                           TPM_NONCE_SIZE + 1 + TPM_HASH_SIZE)
+
+static uint32_t nv_chunk_size(void)
+{
+	return TSS_GetInputBufferSize() - NV_CHUNK_OVERHEAD;
+}
+
+/*
+ * Write one chunk, authorized by sess if it is not NULL.  With c set the
+ * session stays open and its even nonce is taken from the response.
+ */
+static uint32_t nv_write_chunk(uint32_t ordinal,
+                               uint32_t nvIndex,
+                               uint32_t offset,
+                               unsigned char *data, uint32_t datalen,
+                               session *sess, unsigned char c,
+                               const char *msg)
+{
+	STACK_TPM_BUFFER(tpmdata)
+	unsigned char nonceodd[TPM_NONCE_SIZE];
+	unsigned char authdata[TPM_NONCE_SIZE];
+	uint32_t ordinal_no = htonl(ordinal);
+	uint32_t ret;
+	uint32_t datalen_no = htonl(datalen);
+	uint32_t nvIndex_no = htonl(nvIndex);
+	uint32_t offset_no  = htonl(offset);
+
+	if (NULL == sess) {
+		/* build the request buffer */
+		ret = TSS_buildbuff("00 c1 T l l l @", &tpmdata,
+		                             ordinal_no,
+		                               nvIndex_no,
+		                                 offset_no,
+		                                   datalen, data);
+		if ((ret & ERR_MASK)) {
+			return ret;
+		}
+		return TPM_Transmit(&tpmdata, msg);
+	}
+
+	/* generate odd nonce */
+	TSS_gennonce(nonceodd);
+	/* move Network byte order data to variable for hmac calculation */
+	ret = TSS_authhmac(authdata,TSS_Session_GetAuth(sess),TPM_HASH_SIZE,TSS_Session_GetENonce(sess),nonceodd,c,
+	                   TPM_U32_SIZE, &ordinal_no,
+	                   TPM_U32_SIZE, &nvIndex_no,
+	                   TPM_U32_SIZE, &offset_no,
+	                   TPM_U32_SIZE, &datalen_no,
+	                   datalen     , data,
+	                   0,0);
+	if (0 != ret) {
+		return ret;
+	}
+
+	/* build the request buffer */
+	ret = TSS_buildbuff("00 c2 T l l l @ L % o %", &tpmdata,
+	                             ordinal_no,
+	                               nvIndex_no,
+	                                 offset_no,
+	                                   datalen, data,
+	                                     TSS_Session_GetHandle(sess),
+	                                       TPM_NONCE_SIZE,nonceodd,
+	                                         c,
+	                                           TPM_HASH_SIZE,authdata);
+	if ((ret & ERR_MASK)) {
+		return ret;
+	}
+
+	ret = TPM_Transmit(&tpmdata, msg);
+	if (0 != ret) {
+		return ret;
+	}
+
+	return TSS_checkhmac1New(&tpmdata,ordinal_no,sess,nonceodd,TSS_Session_GetAuth(sess),TPM_HASH_SIZE,
+	                         0,0);
+}
+
+/*
+ * Write datalen bytes in as few commands as the TPM's input buffer
+ * allows, all authorized by the one session sess
+ */
+static uint32_t nv_write(uint32_t ordinal,
+                         uint32_t nvIndex,
+                         uint32_t offset,
+                         unsigned char *data, uint32_t datalen,
+                         session *sess,
+                         const char *msg)
+{
+	uint32_t chunk = nv_chunk_size();
+	uint32_t done = 0;
+	uint32_t len;
+	uint32_t ret;
+
+	/* a write of 0 bytes is still sent, it sets bWriteSTClear */
+	do {
+		len = datalen - done;
+		if (len > chunk) {
+			len = chunk;
+		}
+		ret = nv_write_chunk(ordinal, nvIndex, offset + done,
+		                     data + done, len,
+		                     sess, done + len < datalen, msg);
+		done += len;
+	} while (0 == ret && done < datalen);
+
+	return ret;
+}
+
 /****************************************************************************/
 /*                                                                          */
 /* Write a value into NV RAM space                                          */
@@ -251,6 +365,9 @@ uint32_t TPM_NV_DefineSpace2(unsigned char *ownauth,  // HMAC key
 /* datalen     The length of the data to write                              */
 /* ownauth     The sha'ed owner password of the TPM                         */
 /*                                                                          */
+/* Data that does not fit into the TPM's input buffer is written in         */
+/* several commands under one authorization session.                        */
+/*                                                                          */
 /****************************************************************************/
 uint32_t TPM_NV_WriteValue(uint32_t nvIndex,
                            uint32_t offset,
@@ -258,95 +375,29 @@ uint32_t TPM_NV_WriteValue(uint32_t nvIndex,
                            unsigned char *ownauth  // HMAC key
                            )
 {
-	STACK_TPM_BUFFER(tpmdata)
-	unsigned char nonceodd[TPM_NONCE_SIZE];
-	unsigned char authdata[TPM_NONCE_SIZE];
-  	unsigned char c = 0;
-	uint32_t ordinal_no = htonl(TPM_ORD_NV_WriteValue);
 	uint32_t ret;
-	uint32_t datalen_no = htonl(datalen);
-	uint32_t nvIndex_no = htonl(nvIndex);
-	uint32_t offset_no  = htonl(offset);
-	 
+	session sess;
 
 	/* check input arguments */
 /* 	if (data == NULL) return ERR_NULL_ARG; */
 
-	if (NULL != ownauth) {
-		/* generate odd nonce */
-		session sess;
-		TSS_gennonce(nonceodd);
-
-		/* Open OIAP Session */
-		
-		ret = TSS_SessionOpen(SESSION_OSAP|SESSION_OIAP,
-		                      &sess,
-		                      ownauth, TPM_ET_OWNER,0);
-		if (0 != ret) {
-			return ret;
-		}
-		/* move Network byte order data to variable for hmac calculation */
-		ret = TSS_authhmac(authdata,TSS_Session_GetAuth(&sess),TPM_HASH_SIZE,TSS_Session_GetENonce(&sess),nonceodd,c,
-		                   TPM_U32_SIZE, &ordinal_no,
-		                   TPM_U32_SIZE, &nvIndex_no,
-		                   TPM_U32_SIZE, &offset_no,
-		                   TPM_U32_SIZE, &datalen_no,
-		                   datalen     , data,
-		                   0,0);
-		if (0 != ret) {
-			TSS_SessionClose(&sess);
-			return ret;
-		}
-	
-		/* build the request buffer */
-		ret = TSS_buildbuff("00 c2 T l l l @ L % o %", &tpmdata,
-		                             ordinal_no,
-		                               nvIndex_no,
-		                                 offset_no,
-		                                   datalen, data,
-		                                     TSS_Session_GetHandle(&sess),
-		                                       TPM_NONCE_SIZE,nonceodd,
-		                                         c,
-		                                           TPM_HASH_SIZE,authdata);
-
-		if ((ret & ERR_MASK)) {
-			TSS_SessionClose(&sess);
-			return ret;
-		}
-
-		ret = TPM_Transmit(&tpmdata,"NV_WriteValue");
-
-		TSS_SessionClose(&sess);
-		if (0 != ret) {
-			return ret;
-		}
-
-		ret = TSS_checkhmac1(&tpmdata,ordinal_no,nonceodd,TSS_Session_GetAuth(&sess),TPM_HASH_SIZE,
-		                     0,0);
-
-		if (0 != ret) {
-			return ret;
-		}
-	} else {
-		/* build the request buffer */
-		ret = TSS_buildbuff("00 c1 T l l l @", &tpmdata,
-		                             ordinal_no,
-		                               nvIndex_no,
-		                                 offset_no,
-		                                   datalen, data);
-
-		if ((ret & ERR_MASK)) {
-			return ret;
-		}
-
-		ret = TPM_Transmit(&tpmdata,"NV_WriteValue");
-		if (0 != ret ) {
-			return ret;
-		}
+	if (NULL == ownauth) {
+		return nv_write(TPM_ORD_NV_WriteValue, nvIndex, offset,
+		                data, datalen, NULL, "NV_WriteValue");
+	}
 
+	/* Open OIAP Session */
+	ret = TSS_SessionOpen(SESSION_OSAP|SESSION_OIAP,
+	                      &sess,
+	                      ownauth, TPM_ET_OWNER,0);
+	if (0 != ret) {
+		return ret;
 	}
+	ret = nv_write(TPM_ORD_NV_WriteValue, nvIndex, offset,
+	               data, datalen, &sess, "NV_WriteValue");
+	TSS_SessionClose(&sess);
 
-	return ret;	
+	return ret;
 }
 
 /****************************************************************************/
@@ -368,74 +419,170 @@ uint32_t TPM_NV_WriteValueAuth(uint32_t nvIndex,
                                unsigned char * areaauth  // key for area
                                ) 
 {
-	STACK_TPM_BUFFER(tpmdata)
-	unsigned char nonceodd[TPM_NONCE_SIZE];
-	unsigned char authdata[TPM_NONCE_SIZE];
-  	unsigned char c = 0;
-	uint32_t ordinal_no = htonl(TPM_ORD_NV_WriteValueAuth);
 	uint32_t ret;
-	uint32_t datalen_no = htonl(datalen);
-	uint32_t nvIndex_no = htonl(nvIndex);
-	uint32_t offset_no  = htonl(offset);
 	session sess;
-	 
 
 	/* check input arguments */
 	if (areaauth == NULL) return ERR_NULL_ARG;
 
-	/* generate odd nonce */
-	TSS_gennonce(nonceodd);
 	/* Open OIAP Session */
 	ret = TSS_SessionOpen(SESSION_OSAP|SESSION_OIAP,
 	                      &sess,
 	                      areaauth, TPM_ET_NV, nvIndex);
-	                      
 	if (ret != 0) 
 		return ret;
+	ret = nv_write(TPM_ORD_NV_WriteValueAuth, nvIndex, offset,
+	               data, datalen, &sess, "NV_WriteValueAuth - AUTH1");
+	TSS_SessionClose(&sess);
+
+	return ret;
+}
+
+/*
+ * Read one chunk into buffer, authorized by sess if it is not NULL.  With
+ * c set the session stays open and its even nonce is taken from the
+ * response.  *len is the number of bytes the TPM returned, at most
+ * datasize.
+ */
+static uint32_t nv_read_chunk(uint32_t ordinal,
+                              uint32_t nvIndex,
+                              uint32_t offset,
+                              uint32_t datasize,
+                              unsigned char *buffer, uint32_t *len,
+                              session *sess, unsigned char c,
+                              const char *msg)
+{
+	STACK_TPM_BUFFER(tpmdata)
+	unsigned char nonceodd[TPM_NONCE_SIZE];
+	unsigned char authdata[TPM_NONCE_SIZE];
+	uint32_t ordinal_no = htonl(ordinal);
+	uint32_t ret;
+	uint32_t datasize_no= htonl(datasize);
+	uint32_t nvIndex_no = htonl(nvIndex);
+	uint32_t offset_no  = htonl(offset);
+	struct tss_rsp_parser rp;
+	const unsigned char* data = NULL;
+
+	if (NULL == sess) {
+		/* build the request buffer */
+		ret = TSS_MarshalNVReadValue(&tpmdata,
+		                             nvIndex,
+		                             offset,
+		                             datasize);
+		if ((ret & ERR_MASK)) {
+			return ret;
+		}
+
+		ret = TPM_Transmit(&tpmdata, msg);
+		if (0 != ret) {
+			return ret;
+		}
+
+		ret = tpm_buffer_load32(&tpmdata,TPM_DATA_OFFSET, len);
+		if ((ret & ERR_MASK)) {
+			return ret;
+		}
+		if (*len > datasize ||
+		    TPM_DATA_OFFSET + TPM_U32_SIZE + *len > tpmdata.used) {
+			return ERR_BAD_RESP;
+		}
+		memcpy(buffer, &tpmdata.buffer[TPM_DATA_OFFSET+TPM_U32_SIZE], *len);
+		return 0;
+	}
+
+	/* generate odd nonce */
+	TSS_gennonce(nonceodd);
 	/* move Network byte order data to variable for hmac calculation */
-	ret = TSS_authhmac(authdata,TSS_Session_GetAuth(&sess),TPM_HASH_SIZE,TSS_Session_GetENonce(&sess),nonceodd,c,
+	ret = TSS_authhmac(authdata,TSS_Session_GetAuth(sess),TPM_HASH_SIZE,TSS_Session_GetENonce(sess),nonceodd,c,
 	                   TPM_U32_SIZE, &ordinal_no,
 	                   TPM_U32_SIZE, &nvIndex_no,
 	                   TPM_U32_SIZE, &offset_no,
-	                   TPM_U32_SIZE, &datalen_no,
-	                   datalen     , data,
+	                   TPM_U32_SIZE, &datasize_no,
 	                   0,0);
 	if (0 != ret) {
-		TSS_SessionClose(&sess);
 		return ret;
 	}
-	
+
 	/* build the request buffer */
-	ret = TSS_buildbuff("00 c2 T l l l @ L % o %", &tpmdata,
+	ret = TSS_buildbuff("00 c2 T l l l l L % o %", &tpmdata,
 	                             ordinal_no,
 	                               nvIndex_no,
 	                                 offset_no,
-	                                   datalen, data,
-	                                     TSS_Session_GetHandle(&sess),
+	                                   datasize_no,
+	                                     TSS_Session_GetHandle(sess),
 	                                       TPM_NONCE_SIZE,nonceodd,
 	                                         c,
 	                                           TPM_HASH_SIZE,authdata);
-
 	if ((ret & ERR_MASK)) {
-		TSS_SessionClose(&sess);
 		return ret;
 	}
 
-	ret = TPM_Transmit(&tpmdata,"NV_WriteValueAuth - AUTH1");
-
-	TSS_SessionClose(&sess);
+	ret = TPM_Transmit(&tpmdata, msg);
+	if (0 != ret) {
+		return ret;
+	}
 
+	/* decode the data and check the HMAC in one pass */
+	ret = TSS_RspParse_Start(&rp, &tpmdata, ordinal_no, 1);
+	if (0 != ret) {
+		return ret;
+	}
+	if (TSS_RspParse_Load32(&rp, len) == 0) {
+		data = TSS_RspParse_Bytes(&rp, *len);
+	}
+	ret = TSS_RspParse_Verify1(&rp, nonceodd, TSS_Session_GetAuth(sess), TPM_HASH_SIZE);
 	if (0 != ret) {
 		return ret;
 	}
+	if (*len > datasize) {
+		return ERR_BAD_RESP;
+	}
+	/* the even nonce for the next chunk */
+	TSS_Session_SetENonce(sess, &tpmdata.buffer[rp.end]);
+	memcpy(buffer, data, *len);
+	return 0;
+}
 
-	ret = TSS_checkhmac1(&tpmdata,ordinal_no,nonceodd,TSS_Session_GetAuth(&sess),TPM_HASH_SIZE,
-	                     0,0);
+/*
+ * Read datasize bytes in as few commands as the TPM's input buffer
+ * allows, all authorized by the one session sess.  *buffersize is set to
+ * the number of bytes read.
+ */
+static uint32_t nv_read(uint32_t ordinal,
+                        uint32_t nvIndex,
+                        uint32_t offset,
+                        uint32_t datasize,
+                        unsigned char *buffer, uint32_t *buffersize,
+                        session *sess,
+                        const char *msg)
+{
+	uint32_t chunk = nv_chunk_size();
+	uint32_t done = 0;
+	uint32_t want, len;
+	uint32_t ret;
 
+	if (datasize > *buffersize) {
+		datasize = *buffersize;
+	}
+	/* a read of 0 bytes is still sent, it sets bReadSTClear */
+	do {
+		want = datasize - done;
+		if (want > chunk) {
+			want = chunk;
+		}
+		ret = nv_read_chunk(ordinal, nvIndex, offset + done, want,
+		                    buffer + done, &len,
+		                    sess, done + want < datasize, msg);
+		if (0 != ret) {
+			return ret;
+		}
+		done += len;
+	} while (len == want && done < datasize);
+
+	*buffersize = done;
 	return ret;
 }
 
-
 /****************************************************************************/
 /*                                                                          */
 /* Read a value from NV RAM space                                           */
@@ -449,6 +596,9 @@ uint32_t TPM_NV_WriteValueAuth(uint32_t nvIndex,
 /* buffersize  On input: contains the size of the buffer and on output will */
 /*             hold the actual number of bytes that have been read          */
 /*                                                                          */
+/* Data that does not fit into one response is read in several commands   */
+/* under one authorization session.                                         */
+/*                                                                          */
 /****************************************************************************/
 uint32_t TPM_NV_ReadValue(uint32_t nvIndex,
                           uint32_t offset,
@@ -457,108 +607,27 @@ uint32_t TPM_NV_ReadValue(uint32_t nvIndex,
                           unsigned char *ownauth  // HMAC key
                           )
 {
-	STACK_TPM_BUFFER(tpmdata)
-	unsigned char nonceodd[TPM_NONCE_SIZE];
-	unsigned char authdata[TPM_NONCE_SIZE];
-  	unsigned char c = 0;
-	uint32_t ordinal_no = htonl(TPM_ORD_NV_ReadValue);
 	uint32_t ret;
-	uint32_t len;
-	uint32_t datasize_no= htonl(datasize);
-	uint32_t nvIndex_no = htonl(nvIndex);
-	uint32_t offset_no  = htonl(offset);
-	 
+	session sess;
 
 	/* check input arguments */
-	if (buffer == NULL) return ERR_NULL_ARG;
-
-	if (NULL != ownauth) {
-		session sess;
-		/* generate odd nonce */
-		TSS_gennonce(nonceodd);
-
-		/* Open OIAP Session */
-		ret = TSS_SessionOpen(SESSION_OSAP|SESSION_OIAP,
-		                      &sess,
-		                      ownauth, TPM_ET_OWNER, nvIndex);
-		if (ret != 0) 
-			return ret;
-		/* move Network byte order data to variable for hmac calculation */
-		ret = TSS_authhmac(authdata,TSS_Session_GetAuth(&sess),TPM_HASH_SIZE,TSS_Session_GetENonce(&sess),nonceodd,c,
-		                   TPM_U32_SIZE, &ordinal_no,
-		                   TPM_U32_SIZE, &nvIndex_no,
-		                   TPM_U32_SIZE, &offset_no,
-		                   TPM_U32_SIZE, &datasize_no,
-		                   0,0);
-		if (0 != ret) {
-			TSS_SessionClose(&sess);
-			return ret;
-		}
-	
-		/* build the request buffer */
-		ret = TSS_buildbuff("00 c2 T l l l l L % o %", &tpmdata,
-		                             ordinal_no,
-		                               nvIndex_no,
-		                                 offset_no,
-		                                   datasize_no,
-		                                     TSS_Session_GetHandle(&sess),
-		                                       TPM_NONCE_SIZE,nonceodd,
-		                                         c,
-		                                           TPM_HASH_SIZE,authdata);
+	if (buffer == NULL || buffersize == NULL) return ERR_NULL_ARG;
 
-		if ((ret & ERR_MASK)) {
-			TSS_SessionClose(&sess);
-			return ret;
-		}
-
-		ret = TPM_Transmit(&tpmdata,"NV_ReadValue - AUTH1");
-		TSS_SessionClose(&sess);
-
-		if (0 != ret) {
-			return ret;
-		}
-	
-		ret = tpm_buffer_load32(&tpmdata,TPM_DATA_OFFSET, &len);
-		if ((ret & ERR_MASK)) {
-			return ret;
-		}
-
-		ret = TSS_checkhmac1(&tpmdata,ordinal_no,nonceodd,TSS_Session_GetAuth(&sess),TPM_HASH_SIZE,
-		                     TPM_U32_SIZE + len, TPM_DATA_OFFSET,
-		                     0,0);
-
-		if (0 != ret) {
-			return ret;
-		}
-	
-		*buffersize = MIN(*buffersize, len);
-		memcpy(buffer, &tpmdata.buffer[TPM_DATA_OFFSET+TPM_U32_SIZE], *buffersize);
-	} else {
-		/* build the request buffer */
-		ret = TSS_buildbuff("00 c1 T l l l l", &tpmdata,
-		                             ordinal_no,
-		                               nvIndex_no,
-		                                 offset_no,
-		                                   datasize_no);
-
-		if ((ret & ERR_MASK)) {
-			return ret;
-		}
-
-		ret = TPM_Transmit(&tpmdata,"NV_ReadValue");
+	if (NULL == ownauth) {
+		return nv_read(TPM_ORD_NV_ReadValue, nvIndex, offset, datasize,
+		               buffer, buffersize, NULL, "NV_ReadValue");
+	}
 
-		if (0 != ret) {
-			return ret;
-		}
-	
-		ret = tpm_buffer_load32(&tpmdata,TPM_DATA_OFFSET, &len);
-		if ((ret & ERR_MASK)) {
-			return ret;
-		}
+	/* Open OIAP Session */
+	ret = TSS_SessionOpen(SESSION_OSAP|SESSION_OIAP,
+	                      &sess,
+	                      ownauth, TPM_ET_OWNER, nvIndex);
+	if (ret != 0) 
+		return ret;
+	ret = nv_read(TPM_ORD_NV_ReadValue, nvIndex, offset, datasize,
+	              buffer, buffersize, &sess, "NV_ReadValue - AUTH1");
+	TSS_SessionClose(&sess);
 
-		*buffersize = MIN(*buffersize, len);
-		memcpy(buffer, &tpmdata.buffer[TPM_DATA_OFFSET+TPM_U32_SIZE], *buffersize);
-	}
 	return ret;
 }
 
@@ -584,80 +653,59 @@ uint32_t TPM_NV_ReadValueAuth(uint32_t nvIndex,
                               unsigned char * areaauth   // key for area
                               ) 
 {
-	STACK_TPM_BUFFER(tpmdata)
-	unsigned char nonceodd[TPM_NONCE_SIZE];
-	unsigned char authdata[TPM_NONCE_SIZE];
-  	unsigned char c = 0;
-	uint32_t ordinal_no = htonl(TPM_ORD_NV_ReadValueAuth);
 	uint32_t ret;
-	uint32_t len;
-	uint32_t datasize_no= htonl(datasize);
-	uint32_t nvIndex_no = htonl(nvIndex);
-	uint32_t offset_no  = htonl(offset);
 	session sess;
-	 
 
 	/* check input arguments */
-	if (buffer == NULL || areaauth == NULL) return ERR_NULL_ARG;
+	if (buffer == NULL || buffersize == NULL || areaauth == NULL) return ERR_NULL_ARG;
 
-	/* generate odd nonce */
-	TSS_gennonce(nonceodd);
 	/* Open OIAP Session */
 	ret = TSS_SessionOpen(SESSION_OSAP|SESSION_OIAP,
 	                      &sess,
 	                      areaauth, TPM_ET_NV, nvIndex);
 	if (ret != 0) 
 		return ret;
-	/* move Network byte order data to variable for hmac calculation */
-	ret = TSS_authhmac(authdata,TSS_Session_GetAuth(&sess),TPM_HASH_SIZE,TSS_Session_GetENonce(&sess),nonceodd,c,
-	                   TPM_U32_SIZE, &ordinal_no,
-	                   TPM_U32_SIZE, &nvIndex_no,
-	                   TPM_U32_SIZE, &offset_no,
-	                   TPM_U32_SIZE, &datasize_no,
-	                   0,0);
-	if (0 != ret) {
-		TSS_SessionClose(&sess);
-		return ret;
-	}
-	
-	/* build the request buffer */
-	ret = TSS_buildbuff("00 c2 T l l l l L % o %", &tpmdata,
-	                             ordinal_no,
-	                               nvIndex_no,
-	                                 offset_no,
-	                                   datasize_no,
-	                                     TSS_Session_GetHandle(&sess),
-	                                       TPM_NONCE_SIZE,nonceodd,
-	                                         c,
-	                                           TPM_HASH_SIZE,authdata);
+	ret = nv_read(TPM_ORD_NV_ReadValueAuth, nvIndex, offset, datasize,
+	              buffer, buffersize, &sess, "NV_ReadValueAuth");
+	TSS_SessionClose(&sess);
+
+	return ret;
+}
+
+/****************************************************************************/
+/*                                                                          */
+/* Get the public data of an area in NV RAM space                           */
+/*                                                                          */
+/* The arguments are...                                                     */
+/*                                                                          */
+/* nvIndex     The index of a previously defined area                       */
+/* ndp         Receives the TPM_NV_DATA_PUBLIC of the area with its size,   */
+/*             attributes and PCR restrictions                              */
+/*                                                                          */
+/****************************************************************************/
+uint32_t TPM_NV_GetDataPublic(uint32_t nvIndex, TPM_NV_DATA_PUBLIC *ndp)
+{
+	STACK_TPM_BUFFER(scap)
+	STACK_TPM_BUFFER(response)
+	uint32_t ret;
+
+	/* check input arguments */
+	if (ndp == NULL) return ERR_NULL_ARG;
 
+	ret = TSS_buildbuff("L", &scap, nvIndex);
 	if ((ret & ERR_MASK)) {
-		TSS_SessionClose(&sess);
 		return ret;
 	}
-
-	ret = TPM_Transmit(&tpmdata,"NV_ReadValueAuth");
-
-	TSS_SessionClose(&sess);
+	ret = TPM_GetCapability(TPM_CAP_NV_INDEX, &scap, &response);
 	if (0 != ret) {
 		return ret;
 	}
-	
-	ret= tpm_buffer_load32(&tpmdata,TPM_DATA_OFFSET, &len);
+	ret = TPM_ReadNVDataPublic(&response, 0, ndp);
 	if ((ret & ERR_MASK)) {
 		return ret;
 	}
-
-	ret = TSS_checkhmac1(&tpmdata,ordinal_no,nonceodd,TSS_Session_GetAuth(&sess),TPM_HASH_SIZE,
-	                     TPM_U32_SIZE + len, TPM_DATA_OFFSET,
-	                     0,0);
-	
-	if (0 != ret) {
-		return ret;
+	if (ndp->nvIndex != nvIndex) {
+		return ERR_BAD_RESP;
 	}
-
-	*buffersize = MIN(*buffersize, len);
-	memcpy(buffer, &tpmdata.buffer[TPM_DATA_OFFSET+TPM_U32_SIZE], *buffersize);
-	return ret;
+	return 0;
 }
-
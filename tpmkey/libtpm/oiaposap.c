@@ -42,6 +42,7 @@
 #include <string.h>
 #include <netinet/in.h>
 #include <tpm.h>
+#include <marshal.h>
 #include <tpmutil.h>
 #include <tpm_constants.h>
 #include <tpm_structures.h>
@@ -120,27 +121,29 @@ void TPM_CreateEncAuth(const session *sess, const unsigned char *in, unsigned ch
 /****************************************************************************/
 uint32_t TSS_OIAPopen(uint32_t* handle, unsigned char* enonce)
 {
-        STACK_TPM_BUFFER(tpmdata)
+        POOL_TPM_BUFFER(tpmdata, TPM_MAX_BUFF_SIZE)
         uint32_t ret;
 
         /* check input arguments */
         if (handle == NULL || enonce == NULL)
                 return ERR_NULL_ARG;
+        if (tpmdata == NULL)
+                return ERR_MEM_ERR;
         /* build request buffer */
-        ret = TSS_buildbuff("00 C1 T 00 00 00 0A",&tpmdata);
+        ret = TSS_MarshalOIAP(tpmdata);
         if ((ret & ERR_MASK) != 0)
                 return ret;
         /* transmit request to TPM and get result */
-        ret = TPM_Transmit(&tpmdata,"OIAP");
+        ret = TPM_Transmit(tpmdata,"OIAP");
         if (ret != 0)
                 return ret;
-        ret = tpm_buffer_load32(&tpmdata,TPM_DATA_OFFSET, handle);
+        ret = tpm_buffer_load32(tpmdata,TPM_DATA_OFFSET, handle);
         if ((ret & ERR_MASK)) {
                 return ret;
         }
 
         memcpy(enonce,
-               &tpmdata.buffer[TPM_DATA_OFFSET + TPM_U32_SIZE],
+               &tpmdata->buffer[TPM_DATA_OFFSET + TPM_U32_SIZE],
                TPM_NONCE_SIZE);
         return 0;
 }
@@ -162,7 +165,7 @@ uint32_t TSS_OIAPclose(uint32_t handle)
 /****************************************************************************/
 uint32_t TSS_OSAPopen(osapsess* sess, const unsigned char* key, uint16_t etype, uint32_t evalue)
 {
-        STACK_TPM_BUFFER(tpmdata)
+        POOL_TPM_BUFFER(tpmdata, TPM_MAX_BUFF_SIZE)
         uint32_t ret;
         const char* et_aes = getenv("TPM_ET_ENCRYPT_AES");
 
@@ -173,24 +176,23 @@ uint32_t TSS_OSAPopen(osapsess* sess, const unsigned char* key, uint16_t etype,
         /* check input arguments */
         if (key == NULL || sess == NULL)
                 return ERR_NULL_ARG;
+        if (tpmdata == NULL)
+                return ERR_MEM_ERR;
         TSS_gennonce(sess->ononceOSAP);
-        ret = TSS_buildbuff("00 C1 T 00 00 00 0B S L %",&tpmdata,
-                            etype,
-                            evalue,
-                            TPM_NONCE_SIZE, sess->ononceOSAP);
+        ret = TSS_MarshalOSAP(tpmdata, etype, evalue, sess->ononceOSAP);
         if ((ret & ERR_MASK) != 0) return ret;
-        ret = TPM_Transmit(&tpmdata,"OSAP");
+        ret = TPM_Transmit(tpmdata,"OSAP");
         if (ret != 0)  {
                 return ret;
         }
-        ret = tpm_buffer_load32(&tpmdata,TPM_DATA_OFFSET, &sess->handle);
+        ret = tpm_buffer_load32(tpmdata,TPM_DATA_OFFSET, &sess->handle);
         if ((ret & ERR_MASK)) {
                 return ret;
         }
 
         sess->etype = etype;
-        memcpy(sess->enonce,&(tpmdata.buffer[TPM_DATA_OFFSET + TPM_U32_SIZE]),TPM_NONCE_SIZE);
-        memcpy(sess->enonceOSAP,&(tpmdata.buffer[TPM_DATA_OFFSET + TPM_U32_SIZE + TPM_NONCE_SIZE]),TPM_NONCE_SIZE);
+        memcpy(sess->enonce,&(tpmdata->buffer[TPM_DATA_OFFSET + TPM_U32_SIZE]),TPM_NONCE_SIZE);
+        memcpy(sess->enonceOSAP,&(tpmdata->buffer[TPM_DATA_OFFSET + TPM_U32_SIZE + TPM_NONCE_SIZE]),TPM_NONCE_SIZE);
         ret = TSS_rawhmac(sess->ssecret, key, TPM_HASH_SIZE,
                           TPM_NONCE_SIZE, sess->enonceOSAP,
                           TPM_NONCE_SIZE, sess->ononceOSAP,
@@ -224,7 +226,7 @@ uint32_t TSS_DSAPopen(dsapsess* sess,
                       uint32_t keyhandle,
                       unsigned char* evalue, uint32_t evalueSize)
 {
-        STACK_TPM_BUFFER(tpmdata)
+        POOL_TPM_BUFFER(tpmdata, TPM_MAX_BUFF_SIZE)
         uint32_t ret = 0;
         uint32_t ordinal_no = htonl(TPM_ORD_DSAP);
         const char* et_aes = getenv("TPM_ET_ENCRYPT_AES");
@@ -236,9 +238,11 @@ uint32_t TSS_DSAPopen(dsapsess* sess,
         /* check input arguments */
         if (key == NULL || sess == NULL)
                 return ERR_NULL_ARG;
+        if (tpmdata == NULL)
+                return ERR_MEM_ERR;
 
         TSS_gennonce(sess->ononceDSAP);
-        ret = TSS_buildbuff("00 C1 T l S L % @",&tpmdata,
+        ret = TSS_buildbuff("00 C1 T l S L % @",tpmdata,
                             ordinal_no,
                             etype,
                             keyhandle,
@@ -246,20 +250,20 @@ uint32_t TSS_DSAPopen(dsapsess* sess,
                             evalueSize, evalue);
         if ((ret & ERR_MASK) != 0)
                 return ret;
-        ret = TPM_Transmit(&tpmdata,"DSAP");
+        ret = TPM_Transmit(tpmdata,"DSAP");
         if (ret != 0)
                 return ret;
-        ret = tpm_buffer_load32(&tpmdata,TPM_DATA_OFFSET, &sess->handle);
+        ret = tpm_buffer_load32(tpmdata,TPM_DATA_OFFSET, &sess->handle);
         if ((ret & ERR_MASK)) {
                 return ret;
         }
 
         sess->etype = etype;
         memcpy(sess->enonce,
-               &(tpmdata.buffer[TPM_DATA_OFFSET + TPM_U32_SIZE]),
+               &(tpmdata->buffer[TPM_DATA_OFFSET + TPM_U32_SIZE]),
                TPM_NONCE_SIZE);
         memcpy(sess->enonceDSAP,
-               &(tpmdata.buffer[TPM_DATA_OFFSET + TPM_U32_SIZE + TPM_NONCE_SIZE]),
+               &(tpmdata->buffer[TPM_DATA_OFFSET + TPM_U32_SIZE + TPM_NONCE_SIZE]),
                TPM_NONCE_SIZE);
 
         ret = TSS_rawhmac(sess->ssecret, key, TPM_HASH_SIZE,
@@ -320,6 +324,9 @@ uint32_t TSS_Session_CreateTransport(session* sess,
         sess->sess_type = SESSION_TRAN;
         memcpy(sess->authdata, transAuth, TPM_AUTHDATA_SIZE);
         sess->type.tran.handle = transHandle;
+        memset(sess->type.tran.transdigest, 0, TPM_DIGEST_SIZE);
+        memset(&sess->type.tran.currentticks, 0, sizeof(sess->type.tran.currentticks));
+        sess->type.tran.saved = 0;
         TSS_Session_SetENonce(sess,transNonce);
         return 0;
 }
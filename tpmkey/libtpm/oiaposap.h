@@ -74,6 +74,9 @@ typedef struct transess
 {
         uint32_t handle;
         unsigned char enonce[TPM_NONCE_SIZE];
+        unsigned char transdigest[TPM_DIGEST_SIZE];
+        TPM_CURRENT_TICKS currentticks;
+        int saved;      /* written with TSS_Transport_SaveState */
 } transess;
 
 typedef struct session
@@ -135,6 +138,12 @@ uint32_t TSS_Session_CreateTransport(session* sess,
                                      unsigned char* transNonce);
 
 
+uint32_t TSS_Transport_SaveState(session* transSess);
+
+
+uint32_t TSS_Transport_LoadState(session* transSess);
+
+
 unsigned char* TSS_Session_GetAuth(session* sess);
 
 
@@ -40,8 +40,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
 #include <netinet/in.h>
 #include <tpm.h>
+#include <marshal.h>
 #include <tpmutil.h>
 #include <oiaposap.h>
 #include <hmac.h>
@@ -50,6 +55,132 @@
 #include <tpm_structures.h>
 #include "tpmfunc.h"
 
+/*
+ * PCR values only change when they are extended or reset, so values that
+ * were read once are kept in a small file under /run that every tool in
+ * initramfs and early userspace shares.  The file is only trusted for the
+ * boot it was written in and as long as the IMA measurement count did not
+ * move, which covers extends made by other parties through the kernel.
+ * Without that count, e.g. in an initramfs without securityfs, nothing
+ * would notice such extends and the cache is not used.  Extends and resets
+ * done through this library hold the cache lock while they are sent and
+ * drop the touched registers.  Setting TPM_PCR_CACHE=0 disables the cache.
+ */
+#define PCR_CACHE_BOOT_ID       "/proc/sys/kernel/random/boot_id"
+#define PCR_CACHE_MEASUREMENTS  "/sys/kernel/security/ima/runtime_measurements_count"
+
+struct pcr_cache
+{
+        char bootid[40];
+        uint32_t sequence;
+        uint32_t valid;
+        unsigned char values[TPM_NUM_PCR][TPM_HASH_SIZE];
+};
+
+static int openPCRCache(void)
+{
+        char filename[200];
+        char* inst = getenv("TPM_INSTANCE");
+        char* use = getenv("TPM_PCR_CACHE");
+        int fd;
+
+        if (use != NULL && !strcmp(use, "0"))
+                return -1;
+
+        snprintf(filename, sizeof(filename), "/run/.pcrs-%s", inst ? inst : "0");
+        fd = open(filename, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (fd < 0)
+                return -1;
+        if (flock(fd, LOCK_EX) < 0) {
+                close(fd);
+                return -1;
+        }
+        return fd;
+}
+
+static int readPCRCacheSequence(uint32_t* sequence)
+{
+        char buffer[16] = { 0 };
+        char* end;
+        int fd = open(PCR_CACHE_MEASUREMENTS, O_RDONLY | O_CLOEXEC);
+
+        if (fd < 0)
+                return -1;
+        if (read(fd, buffer, sizeof(buffer) - 1) <= 0) {
+                close(fd);
+                return -1;
+        }
+        close(fd);
+        *sequence = strtoul(buffer, &end, 10);
+        return end == buffer ? -1 : 0;
+}
+
+/*
+ * Load the cache from fd; a missing or stale file yields an empty cache
+ * that is already stamped with the current boot and sequence.  Returns -1
+ * if the cache cannot be used at all.
+ */
+static int loadPCRCache(int fd, struct pcr_cache* cache)
+{
+        struct pcr_cache current;
+        int bfd;
+
+        memset(&current, 0, sizeof(current));
+        bfd = open(PCR_CACHE_BOOT_ID, O_RDONLY | O_CLOEXEC);
+        if (bfd >= 0) {
+                if (read(bfd, current.bootid, sizeof(current.bootid) - 1) < 0)
+                        current.bootid[0] = 0;
+                close(bfd);
+        }
+        if (readPCRCacheSequence(&current.sequence) < 0)
+                return -1;
+
+        if (pread(fd, cache, sizeof(*cache), 0) != sizeof(*cache) ||
+            current.bootid[0] == 0 ||
+            memcmp(cache->bootid, current.bootid, sizeof(current.bootid)) ||
+            cache->sequence != current.sequence) {
+                memcpy(cache, &current, sizeof(current));
+        }
+        return 0;
+}
+
+static void storePCRCache(int fd, const struct pcr_cache* cache)
+{
+        /* drop a partially written cache; it then fails the size check */
+        if (pwrite(fd, cache, sizeof(*cache), 0) != sizeof(*cache)) {
+                if (ftruncate(fd, 0) < 0)
+                        return;
+        }
+}
+
+static void closePCRCache(int fd)
+{
+        flock(fd, LOCK_UN);
+        close(fd);
+}
+
+/*
+ * Drop the registers in mask from the cache locked by openPCRCache and
+ * release it.  The lock is taken before the command that changes the
+ * registers is sent, so no reader can store their old values meanwhile.
+ */
+static void invalidatePCRCache(int fd, uint32_t mask)
+{
+        struct pcr_cache cache;
+
+        if (fd < 0)
+                return;
+        if (loadPCRCache(fd, &cache) < 0) {
+                /* an unstamped cache never matches, drop what is left */
+                memset(&cache, 0, sizeof(cache));
+                storePCRCache(fd, &cache);
+        } else if (cache.valid & mask) {
+                cache.valid &= ~mask;
+                storePCRCache(fd, &cache);
+        }
+        closePCRCache(fd);
+}
+
 /****************************************************************************/
 /*                                                                          */
 /* Extend a specified PCR register by adding a new measure                  */
@@ -69,6 +200,7 @@ uint32_t TPM_Extend(uint32_t pcrIndex,
         uint32_t ret;
         uint32_t ordinal_no = htonl(TPM_ORD_Extend);
         uint32_t pcrIndex_no = htonl(pcrIndex);
+        int fd;
 
         STACK_TPM_BUFFER(tpmdata)
 
@@ -80,7 +212,9 @@ uint32_t TPM_Extend(uint32_t pcrIndex,
                 return ret;
         }
 
+        fd = pcrIndex < TPM_NUM_PCR ? openPCRCache() : -1;
         ret = TPM_Transmit(&tpmdata,"Extend");
+        invalidatePCRCache(fd, 1u << (pcrIndex % TPM_NUM_PCR));
 
         if (0 != ret) {
                 return ret;
@@ -466,11 +600,18 @@ uint32_t TPM_Quote2(uint32_t keyhandle,
 uint32_t TPM_PcrRead(uint32_t pcrindex, unsigned char* pcrvalue)
 {
         uint32_t ret;
+        TPM_PCR_SELECTION selection;
 
         STACK_TPM_BUFFER(tpmdata)
 
         if (pcrvalue == NULL) return ERR_NULL_ARG;
-        ret = TSS_buildbuff("00 c1 T 00 00 00 15 L",&tpmdata,pcrindex);
+        if (pcrindex < TPM_NUM_PCR) {
+                memset(&selection,0,sizeof(selection));
+                selection.sizeOfSelect = TPM_NUM_PCR / 8;
+                selection.pcrSelect[pcrindex / 8] = 1 << (pcrindex % 8);
+                return TPM_PcrReadMany(&selection,pcrvalue,NULL);
+        }
+        ret = TSS_MarshalPcrRead(&tpmdata,pcrindex);
         if ((ret & ERR_MASK) != 0) return ret;
         ret = TPM_Transmit(&tpmdata,"PCRRead");
         if (ret != 0) return ret;
@@ -480,6 +621,130 @@ uint32_t TPM_PcrRead(uint32_t pcrindex, unsigned char* pcrvalue)
         return 0;
 }
 
+/****************************************************************************/
+/*                                                                          */
+/*  Read several PCR values                                                 */
+/*                                                                          */
+/* The arguments are...                                                     */
+/*                                                                          */
+/* selection is the selection of PCRs to read                               */
+/* pcrvalues is pointing to a buffer that receives TPM_HASH_SIZE bytes for  */
+/*           every selected PCR, in ascending PCR order; this is the layout */
+/*           of the value array of a TPM_PCR_COMPOSITE                      */
+/* usecs     is pointing to an array that receives the time in micro-       */
+/*           seconds spent on every PCR, in the same order (may be NULL)    */
+/*                                                                          */
+/* TPM 1.2 has no unsigned command that returns more than one PCR, so the   */
+/* values are read back to back through a single stack buffer.  The         */
+/* response overwrites the request, so the fixed size PcrRead command is    */
+/* marshalled again for every index.  Registers found in the PCR cache are  */
+/* not sent to the TPM at all.                                              */
+/****************************************************************************/
+uint32_t TPM_PcrReadMany(const TPM_PCR_SELECTION* selection,
+                         unsigned char* pcrvalues,
+                         uint32_t* usecs)
+{
+        uint32_t ret;
+        uint32_t i;
+        uint32_t j = 0;
+        struct timespec start, end;
+        struct pcr_cache cache;
+        int dirty = 0;
+        int fd;
+
+        STACK_TPM_BUFFER(tpmdata)
+
+        if (selection == NULL || pcrvalues == NULL) return ERR_NULL_ARG;
+        if (selection->sizeOfSelect > sizeof(selection->pcrSelect)) return ERR_BAD_ARG;
+
+        fd = openPCRCache();
+        if (fd >= 0 && loadPCRCache(fd, &cache) < 0) {
+                closePCRCache(fd);
+                fd = -1;
+        }
+        if (fd < 0)
+                memset(&cache, 0, sizeof(cache));
+
+        ret = 0;
+        for (i = 0; i < selection->sizeOfSelect * 8u; ++i) {
+                if (!(selection->pcrSelect[i / 8] & (1 << (i % 8)))) continue;
+
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                if (cache.valid & (1u << i)) {
+                        memcpy(&pcrvalues[j * TPM_HASH_SIZE],
+                               cache.values[i],
+                               TPM_HASH_SIZE);
+                } else {
+                        ret = TSS_MarshalPcrRead(&tpmdata,i);
+                        if ((ret & ERR_MASK) != 0) break;
+                        ret = TPM_Transmit(&tpmdata,"PCRRead");
+                        if (ret != 0) break;
+                        memcpy(&pcrvalues[j * TPM_HASH_SIZE],
+                               &tpmdata.buffer[TPM_DATA_OFFSET],
+                               TPM_HASH_SIZE);
+                        memcpy(cache.values[i],
+                               &tpmdata.buffer[TPM_DATA_OFFSET],
+                               TPM_HASH_SIZE);
+                        cache.valid |= 1u << i;
+                        dirty = 1;
+                }
+                clock_gettime(CLOCK_MONOTONIC, &end);
+
+                if (usecs != NULL)
+                        usecs[j] = (end.tv_sec - start.tv_sec) * 1000000 +
+                                   (end.tv_nsec - start.tv_nsec) / 1000;
+                ++j;
+        }
+
+        if (fd >= 0) {
+                if (dirty)
+                        storePCRCache(fd, &cache);
+                closePCRCache(fd);
+        }
+        return ret;
+}
+
+/****************************************************************************/
+/*                                                                          */
+/*  Calculate the composite hash of a set of PCR values                     */
+/*                                                                          */
+/* The arguments are...                                                     */
+/*                                                                          */
+/* selection is the selection of PCRs                                       */
+/* pcrvalues are the values of the selected PCRs as TPM_PcrReadMany        */
+/*           returns them                                                   */
+/* digest    is pointing to a buffer the size of TPM_HASH_SIZE that         */
+/*           receives the TPM_COMPOSITE_HASH                                */
+/****************************************************************************/
+uint32_t TSS_PCRComposite(const TPM_PCR_SELECTION* selection,
+                          const unsigned char* pcrvalues,
+                          unsigned char* digest)
+{
+        uint32_t ret;
+        uint32_t i;
+        uint32_t numregs = 0;
+        TPM_PCR_COMPOSITE comp;
+
+        STACK_TPM_BUFFER(serComp)
+
+        if (selection == NULL || pcrvalues == NULL || digest == NULL) return ERR_NULL_ARG;
+        if (selection->sizeOfSelect > sizeof(selection->pcrSelect)) return ERR_BAD_ARG;
+
+        for (i = 0; i < selection->sizeOfSelect * 8u; ++i)
+                if (selection->pcrSelect[i / 8] & (1 << (i % 8)))
+                        ++numregs;
+
+        memset(&comp,0,sizeof(comp));
+        comp.select = *selection;
+        comp.pcrValue.size = numregs * TPM_HASH_SIZE;
+        comp.pcrValue.buffer = (BYTE*)pcrvalues;
+        ret = TPM_WritePCRComposite(&serComp, &comp);
+        if ((ret & ERR_MASK)) return ret;
+
+        TSS_sha1(serComp.buffer, serComp.used, digest);
+        return 0;
+}
+
 /****************************************************************************/
 /*                                                                          */
 /*  Create PCR_INFO structure using current PCR values                      */
@@ -495,13 +760,11 @@ uint32_t TSS_GenPCRInfo(uint32_t pcrmap, unsigned char* pcrinfo, uint32_t* len)
                 unsigned char crthash[TPM_HASH_SIZE];
         } myinfo;
         uint32_t i;
-        int j;
         uint32_t work;
-        unsigned char* valarray;
+        unsigned char valarray[TPM_PCR_MASK_SIZE * 8 * TPM_HASH_SIZE];
+        TPM_PCR_SELECTION selection;
         uint32_t numregs;
         uint32_t ret;
-        uint32_t valsize;
-        gcry_md_hd_t sha;
 
         /* check arguments */
         if (pcrinfo == NULL || len == NULL) return ERR_NULL_ARG;
@@ -526,33 +789,16 @@ uint32_t TSS_GenPCRInfo(uint32_t pcrmap, unsigned char* pcrinfo, uint32_t* len)
                 *len = 0;
                 return 0;
         }
-        /* create the array of PCR values */
-        valarray = (unsigned char*)malloc(TPM_HASH_SIZE * numregs);
         /* read the PCR values into the value array */
-        work = pcrmap;
-        j = 0;
-        for (i = 0; i < (TPM_PCR_MASK_SIZE * 8); ++i, work = work >> 1)
-        {
-                if ((work & 1) == 0) continue;
-                ret = TPM_PcrRead(i,&(valarray[(j * TPM_HASH_SIZE)]));
-                if (ret) return ret;
-                ++j;
-        }
-        myinfo.selsize = ntohs(TPM_PCR_MASK_SIZE);
-        valsize = ntohl(numregs * TPM_HASH_SIZE);
+        memset(&selection,0,sizeof(selection));
+        selection.sizeOfSelect = TPM_PCR_MASK_SIZE;
+        memcpy(selection.pcrSelect,myinfo.select,TPM_PCR_MASK_SIZE);
+        ret = TPM_PcrReadMany(&selection,valarray,NULL);
+        if (ret) return ret;
         /* calculate composite hash */
-        gcry_md_open(&sha, GCRY_MD_SHA1, 0);
-        gcry_md_write(sha,&myinfo.selsize,TPM_U16_SIZE);
-        gcry_md_write(sha,&myinfo.select,TPM_PCR_MASK_SIZE);
-        gcry_md_write(sha,&valsize,TPM_U32_SIZE);
-        for (i = 0; i < numregs; ++i)
-        {
-                gcry_md_write(sha,&(valarray[(i * TPM_HASH_SIZE)]),TPM_HASH_SIZE);
-        }
-        const unsigned char* digest = gcry_md_read(sha, 0);
-
-        memcpy(myinfo.relhash, digest, TPM_HASH_SIZE);
-        gcry_md_close(sha);
+        ret = TSS_PCRComposite(&selection,valarray,myinfo.relhash);
+        if (ret) return ret;
+        myinfo.selsize = ntohs(TPM_PCR_MASK_SIZE);
         memcpy(myinfo.crthash,myinfo.relhash,TPM_HASH_SIZE);
         memcpy(pcrinfo,&myinfo,sizeof (struct pcrinfo));
         *len = sizeof (struct pcrinfo);
@@ -572,6 +818,9 @@ uint32_t TPM_PCRReset(TPM_PCR_SELECTION* selection)
 {
         uint32_t ret;
         uint32_t ordinal_no = htonl(TPM_ORD_PCR_Reset);
+        uint32_t mask;
+        uint32_t i;
+        int fd;
 
         STACK_TPM_BUFFER(tpmdata)
         struct tpm_buffer* serPCRMap = TSS_AllocTPMBuffer(TPM_U16_SIZE + selection->sizeOfSelect + 10);
@@ -596,7 +845,13 @@ uint32_t TPM_PCRReset(TPM_PCR_SELECTION* selection)
         if ((ret & ERR_MASK)) {
                 return ret;
         }
+        mask = 0;
+        for (i = 0; i < selection->sizeOfSelect && i < TPM_NUM_PCR / 8; ++i)
+                mask |= (uint32_t)selection->pcrSelect[i] << (i * 8);
+
+        fd = openPCRCache();
         ret = TPM_Transmit(&tpmdata,"PCR Reset");
+        invalidatePCRCache(fd, mask);
 
         return ret;
 }
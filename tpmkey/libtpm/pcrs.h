@@ -40,6 +40,8 @@
 #ifndef PCRS_H
 #define PCRS_H
 
+#include <tpm_structures.h>
+
 #define TPM_PCR_NUM       16  /* number of PCR registers supported */
 #define TPM_PCR_MASK_SIZE  2  /* size in bytes of PCR bit mask     */
 
@@ -47,6 +49,16 @@
 uint32_t TPM_PcrRead(uint32_t pcrindex, unsigned char* pcrvalue);
 
 
+uint32_t TPM_PcrReadMany(const TPM_PCR_SELECTION* selection,
+                         unsigned char* pcrvalues,
+                         uint32_t* usecs);
+
+
+uint32_t TSS_PCRComposite(const TPM_PCR_SELECTION* selection,
+                          const unsigned char* pcrvalues,
+                          unsigned char* digest);
+
+
 //uint32_t TSS_GenPCRInfo(uint32_t pcrmap, unsigned char *pcrinfo, unsigned int *len);
 
 #endif
@@ -42,6 +42,7 @@
 #include <string.h>
 #include <netinet/in.h>
 #include <tpm.h>
+#include <marshal.h>
 #include <tpmutil.h>
 #include <tpm_structures.h>
 #include <tpmfunc.h>
@@ -52,6 +53,330 @@
 #define MAXPCRINFOLEN ((TPM_HASH_SIZE * 2) + TPM_U16_SIZE + TPM_PCR_MASK_SIZE)
 
 
+/*
+ * Seal data through an open OSAP or DSAP session.  With *continueSession set
+ * the session stays open and its even nonce is rolled forward from the
+ * response, so the next Seal can use it without a new OSAP round trip.
+ * *continueSession receives the flag of the response, 0 if the TPM ended
+ * the session anyway.
+ */
+static uint32_t TPM_Seal_Session(session* sess,
+                                 uint32_t keyhandle,
+                                 unsigned char* pcrinfo, uint32_t pcrinfosize,
+                                 unsigned char* dataauth,
+                                 unsigned char* data, uint32_t datalen,
+                                 unsigned char* blob, uint32_t* bloblen,
+                                 unsigned char* continueSession)
+{
+        uint32_t ret;
+
+        STACK_TPM_BUFFER(tpmdata)
+        unsigned char encauth[TPM_HASH_SIZE];
+        unsigned char pubauth[TPM_HASH_SIZE];
+        unsigned char nonceodd[TPM_NONCE_SIZE];
+        unsigned char c = *continueSession;
+        uint32_t ordinal = htonl(TPM_ORD_Seal);
+        uint32_t pcrsize = htonl(pcrinfosize);
+        uint32_t datsize = htonl(datalen);
+        uint32_t keyhndl = htonl(keyhandle);
+        uint32_t sealinfosize;
+        uint32_t encdatasize;
+        uint32_t storedsize;
+        uint32_t rspsize;
+
+        /* calculate encrypted authorization value */
+        TPM_CreateEncAuth(sess, dataauth, encauth, 0);
+        /* generate odd nonce */
+        TSS_gennonce(nonceodd);
+        /* calculate authorization HMAC value */
+        if (pcrinfosize == 0) {
+                /* no pcr info specified */
+                ret = TSS_authhmac(pubauth,TSS_Session_GetAuth(sess),TPM_HASH_SIZE,TSS_Session_GetENonce(sess),nonceodd,c,
+                                   TPM_U32_SIZE,&ordinal,
+                                   TPM_HASH_SIZE,encauth,
+                                   TPM_U32_SIZE,&pcrsize,
+                                   TPM_U32_SIZE,&datsize,
+                                   datalen,data,
+                                   0,0);
+        } else {
+                /* pcr info specified */
+                ret = TSS_authhmac(pubauth,TSS_Session_GetAuth(sess),TPM_HASH_SIZE,TSS_Session_GetENonce(sess),nonceodd,c,
+                                   TPM_U32_SIZE,&ordinal,
+                                   TPM_HASH_SIZE,encauth,
+                                   TPM_U32_SIZE,&pcrsize,
+                                   pcrinfosize,pcrinfo,
+                                   TPM_U32_SIZE,&datsize,
+                                   datalen,data,
+                                   0,0);
+        }
+        if (ret != 0) {
+                return ret;
+        }
+        /* build the request buffer */
+        ret = TSS_buildbuff("00 C2 T l l % @ @ L % o %",&tpmdata,
+                            ordinal,
+                            keyhndl,
+                            TPM_HASH_SIZE,encauth,
+                            pcrinfosize,pcrinfo,
+                            datalen,data,
+                            TSS_Session_GetHandle(sess),
+                            TPM_NONCE_SIZE,nonceodd,
+                            c,
+                            TPM_HASH_SIZE,pubauth);
+        if ((ret & ERR_MASK) != 0) {
+                return ret;
+        }
+        /* transmit the request buffer to the TPM device and read the reply */
+        ret = TPM_Transmit(&tpmdata,"Seal");
+        if (ret != 0) {
+                return ret;
+        }
+        /* calculate the size of the returned Blob */
+        ret = tpm_buffer_load32(&tpmdata,TPM_DATA_OFFSET + TPM_U32_SIZE, &sealinfosize);
+        if ((ret & ERR_MASK)) {
+                return ret;
+        }
+        ret = tpm_buffer_load32(&tpmdata,TPM_DATA_OFFSET + TPM_U32_SIZE + TPM_U32_SIZE + sealinfosize, &encdatasize);
+        if ((ret & ERR_MASK)) {
+                return ret;
+        }
+        storedsize = TPM_U32_SIZE + TPM_U32_SIZE + sealinfosize +
+                     TPM_U32_SIZE + encdatasize;
+        /* check the HMAC in the response */
+        ret = TSS_checkhmac1(&tpmdata,ordinal,nonceodd,TSS_Session_GetAuth(sess),TPM_HASH_SIZE,
+                             storedsize,TPM_DATA_OFFSET,
+                             0,0);
+        if (ret != 0) {
+                return ret;
+        }
+        if (storedsize > *bloblen) {
+                return ERR_BUFFER;
+        }
+        if (c) {
+                ret = tpm_buffer_load32(&tpmdata,TPM_PARAMSIZE_OFFSET,&rspsize);
+                if ((ret & ERR_MASK)) {
+                        return ret;
+                }
+                *continueSession = tpmdata.buffer[rspsize - TPM_HASH_SIZE - 1];
+                TSS_Session_SetENonce(sess,
+                                      &tpmdata.buffer[rspsize - TPM_HASH_SIZE - 1 - TPM_NONCE_SIZE]);
+        }
+        /* copy the returned blob to caller */
+        memcpy(blob,&tpmdata.buffer[TPM_DATA_OFFSET],storedsize);
+        *bloblen = storedsize;
+        return 0;
+}
+
+/****************************************************************************/
+/*                                                                          */
+/* Seal data                                                                */
+/*                                                                          */
+/* The arguments are...                                                     */
+/*                                                                          */
+/* keyhandle   is the handle of the key used to seal the data               */
+/*             0x40000000 for the SRK                                       */
+/* pcrinfo     is a serialized TPM_PCR_INFO structure or NULL               */
+/* pcrinfosize is the length of pcrinfo, 0 to not bind to PCRs              */
+/* keyauth     is the authorization data (password) for the key             */
+/*             or NULL if no password is required                           */
+/* dataauth    is the authorization data (password) for the data being      */
+/*             sealed or NULL if no password is required                    */
+/*             both authorization values must be 20 bytes long              */
+/* data        is a pointer to the data to be sealed                        */
+/* datalen     is the length of the data to be sealed                       */
+/* blob        is a pointer to an area to receive the sealed blob           */
+/* bloblen     is a pointer to the size of blob, it receives the length of  */
+/*             the sealed blob                                              */
+/*                                                                          */
+/****************************************************************************/
+uint32_t TPM_Seal(uint32_t keyhandle,
+                  unsigned char* pcrinfo, uint32_t pcrinfosize,
+                  unsigned char* keyauth,
+                  unsigned char* dataauth,
+                  unsigned char* data, uint32_t datalen,
+                  unsigned char* blob, uint32_t* bloblen)
+{
+        uint32_t ret;
+        unsigned char dummyauth[TPM_HASH_SIZE];
+        unsigned char* passptr1;
+        unsigned char* passptr2;
+        unsigned char c = 0;
+        uint16_t keytype;
+        session sess;
+
+        memset(dummyauth,0,sizeof dummyauth);
+        /* check input arguments */
+        if (data == NULL || blob == NULL || bloblen == NULL) return ERR_NULL_ARG;
+        if (pcrinfosize != 0 && pcrinfo == NULL) return ERR_NULL_ARG;
+        if (keyhandle == TPM_KH_SRK) keytype = TPM_ET_SRK;
+        else keytype = TPM_ET_KEYHANDLE;
+        if (keyauth == NULL) passptr1 = dummyauth;
+        else passptr1 = keyauth;
+        if (dataauth == NULL) passptr2 = dummyauth;
+        else passptr2 = dataauth;
+
+        ret = needKeysRoom(keyhandle, 0, 0, 0);
+        if (ret != 0) {
+                return ret;
+        }
+
+        /* Open OSAP Session */
+        ret = TSS_SessionOpen(SESSION_OSAP | SESSION_DSAP,
+                              &sess,
+                              passptr1, keytype, keyhandle);
+        if (ret != 0) {
+                return ret;
+        }
+        ret = TPM_Seal_Session(&sess, keyhandle,
+                               pcrinfo, pcrinfosize,
+                               passptr2,
+                               data, datalen,
+                               blob, bloblen,
+                               &c);
+        TSS_SessionClose(&sess);
+        return ret;
+}
+
+/****************************************************************************/
+/*                                                                          */
+/* Seal data to several PCR policies                                        */
+/*                                                                          */
+/* The arguments are...                                                     */
+/*                                                                          */
+/* keyhandle   is the handle of the key used to seal the data               */
+/* count       is the number of policies                                    */
+/* pcrinfo     is an array of count serialized TPM_PCR_INFO structures,     */
+/*             an entry may be NULL to not bind that blob to PCRs           */
+/* pcrinfosize is an array of the count lengths of pcrinfo                  */
+/* keyauth, dataauth, data and datalen are as for TPM_Seal                  */
+/* blobs       receives the sealed blobs back to back; every blob is a      */
+/*             self-delimiting TPM_STORED_DATA                              */
+/*                                                                          */
+/* All blobs are sealed through a single OSAP session that is kept open     */
+/* between the commands, so sealing N variants costs N + 2 commands         */
+/* instead of 3 * N.  Should the TPM end the session nevertheless, the next */
+/* blob is sealed through a new one.                                        */
+/****************************************************************************/
+uint32_t TSS_SealMany(uint32_t keyhandle,
+                      uint32_t count,
+                      unsigned char** pcrinfo, uint32_t* pcrinfosize,
+                      unsigned char* keyauth,
+                      unsigned char* dataauth,
+                      unsigned char* data, uint32_t datalen,
+                      struct tpm_buffer* blobs)
+{
+        uint32_t ret;
+        uint32_t i;
+        uint32_t bloblen;
+        unsigned char dummyauth[TPM_HASH_SIZE];
+        unsigned char* passptr1;
+        unsigned char* passptr2;
+        unsigned char c;
+        int open;
+        uint16_t keytype;
+        session sess;
+
+        memset(dummyauth,0,sizeof dummyauth);
+        /* check input arguments */
+        if (data == NULL || blobs == NULL) return ERR_NULL_ARG;
+        if (count != 0 && (pcrinfo == NULL || pcrinfosize == NULL)) return ERR_NULL_ARG;
+        if (keyhandle == TPM_KH_SRK) keytype = TPM_ET_SRK;
+        else keytype = TPM_ET_KEYHANDLE;
+        if (keyauth == NULL) passptr1 = dummyauth;
+        else passptr1 = keyauth;
+        if (dataauth == NULL) passptr2 = dummyauth;
+        else passptr2 = dataauth;
+
+        blobs->used = 0;
+        if (count == 0) return 0;
+
+        ret = needKeysRoom(keyhandle, 0, 0, 0);
+        if (ret != 0) {
+                return ret;
+        }
+
+        ret = TSS_SessionOpen(SESSION_OSAP | SESSION_DSAP,
+                              &sess,
+                              passptr1, keytype, keyhandle);
+        if (ret != 0) {
+                return ret;
+        }
+        open = 1;
+        /* keep the parent loaded for the whole batch */
+        TSS_KeyPin(keyhandle);
+        for (i = 0; i < count; ++i) {
+                if (pcrinfosize[i] != 0 && pcrinfo[i] == NULL) {
+                        ret = ERR_NULL_ARG;
+                        break;
+                }
+                if (!open) {
+                        ret = TSS_SessionOpen(SESSION_OSAP | SESSION_DSAP,
+                                              &sess,
+                                              passptr1, keytype, keyhandle);
+                        if (ret != 0) {
+                                break;
+                        }
+                        open = 1;
+                }
+                bloblen = blobs->size - blobs->used;
+                c = 1;
+                ret = TPM_Seal_Session(&sess, keyhandle,
+                                       pcrinfo[i], pcrinfosize[i],
+                                       passptr2,
+                                       data, datalen,
+                                       &blobs->buffer[blobs->used], &bloblen,
+                                       &c);
+                if (ret != 0) {
+                        break;
+                }
+                blobs->used += bloblen;
+                if (!c) {
+                        /* the TPM ended the session */
+                        TSS_SessionClose(&sess);
+                        open = 0;
+                }
+        }
+        TSS_KeyUnpin(keyhandle);
+        if (open) {
+                TSS_SessionClose(&sess);
+        }
+        if (ret != 0) {
+                blobs->used = 0;
+        }
+        return ret;
+}
+
+/****************************************************************************/
+/*                                                                          */
+/* Seal data to the current values of PCRs                                  */
+/*                                                                          */
+/* pcrmap is a bitmap of the PCRs to bind to, see TSS_GenPCRInfo; the      */
+/* other arguments are as for TPM_Seal                                      */
+/*                                                                          */
+/****************************************************************************/
+uint32_t TPM_SealCurrPCR(uint32_t keyhandle,
+                         uint32_t pcrmap,
+                         unsigned char* keyauth,
+                         unsigned char* dataauth,
+                         unsigned char* data, uint32_t datalen,
+                         unsigned char* blob, uint32_t* bloblen)
+{
+        uint32_t ret;
+        unsigned char pcrinfo[MAXPCRINFOLEN];
+        uint32_t pcrlen;
+
+        ret = TSS_GenPCRInfo(pcrmap,pcrinfo,&pcrlen);
+        if (ret != 0) {
+                return ret;
+        }
+        return TPM_Seal(keyhandle,
+                        pcrinfo,pcrlen,
+                        keyauth,
+                        dataauth,
+                        data,datalen,
+                        blob,bloblen);
+}
+
 /****************************************************************************/
 /*                                                                          */
 /* Unseal a data object                                                     */
@@ -72,24 +397,26 @@
 /*                                                                          */
 
 /****************************************************************************/
-uint32_t TPM_Unseal(uint32_t keyhandle,
-                    unsigned char* keyauth,
-                    unsigned char* dataauth,
-                    unsigned char* blob, uint32_t bloblen,
-                    unsigned char* rawdata, uint32_t* datalen)
+static uint32_t _TPM_Unseal(uint32_t keyhandle,
+                            unsigned char* keyauth,
+                            unsigned char* dataauth,
+                            unsigned char* blob, uint32_t bloblen,
+                            unsigned char* rawdata, uint32_t* datalen)
 {
         uint32_t ret;
 
-        STACK_TPM_BUFFER(tpmdata)
+        POOL_TPM_BUFFER(tpmdata, TPM_MAX_BUFF_SIZE)
         unsigned char nonceodd[TPM_NONCE_SIZE];
         unsigned char dummyauth[TPM_NONCE_SIZE];
         unsigned char* passptr2;
         unsigned char c = 0;
         uint32_t ordinal = htonl(TPM_ORD_Unseal);
-        uint32_t keyhndl = htonl(keyhandle);
         unsigned char authdata1[TPM_HASH_SIZE];
         unsigned char authdata2[TPM_HASH_SIZE];
         session sess;
+        struct tss_rsp_parser rp;
+        const unsigned char* secret = NULL;
+        uint32_t len = 0;
 
         ret = needKeysRoom(keyhandle, 0, 0, 0);
         if (ret != 0) {
@@ -100,6 +427,7 @@ uint32_t TPM_Unseal(uint32_t keyhandle,
         memset(dummyauth,0,sizeof dummyauth);
         /* check input arguments */
         if (rawdata == NULL || blob == NULL) return ERR_NULL_ARG;
+        if (tpmdata == NULL) return ERR_MEM_ERR;
         if (dataauth == NULL) passptr2 = dummyauth;
         else passptr2 = dataauth;
         if (keyauth != NULL) /* key password specified */ {
@@ -144,18 +472,15 @@ uint32_t TPM_Unseal(uint32_t keyhandle,
                         return ret;
                 }
                 /* build the request buffer */
-                ret = TSS_buildbuff("00 C3 T l l % L % o % L % o %",&tpmdata,
-                                    ordinal,
-                                    keyhndl,
-                                    bloblen,blob,
-                                    TSS_Session_GetHandle(&sess),
-                                    TPM_NONCE_SIZE,nonceodd,
-                                    c,
-                                    TPM_HASH_SIZE,authdata1,
-                                    TSS_Session_GetHandle(&sess2),
-                                    TPM_NONCE_SIZE,nonceodd2,
-                                    c,
-                                    TPM_HASH_SIZE,authdata2);
+                ret = TSS_MarshalUnseal(tpmdata,
+                                        keyhandle,
+                                        blob,bloblen,
+                                        TSS_Session_GetHandle(&sess),
+                                        nonceodd,
+                                        authdata1,
+                                        TSS_Session_GetHandle(&sess2),
+                                        nonceodd2,
+                                        authdata2);
 
                 if ((ret & ERR_MASK) != 0) {
                         TSS_SessionClose(&sess);
@@ -163,25 +488,25 @@ uint32_t TPM_Unseal(uint32_t keyhandle,
                         return ret;
                 }
                 /* transmit the request buffer to the TPM device and read the reply */
-                ret = TPM_Transmit(&tpmdata,"Unseal - AUTH2");
+                ret = TPM_Transmit(tpmdata,"Unseal - AUTH2");
                 TSS_SessionClose(&sess);
                 TSS_SessionClose(&sess2);
 
                 if (ret != 0) {
                         return ret;
                 }
-                ret = tpm_buffer_load32(&tpmdata,TPM_DATA_OFFSET,datalen);
-                if ((ret & ERR_MASK)) {
+                /* decode the secret and check the HMACs in one pass */
+                ret = TSS_RspParse_Start(&rp, tpmdata, ordinal, 2);
+                if (ret != 0) {
                         return ret;
                 }
-                /* check HMAC in response */
-                ret = TSS_checkhmac2(&tpmdata,ordinal,nonceodd,
-                                     TSS_Session_GetAuth(&sess),TPM_HASH_SIZE,
-                                     nonceodd2,
-                                     TSS_Session_GetAuth(&sess2),TPM_HASH_SIZE,
-                                     TPM_U32_SIZE,TPM_DATA_OFFSET,
-                                     *datalen,TPM_DATA_OFFSET + TPM_U32_SIZE,
-                                     0,0);
+                if (TSS_RspParse_Load32(&rp, &len) == 0) {
+                        secret = TSS_RspParse_Bytes(&rp, len);
+                }
+                ret = TSS_RspParse_Verify2(&rp, nonceodd,
+                                           TSS_Session_GetAuth(&sess), TPM_HASH_SIZE,
+                                           nonceodd2,
+                                           TSS_Session_GetAuth(&sess2), TPM_HASH_SIZE);
         } else /* no key password */ {
                 /* open ONE OIAP session, for the Data */
                 ret = TSS_SessionOpen(SESSION_OIAP,
@@ -198,44 +523,58 @@ uint32_t TPM_Unseal(uint32_t keyhandle,
                         return ret;
                 }
                 /* build the request buffer */
-                ret = TSS_buildbuff("00 C2 T l l % L % o %",&tpmdata,
-                                    ordinal,
-                                    keyhndl,
-                                    bloblen,blob,
-                                    TSS_Session_GetHandle(&sess),
-                                    TPM_NONCE_SIZE,nonceodd,
-                                    c,
-                                    TPM_HASH_SIZE,authdata2);
+                ret = TSS_MarshalUnseal(tpmdata,
+                                        keyhandle,
+                                        blob,bloblen,
+                                        TSS_Session_GetHandle(&sess),
+                                        nonceodd,
+                                        authdata2,
+                                        0, NULL, NULL);
 
                 if ((ret & ERR_MASK) != 0) {
                         TSS_SessionClose(&sess);
                         return ret;
                 }
                 /* transmit the request buffer to the TPM device and read the reply */
-                ret = TPM_Transmit(&tpmdata,"Unseal - AUTH1");
+                ret = TPM_Transmit(tpmdata,"Unseal - AUTH1");
 
                 TSS_SessionClose(&sess);
 
                 if (ret != 0) {
                         return ret;
                 }
-                ret = tpm_buffer_load32(&tpmdata,TPM_DATA_OFFSET, datalen);
-                if ((ret & ERR_MASK)) {
+                /* decode the secret and check the HMAC in one pass */
+                ret = TSS_RspParse_Start(&rp, tpmdata, ordinal, 1);
+                if (ret != 0) {
                         return ret;
                 }
-                /* check HMAC in response */
-                ret = TSS_checkhmac1(&tpmdata,ordinal,nonceodd,
-                                     TSS_Session_GetAuth(&sess),TPM_HASH_SIZE,
-                                     TPM_U32_SIZE,TPM_DATA_OFFSET,
-                                     *datalen,TPM_DATA_OFFSET + TPM_U32_SIZE,
-                                     0,0);
+                if (TSS_RspParse_Load32(&rp, &len) == 0) {
+                        secret = TSS_RspParse_Bytes(&rp, len);
+                }
+                ret = TSS_RspParse_Verify1(&rp, nonceodd,
+                                           TSS_Session_GetAuth(&sess), TPM_HASH_SIZE);
         }
-        if (ret != 0) {
-                return ret;
+        /* the secret is only copied out of the response once it is verified */
+        if (ret == 0) {
+                memcpy(rawdata, secret, len);
+                *datalen = len;
         }
-        /* copy decrypted data back to caller */
-        memcpy(rawdata,
-               &tpmdata.buffer[TPM_DATA_OFFSET + TPM_U32_SIZE],
-               *datalen);
+        explicit_bzero(tpmdata->buffer, tpmdata->used);
+        return ret;
+}
+
+uint32_t TPM_Unseal(uint32_t keyhandle,
+                    unsigned char* keyauth,
+                    unsigned char* dataauth,
+                    unsigned char* blob, uint32_t bloblen,
+                    unsigned char* rawdata, uint32_t* datalen)
+{
+        uint32_t ret;
+
+        /* measure the deepest stack of the whole unseal, sessions included */
+        TSS_STACK_REPORT_BEGIN();
+        ret = _TPM_Unseal(keyhandle, keyauth, dataauth, blob, bloblen,
+                          rawdata, datalen);
+        TSS_STACK_REPORT_END("TPM_Unseal");
         return ret;
 }
@@ -283,6 +283,213 @@ uint32_t TPM_WritePubInfo(TPM_NV_DATA_PUBLIC * pub,
 	return ret;
 }
 
+static uint32_t read_pcr_info_short(const unsigned char* select, uint16_t sizeOfSelect,
+                                    TPM_LOCALITY_SELECTION locality, const unsigned char* digest,
+                                    TPM_PCR_INFO_SHORT* info)
+{
+        if (sizeOfSelect > sizeof(info->pcrSelection.pcrSelect)) {
+                return ERR_BUFFER;
+        }
+        info->pcrSelection.sizeOfSelect = sizeOfSelect;
+        memcpy(info->pcrSelection.pcrSelect, select, sizeOfSelect);
+        info->localityAtRelease = locality;
+        memcpy(info->digestAtRelease, digest, TPM_DIGEST_SIZE);
+        return 0;
+}
+
+/*
+ * Copy a TPM_NV_DATA_PUBLIC out of its view, so that the bounds are
+ * checked once for the whole structure
+ */
+uint32_t TPM_ReadNVDataPublic(const struct tpm_buffer* buffer, uint32_t offset,
+                              TPM_NV_DATA_PUBLIC* ndp)
+{
+        struct tpm_nv_data_public_view v;
+        const unsigned char* select;
+        uint16_t sizeOfSelect;
+        uint32_t size;
+        uint32_t ret;
+
+        size = TPM_ViewNVDataPublic(buffer, offset, &v);
+        if ((size & ERR_MASK)) {
+                return size;
+        }
+        ndp->tag = TPM_NVDataPublicView_Tag(&v);
+        ndp->nvIndex = TPM_NVDataPublicView_NVIndex(&v);
+        select = TPM_NVDataPublicView_ReadSelect(&v, &sizeOfSelect);
+        ret = read_pcr_info_short(select, sizeOfSelect,
+                                  TPM_NVDataPublicView_ReadLocality(&v),
+                                  TPM_NVDataPublicView_ReadDigest(&v),
+                                  &ndp->pcrInfoRead);
+        if (ret != 0) {
+                return ret;
+        }
+        select = TPM_NVDataPublicView_WriteSelect(&v, &sizeOfSelect);
+        ret = read_pcr_info_short(select, sizeOfSelect,
+                                  TPM_NVDataPublicView_WriteLocality(&v),
+                                  TPM_NVDataPublicView_WriteDigest(&v),
+                                  &ndp->pcrInfoWrite);
+        if (ret != 0) {
+                return ret;
+        }
+        ndp->permission.tag = TPM_NVDataPublicView_PermissionTag(&v);
+        ndp->permission.attributes = TPM_NVDataPublicView_Attributes(&v);
+        ndp->bReadSTClear = TPM_NVDataPublicView_ReadSTClear(&v);
+        ndp->bWriteSTClear = TPM_NVDataPublicView_WriteSTClear(&v);
+        ndp->bWriteDefine = TPM_NVDataPublicView_WriteDefine(&v);
+        ndp->dataSize = TPM_NVDataPublicView_DataSize(&v);
+        return size;
+}
+
+/*
+ * Size of the sized field at off of len bytes, with a size prefix of
+ * prefix bytes, or 0 if it runs past len
+ */
+static uint32_t view_sized(const unsigned char* data, uint32_t len,
+                           uint32_t off, uint32_t prefix)
+{
+        uint32_t size;
+
+        if (off > len || len - off < prefix) {
+                return 0;
+        }
+        size = (prefix == TPM_U16_SIZE) ? LOAD16(data, off) : LOAD32(data, off);
+        if (size > len - off - prefix) {
+                return 0;
+        }
+        return prefix + size;
+}
+
+static uint32_t view_pcr_info_long(const unsigned char* data, uint32_t len,
+                                   struct tpm_pcr_info_long_view* v)
+{
+        uint32_t off = TPM_U16_SIZE + 2;
+        uint32_t n;
+
+        n = view_sized(data, len, off, TPM_U16_SIZE);
+        if (n == 0) {
+                return ERR_BUFFER;
+        }
+        off += n;
+        v->release = off;
+        n = view_sized(data, len, off, TPM_U16_SIZE);
+        if (n == 0) {
+                return ERR_BUFFER;
+        }
+        off += n;
+        v->digests = off;
+        if (len - off < 2 * TPM_DIGEST_SIZE) {
+                return ERR_BUFFER;
+        }
+        v->data = data;
+        return off + 2 * TPM_DIGEST_SIZE;
+}
+
+uint32_t TPM_ViewPCRInfoLong(const struct tpm_buffer* buffer, uint32_t offset,
+                             struct tpm_pcr_info_long_view* v)
+{
+        if (offset > buffer->used) {
+                return ERR_BUFFER;
+        }
+        return view_pcr_info_long(&buffer->buffer[offset], buffer->used - offset, v);
+}
+
+uint32_t TPM_ViewKey(const struct tpm_buffer* buffer, uint32_t offset,
+                     struct tpm_key_view* v)
+{
+        const unsigned char* data;
+        uint32_t len, off, n;
+
+        if (offset > buffer->used) {
+                return ERR_BUFFER;
+        }
+        data = &buffer->buffer[offset];
+        len = buffer->used - offset;
+        /* tag, fill, keyUsage, keyFlags, authDataUsage, then the TPM_KEY_PARMS */
+        off = 3 * TPM_U32_SIZE + 3 * TPM_U16_SIZE + 1;
+        n = view_sized(data, len, off, TPM_U32_SIZE);
+        if (n == 0) {
+                return ERR_BUFFER;
+        }
+        off += n;
+        v->pcrinfo = off;
+        n = view_sized(data, len, off, TPM_U32_SIZE);
+        if (n == 0) {
+                return ERR_BUFFER;
+        }
+        off += n;
+        v->pubkey = off;
+        n = view_sized(data, len, off, TPM_U32_SIZE);
+        if (n == 0) {
+                return ERR_BUFFER;
+        }
+        off += n;
+        v->encdata = off;
+        n = view_sized(data, len, off, TPM_U32_SIZE);
+        if (n == 0) {
+                return ERR_BUFFER;
+        }
+        v->data = data;
+        return off + n;
+}
+
+/*
+ * The TPM_PCR_INFO_LONG a TPM_KEY12 is bound to; ERR_NOT_FOUND if the key
+ * is not bound to PCRs
+ */
+uint32_t TPM_ViewKeyPCRInfoLong(const struct tpm_key_view* key,
+                                struct tpm_pcr_info_long_view* v)
+{
+        const unsigned char* pcrinfo;
+        uint32_t size;
+        uint32_t ret;
+
+        pcrinfo = TPM_KeyView_PCRInfo(key, &size);
+        if (size == 0) {
+                return ERR_NOT_FOUND;
+        }
+        ret = view_pcr_info_long(pcrinfo, size, v);
+        if ((ret & ERR_MASK) == 0 && ret != size) {
+                ret = ERR_STRUCTURE;
+        }
+        return ret;
+}
+
+uint32_t TPM_ViewNVDataPublic(const struct tpm_buffer* buffer, uint32_t offset,
+                              struct tpm_nv_data_public_view* v)
+{
+        const unsigned char* data;
+        uint32_t len, off, n;
+
+        if (offset > buffer->used) {
+                return ERR_BUFFER;
+        }
+        data = &buffer->buffer[offset];
+        len = buffer->used - offset;
+        /* tag and nvIndex, then two TPM_PCR_INFO_SHORT */
+        off = TPM_U16_SIZE + TPM_U32_SIZE;
+        v->pcrinforead = off;
+        n = view_sized(data, len, off, TPM_U16_SIZE);
+        if (n == 0 || len - off - n < 1 + TPM_DIGEST_SIZE) {
+                return ERR_BUFFER;
+        }
+        off += n + 1 + TPM_DIGEST_SIZE;
+        v->pcrinfowrite = off;
+        n = view_sized(data, len, off, TPM_U16_SIZE);
+        if (n == 0 || len - off - n < 1 + TPM_DIGEST_SIZE) {
+                return ERR_BUFFER;
+        }
+        off += n + 1 + TPM_DIGEST_SIZE;
+        v->permission = off;
+        /* permission, bReadSTClear, bWriteSTClear, bWriteDefine, dataSize */
+        n = TPM_U16_SIZE + TPM_U32_SIZE + 3 + TPM_U32_SIZE;
+        if (len - off < n) {
+                return ERR_BUFFER;
+        }
+        v->data = data;
+        return off + n;
+}
+
 #if 0
 /****************************************************************************/
 /*                                                                          */
@@ -824,4 +824,226 @@ enum {
         PARAMS_TPM_TRANSPORT_LOG_OUT(&,x)
 
 
+/*
+ * Views over serialized structures.  TPM_View* checks once that the
+ * structure at offset lies within the used part of the buffer and notes
+ * where its variable length parts start; the accessors below then read
+ * the big-endian fields in place, nothing is copied.  A view is only
+ * valid as long as the buffer it was taken from.  Like TSS_parsebuff,
+ * TPM_View* returns the serialized size, or ERR_BUFFER if the structure
+ * does not fit.
+ */
+struct tpm_pcr_info_long_view {
+        const unsigned char* data;
+        uint32_t release;               /* releasePCRSelection */
+        uint32_t digests;               /* digestAtCreation, digestAtRelease */
+};
+
+/* TPM_KEY12, or a TPM_KEY which has the same layout after the version */
+struct tpm_key_view {
+        const unsigned char* data;
+        uint32_t pcrinfo;               /* PCRInfoSize */
+        uint32_t pubkey;                /* pubKey.keyLength */
+        uint32_t encdata;               /* encDataSize */
+};
+
+struct tpm_nv_data_public_view {
+        const unsigned char* data;
+        uint32_t pcrinforead;           /* pcrInfoRead */
+        uint32_t pcrinfowrite;          /* pcrInfoWrite */
+        uint32_t permission;            /* permission */
+};
+
+uint32_t TPM_ViewPCRInfoLong(const struct tpm_buffer* buffer, uint32_t offset,
+                             struct tpm_pcr_info_long_view* v);
+
+
+uint32_t TPM_ViewKey(const struct tpm_buffer* buffer, uint32_t offset,
+                     struct tpm_key_view* v);
+
+
+uint32_t TPM_ViewKeyPCRInfoLong(const struct tpm_key_view* key,
+                                struct tpm_pcr_info_long_view* v);
+
+
+uint32_t TPM_ViewNVDataPublic(const struct tpm_buffer* buffer, uint32_t offset,
+                              struct tpm_nv_data_public_view* v);
+
+
+/* TPM_PCR_INFO_LONG */
+static inline uint16_t TPM_PCRInfoLongView_Tag(const struct tpm_pcr_info_long_view* v)
+{
+        return LOAD16(v->data, 0);
+}
+
+static inline TPM_LOCALITY_SELECTION TPM_PCRInfoLongView_LocalityAtCreation(const struct tpm_pcr_info_long_view* v)
+{
+        return v->data[TPM_U16_SIZE];
+}
+
+static inline TPM_LOCALITY_SELECTION TPM_PCRInfoLongView_LocalityAtRelease(const struct tpm_pcr_info_long_view* v)
+{
+        return v->data[TPM_U16_SIZE + 1];
+}
+
+static inline const unsigned char* TPM_PCRInfoLongView_CreationSelect(const struct tpm_pcr_info_long_view* v,
+                                                                      uint16_t* sizeOfSelect)
+{
+        *sizeOfSelect = LOAD16(v->data, TPM_U16_SIZE + 2);
+        return &v->data[2 * TPM_U16_SIZE + 2];
+}
+
+static inline const unsigned char* TPM_PCRInfoLongView_ReleaseSelect(const struct tpm_pcr_info_long_view* v,
+                                                                     uint16_t* sizeOfSelect)
+{
+        *sizeOfSelect = LOAD16(v->data, v->release);
+        return &v->data[v->release + TPM_U16_SIZE];
+}
+
+static inline const unsigned char* TPM_PCRInfoLongView_DigestAtCreation(const struct tpm_pcr_info_long_view* v)
+{
+        return &v->data[v->digests];
+}
+
+static inline const unsigned char* TPM_PCRInfoLongView_DigestAtRelease(const struct tpm_pcr_info_long_view* v)
+{
+        return &v->data[v->digests + TPM_DIGEST_SIZE];
+}
+
+/* TPM_KEY12 */
+static inline uint16_t TPM_KeyView_Tag(const struct tpm_key_view* v)
+{
+        return LOAD16(v->data, 0);
+}
+
+static inline TPM_KEY_USAGE TPM_KeyView_KeyUsage(const struct tpm_key_view* v)
+{
+        return LOAD16(v->data, TPM_U32_SIZE);
+}
+
+static inline TPM_KEY_FLAGS TPM_KeyView_KeyFlags(const struct tpm_key_view* v)
+{
+        return LOAD32(v->data, TPM_U32_SIZE + TPM_U16_SIZE);
+}
+
+static inline TPM_AUTH_DATA_USAGE TPM_KeyView_AuthDataUsage(const struct tpm_key_view* v)
+{
+        return v->data[2 * TPM_U32_SIZE + TPM_U16_SIZE];
+}
+
+static inline TPM_ALGORITHM_ID TPM_KeyView_AlgorithmID(const struct tpm_key_view* v)
+{
+        return LOAD32(v->data, 2 * TPM_U32_SIZE + TPM_U16_SIZE + 1);
+}
+
+static inline TPM_ENC_SCHEME TPM_KeyView_EncScheme(const struct tpm_key_view* v)
+{
+        return LOAD16(v->data, 3 * TPM_U32_SIZE + TPM_U16_SIZE + 1);
+}
+
+static inline TPM_SIG_SCHEME TPM_KeyView_SigScheme(const struct tpm_key_view* v)
+{
+        return LOAD16(v->data, 3 * TPM_U32_SIZE + 2 * TPM_U16_SIZE + 1);
+}
+
+static inline const unsigned char* TPM_KeyView_Parms(const struct tpm_key_view* v, uint32_t* size)
+{
+        *size = LOAD32(v->data, 3 * TPM_U32_SIZE + 3 * TPM_U16_SIZE + 1);
+        return &v->data[4 * TPM_U32_SIZE + 3 * TPM_U16_SIZE + 1];
+}
+
+static inline const unsigned char* TPM_KeyView_PCRInfo(const struct tpm_key_view* v, uint32_t* size)
+{
+        *size = LOAD32(v->data, v->pcrinfo);
+        return &v->data[v->pcrinfo + TPM_U32_SIZE];
+}
+
+static inline const unsigned char* TPM_KeyView_PubKey(const struct tpm_key_view* v, uint32_t* size)
+{
+        *size = LOAD32(v->data, v->pubkey);
+        return &v->data[v->pubkey + TPM_U32_SIZE];
+}
+
+static inline const unsigned char* TPM_KeyView_EncData(const struct tpm_key_view* v, uint32_t* size)
+{
+        *size = LOAD32(v->data, v->encdata);
+        return &v->data[v->encdata + TPM_U32_SIZE];
+}
+
+/* TPM_NV_DATA_PUBLIC */
+static inline uint16_t TPM_NVDataPublicView_Tag(const struct tpm_nv_data_public_view* v)
+{
+        return LOAD16(v->data, 0);
+}
+
+static inline TPM_NV_INDEX TPM_NVDataPublicView_NVIndex(const struct tpm_nv_data_public_view* v)
+{
+        return LOAD32(v->data, TPM_U16_SIZE);
+}
+
+static inline const unsigned char* TPM_NVDataPublicView_ReadSelect(const struct tpm_nv_data_public_view* v,
+                                                                   uint16_t* sizeOfSelect)
+{
+        *sizeOfSelect = LOAD16(v->data, v->pcrinforead);
+        return &v->data[v->pcrinforead + TPM_U16_SIZE];
+}
+
+static inline TPM_LOCALITY_SELECTION TPM_NVDataPublicView_ReadLocality(const struct tpm_nv_data_public_view* v)
+{
+        return v->data[v->pcrinfowrite - TPM_DIGEST_SIZE - 1];
+}
+
+static inline const unsigned char* TPM_NVDataPublicView_ReadDigest(const struct tpm_nv_data_public_view* v)
+{
+        return &v->data[v->pcrinfowrite - TPM_DIGEST_SIZE];
+}
+
+static inline const unsigned char* TPM_NVDataPublicView_WriteSelect(const struct tpm_nv_data_public_view* v,
+                                                                    uint16_t* sizeOfSelect)
+{
+        *sizeOfSelect = LOAD16(v->data, v->pcrinfowrite);
+        return &v->data[v->pcrinfowrite + TPM_U16_SIZE];
+}
+
+static inline TPM_LOCALITY_SELECTION TPM_NVDataPublicView_WriteLocality(const struct tpm_nv_data_public_view* v)
+{
+        return v->data[v->permission - TPM_DIGEST_SIZE - 1];
+}
+
+static inline const unsigned char* TPM_NVDataPublicView_WriteDigest(const struct tpm_nv_data_public_view* v)
+{
+        return &v->data[v->permission - TPM_DIGEST_SIZE];
+}
+
+static inline uint16_t TPM_NVDataPublicView_PermissionTag(const struct tpm_nv_data_public_view* v)
+{
+        return LOAD16(v->data, v->permission);
+}
+
+static inline uint32_t TPM_NVDataPublicView_Attributes(const struct tpm_nv_data_public_view* v)
+{
+        return LOAD32(v->data, v->permission + TPM_U16_SIZE);
+}
+
+static inline TPM_BOOL TPM_NVDataPublicView_ReadSTClear(const struct tpm_nv_data_public_view* v)
+{
+        return v->data[v->permission + TPM_U16_SIZE + TPM_U32_SIZE];
+}
+
+static inline TPM_BOOL TPM_NVDataPublicView_WriteSTClear(const struct tpm_nv_data_public_view* v)
+{
+        return v->data[v->permission + TPM_U16_SIZE + TPM_U32_SIZE + 1];
+}
+
+static inline TPM_BOOL TPM_NVDataPublicView_WriteDefine(const struct tpm_nv_data_public_view* v)
+{
+        return v->data[v->permission + TPM_U16_SIZE + TPM_U32_SIZE + 2];
+}
+
+static inline uint32_t TPM_NVDataPublicView_DataSize(const struct tpm_nv_data_public_view* v)
+{
+        return LOAD32(v->data, v->permission + TPM_U16_SIZE + TPM_U32_SIZE + 3);
+}
+
+
 #endif
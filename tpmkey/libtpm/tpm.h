@@ -176,6 +176,7 @@ struct tpm_buffer
 
 enum {
         BUFFER_FLAG_ON_STACK = 1,
+        BUFFER_FLAG_POOLED = 2,         /* from the buffer arena of a context */
 };
 
 #define STACK_TPM_BUFFER(X)                    \
@@ -204,6 +205,48 @@ enum {
 struct tpm_buffer* TSS_AllocTPMBuffer(int len);
 
 
+struct tpm_buffer* TSS_GetPoolBuffer(uint32_t len);
+
+
+void TSS_PutPoolBuffer(struct tpm_buffer** buf);
+
+
+/*
+ * A tpm_buffer of len bytes for the deep call chains (key swapping,
+ * sessions, transport wrapping).  With TPM_SMALL_STACK it is taken from
+ * the buffer arena of the context and given back when X goes out of
+ * scope, otherwise it is a full STACK_TPM_BUFFER.  X is a pointer either
+ * way and is NULL if the arena could not grow.
+ */
+#ifdef TPM_SMALL_STACK
+#define POOL_TPM_BUFFER(X, len)                                         \
+        struct tpm_buffer* X __attribute__((cleanup(TSS_PutPoolBuffer))) = \
+                TSS_GetPoolBuffer(len);
+#else
+#define POOL_TPM_BUFFER(X, len)                                         \
+        STACK_TPM_BUFFER(X##_stack)                                     \
+        struct tpm_buffer* X = &X##_stack;
+#endif
+
+
+/* peak stack use of a call, see TSS_StackPaint */
+#ifdef TPM_STACK_REPORT
+#define TSS_STACK_REPORT_BEGIN()                                        \
+        TSS_StackPaint(0)
+#define TSS_STACK_REPORT_END(what)                                      \
+        TSS_StackReport(what, TSS_StackPaint(1))
+#else
+#define TSS_STACK_REPORT_BEGIN()
+#define TSS_STACK_REPORT_END(what)
+#endif
+
+
+size_t TSS_StackPaint(int measure);
+
+
+void TSS_StackReport(const char* what, size_t stack);
+
+
 static inline struct tpm_buffer* clone_tpm_buffer(struct tpm_buffer* orig) {
         struct tpm_buffer* buf = TSS_AllocTPMBuffer(orig->used + 20);
 
@@ -42,6 +42,12 @@
 
 #include "tpm.h"
 
+/* socket of the tpmkeyd broker, overridden by TPM_BROKER_SOCKET */
+#define TPM_BROKER_SOCKET "/run/tpmkeyd.socket"
+
+/* socket of the tpmvmux vTPM multiplexer */
+#define TPM_VTPM_SOCKET "/var/vtpm/vtpm.socket"
+
 struct tpm_transport
 {
         uint32_t (* open)(int* fd);
@@ -56,6 +62,7 @@ enum {
         TPM_LOWLEVEL_TRANSPORT_UNIXIO,
         TPM_LOWLEVEL_TRANSPORT_CCA,
         TPM_LOWLEVEL_TRANSPORT_LIBTPMS,
+        TPM_LOWLEVEL_TRANSPORT_QUEUE,
 };
 
 
@@ -87,4 +94,10 @@ int TPM_LowLevel_Use_VTPM(void);
 int TPM_LowLevel_VTPM_Set(int state);
 
 
+uint32_t TSS_WritePacket(int fd, const unsigned char* buffer, uint32_t len);
+
+
+uint32_t TSS_ReadPacket(int fd, struct tpm_buffer* tb, uint32_t prefix);
+
+
 #endif
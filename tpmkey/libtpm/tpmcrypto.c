@@ -0,0 +1,61 @@
+/********************************************************************************/
+/*										*/
+/*                             TPM Crypto Providers                             */
+/*										*/
+/********************************************************************************/
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tpm.h"
+#include "tpmcrypto.h"
+
+#ifdef TPM_GCRYPT
+static const struct tss_crypto* provider = &tss_crypto_gcrypt;
+#else
+static const struct tss_crypto* provider = &tss_crypto_builtin;
+#endif
+
+static pthread_once_t provider_once = PTHREAD_ONCE_INIT;
+
+/* TPM_CRYPTO=builtin selects the built-in provider in gcrypt builds */
+static void initProvider(void)
+{
+        const char* name = getenv("TPM_CRYPTO");
+
+        if (name && !strcmp(name, tss_crypto_builtin.name)) {
+                provider = &tss_crypto_builtin;
+        }
+        if (provider->init) {
+                provider->init();
+        }
+}
+
+/****************************************************************************/
+/*                                                                          */
+/* Get the crypto provider, initializing it on first use                    */
+/*                                                                          */
+/****************************************************************************/
+const struct tss_crypto* TSS_Crypto_Get(void)
+{
+        pthread_once(&provider_once, initProvider);
+        return provider;
+}
+
+/****************************************************************************/
+/*                                                                          */
+/* Replace the crypto provider; must be called before any other thread      */
+/* uses the library.  Returns the previous provider.                        */
+/*                                                                          */
+/****************************************************************************/
+const struct tss_crypto* TSS_Crypto_Set(const struct tss_crypto* newprovider)
+{
+        const struct tss_crypto* old = TSS_Crypto_Get();
+
+        if (newprovider->init) {
+                newprovider->init();
+        }
+        provider = newprovider;
+        return old;
+}
@@ -0,0 +1,85 @@
+/********************************************************************************/
+/*										*/
+/*                             TPM Crypto Providers                             */
+/*										*/
+/********************************************************************************/
+
+#ifndef TPMCRYPTO_H
+#define TPMCRYPTO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * All hashing and encryption of the library goes through a crypto
+ * provider.  The built-in provider has no dependencies and uses the
+ * SHA and AES instructions where the CPU has them; with TPM_GCRYPT
+ * libgcrypt is available as well and is the default.
+ */
+
+struct tss_iovec
+{
+        const void* data;
+        size_t len;
+};
+
+/* running SHA-1 of a provider */
+struct tss_sha1
+{
+        union {
+                uint64_t align;
+                unsigned char state[128];
+        } u;
+};
+
+/* HMAC-SHA1 with the key already set */
+struct tss_hmac_sha1
+{
+        union {
+                uint64_t align;
+                unsigned char state[160];
+        } u;
+};
+
+struct tss_crypto
+{
+        const char* name;
+        uint32_t (* init)(void);
+        uint32_t (* sha1_init)(struct tss_sha1* sha);
+        void (* sha1_update)(struct tss_sha1* sha, const void* data, size_t len);
+        void (* sha1_final)(struct tss_sha1* sha, unsigned char* digest);
+        uint32_t (* sha1)(unsigned char* digest,
+                          const struct tss_iovec* parts, unsigned int nparts);
+        /* keys longer than a SHA-1 block must be hashed by the caller */
+        void (* hmac_sha1_setkey)(struct tss_hmac_sha1* hmac,
+                                  const unsigned char* key, unsigned int keylen);
+        uint32_t (* hmac_sha1)(const struct tss_hmac_sha1* hmac, unsigned char* digest,
+                               const struct tss_iovec* parts, unsigned int nparts);
+        /* encrypt nblocks independent 16 byte blocks */
+        uint32_t (* aes128_ecb)(const unsigned char* key,
+                                unsigned char* out, const unsigned char* in,
+                                size_t nblocks);
+};
+
+#define TSS_SHA1_BLOCK_SIZE 64
+
+
+extern const struct tss_crypto tss_crypto_builtin;
+
+
+#ifdef TPM_GCRYPT
+
+
+extern const struct tss_crypto tss_crypto_gcrypt;
+
+
+#endif
+
+
+const struct tss_crypto* TSS_Crypto_Get(void);
+
+
+const struct tss_crypto* TSS_Crypto_Set(const struct tss_crypto* provider);
+
+
+#endif
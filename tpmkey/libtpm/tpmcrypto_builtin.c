@@ -0,0 +1,470 @@
+/********************************************************************************/
+/*										*/
+/*                         TPM Built-in Crypto Provider                         */
+/*										*/
+/********************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "tpm.h"
+#include "tpmcrypto.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define TPM_CRYPTO_X86 1
+#endif
+
+/*
+ * SHA-1 (FIPS 180-4) and AES-128 encryption (FIPS 197).  The block
+ * functions are picked once by init: SHA-NI and AES-NI if the CPU has
+ * them, portable C otherwise.
+ */
+
+struct sha1_state
+{
+        uint32_t h[5];
+        uint32_t used;                          /* bytes in buffer */
+        uint64_t length;                        /* bytes hashed so far */
+        unsigned char buffer[TSS_SHA1_BLOCK_SIZE];
+};
+
+struct hmac_state
+{
+        uint32_t inner[5];                      /* state after key ^ ipad */
+        uint32_t outer[5];                      /* state after key ^ opad */
+};
+
+_Static_assert(sizeof(struct sha1_state) <= sizeof(struct tss_sha1), "SHA-1 state too large");
+_Static_assert(sizeof(struct hmac_state) <= sizeof(struct tss_hmac_sha1), "HMAC state too large");
+
+static const uint32_t sha1_iv[5] = {
+        0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0
+};
+
+static inline uint32_t rol32(uint32_t x, unsigned int n)
+{
+        return (x << n) | (x >> (32 - n));
+}
+
+static void sha1_blocks_c(uint32_t h[5], const unsigned char* data, size_t blocks)
+{
+        uint32_t w[80];
+        uint32_t a, b, c, d, e, f, k, t;
+        unsigned int i;
+
+        while (blocks--) {
+                for (i = 0; i < 16; i++) {
+                        w[i] = LOAD32(data, i * 4);
+                }
+                for (i = 16; i < 80; i++) {
+                        w[i] = rol32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+                }
+                a = h[0];
+                b = h[1];
+                c = h[2];
+                d = h[3];
+                e = h[4];
+                for (i = 0; i < 80; i++) {
+                        if (i < 20) {
+                                f = (b & c) | (~b & d);
+                                k = 0x5a827999;
+                        } else if (i < 40) {
+                                f = b ^ c ^ d;
+                                k = 0x6ed9eba1;
+                        } else if (i < 60) {
+                                f = (b & c) | (b & d) | (c & d);
+                                k = 0x8f1bbcdc;
+                        } else {
+                                f = b ^ c ^ d;
+                                k = 0xca62c1d6;
+                        }
+                        t = rol32(a, 5) + f + e + k + w[i];
+                        e = d;
+                        d = c;
+                        c = rol32(b, 30);
+                        b = a;
+                        a = t;
+                }
+                h[0] += a;
+                h[1] += b;
+                h[2] += c;
+                h[3] += d;
+                h[4] += e;
+                data += TSS_SHA1_BLOCK_SIZE;
+        }
+}
+
+#ifdef TPM_CRYPTO_X86
+
+/*
+ * Group i of four rounds.  Message words are scheduled three groups
+ * ahead in msg[(i + 1) % 4] .. msg[(i + 3) % 4].
+ */
+#define SHANI_ROUNDS(i, ein, eout)                                                              \
+        ein = _mm_sha1nexte_epu32(ein, msg[(i) % 4]);                                           \
+        eout = abcd;                                                                            \
+        if ((i) >= 3 && (i) <= 18)                                                              \
+                msg[((i) + 1) % 4] = _mm_sha1msg2_epu32(msg[((i) + 1) % 4], msg[(i) % 4]);      \
+        abcd = _mm_sha1rnds4_epu32(abcd, ein, (i) / 5);                                         \
+        if ((i) <= 16)                                                                          \
+                msg[((i) + 3) % 4] = _mm_sha1msg1_epu32(msg[((i) + 3) % 4], msg[(i) % 4]);      \
+        if ((i) >= 2 && (i) <= 17)                                                              \
+                msg[((i) + 2) % 4] = _mm_xor_si128(msg[((i) + 2) % 4], msg[(i) % 4]);
+
+__attribute__((target("sha,sse4.1")))
+static void sha1_blocks_shani(uint32_t h[5], const unsigned char* data, size_t blocks)
+{
+        const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+        __m128i abcd, abcd_save, e0, e0_save, e1;
+        __m128i msg[4];
+        unsigned int i;
+
+        abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)h), 0x1b);
+        e0 = _mm_set_epi32(h[4], 0, 0, 0);
+
+        while (blocks--) {
+                abcd_save = abcd;
+                e0_save = e0;
+                for (i = 0; i < 4; i++) {
+                        msg[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 16 * i)), mask);
+                }
+
+                e0 = _mm_add_epi32(e0, msg[0]);
+                e1 = abcd;
+                abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+                SHANI_ROUNDS(1, e1, e0)
+                SHANI_ROUNDS(2, e0, e1)
+                SHANI_ROUNDS(3, e1, e0)
+                SHANI_ROUNDS(4, e0, e1)
+                SHANI_ROUNDS(5, e1, e0)
+                SHANI_ROUNDS(6, e0, e1)
+                SHANI_ROUNDS(7, e1, e0)
+                SHANI_ROUNDS(8, e0, e1)
+                SHANI_ROUNDS(9, e1, e0)
+                SHANI_ROUNDS(10, e0, e1)
+                SHANI_ROUNDS(11, e1, e0)
+                SHANI_ROUNDS(12, e0, e1)
+                SHANI_ROUNDS(13, e1, e0)
+                SHANI_ROUNDS(14, e0, e1)
+                SHANI_ROUNDS(15, e1, e0)
+                SHANI_ROUNDS(16, e0, e1)
+                SHANI_ROUNDS(17, e1, e0)
+                SHANI_ROUNDS(18, e0, e1)
+                SHANI_ROUNDS(19, e1, e0)
+
+                e0 = _mm_sha1nexte_epu32(e0, e0_save);
+                abcd = _mm_add_epi32(abcd, abcd_save);
+                data += TSS_SHA1_BLOCK_SIZE;
+        }
+
+        _mm_storeu_si128((__m128i*)h, _mm_shuffle_epi32(abcd, 0x1b));
+        h[4] = _mm_extract_epi32(e0, 3);
+}
+
+#endif
+
+static void (* sha1_blocks)(uint32_t h[5], const unsigned char* data, size_t blocks) = sha1_blocks_c;
+
+static void sha1_start(struct sha1_state* s, const uint32_t h[5], uint64_t length)
+{
+        memcpy(s->h, h, sizeof(s->h));
+        s->used = 0;
+        s->length = length;
+}
+
+static void sha1_feed(struct sha1_state* s, const void* data, size_t len)
+{
+        const unsigned char* p = data;
+        size_t n;
+
+        s->length += len;
+        if (s->used) {
+                n = TSS_SHA1_BLOCK_SIZE - s->used;
+                if (n > len) {
+                        n = len;
+                }
+                memcpy(s->buffer + s->used, p, n);
+                s->used += n;
+                p += n;
+                len -= n;
+                if (s->used < TSS_SHA1_BLOCK_SIZE) {
+                        return;
+                }
+                sha1_blocks(s->h, s->buffer, 1);
+                s->used = 0;
+        }
+        n = len / TSS_SHA1_BLOCK_SIZE;
+        if (n) {
+                sha1_blocks(s->h, p, n);
+                p += n * TSS_SHA1_BLOCK_SIZE;
+                len -= n * TSS_SHA1_BLOCK_SIZE;
+        }
+        memcpy(s->buffer, p, len);
+        s->used = len;
+}
+
+static void sha1_finish(struct sha1_state* s, unsigned char* digest)
+{
+        uint64_t bits = s->length * 8;
+        unsigned int i;
+
+        s->buffer[s->used++] = 0x80;
+        if (s->used > TSS_SHA1_BLOCK_SIZE - 8) {
+                memset(s->buffer + s->used, 0, TSS_SHA1_BLOCK_SIZE - s->used);
+                sha1_blocks(s->h, s->buffer, 1);
+                s->used = 0;
+        }
+        memset(s->buffer + s->used, 0, TSS_SHA1_BLOCK_SIZE - 8 - s->used);
+        STORE32(s->buffer, TSS_SHA1_BLOCK_SIZE - 8, (uint32_t)(bits >> 32));
+        STORE32(s->buffer, TSS_SHA1_BLOCK_SIZE - 4, (uint32_t)bits);
+        sha1_blocks(s->h, s->buffer, 1);
+        for (i = 0; i < 5; i++) {
+                STORE32(digest, i * 4, s->h[i]);
+        }
+}
+
+static uint32_t builtin_sha1_init(struct tss_sha1* sha)
+{
+        sha1_start((struct sha1_state*)sha->u.state, sha1_iv, 0);
+        return 0;
+}
+
+static void builtin_sha1_update(struct tss_sha1* sha, const void* data, size_t len)
+{
+        sha1_feed((struct sha1_state*)sha->u.state, data, len);
+}
+
+static void builtin_sha1_final(struct tss_sha1* sha, unsigned char* digest)
+{
+        sha1_finish((struct sha1_state*)sha->u.state, digest);
+}
+
+static uint32_t builtin_sha1(unsigned char* digest,
+                             const struct tss_iovec* parts, unsigned int nparts)
+{
+        struct sha1_state s;
+        unsigned int i;
+
+        sha1_start(&s, sha1_iv, 0);
+        for (i = 0; i < nparts; i++) {
+                sha1_feed(&s, parts[i].data, parts[i].len);
+        }
+        sha1_finish(&s, digest);
+        return 0;
+}
+
+static void builtin_hmac_sha1_setkey(struct tss_hmac_sha1* hmac,
+                                     const unsigned char* key, unsigned int keylen)
+{
+        struct hmac_state* hs = (struct hmac_state*)hmac->u.state;
+        unsigned char pad[TSS_SHA1_BLOCK_SIZE];
+        unsigned int i;
+
+        memcpy(hs->inner, sha1_iv, sizeof(hs->inner));
+        memcpy(hs->outer, sha1_iv, sizeof(hs->outer));
+
+        memset(pad, 0x36, sizeof(pad));
+        for (i = 0; i < keylen; i++) {
+                pad[i] ^= key[i];
+        }
+        sha1_blocks(hs->inner, pad, 1);
+        memset(pad, 0x5c, sizeof(pad));
+        for (i = 0; i < keylen; i++) {
+                pad[i] ^= key[i];
+        }
+        sha1_blocks(hs->outer, pad, 1);
+        memset(pad, 0, sizeof(pad));
+}
+
+static uint32_t builtin_hmac_sha1(const struct tss_hmac_sha1* hmac, unsigned char* digest,
+                                  const struct tss_iovec* parts, unsigned int nparts)
+{
+        const struct hmac_state* hs = (const struct hmac_state*)hmac->u.state;
+        unsigned char inner[TPM_HASH_SIZE];
+        struct sha1_state s;
+        unsigned int i;
+
+        sha1_start(&s, hs->inner, TSS_SHA1_BLOCK_SIZE);
+        for (i = 0; i < nparts; i++) {
+                sha1_feed(&s, parts[i].data, parts[i].len);
+        }
+        sha1_finish(&s, inner);
+
+        sha1_start(&s, hs->outer, TSS_SHA1_BLOCK_SIZE);
+        sha1_feed(&s, inner, sizeof(inner));
+        sha1_finish(&s, digest);
+        return 0;
+}
+
+/* AES-128 */
+
+#define AES_ROUNDS 10
+#define AES_BLOCK  16
+
+static const unsigned char aes_sbox[256] = {
+        0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+        0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+        0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+        0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+        0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+        0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+        0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+        0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+        0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+        0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+        0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+        0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+        0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+        0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+        0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+        0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16,
+};
+
+/* round keys in FIPS 197 byte order, which is also what AESENC expects */
+static void aes128_expand(const unsigned char* key, unsigned char rk[(AES_ROUNDS + 1) * AES_BLOCK])
+{
+        unsigned char rcon = 0x01;
+        unsigned int i;
+
+        memcpy(rk, key, AES_BLOCK);
+        for (i = AES_BLOCK; i < (AES_ROUNDS + 1) * AES_BLOCK; i += 4) {
+                unsigned char t0 = rk[i - 4], t1 = rk[i - 3], t2 = rk[i - 2], t3 = rk[i - 1];
+
+                if (i % AES_BLOCK == 0) {
+                        unsigned char tmp = t0;
+
+                        t0 = aes_sbox[t1] ^ rcon;
+                        t1 = aes_sbox[t2];
+                        t2 = aes_sbox[t3];
+                        t3 = aes_sbox[tmp];
+                        rcon = (rcon << 1) ^ ((rcon & 0x80) ? 0x1b : 0);
+                }
+                rk[i + 0] = rk[i - AES_BLOCK + 0] ^ t0;
+                rk[i + 1] = rk[i - AES_BLOCK + 1] ^ t1;
+                rk[i + 2] = rk[i - AES_BLOCK + 2] ^ t2;
+                rk[i + 3] = rk[i - AES_BLOCK + 3] ^ t3;
+        }
+}
+
+static inline unsigned char xtime(unsigned char x)
+{
+        return (x << 1) ^ ((x & 0x80) ? 0x1b : 0);
+}
+
+static void aes128_blocks_c(const unsigned char* rk, unsigned char* out,
+                            const unsigned char* in, size_t nblocks)
+{
+        unsigned char s[AES_BLOCK], t[AES_BLOCK];
+        unsigned int r, c, i;
+
+        while (nblocks--) {
+                for (i = 0; i < AES_BLOCK; i++) {
+                        s[i] = in[i] ^ rk[i];
+                }
+                for (r = 1; r <= AES_ROUNDS; r++) {
+                        /* SubBytes and ShiftRows; the state is column major */
+                        for (c = 0; c < 4; c++) {
+                                for (i = 0; i < 4; i++) {
+                                        t[c * 4 + i] = aes_sbox[s[((c + i) % 4) * 4 + i]];
+                                }
+                        }
+                        if (r < AES_ROUNDS) {
+                                /* MixColumns */
+                                for (c = 0; c < 4; c++) {
+                                        unsigned char* col = &t[c * 4];
+                                        unsigned char a = col[0] ^ col[1] ^ col[2] ^ col[3];
+                                        unsigned char c0 = col[0];
+
+                                        col[0] ^= a ^ xtime(col[0] ^ col[1]);
+                                        col[1] ^= a ^ xtime(col[1] ^ col[2]);
+                                        col[2] ^= a ^ xtime(col[2] ^ col[3]);
+                                        col[3] ^= a ^ xtime(col[3] ^ c0);
+                                }
+                        }
+                        for (i = 0; i < AES_BLOCK; i++) {
+                                s[i] = t[i] ^ rk[r * AES_BLOCK + i];
+                        }
+                }
+                memcpy(out, s, AES_BLOCK);
+                in += AES_BLOCK;
+                out += AES_BLOCK;
+        }
+        memset(s, 0, sizeof(s));
+        memset(t, 0, sizeof(t));
+}
+
+#ifdef TPM_CRYPTO_X86
+
+__attribute__((target("aes,sse2")))
+static void aes128_blocks_ni(const unsigned char* rk, unsigned char* out,
+                             const unsigned char* in, size_t nblocks)
+{
+        __m128i k[AES_ROUNDS + 1];
+        unsigned int r;
+
+        for (r = 0; r <= AES_ROUNDS; r++) {
+                k[r] = _mm_loadu_si128((const __m128i*)(rk + r * AES_BLOCK));
+        }
+        while (nblocks--) {
+                __m128i b = _mm_xor_si128(_mm_loadu_si128((const __m128i*)in), k[0]);
+
+                for (r = 1; r < AES_ROUNDS; r++) {
+                        b = _mm_aesenc_si128(b, k[r]);
+                }
+                b = _mm_aesenclast_si128(b, k[AES_ROUNDS]);
+                _mm_storeu_si128((__m128i*)out, b);
+                in += AES_BLOCK;
+                out += AES_BLOCK;
+        }
+}
+
+#endif
+
+static void (* aes128_blocks)(const unsigned char* rk, unsigned char* out,
+                              const unsigned char* in, size_t nblocks) = aes128_blocks_c;
+
+static uint32_t builtin_aes128_ecb(const unsigned char* key,
+                                   unsigned char* out, const unsigned char* in,
+                                   size_t nblocks)
+{
+        unsigned char rk[(AES_ROUNDS + 1) * AES_BLOCK];
+
+        aes128_expand(key, rk);
+        aes128_blocks(rk, out, in, nblocks);
+        memset(rk, 0, sizeof(rk));
+        return 0;
+}
+
+static uint32_t builtin_init(void)
+{
+#ifdef TPM_CRYPTO_X86
+        unsigned int eax, ebx, ecx, edx;
+
+        if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_AES)) {
+                aes128_blocks = aes128_blocks_ni;
+        }
+        if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_SHA) &&
+            __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_1)) {
+                sha1_blocks = sha1_blocks_shani;
+        }
+#endif
+        if (getenv("TPM_CRYPTO_NO_ACCEL")) {
+                sha1_blocks = sha1_blocks_c;
+                aes128_blocks = aes128_blocks_c;
+        }
+        return 0;
+}
+
+const struct tss_crypto tss_crypto_builtin = {
+        .name = "builtin",
+        .init = builtin_init,
+        .sha1_init = builtin_sha1_init,
+        .sha1_update = builtin_sha1_update,
+        .sha1_final = builtin_sha1_final,
+        .sha1 = builtin_sha1,
+        .hmac_sha1_setkey = builtin_hmac_sha1_setkey,
+        .hmac_sha1 = builtin_hmac_sha1,
+        .aes128_ecb = builtin_aes128_ecb,
+};
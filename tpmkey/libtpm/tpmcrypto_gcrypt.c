@@ -0,0 +1,153 @@
+/********************************************************************************/
+/*										*/
+/*                        TPM libgcrypt Crypto Provider                         */
+/*										*/
+/********************************************************************************/
+
+#ifdef TPM_GCRYPT
+
+#include <string.h>
+#include <gcrypt.h>
+
+#include "tpm.h"
+#include "tpmcrypto.h"
+
+/* the pads of the key, one block each */
+struct hmac_state
+{
+        unsigned char ipad[TSS_SHA1_BLOCK_SIZE];
+        unsigned char opad[TSS_SHA1_BLOCK_SIZE];
+};
+
+_Static_assert(sizeof(gcry_md_hd_t) <= sizeof(struct tss_sha1), "SHA-1 state too large");
+_Static_assert(sizeof(struct hmac_state) <= sizeof(struct tss_hmac_sha1), "HMAC state too large");
+
+#define MAX_PARTS 16
+
+static uint32_t gcrypt_init(void)
+{
+        if (!gcry_control(GCRYCTL_INITIALIZATION_FINISHED_P)) {
+                gcry_check_version(NULL);
+        }
+        return 0;
+}
+
+static uint32_t gcrypt_sha1_init(struct tss_sha1* sha)
+{
+        gcry_md_hd_t* hd = (gcry_md_hd_t*)sha->u.state;
+
+        if (gcry_md_open(hd, GCRY_MD_SHA1, 0) != 0) {
+                return ERR_CRYPT_ERR;
+        }
+        return 0;
+}
+
+static void gcrypt_sha1_update(struct tss_sha1* sha, const void* data, size_t len)
+{
+        gcry_md_write(*(gcry_md_hd_t*)sha->u.state, data, len);
+}
+
+static void gcrypt_sha1_final(struct tss_sha1* sha, unsigned char* digest)
+{
+        gcry_md_hd_t hd = *(gcry_md_hd_t*)sha->u.state;
+
+        memcpy(digest, gcry_md_read(hd, GCRY_MD_SHA1), TPM_HASH_SIZE);
+        gcry_md_close(hd);
+}
+
+static uint32_t gcrypt_sha1(unsigned char* digest,
+                            const struct tss_iovec* parts, unsigned int nparts)
+{
+        gcry_buffer_t iov[MAX_PARTS];
+        unsigned int i;
+
+        if (nparts > MAX_PARTS) {
+                return ERR_BUFFER;
+        }
+        memset(iov, 0, nparts * sizeof(gcry_buffer_t));
+        for (i = 0; i < nparts; i++) {
+                iov[i].data = (void*)parts[i].data;
+                iov[i].len = parts[i].len;
+        }
+        if (gcry_md_hash_buffers(GCRY_MD_SHA1, 0, digest, iov, nparts) != 0) {
+                return ERR_CRYPT_ERR;
+        }
+        return 0;
+}
+
+static void gcrypt_hmac_sha1_setkey(struct tss_hmac_sha1* hmac,
+                                    const unsigned char* key, unsigned int keylen)
+{
+        struct hmac_state* hs = (struct hmac_state*)hmac->u.state;
+        unsigned int i;
+
+        memset(hs->ipad, 0x36, sizeof(hs->ipad));
+        memset(hs->opad, 0x5c, sizeof(hs->opad));
+        for (i = 0; i < keylen; i++) {
+                hs->ipad[i] ^= key[i];
+                hs->opad[i] ^= key[i];
+        }
+}
+
+static uint32_t gcrypt_hmac_sha1(const struct tss_hmac_sha1* hmac, unsigned char* digest,
+                                 const struct tss_iovec* parts, unsigned int nparts)
+{
+        const struct hmac_state* hs = (const struct hmac_state*)hmac->u.state;
+        gcry_buffer_t iov[MAX_PARTS + 1];
+        unsigned char inner[TPM_HASH_SIZE];
+        unsigned int i;
+
+        if (nparts > MAX_PARTS) {
+                return ERR_BUFFER;
+        }
+        memset(iov, 0, (nparts + 1) * sizeof(gcry_buffer_t));
+        iov[0].data = (void*)hs->ipad;
+        iov[0].len = sizeof(hs->ipad);
+        for (i = 0; i < nparts; i++) {
+                iov[i + 1].data = (void*)parts[i].data;
+                iov[i + 1].len = parts[i].len;
+        }
+        if (gcry_md_hash_buffers(GCRY_MD_SHA1, 0, inner, iov, nparts + 1) != 0) {
+                return ERR_CRYPT_ERR;
+        }
+        iov[0].data = (void*)hs->opad;
+        iov[0].len = sizeof(hs->opad);
+        iov[1].data = inner;
+        iov[1].len = sizeof(inner);
+        if (gcry_md_hash_buffers(GCRY_MD_SHA1, 0, digest, iov, 2) != 0) {
+                return ERR_CRYPT_ERR;
+        }
+        return 0;
+}
+
+static uint32_t gcrypt_aes128_ecb(const unsigned char* key,
+                                  unsigned char* out, const unsigned char* in,
+                                  size_t nblocks)
+{
+        gcry_cipher_hd_t hd;
+        uint32_t ret = 0;
+
+        if (gcry_cipher_open(&hd, GCRY_CIPHER_AES128, GCRY_CIPHER_MODE_ECB, 0) != 0) {
+                return ERR_CRYPT_ERR;
+        }
+        if (gcry_cipher_setkey(hd, key, 16) != 0 ||
+            gcry_cipher_encrypt(hd, out, nblocks * 16, in, nblocks * 16) != 0) {
+                ret = ERR_CRYPT_ERR;
+        }
+        gcry_cipher_close(hd);
+        return ret;
+}
+
+const struct tss_crypto tss_crypto_gcrypt = {
+        .name = "gcrypt",
+        .init = gcrypt_init,
+        .sha1_init = gcrypt_sha1_init,
+        .sha1_update = gcrypt_sha1_update,
+        .sha1_final = gcrypt_sha1_final,
+        .sha1 = gcrypt_sha1,
+        .hmac_sha1_setkey = gcrypt_hmac_sha1_setkey,
+        .hmac_sha1 = gcrypt_hmac_sha1,
+        .aes128_ecb = gcrypt_aes128_ecb,
+};
+
+#endif
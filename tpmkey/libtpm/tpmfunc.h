@@ -47,7 +47,9 @@
 #include <oiaposap.h>
 #include <tpm_structures.h>
 
+#ifdef TPM_GCRYPT
 #include <gcrypt.h>
+#endif
 
 
 /* section 3: Admin startup and state */
@@ -262,6 +264,11 @@ uint32_t TPM_Extend(uint32_t pcrIndex,
 uint32_t TPM_PcrRead(uint32_t pcrindex, unsigned char* pcrvalue);
 
 
+uint32_t TPM_PcrReadMany(const TPM_PCR_SELECTION* selection,
+                         unsigned char* pcrvalues,
+                         uint32_t* usecs);
+
+
 uint32_t TPM_Quote(uint32_t keyhandle,
                    unsigned char* keyauth,
                    unsigned char* externalData,
@@ -475,6 +482,15 @@ uint32_t TPM_Seal(uint32_t keyhandle,
                   unsigned char* blob, uint32_t* bloblen);
 
 
+uint32_t TSS_SealMany(uint32_t keyhandle,
+                      uint32_t count,
+                      unsigned char** pcrinfo, uint32_t* pcrinfosize,
+                      unsigned char* keyauth,
+                      unsigned char* dataauth,
+                      unsigned char* data, uint32_t datalen,
+                      struct tpm_buffer* blobs);
+
+
 uint32_t TPM_Unseal(uint32_t keyhandle,
                     unsigned char* keyauth,
                     unsigned char* dataauth,
@@ -488,6 +504,9 @@ uint32_t TPM_UnBind(uint32_t keyhandle,
                     unsigned char* blob, uint32_t* bloblen);
 
 
+#ifdef TPM_GCRYPT
+
+
 uint32_t TSS_Bind(gcry_sexp_t key,
                   const struct tpm_buffer* data,
                   struct tpm_buffer* blob);
@@ -498,6 +517,9 @@ uint32_t TSS_BindPKCSv15(gcry_sexp_t key,
                          struct tpm_buffer* blob);
 
 
+#endif
+
+
 uint32_t TPM_LoadKey(uint32_t keyhandle, unsigned char* keyauth,
                      keydata* keyparms,uint32_t* newhandle);
 
@@ -506,6 +528,11 @@ uint32_t TPM_LoadKey2(uint32_t keyhandle, unsigned char* keyauth,
                       keydata* keyparms, uint32_t* newhandle);
 
 
+uint32_t TPM_LoadKey2Blob(uint32_t keyhandle, unsigned char* keyauth,
+                          const unsigned char* keyblob, uint32_t keybloblen,
+                          uint32_t* newhandle);
+
+
 uint32_t TPM_GetPubKey(uint32_t keyhandle,
                        unsigned char* keyauth,
                        pubkeydata* pk);
@@ -693,6 +720,9 @@ uint32_t TPM_NV_ReadValueAuth(uint32_t nvIndex,
                               unsigned char* areaauth);
 
 
+uint32_t TPM_NV_GetDataPublic(uint32_t nvIndex, TPM_NV_DATA_PUBLIC* ndp);
+
+
 /* Section 25: Counter related functions */
 uint32_t TPM_CreateCounter(uint32_t keyhandle,
                            unsigned char* ownauth,      // HMAC key
@@ -815,6 +845,11 @@ uint32_t TSS_GenPCRInfo(uint32_t pcrmap,
                         uint32_t* len);
 
 
+uint32_t TSS_PCRComposite(const TPM_PCR_SELECTION* selection,
+                          const unsigned char* pcrvalues,
+                          unsigned char* digest);
+
+
 char* TPM_GetErrMsg(uint32_t code);
 
 
@@ -980,9 +1015,15 @@ uint32_t  TSS_KeyExtract(const struct tpm_buffer* tb, uint32_t offset, keydata*
 uint32_t  TSS_PubKeyExtract(const struct tpm_buffer* tb, uint32_t offset, pubkeydata* k);
 
 
+#ifdef TPM_GCRYPT
+
+
 gcry_sexp_t TSS_convpubkey(pubkeydata* k);
 
 
+#endif
+
+
 uint32_t  TPM_WriteKey(struct tpm_buffer* tb, keydata* k);
 
 
@@ -1066,6 +1107,9 @@ uint32_t TPM_GetNumPCRRegisters(uint32_t* res);
 
 uint32_t TPM_GetTPMInputBufferSize(uint32_t* size);
 
+
+uint32_t TSS_GetInputBufferSize(void);
+
 struct tpm_buffer* TSS_AllocTPMBuffer(int len);
 
 
@@ -1159,12 +1203,18 @@ uint32_t _TPM_GetCalculatedAuditDigest(TPM_DIGEST* digest);
 uint32_t _TPM_SetAuditStatus(uint32_t ord, TPM_BOOL enable);
 
 
+#ifdef TPM_GCRYPT
+
+
 uint32_t TPM_ValidateSignature(uint16_t sigscheme,
                                struct tpm_buffer* data,
                                struct tpm_buffer* signature,
                                gcry_sexp_t rsa);
 
 
+#endif
+
+
 uint32_t TPM_WriteTransportLogIn(struct tpm_buffer* buffer,
                                  TPM_TRANSPORT_LOG_IN* ttli);
 
@@ -1182,9 +1232,6 @@ uint32_t TPM_ReadCurrentTicks(struct tpm_buffer* buffer,
                               TPM_CURRENT_TICKS* tct);
 
 
-uint32_t read_transdigest(uint32_t handle, unsigned char* digest);
-
-
 void print_array(const char* name, const unsigned char* data, unsigned int len);
 
 
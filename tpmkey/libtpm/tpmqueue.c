@@ -0,0 +1,859 @@
+/********************************************************************************/
+/*										*/
+/*                        TPM Asynchronous Command Queue                        */
+/*										*/
+/********************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <tpm.h>
+#include <tpm_constants.h>
+#include <tpmfunc.h>
+#include <tpmutil.h>
+#include <tpm_lowlevel.h>
+#include <tpmqueue.h>
+
+/*
+ * The TPM executes one command at a time.  Producers push marshalled
+ * requests into a lock-free multi-producer single-consumer queue and one
+ * device thread drains it, so host side work (nonces, HMACs, marshalling)
+ * of the producers overlaps with the device latency.  At most depth
+ * requests are in flight; further submissions block (back-pressure).
+ *
+ * The queue is the intrusive MPSC list of D. Vyukov: producers swap
+ * themselves in at head with one atomic exchange, the consumer follows
+ * the next pointers from tail.
+ *
+ * Identical read-only requests are coalesced: while one is in flight,
+ * further submissions of the same bytes do not reach the device but
+ * receive a copy of its response.  With a freshness window set for an
+ * ordinal, responses are also reused for that long after completion;
+ * any other command passing the device thread drops those responses.
+ *
+ * The device thread does not serve requests in arrival order.  It keeps
+ * the requests taken off the queue in a pending list and always sends
+ * one of the lowest aged class
+ *
+ *      class - waited / aging
+ *
+ * so an unseal is not stuck behind a batch of quotes, and a request gains
+ * one class for every aging interval it waits and cannot starve.  Within
+ * a class short commands go first, then the one waiting longest.  The
+ * expected duration of an ordinal is its short, medium or long duration
+ * as reported by the TPM; it never moves a request into another class,
+ * the reported timeouts are far longer than the aging interval.
+ *
+ * Only requests of different streams are reordered.  Every request takes
+ * the next sequence number of its stream on submission and is not sent
+ * before the stream completed all requests numbered lower, so a PcrRead
+ * submitted after an Extend sees the extended value while submission
+ * itself stays lock-free.  For the same reason a stream with requests
+ * outstanding is neither served from a fresh response nor coalesced, and
+ * only with a leader that is not waiting for its own stream.
+ */
+#define TPM_QUEUE_WINDOWS       8
+#define TPM_QUEUE_FRESH         16
+
+/* recheck interval while every pending request waits for its stream */
+#define TPM_QUEUE_POLL_NSECS    1000000
+
+struct fresh_response
+{
+        struct timespec stamp;
+        uint32_t keylen;
+        unsigned char key[TPM_QUEUE_KEY_SIZE];
+        uint32_t len;
+        unsigned char* rsp;
+};
+
+struct tpm_queue
+{
+        struct tpm_request* _Atomic head;
+        struct tpm_request* tail;
+        struct tpm_request stub;
+        sem_t items;
+        sem_t slots;
+        pthread_t thread;
+
+        pthread_mutex_t lock;                   /* protects everything below */
+        struct tpm_request* inflight;           /* coalescing leaders */
+        struct {
+                uint32_t ordinal;
+                uint32_t usecs;
+        } window[TPM_QUEUE_WINDOWS];
+        unsigned int num_fresh;
+        unsigned int next_fresh;
+        struct fresh_response fresh[TPM_QUEUE_FRESH];
+        uint32_t aging;
+        struct tpm_queue_stats stats[TPM_PRIO_CLASSES];
+
+        /* owned by the device thread */
+        struct tpm_request* pending;
+        struct tpm_request* stop;
+        int have_durations;
+        uint32_t durations[3];                  /* short, medium, long in usecs */
+        int transport_type;                     /* of the device thread, 0 for default */
+        void* transport_data;
+};
+
+enum {
+        TPM_DURATION_SHORT = 0,
+        TPM_DURATION_MEDIUM,
+        TPM_DURATION_LONG,
+};
+
+/* the stream of requests that do not name a submitter */
+static __thread struct tpm_stream thread_stream;
+
+/* whether all earlier requests of the stream of req completed */
+static int stream_turn(const struct tpm_request* req)
+{
+        return atomic_load_explicit(&req->stream->completed, memory_order_acquire) == req->seq;
+}
+
+/* before done is posted, the stream may be gone afterwards */
+static void stream_complete(struct tpm_request* req)
+{
+        atomic_fetch_add_explicit(&req->stream->completed, 1, memory_order_release);
+}
+
+static void queue_push(struct tpm_queue* q, struct tpm_request* req)
+{
+        struct tpm_request* prev;
+
+        atomic_store_explicit(&req->next, NULL, memory_order_relaxed);
+        prev = atomic_exchange_explicit(&q->head, req, memory_order_acq_rel);
+        atomic_store_explicit(&prev->next, req, memory_order_release);
+}
+
+/* returns NULL when empty or when a producer is half way through a push */
+static struct tpm_request* queue_pop(struct tpm_queue* q)
+{
+        struct tpm_request* tail = q->tail;
+        struct tpm_request* next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+        if (tail == &q->stub) {
+                if (next == NULL)
+                        return NULL;
+                q->tail = next;
+                tail = next;
+                next = atomic_load_explicit(&next->next, memory_order_acquire);
+        }
+        if (next != NULL) {
+                q->tail = next;
+                return tail;
+        }
+        if (tail != atomic_load_explicit(&q->head, memory_order_acquire))
+                return NULL;
+        queue_push(q, &q->stub);
+        next = atomic_load_explicit(&tail->next, memory_order_acquire);
+        if (next != NULL) {
+                q->tail = next;
+                return tail;
+        }
+        return NULL;
+}
+
+/* only unauthorized commands without side effects are coalesced */
+static int coalescable(const struct tpm_buffer* tb)
+{
+        uint16_t tag;
+        uint32_t ordinal;
+
+        if (tb->used < TPM_U16_SIZE + 2 * TPM_U32_SIZE || tb->used > TPM_QUEUE_KEY_SIZE)
+                return 0;
+        tpm_buffer_load16(tb, 0, &tag);
+        tpm_buffer_load32(tb, TPM_U16_SIZE + TPM_U32_SIZE, &ordinal);
+        if (tag != TPM_TAG_RQU_COMMAND)
+                return 0;
+        switch (ordinal) {
+        case TPM_ORD_PcrRead:
+        case TPM_ORD_GetCapability:
+        case TPM_ORD_ReadPubek:
+        case TPM_ORD_NV_ReadValue:
+        case TPM_ORD_GetTestResult:
+                return 1;
+        }
+        return 0;
+}
+
+static uint32_t freshness(const struct tpm_queue* q, const unsigned char* key)
+{
+        uint32_t ordinal = LOAD32(key, TPM_U16_SIZE + TPM_U32_SIZE);
+        unsigned int i;
+
+        for (i = 0; i < TPM_QUEUE_WINDOWS; i++) {
+                if (q->window[i].ordinal == ordinal)
+                        return q->window[i].usecs;
+        }
+        return 0;
+}
+
+static uint64_t elapsed_usecs(const struct timespec* since)
+{
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (uint64_t)(now.tv_sec - since->tv_sec) * 1000000 +
+               (now.tv_nsec - since->tv_nsec) / 1000;
+}
+
+static uint32_t copy_response(struct tpm_buffer* tb, const unsigned char* rsp, uint32_t len)
+{
+        if (len > tb->size)
+                return ERR_BUFFER;
+        memcpy(tb->buffer, rsp, len);
+        tb->used = len;
+        return 0;
+}
+
+/* call with q->lock held */
+static int fresh_lookup(struct tpm_queue* q, struct tpm_request* req)
+{
+        uint32_t usecs = freshness(q, req->tb->buffer);
+        unsigned int i;
+
+        if (usecs == 0)
+                return 0;
+        for (i = 0; i < q->num_fresh; i++) {
+                struct fresh_response* f = &q->fresh[i];
+
+                if (f->keylen == req->tb->used &&
+                    !memcmp(f->key, req->tb->buffer, f->keylen) &&
+                    elapsed_usecs(&f->stamp) < usecs) {
+                        req->result = copy_response(req->tb, f->rsp, f->len);
+                        return 1;
+                }
+        }
+        return 0;
+}
+
+/* call with q->lock held */
+static void fresh_store(struct tpm_queue* q, const struct tpm_request* req)
+{
+        struct fresh_response* f = NULL;
+        unsigned char* rsp;
+        unsigned int i;
+
+        if (freshness(q, req->key) == 0)
+                return;
+        for (i = 0; i < q->num_fresh; i++) {
+                if (q->fresh[i].keylen == req->keylen &&
+                    !memcmp(q->fresh[i].key, req->key, req->keylen)) {
+                        f = &q->fresh[i];
+                        break;
+                }
+        }
+        if (f == NULL) {
+                f = &q->fresh[q->next_fresh];
+                q->next_fresh = (q->next_fresh + 1) % TPM_QUEUE_FRESH;
+                if (q->num_fresh < TPM_QUEUE_FRESH)
+                        q->num_fresh++;
+        }
+        rsp = realloc(f->rsp, req->tb->used);
+        if (rsp == NULL) {
+                f->keylen = 0;
+                return;
+        }
+        f->rsp = rsp;
+        memcpy(f->rsp, req->tb->buffer, req->tb->used);
+        f->len = req->tb->used;
+        f->keylen = req->keylen;
+        memcpy(f->key, req->key, req->keylen);
+        clock_gettime(CLOCK_MONOTONIC, &f->stamp);
+}
+
+static void fresh_flush(struct tpm_queue* q)
+{
+        pthread_mutex_lock(&q->lock);
+        q->num_fresh = 0;
+        q->next_fresh = 0;
+        pthread_mutex_unlock(&q->lock);
+}
+
+/*
+ * Hand the response of a coalescing leader to the requests waiting on it.
+ */
+static void coalesce_complete(struct tpm_queue* q, struct tpm_request* req)
+{
+        struct tpm_request** pp;
+        struct tpm_request* w;
+        struct tpm_request* next;
+
+        pthread_mutex_lock(&q->lock);
+        for (pp = &q->inflight; *pp != NULL; pp = &(*pp)->inflight) {
+                if (*pp == req) {
+                        *pp = req->inflight;
+                        break;
+                }
+        }
+        w = req->waiters;
+        req->waiters = NULL;
+        if (req->result == 0)
+                fresh_store(q, req);
+        pthread_mutex_unlock(&q->lock);
+
+        /* waiters are chained through their own waiters pointer */
+        for (; w != NULL; w = next) {
+                next = w->waiters;
+                w->result = req->result;
+                if (req->result == 0)
+                        w->result = copy_response(w->tb, req->tb->buffer, req->tb->used);
+                if (w->complete)
+                        w->complete(w);
+                stream_complete(w);
+                sem_post(&w->done);
+        }
+}
+
+static uint32_t request_ordinal(const struct tpm_request* req)
+{
+        uint32_t ordinal = 0;
+
+        tpm_buffer_load32(req->tb, TPM_U16_SIZE + TPM_U32_SIZE, &ordinal);
+        return ordinal;
+}
+
+static enum tpm_priority classify(uint32_t ordinal)
+{
+        switch (ordinal) {
+        case TPM_ORD_Quote:
+        case TPM_ORD_Quote2:
+        case TPM_ORD_Sign:
+        case TPM_ORD_CertifyKey:
+        case TPM_ORD_CertifyKey2:
+        case TPM_ORD_TickStampBlob:
+        case TPM_ORD_GetAuditDigestSigned:
+        case TPM_ORD_MakeIdentity:
+        case TPM_ORD_ActivateIdentity:
+                return TPM_PRIO_ATTESTATION;
+        case TPM_ORD_GetRandom:
+        case TPM_ORD_StirRandom:
+        case TPM_ORD_SelfTestFull:
+        case TPM_ORD_ContinueSelfTest:
+                return TPM_PRIO_BACKGROUND;
+        }
+        return TPM_PRIO_INTERACTIVE;
+}
+
+/* duration class of an ordinal, following the TPM main specification */
+static int ordinal_duration(uint32_t ordinal)
+{
+        switch (ordinal) {
+        case TPM_ORD_TakeOwnership:
+        case TPM_ORD_CreateWrapKey:
+        case TPM_ORD_CMK_CreateKey:
+        case TPM_ORD_MakeIdentity:
+        case TPM_ORD_CreateEndorsementKeyPair:
+        case TPM_ORD_CreateRevocableEK:
+        case TPM_ORD_SelfTestFull:
+        case TPM_ORD_ContinueSelfTest:
+        case TPM_ORD_DAA_Join:
+        case TPM_ORD_DAA_Sign:
+                return TPM_DURATION_LONG;
+        case TPM_ORD_Quote:
+        case TPM_ORD_Quote2:
+        case TPM_ORD_Sign:
+        case TPM_ORD_CertifyKey:
+        case TPM_ORD_CertifyKey2:
+        case TPM_ORD_TickStampBlob:
+        case TPM_ORD_GetAuditDigestSigned:
+        case TPM_ORD_ActivateIdentity:
+        case TPM_ORD_Seal:
+        case TPM_ORD_Unseal:
+        case TPM_ORD_LoadKey:
+        case TPM_ORD_LoadKey2:
+        case TPM_ORD_Extend:
+        case TPM_ORD_GetPubKey:
+                return TPM_DURATION_MEDIUM;
+        }
+        return TPM_DURATION_SHORT;
+}
+
+/*
+ * Ask the TPM for its command durations, fall back to typical values.
+ */
+static void load_durations(struct tpm_queue* q)
+{
+        STACK_TPM_BUFFER(subcap)
+        STACK_TPM_BUFFER(response)
+        uint32_t ret;
+        int i;
+
+        q->durations[TPM_DURATION_SHORT] = 20000;
+        q->durations[TPM_DURATION_MEDIUM] = 750000;
+        q->durations[TPM_DURATION_LONG] = 2000000;
+        q->have_durations = 1;
+
+        STORE32(subcap.buffer, 0, TPM_CAP_PROP_DURATION);
+        subcap.used = TPM_U32_SIZE;
+        ret = TPM_GetCapability(TPM_CAP_PROPERTY, &subcap, &response);
+        if (ret != 0 || response.used < 3 * TPM_U32_SIZE)
+                return;
+        for (i = 0; i < 3; i++) {
+                uint32_t usecs = LOAD32(response.buffer, i * TPM_U32_SIZE);
+
+                if (usecs > 0)
+                        q->durations[i] = usecs;
+        }
+}
+
+static int64_t usecs_between(const struct timespec* from, const struct timespec* to)
+{
+        return (int64_t)(to->tv_sec - from->tv_sec) * 1000000 +
+               (to->tv_nsec - from->tv_nsec) / 1000;
+}
+
+/*
+ * Take the next request off the pending list: lowest aged class first,
+ * then shortest expected duration, then longest wait.  Returns NULL when
+ * every pending request waits for an earlier one of its stream.
+ */
+static struct tpm_request* schedule(struct tpm_queue* q, const struct timespec* now)
+{
+        struct tpm_request** best = NULL;
+        struct tpm_request** pp;
+        struct tpm_request* req;
+        int64_t best_class = 0, best_waited = 0;
+        uint32_t best_duration = 0;
+        int64_t aging;
+
+        pthread_mutex_lock(&q->lock);
+        aging = q->aging;
+
+        for (pp = &q->pending; *pp != NULL; pp = &(*pp)->pending) {
+                int64_t waited, class;
+                uint32_t duration;
+
+                req = *pp;
+                if (!stream_turn(req))
+                        continue;
+                waited = usecs_between(&req->submitted, now);
+                class = (int64_t)req->priority - waited / aging;
+                duration = q->durations[ordinal_duration(request_ordinal(req))];
+                if (best == NULL || class < best_class ||
+                    (class == best_class && (duration < best_duration ||
+                     (duration == best_duration && waited > best_waited)))) {
+                        best = pp;
+                        best_class = class;
+                        best_duration = duration;
+                        best_waited = waited;
+                }
+        }
+        pthread_mutex_unlock(&q->lock);
+        if (best == NULL)
+                return NULL;
+        req = *best;
+        *best = req->pending;
+        return req;
+}
+
+static void account(struct tpm_queue* q, const struct tpm_request* req,
+                    const struct timespec* start, const struct timespec* end)
+{
+        struct tpm_queue_stats* stats = &q->stats[req->priority - 1];
+        uint64_t wait = usecs_between(&req->submitted, start);
+
+        pthread_mutex_lock(&q->lock);
+        stats->requests++;
+        stats->wait_usecs += wait;
+        if (wait > stats->max_wait_usecs)
+                stats->max_wait_usecs = wait;
+        stats->busy_usecs += usecs_between(start, end);
+        pthread_mutex_unlock(&q->lock);
+}
+
+/* move one request from the lock-free queue to the pending list */
+static int take_request(struct tpm_queue* q)
+{
+        struct tpm_request* req;
+
+        while ((req = queue_pop(q)) == NULL)
+                sched_yield();
+        if (req->tb == NULL) {
+                /* the stop request, answered once everything else is done */
+                q->stop = req;
+                return 0;
+        }
+        req->pending = q->pending;
+        q->pending = req;
+        return 1;
+}
+
+/* wait a little for the next request, returns 0 on timeout */
+static int wait_request(struct tpm_queue* q)
+{
+        struct timespec deadline;
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += TPM_QUEUE_POLL_NSECS;
+        if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+        }
+        return sem_timedwait(&q->items, &deadline) == 0;
+}
+
+static void* queue_thread(void* arg)
+{
+        struct tpm_queue* q = arg;
+        struct tss_ctx* ctx = TSS_Ctx_New();
+        struct tpm_request* req;
+        struct timespec start, end;
+        int running = 1;
+
+        /* the device thread owns the connection to the TPM */
+        TSS_Ctx_SetCurrent(ctx);
+        if (ctx != NULL && q->transport_type != 0) {
+                TPM_LowLevel_Transport_Init(q->transport_type);
+                ctx->transport_data = q->transport_data;
+        }
+        while (running || q->pending != NULL) {
+                if (q->pending == NULL) {
+                        while (sem_wait(&q->items) != 0 && errno == EINTR)
+                                ;
+                        running = take_request(q);
+                }
+                while (running && sem_trywait(&q->items) == 0)
+                        running = take_request(q);
+                if (q->pending == NULL)
+                        continue;
+                if (ctx != NULL && !q->have_durations)
+                        load_durations(q);
+
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                req = schedule(q, &start);
+                if (req == NULL) {
+                        /*
+                         * The earlier requests are still being pushed, or
+                         * were submitted to another queue.
+                         */
+                        if (wait_request(q))
+                                running = take_request(q);
+                        continue;
+                }
+                if (req->keylen == 0)
+                        fresh_flush(q);
+                if (ctx == NULL)
+                        req->result = ERR_MEM_ERR;
+                else
+                        req->result = TPM_Send(req->tb, req->msg);
+                clock_gettime(CLOCK_MONOTONIC, &end);
+                account(q, req, &start, &end);
+                if (req->keylen > 0)
+                        coalesce_complete(q, req);
+                if (req->complete)
+                        req->complete(req);
+                stream_complete(req);
+                sem_post(&req->done);
+                sem_post(&q->slots);
+        }
+        if (q->stop != NULL)
+                sem_post(&q->stop->done);
+        TSS_Ctx_Free(ctx);
+        return NULL;
+}
+
+/****************************************************************************/
+/*                                                                          */
+/* Start a device thread                                                    */
+/*                                                                          */
+/* depth is the maximum number of submitted, not yet completed requests     */
+/* transport_type selects the lowlevel transport of the device thread, 0    */
+/* for the default one, transport_data is passed to it (e.g. the socket     */
+/* path for TPM_LOWLEVEL_TRANSPORT_UNIXIO)                                  */
+/*                                                                          */
+/****************************************************************************/
+struct tpm_queue* TSS_Queue_StartTransport(unsigned int depth, int transport_type,
+                                           void* transport_data)
+{
+        struct tpm_queue* q = calloc(1, sizeof(struct tpm_queue));
+
+        if (q == NULL)
+                return NULL;
+        if (depth == 0)
+                depth = 1;
+        atomic_init(&q->head, &q->stub);
+        atomic_init(&q->stub.next, NULL);
+        q->aging = TPM_QUEUE_AGING_USECS;
+        q->transport_type = transport_type;
+        q->transport_data = transport_data;
+        q->tail = &q->stub;
+        sem_init(&q->items, 0, 0);
+        sem_init(&q->slots, 0, depth);
+        pthread_mutex_init(&q->lock, NULL);
+        if (pthread_create(&q->thread, NULL, queue_thread, q) != 0) {
+                pthread_mutex_destroy(&q->lock);
+                sem_destroy(&q->items);
+                sem_destroy(&q->slots);
+                free(q);
+                return NULL;
+        }
+        return q;
+}
+
+struct tpm_queue* TSS_Queue_Start(unsigned int depth)
+{
+        return TSS_Queue_StartTransport(depth, 0, NULL);
+}
+
+/*
+ * Stop the device thread after all requests submitted before have
+ * completed.
+ */
+void TSS_Queue_Stop(struct tpm_queue* q)
+{
+        struct tpm_request stop;
+        unsigned int i;
+
+        if (q == NULL)
+                return;
+        memset(&stop, 0, sizeof(stop));
+        sem_init(&stop.done, 0, 0);
+        queue_push(q, &stop);
+        sem_post(&q->items);
+        pthread_join(q->thread, NULL);
+        sem_destroy(&stop.done);
+        sem_destroy(&q->items);
+        sem_destroy(&q->slots);
+        pthread_mutex_destroy(&q->lock);
+        for (i = 0; i < TPM_QUEUE_FRESH; i++)
+                free(q->fresh[i].rsp);
+        free(q);
+}
+
+/****************************************************************************/
+/*                                                                          */
+/* Submit a request                                                         */
+/*                                                                          */
+/* Blocks while the queue is full.  The request and its buffer must stay    */
+/* valid until it completed.  Requests with the same submitter, or from the */
+/* same thread if it is NULL, are sent in the order they were submitted;    */
+/* that thread must not exit before its requests completed.                 */
+/*                                                                          */
+/****************************************************************************/
+uint32_t TSS_Queue_Submit(struct tpm_queue* q, struct tpm_request* req)
+{
+        if (q == NULL || req == NULL || req->tb == NULL)
+                return ERR_NULL_ARG;
+        if (sem_init(&req->done, 0, 0) != 0)
+                return ERR_IO;
+        req->inflight = NULL;
+        req->waiters = NULL;
+        req->keylen = 0;
+        req->stream = req->submitter ? req->submitter : &thread_stream;
+        if (req->priority < TPM_PRIO_INTERACTIVE || req->priority > TPM_PRIO_BACKGROUND)
+                req->priority = classify(request_ordinal(req));
+        clock_gettime(CLOCK_MONOTONIC, &req->submitted);
+        req->seq = atomic_fetch_add_explicit(&req->stream->submitted, 1, memory_order_relaxed);
+        /*
+         * A leader holds its slot before others wait on it, the requests
+         * queued behind those waiters could hold all slots otherwise.
+         */
+        while (sem_wait(&q->slots) != 0 && errno == EINTR)
+                ;
+        /* earlier requests of the stream must complete first */
+        if (coalescable(req->tb) && stream_turn(req)) {
+                struct tpm_request* leader;
+
+                pthread_mutex_lock(&q->lock);
+                if (fresh_lookup(q, req)) {
+                        pthread_mutex_unlock(&q->lock);
+                        sem_post(&q->slots);
+                        if (req->complete)
+                                req->complete(req);
+                        stream_complete(req);
+                        sem_post(&req->done);
+                        return 0;
+                }
+                for (leader = q->inflight; leader != NULL; leader = leader->inflight) {
+                        if (leader->keylen == req->tb->used &&
+                            !memcmp(leader->key, req->tb->buffer, leader->keylen) &&
+                            stream_turn(leader))
+                                break;
+                }
+                if (leader != NULL) {
+                        req->waiters = leader->waiters;
+                        leader->waiters = req;
+                        pthread_mutex_unlock(&q->lock);
+                        sem_post(&q->slots);
+                        return 0;
+                }
+                req->keylen = req->tb->used;
+                memcpy(req->key, req->tb->buffer, req->keylen);
+                req->inflight = q->inflight;
+                q->inflight = req;
+                pthread_mutex_unlock(&q->lock);
+        }
+        queue_push(q, req);
+        sem_post(&q->items);
+        return 0;
+}
+
+/*
+ * Wait for a submitted request, returns the result of TPM_Send.
+ */
+uint32_t TSS_Queue_Wait(struct tpm_request* req)
+{
+        while (sem_wait(&req->done) != 0 && errno == EINTR)
+                ;
+        sem_destroy(&req->done);
+        return req->result;
+}
+
+/****************************************************************************/
+/*                                                                          */
+/* Reuse responses of an ordinal for usecs after they completed             */
+/*                                                                          */
+/* Only the read-only ordinals that are coalesced anyway are accepted,      */
+/* usecs 0 turns the window off again.                                      */
+/*                                                                          */
+/****************************************************************************/
+uint32_t TSS_Queue_SetFreshness(struct tpm_queue* q, uint32_t ordinal, uint32_t usecs)
+{
+        uint32_t ret = ERR_BAD_ARG;
+        unsigned int i, slot = TPM_QUEUE_WINDOWS;
+
+        if (q == NULL)
+                return ERR_NULL_ARG;
+        switch (ordinal) {
+        case TPM_ORD_PcrRead:
+        case TPM_ORD_GetCapability:
+        case TPM_ORD_ReadPubek:
+        case TPM_ORD_NV_ReadValue:
+        case TPM_ORD_GetTestResult:
+                break;
+        default:
+                return ERR_BAD_ARG;
+        }
+        pthread_mutex_lock(&q->lock);
+        for (i = 0; i < TPM_QUEUE_WINDOWS; i++) {
+                if (q->window[i].ordinal == ordinal) {
+                        slot = i;
+                        break;
+                }
+                if (slot == TPM_QUEUE_WINDOWS && q->window[i].usecs == 0)
+                        slot = i;
+        }
+        if (slot < TPM_QUEUE_WINDOWS) {
+                q->window[slot].ordinal = ordinal;
+                q->window[slot].usecs = usecs;
+                ret = 0;
+        }
+        pthread_mutex_unlock(&q->lock);
+        return ret;
+}
+
+/*
+ * Set the time after which a waiting request is promoted by one class.
+ */
+uint32_t TSS_Queue_SetAging(struct tpm_queue* q, uint32_t usecs)
+{
+        if (q == NULL)
+                return ERR_NULL_ARG;
+        if (usecs == 0)
+                return ERR_BAD_ARG;
+        pthread_mutex_lock(&q->lock);
+        q->aging = usecs;
+        pthread_mutex_unlock(&q->lock);
+        return 0;
+}
+
+/*
+ * Copy the wait and busy times accumulated for one class.
+ */
+uint32_t TSS_Queue_GetStats(struct tpm_queue* q, enum tpm_priority priority,
+                            struct tpm_queue_stats* stats)
+{
+        if (q == NULL || stats == NULL)
+                return ERR_NULL_ARG;
+        if (priority < TPM_PRIO_INTERACTIVE || priority > TPM_PRIO_BACKGROUND)
+                return ERR_BAD_ARG;
+        pthread_mutex_lock(&q->lock);
+        *stats = q->stats[priority - 1];
+        pthread_mutex_unlock(&q->lock);
+        return 0;
+}
+
+static uint32_t queue_transmit(struct tpm_queue* q, struct tpm_buffer* tb, const char* msg,
+                               enum tpm_priority priority)
+{
+        struct tpm_request req = {
+                .tb = tb,
+                .msg = msg,
+                .priority = priority,
+        };
+        uint32_t ret = TSS_Queue_Submit(q, &req);
+
+        if (ret != 0)
+                return ret;
+        return TSS_Queue_Wait(&req);
+}
+
+uint32_t TSS_Queue_Transmit(struct tpm_queue* q, struct tpm_buffer* tb, const char* msg)
+{
+        return queue_transmit(q, tb, msg, TPM_PRIO_DEFAULT);
+}
+
+/*
+ * Lowlevel transport that hands requests to the device thread; the queue
+ * is found in the context of the calling thread.
+ */
+static uint32_t queue_open(int* fd)
+{
+        *fd = 0;
+        return 0;
+}
+
+static uint32_t queue_close(int fd)
+{
+        (void)fd;
+        return 0;
+}
+
+static uint32_t queue_send(int fd, struct tpm_buffer* tb, const char* msg)
+{
+        struct tss_ctx* ctx = TSS_Ctx_Get();
+
+        (void)fd;
+        return queue_transmit(ctx->transport_data, tb, msg, ctx->priority);
+}
+
+static uint32_t queue_recv(int fd, struct tpm_buffer* tb)
+{
+        /* the response was stored by queue_send */
+        (void)fd;
+        (void)tb;
+        return 0;
+}
+
+static struct tpm_transport queue_transport = {
+        .open = queue_open,
+        .close = queue_close,
+        .send = queue_send,
+        .recv = queue_recv,
+};
+
+/****************************************************************************/
+/*                                                                          */
+/* Route all commands of a context through a queue                          */
+/*                                                                          */
+/* With ctx made current by TSS_Ctx_SetCurrent, every library call of that  */
+/* thread (TPM_Unseal, TPM_PcrRead, ...) prepares its command locally and   */
+/* only the device round trip is serialized by the device thread.           */
+/* ctx->priority selects the scheduling class of these commands.            */
+/*                                                                          */
+/****************************************************************************/
+uint32_t TSS_Queue_Attach(struct tpm_queue* q, struct tss_ctx* ctx)
+{
+        if (q == NULL || ctx == NULL)
+                return ERR_NULL_ARG;
+        ctx->transport = &queue_transport;
+        ctx->transport_type = TPM_LOWLEVEL_TRANSPORT_QUEUE;
+        ctx->transport_data = q;
+        return 0;
+}
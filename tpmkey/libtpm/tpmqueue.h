@@ -0,0 +1,117 @@
+/********************************************************************************/
+/*										*/
+/*                        TPM Asynchronous Command Queue                        */
+/*										*/
+/********************************************************************************/
+
+#ifndef TPMQUEUE_H
+#define TPMQUEUE_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <semaphore.h>
+#include <time.h>
+#include <tpm.h>
+
+/* largest request that is considered for coalescing */
+#define TPM_QUEUE_KEY_SIZE      32
+
+/*
+ * Scheduling classes, most urgent first.  A request left at
+ * TPM_PRIO_DEFAULT is classified by its ordinal.
+ */
+enum tpm_priority {
+        TPM_PRIO_DEFAULT = 0,
+        TPM_PRIO_INTERACTIVE,           /* unseal, key loading, sessions */
+        TPM_PRIO_ATTESTATION,           /* quotes, signatures */
+        TPM_PRIO_BACKGROUND,            /* entropy, self tests */
+};
+
+#define TPM_PRIO_CLASSES        3
+
+/* default time after which a waiting request is promoted by one class */
+#define TPM_QUEUE_AGING_USECS   500000
+
+struct tpm_queue_stats
+{
+        uint64_t requests;              /* completed requests */
+        uint64_t wait_usecs;            /* total time spent queued */
+        uint64_t max_wait_usecs;
+        uint64_t busy_usecs;            /* total time spent in the TPM */
+};
+
+struct tpm_queue;
+struct tss_ctx;
+
+/*
+ * Requests of one stream reach the TPM in the order they were submitted.
+ * Zero initialize; must stay valid until its last request completed.
+ */
+struct tpm_stream
+{
+        uint64_t _Atomic submitted;
+        uint64_t _Atomic completed;
+};
+
+/*
+ * A fully marshalled request.  tb holds the request on submission and the
+ * response on completion.  complete is called on the device thread and must
+ * not block; callers that prefer a future use TSS_Queue_Wait instead.
+ * Requests of one submitter reach the TPM in the order they were submitted.
+ */
+struct tpm_request
+{
+        struct tpm_buffer* tb;
+        const char* msg;
+        uint32_t result;
+        void (* complete)(struct tpm_request* req);
+        void* priv;
+        enum tpm_priority priority;
+        struct tpm_stream* submitter;           /* NULL for the submitting thread */
+
+        /* private to the queue */
+        struct tpm_request* _Atomic next;
+        sem_t done;
+        struct tpm_request* pending;            /* next request waiting for the device */
+        struct timespec submitted;
+        struct tpm_request* inflight;           /* next coalescing leader */
+        struct tpm_request* waiters;            /* requests sharing this one */
+        uint32_t keylen;
+        unsigned char key[TPM_QUEUE_KEY_SIZE];  /* copy of the request bytes */
+        struct tpm_stream* stream;              /* submitter or submitting thread */
+        uint64_t seq;                           /* position in the stream */
+};
+
+
+struct tpm_queue* TSS_Queue_Start(unsigned int depth);
+
+
+struct tpm_queue* TSS_Queue_StartTransport(unsigned int depth, int transport_type,
+                                           void* transport_data);
+
+
+void TSS_Queue_Stop(struct tpm_queue* q);
+
+
+uint32_t TSS_Queue_Submit(struct tpm_queue* q, struct tpm_request* req);
+
+
+uint32_t TSS_Queue_Wait(struct tpm_request* req);
+
+
+uint32_t TSS_Queue_Transmit(struct tpm_queue* q, struct tpm_buffer* tb, const char* msg);
+
+
+uint32_t TSS_Queue_SetFreshness(struct tpm_queue* q, uint32_t ordinal, uint32_t usecs);
+
+
+uint32_t TSS_Queue_SetAging(struct tpm_queue* q, uint32_t usecs);
+
+
+uint32_t TSS_Queue_GetStats(struct tpm_queue* q, enum tpm_priority priority,
+                            struct tpm_queue_stats* stats);
+
+
+uint32_t TSS_Queue_Attach(struct tpm_queue* q, struct tss_ctx* ctx);
+
+#endif
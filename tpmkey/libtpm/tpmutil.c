@@ -52,9 +52,6 @@
 #include <sys/types.h>
 #include <fcntl.h>
 
-#include <immintrin.h>
-#include <gcrypt.h>
-
 #include "tpm.h"
 #include "tpmfunc.h"
 #include "tpm_types.h"
@@ -62,6 +59,7 @@
 #include "tpmutil.h"
 #include "tpm_error.h"
 #include "tpm_lowlevel.h"
+#include "tpmcrypto.h"
 
 /* local prototypes */
 
@@ -71,28 +69,71 @@ static TPM_RESULT TPMC_SHA1_valist(TPM_DIGEST md,
                                    va_list ap);
 
 
-static TPM_RESULT TPMC_SHA1Init(void** context);
-
+/* local variables */
 
-static TPM_RESULT TPMC_SHA1_Update(void* context, const unsigned char* data, uint32_t length);
+static int preferred_transport = TPM_LOWLEVEL_TRANSPORT_CHARDEV;
 
+#define TSS_CTX_INITIALIZER { .fd = -1, .buf_len = -1 }
 
-static TPM_RESULT TPMC_SHA1Final(unsigned char* md, void* context);
+static struct tss_ctx default_ctx = TSS_CTX_INITIALIZER;
+static __thread struct tss_ctx* current_ctx = NULL;
 
 
-static TPM_RESULT TPMC_SHA1Delete(void** context);
+/****************************************************************************/
+/*                                                                          */
+/* Library contexts                                                         */
+/*                                                                          */
+/****************************************************************************/
+struct tss_ctx* TSS_Ctx_New(void)
+{
+        struct tss_ctx* ctx = malloc(sizeof(struct tss_ctx));
 
+        if (NULL != ctx) {
+                *ctx = (struct tss_ctx) TSS_CTX_INITIALIZER;
+        }
+        return ctx;
+}
 
-/* local variables */
+void TSS_Ctx_Free(struct tss_ctx* ctx)
+{
+        if (NULL == ctx || &default_ctx == ctx) {
+                return;
+        }
+        if (current_ctx == ctx) {
+                current_ctx = NULL;
+        }
+        if (ctx->fd != -1 && NULL != ctx->transport) {
+                ctx->transport->close(ctx->fd);
+        }
+        TSS_KeySwap_Free(ctx->keyswap);
+        TSS_HMAC_Free(ctx->hmac_keys);
+        TSS_Nonce_Free(ctx->nonces);
+        TSS_BufferArena_Free(ctx->buffer_arena);
+        free(ctx);
+}
 
-static unsigned int logflag = 0;
-/* the to-be-used lowlevel transport */
-static struct tpm_transport* use_transp = NULL;
-static int actual_used_transport = 0;
+/*
+ * Get the context of the calling thread.
+ */
+struct tss_ctx* TSS_Ctx_Get(void)
+{
+        if (NULL != current_ctx) {
+                return current_ctx;
+        }
+        return &default_ctx;
+}
 
-static int preferred_transport = TPM_LOWLEVEL_TRANSPORT_CHARDEV;
+/*
+ * Make ctx the context of the calling thread, NULL selects the
+ * default context.  Returns the previous context.
+ */
+struct tss_ctx* TSS_Ctx_SetCurrent(struct tss_ctx* ctx)
+{
+        struct tss_ctx* old = TSS_Ctx_Get();
 
-static int use_vtpm = 0;
+        current_ctx = ctx;
+        return old;
+}
 
 
 /****************************************************************************/
@@ -102,9 +143,28 @@ static int use_vtpm = 0;
 /****************************************************************************/
 struct tpm_transport* TPM_LowLevel_Transport_Set(struct tpm_transport* new_tp)
 {
-        struct tpm_transport* old = use_transp;
+        struct tss_ctx* ctx = TSS_Ctx_Get();
+        struct tpm_transport* old = ctx->transport;
 
-        use_transp = new_tp;
+        ctx->transport = new_tp;
+        return old;
+}
+
+/*
+ * Prefix requests with the vTPM instance and locality; only honoured
+ * by transports that talk to a multiplexer.
+ */
+int TPM_LowLevel_Use_VTPM(void)
+{
+        return TSS_Ctx_Get()->use_vtpm;
+}
+
+int TPM_LowLevel_VTPM_Set(int state)
+{
+        struct tss_ctx* ctx = TSS_Ctx_Get();
+        int old = ctx->use_vtpm;
+
+        ctx->use_vtpm = state;
         return old;
 }
 
@@ -117,6 +177,7 @@ struct tpm_transport* TPM_LowLevel_Transport_Set(struct tpm_transport* new_tp)
  */
 int TPM_LowLevel_Transport_Init(int choice)
 {
+        struct tss_ctx* ctx = TSS_Ctx_Get();
         int tp = choice;
 
         if (tp == 0) {
@@ -126,13 +187,14 @@ int TPM_LowLevel_Transport_Init(int choice)
         switch (tp) {
         default:
         case TPM_LOWLEVEL_TRANSPORT_CHARDEV:
-                use_vtpm = 0;
+                ctx->use_vtpm = 0;
                 TPM_LowLevel_TransportCharDev_Set();
                 break;
 
         case TPM_LOWLEVEL_TRANSPORT_TCP_SOCKET:
                 break;
         case TPM_LOWLEVEL_TRANSPORT_UNIXIO:
+                TPM_LowLevel_TransportUnixIO_Set();
                 break;
 
 #ifdef TPM_USE_LIBTPMS
@@ -141,7 +203,7 @@ int TPM_LowLevel_Transport_Init(int choice)
                 break;
 #endif
         }
-        actual_used_transport = tp;
+        ctx->transport_type = tp;
 
         return tp;
 }
@@ -160,30 +222,6 @@ uint32_t TSS_getsize(unsigned char* rsp)
         return size;
 }
 
-/****************************************************************************/
-/*                                                                          */
-/* Generate a random nonce                                                  */
-/*                                                                          */
-
-/****************************************************************************/
-void TSS_gennonce(unsigned char* nonce)
-{
-        uint64_t end = TPM_HASH_SIZE / sizeof(uint64_t);
-        uint64_t pos;
-
-        for (pos = 0; pos < end; pos++) {
-                unsigned long long rd = 0;
-
-                _rdrand64_step(&rd);
-                *(((uint64_t*) nonce) + pos) = rd;
-        }
-        // 4 bytes now remain as TPM_HASH_SIZE is 20 bytes long
-        unsigned int rd = 0;
-
-        _rdrand32_step(&rd);
-        *((uint32_t*)(((uint64_t*) nonce) + pos)) = rd;
-}
-
 /****************************************************************************/
 /*                                                                          */
 /*  This routine takes a format string, sort of analogous to sprintf,       */
@@ -751,12 +789,13 @@ void showBuff(unsigned char* buff, char* string)
 {
         uint32_t i,len;
         uint32_t addsize = 0;
+        struct tss_ctx* ctx = TSS_Ctx_Get();
 
-        if (use_vtpm) {
+        if (ctx->use_vtpm) {
                 addsize = 4;
         }
 
-        if (!logflag) return;
+        if (!ctx->logflag) return;
         len = addsize + LOAD32(buff,addsize + TPM_PARAMSIZE_OFFSET);
 
         printf("%s length=%d\n", string,(int)len);
@@ -779,26 +818,31 @@ void showBuff(unsigned char* buff, char* string)
 
 uint32_t TPM_Send(struct tpm_buffer* tb,const char* msg) {
         uint32_t rc = 0;
-        static int sock_fd = -1;
+        struct tss_ctx* ctx = TSS_Ctx_Get();
 
-        if (!actual_used_transport) {
+        if (!ctx->transport_type) {
                 TPM_LowLevel_Transport_Init(0);
         }
 
-        /* To emulate the real behavior, open and close the socket each
-           time.  If this kills performance, we can introduce a static and
-           keep the socket open. */
-        if (sock_fd == -1) {
-                rc = use_transp->open(&sock_fd);
+        /* The connection is opened once per context and kept open. */
+        if (ctx->fd == -1) {
+                rc = ctx->transport->open(&ctx->fd);
         }
         if (rc == 0) {
-                if (logflag) printf("\nTPM_Send: %s\n", msg);
-                rc = use_transp->send(sock_fd, tb, msg);
+                if (ctx->logflag) printf("\nTPM_Send: %s\n", msg);
+                rc = ctx->transport->send(ctx->fd, tb, msg);
         }
         if (rc == 0) {
-                rc = use_transp->recv(sock_fd, tb);
+                rc = ctx->transport->recv(ctx->fd, tb);
+        }
+        /*
+         * After an I/O error the stream may be dead (restarted broker) or
+         * out of step; the next request opens a new connection.
+         */
+        if ((rc & ERR_MASK) && ctx->fd != -1) {
+                ctx->transport->close(ctx->fd);
+                ctx->fd = -1;
         }
-        // use_transp->close(sock_fd);
         return rc;
 }
 
@@ -862,22 +906,18 @@ static uint32_t destroyTransport(session* transSession)
         return ret;
 }
 
-extern uint32_t (* g_transportFunction[])(struct tpm_buffer* tb,
-                                          const char* msg);
-extern uint32_t g_num_transports;
-
 static uint32_t TPM_Transmit_Internal(struct tpm_buffer* tb,const char* msg,
                                       int allowTransport)
 {
         uint32_t rc = 0, irc;
-        static int transport_created = 0;
+        struct tss_ctx* ctx = TSS_Ctx_Get();
 
-        if (0 == transport_created) {
+        if (0 == ctx->transport_created) {
                 uint32_t ord = 0;
                 session sess;
 
                 tpm_buffer_load32(tb, 6, &ord);
-                transport_created = 1;
+                ctx->transport_created = 1;
                 if (allowTransport && allowsTransport(ord)) {
                         uint32_t in_tp;
 
@@ -901,23 +941,23 @@ static uint32_t TPM_Transmit_Internal(struct tpm_buffer* tb,const char* msg,
                 } else {
                         rc = TPM_Transmit(tb,msg);
                 }
-                transport_created = 0;
+                ctx->transport_created = 0;
                 return rc;
         }
 
-        if (g_num_transports > 0 && NULL != g_transportFunction[g_num_transports - 1]) {
-                --g_num_transports;
+        if (ctx->num_transports > 0 && NULL != ctx->transport_function[ctx->num_transports - 1]) {
+                --ctx->num_transports;
                 /*
                  * I cannot do the auditing here. Must do this in
                  * all transports separately.
-                 */rc = g_transportFunction[g_num_transports](tb, msg);
+                 */rc = ctx->transport_function[ctx->num_transports](tb, msg);
                 if (0 == rc) {
                         /*
                          * Transport function was doing OK, so let me see whether
                          * the caller also did OK.
                          */tpm_buffer_load32(tb, TPM_RETURN_OFFSET, &rc);
                 }
-                g_num_transports++;
+                ctx->num_transports++;
         } else {
                 char mesg[1024];
                 unsigned int inst = 0;
@@ -951,7 +991,7 @@ static uint32_t TPM_Transmit_Internal(struct tpm_buffer* tb,const char* msg,
                 orig_request = clone_tpm_buffer(tb);
 #endif
 
-                if (use_vtpm) {
+                if (ctx->use_vtpm) {
                         /*
                          * Check whether an instance of the TPM is to be used.
                          */
@@ -981,13 +1021,15 @@ static uint32_t TPM_Transmit_Internal(struct tpm_buffer* tb,const char* msg,
                 }
 
                 tpm_buffer_load16(tb, tagoffset, &tag_out);
-                if (use_vtpm)
+                if (ctx->use_vtpm)
                         sprintf(mesg,"%s (instance=%d, locality=%d)",msg,inst,locty);
                 else
                         sprintf(mesg,"%s", msg);
                 rc = TPM_Send(tb, mesg);
 
-                if (actual_used_transport != TPM_LOWLEVEL_TRANSPORT_CHARDEV) {
+                if (ctx->transport_type != TPM_LOWLEVEL_TRANSPORT_CHARDEV &&
+                    ctx->transport_type != TPM_LOWLEVEL_TRANSPORT_UNIXIO &&
+                    ctx->transport_type != TPM_LOWLEVEL_TRANSPORT_QUEUE) {
                         /*
                          * For some reason the HW TPM seems to return a wrong initial byte
                          * when doing a Quote(). So I have to deactivate this part here
@@ -1000,7 +1042,7 @@ static uint32_t TPM_Transmit_Internal(struct tpm_buffer* tb,const char* msg,
                         }
                 }
 
-                if (use_vtpm) {
+                if (ctx->use_vtpm) {
                         /*
                          * Only when using character device I do not expect the instance number to come back
                          */
@@ -1058,14 +1100,9 @@ uint32_t TPM_Transmit_NoTransport(struct tpm_buffer* tb,const char* msg)
 /****************************************************************************/
 void TSS_sha1(void* input, unsigned int len, unsigned char* output)
 {
-        gcry_md_hd_t sha;
+        struct tss_iovec part = { input, len };
 
-        gcry_md_open(&sha, GCRY_MD_SHA1, 0);
-        gcry_md_write(sha,input,len);
-        const unsigned char* digest = gcry_md_read(sha,0);
-
-        memcpy(output,digest,20);
-        gcry_md_close(sha);
+        TSS_Crypto_Get()->sha1(output, &part, 1);
 }
 
 /****************************************************************************/
@@ -1079,10 +1116,12 @@ int TPM_setlog(int flag)
         int old;
         char* dump = getenv("TPM_DUMP_COMMANDS");
 
-        old = logflag;
+        struct tss_ctx* ctx = TSS_Ctx_Get();
+
+        old = ctx->logflag;
         /* user has control if TPM_DUMP_COMMANDS == "0" */
-        if (NULL == dump || strcmp(dump,"0") == 0) logflag = flag;
-        else logflag = strtol(dump, NULL, 10);
+        if (NULL == dump || strcmp(dump,"0") == 0) ctx->logflag = flag;
+        else ctx->logflag = strtol(dump, NULL, 10);
         return old;
 }
 
@@ -1171,8 +1210,6 @@ uint32_t parseHash(char* string, unsigned char* hash)
         return ret;
 }
 
-#if 0
-
 /* TPM_XOR XOR's 'in1' and 'in2' of 'length', putting the result in 'out'
 
  */
@@ -1189,7 +1226,8 @@ static void TPM_XOR(unsigned char* out,
         return;
 }
 
-#endif
+/* counter blocks encrypted per provider call */
+#define AES_BATCH 16
 
 /****************************************************************************/
 /*									  */
@@ -1210,45 +1248,73 @@ TPM_RESULT TPM_AES_ctr128_Encrypt(unsigned char* data_out,
                                   unsigned int aes_key_len,
                                   unsigned char ctr[TPM_AES_BLOCK_SIZE])
 {
+        const struct tss_crypto* crypto = TSS_Crypto_Get();
+        unsigned char blocks[AES_BATCH][TPM_AES_BLOCK_SIZE];
+        unsigned char pad[AES_BATCH][TPM_AES_BLOCK_SIZE];
+        unsigned long n, i, len;
+        uint32_t cint;
         TPM_RESULT rc = 0;
-        // uint32_t cint;
-        // unsigned char pad_buffer[TPM_AES_BLOCK_SIZE];	/* the XOR pad */
-
-        // note this implemenation might not suffice
-        // the expectaions of the TPM (see comment above method)
-        // but, it never seems to get actually called for TPM_Unseal
-        gcry_cipher_hd_t aes;
-
-        gcry_cipher_open(&aes, GCRY_CIPHER_AES128, GCRY_CIPHER_MODE_CTR, 0);
-        gcry_cipher_setctr(aes, ctr, 16);
-        gcry_cipher_setkey(aes, aes_key, aes_key_len);
-        gcry_cipher_encrypt(aes, data_out, data_size, data_in, data_size);
-        gcry_cipher_close(aes);
 
-#if 0
-        while (data_size != 0) {
-                /* get an XOR pad array by encrypting the CTR with the AES key */
-                AES_encrypt(ctr, pad_buffer, aes_enc_key);
-                /* partial or full last data block */
-                if (data_size <= TPM_AES_BLOCK_SIZE) {
-                        TPM_XOR(data_out, data_in, pad_buffer, data_size);
-                        data_size = 0;
+        /* aes_key_len is in bits */
+        if (aes_key_len != TPM_AES_BITS) {
+                return TPM_BAD_PARAMETER;
+        }
+        while (rc == 0 && data_size != 0) {
+                /* the pads of the next blocks are the encrypted counters */
+                n = (data_size + TPM_AES_BLOCK_SIZE - 1) / TPM_AES_BLOCK_SIZE;
+                if (n > AES_BATCH) {
+                        n = AES_BATCH;
                 }
-                /* full block, not the last block */
-                else {
-                        TPM_XOR(data_out, data_in, pad_buffer, TPM_AES_BLOCK_SIZE);
-                        data_in += TPM_AES_BLOCK_SIZE;
-                        data_out += TPM_AES_BLOCK_SIZE;
-                        data_size -= TPM_AES_BLOCK_SIZE;
+                cint = LOAD32(ctr, 12);
+                for (i = 0; i < n; i++) {
+                        memcpy(blocks[i], ctr, 12);
+                        STORE32(blocks[i], 12, cint + i);
                 }
+                rc = crypto->aes128_ecb(aes_key, pad[0], blocks[0], n);
+                len = MIN(data_size, n * TPM_AES_BLOCK_SIZE);
+                TPM_XOR(data_out, data_in, pad[0], len);
+                data_in += len;
+                data_out += len;
+                data_size -= len;
                 /* if not the last block, increment CTR */
-                if (data_size != 0) {
-                        cint = LOAD32(ctr, 12); /* byte array to uint32_t */
-                        cint++;         /* increment */
-                        STORE32(ctr, 12, cint); /* uint32_t to byte array */
-                }
+                STORE32(ctr, 12, data_size ? cint + n : cint + n - 1);
         }
-#endif
+        memset(pad, 0, sizeof(pad));
+        return rc;
+}
+
+/****************************************************************************/
+/*									  */
+/* AES OFB mode								*/
+/*									  */
+/****************************************************************************/
+
+TPM_RESULT TPM_AES_ofb128_Encrypt(unsigned char* data_out,
+                                  const unsigned char* data_in,
+                                  unsigned long data_size,
+                                  const unsigned char* aes_key,
+                                  unsigned int aes_key_len,
+                                  const unsigned char iv[TPM_AES_BLOCK_SIZE])
+{
+        const struct tss_crypto* crypto = TSS_Crypto_Get();
+        unsigned char pad[TPM_AES_BLOCK_SIZE];
+        unsigned long len;
+        TPM_RESULT rc = 0;
+
+        /* aes_key_len is in bits */
+        if (aes_key_len != TPM_AES_BITS) {
+                return TPM_BAD_PARAMETER;
+        }
+        memcpy(pad, iv, TPM_AES_BLOCK_SIZE);
+        while (rc == 0 && data_size != 0) {
+                rc = crypto->aes128_ecb(aes_key, pad, pad, 1);
+                len = MIN(data_size, TPM_AES_BLOCK_SIZE);
+                TPM_XOR(data_out, data_in, pad, len);
+                data_in += len;
+                data_out += len;
+                data_size -= len;
+        }
+        memset(pad, 0, sizeof(pad));
         return rc;
 }
 
@@ -1368,85 +1434,24 @@ static TPM_RESULT TPMC_SHA1_valist(TPM_DIGEST md,
                                    uint32_t length0, unsigned char* buffer0,
                                    va_list ap)
 {
-        TPM_RESULT rc = 0;
-        TPM_RESULT rc1 = 0;
+        const struct tss_crypto* crypto = TSS_Crypto_Get();
+        struct tss_sha1 context;
         uint32_t length;
         unsigned char* buffer;
-        void* context = NULL;                   /* platform dependent context */
-        TPM_BOOL done = FALSE;
+        TPM_RESULT rc;
 
-        if (rc == 0) {
-                rc = TPMC_SHA1Init(&context);
-        }
-        if (rc == 0) {
-                if (length0 != 0) {     /* optional first text block */
-                        rc = TPMC_SHA1_Update(context, buffer0, length0); /* hash the buffer */
-                }
-        }
-        while ((rc == 0) && !done) {
-                length = va_arg(ap, uint32_t);          /* first vararg is the length */
-                if (length != 0) {              /* loop until a zero length argument terminates */
-                        buffer = va_arg(ap, unsigned char*); /* second vararg is the array */
-                        rc = TPMC_SHA1_Update(context, buffer, length); /* hash the buffer */
-                }
-                else {
-                        done = TRUE;
-                }
-        }
-        if (rc == 0) {
-                rc = TPMC_SHA1Final(md, context);
-        }
-        if (rc == 0) {
+        rc = crypto->sha1_init(&context);
+        if (rc != 0) {
+                return TPM_SHA_ERROR;
         }
-        /* previous errors have priority, but call Delete even if there was an error */
-        rc1 = TPMC_SHA1Delete(&context);
-        if (rc == 0) {  /* if no processing error */
-                rc = rc1; /* report Delete error */
+        if (length0 != 0) {     /* optional first text block */
+                crypto->sha1_update(&context, buffer0, length0);
         }
-        return rc;
-}
-
-/* for the openSSL version, TPM_SHA1Context is a SHA_CTX structure */
-
-/* TPM_SHA1Init() initializes a platform dependent TPM_SHA1Context structure.
-
-   The structure must be freed using TPM_SHA1Final()
- */
-
-static TPM_RESULT TPMC_SHA1Init(void** context)
-{
-        return gcry_md_open((gcry_md_hd_t*) context, GCRY_MD_SHA1, 0);
-}
-
-static TPM_RESULT TPMC_SHA1_Update(void* context, const unsigned char* data, uint32_t length)
-{
-        if (context) {
-                gcry_md_write((gcry_md_hd_t) context, data, length);
-                return TPM_SUCCESS;
-        } else
-                return TPM_SHA_THREAD;
-
-}
-
-static TPM_RESULT TPMC_SHA1Final(unsigned char* md, void* context)
-{
-        if (context) {
-                const unsigned char* digest = gcry_md_read((gcry_md_hd_t) context, GCRY_MD_SHA1);
-
-                if (!digest)
-                        return TPM_SHA_ERROR;
-                memcpy(context, digest, 20);
-                return TPM_SUCCESS;
-        } else
-                return TPM_SHA_THREAD;
-
-}
-
-static TPM_RESULT TPMC_SHA1Delete(void** context)
-{
-        if (context) {
-                gcry_md_close(*context);
-                context = NULL;
+        /* loop until a zero length argument terminates */
+        while ((length = va_arg(ap, uint32_t)) != 0) {
+                buffer = va_arg(ap, unsigned char*);
+                crypto->sha1_update(&context, buffer, length);
         }
+        crypto->sha1_final(&context, md);
         return TPM_SUCCESS;
 }
@@ -63,6 +63,50 @@
 
 
 struct tpm_buffer;
+struct tpm_transport;
+struct tss_keyswap;
+struct tss_hmac_keys;
+struct tss_nonce_pool;
+struct tss_buffer_arena;
+
+/*
+ * Library state.  Every thread talks to the TPM through its current
+ * context, which is the default context unless TSS_Ctx_SetCurrent installed
+ * another one.  Threads with their own context do not share any state and
+ * can prepare and send commands independently.
+ */
+struct tss_ctx
+{
+        struct tpm_transport* transport;        /* the to-be-used lowlevel transport */
+        void* transport_data;                   /* private data of the lowlevel transport */
+        int priority;                           /* scheduling class of queued commands */
+        int transport_type;                     /* the actually used lowlevel transport */
+        int use_vtpm;
+        unsigned int logflag;
+        int fd;                                 /* connection to the TPM, -1 if closed */
+        int transport_created;
+        uint32_t num_transports;                /* stack of transport functions */
+        uint32_t (* transport_function[TPM_MAX_TRANSPORTS])(struct tpm_buffer* tb,
+                                                            const char* msg);
+        session* trans_session[TPM_MAX_TRANSPORTS];
+        int buf_len;                            /* see TSS_GetInputBufferSize, -1 if unknown */
+        struct tss_keyswap* keyswap;            /* contexts of swapped out keys */
+        struct tss_hmac_keys* hmac_keys;        /* padded HMAC keys in use */
+        struct tss_nonce_pool* nonces;          /* random bytes for nonces */
+        struct tss_buffer_arena* buffer_arena;  /* POOL_TPM_BUFFER storage */
+};
+
+
+struct tss_ctx* TSS_Ctx_New(void);
+
+
+void TSS_Ctx_Free(struct tss_ctx* ctx);
+
+
+struct tss_ctx* TSS_Ctx_Get(void);
+
+
+struct tss_ctx* TSS_Ctx_SetCurrent(struct tss_ctx* ctx);
 
 
 uint32_t TSS_getsize(unsigned char* rsp);
@@ -171,6 +215,14 @@ TPM_RESULT TPM_AES_ctr128_Encrypt(unsigned char* data_out,
                                   unsigned char ctr[TPM_AES_BLOCK_SIZE]);
 
 
+TPM_RESULT TPM_AES_ofb128_Encrypt(unsigned char* data_out,
+                                  const unsigned char* data_in,
+                                  unsigned long data_size,
+                                  const unsigned char* aes_key,
+                                  unsigned int aes_key_len,
+                                  const unsigned char iv[TPM_AES_BLOCK_SIZE]);
+
+
 TPM_RESULT TSS_MGF1(unsigned char* mask,
                     uint32_t maskLen,
                     const unsigned char* mgfSeed,
@@ -200,4 +252,44 @@ uint32_t needKeysRoom_Stacked(uint32_t key1, uint32_t* orig_key1);
 uint32_t needKeysRoom_Stacked_Undo(uint32_t swapout_key, uint32_t swapin_key);
 
 
+struct tss_keyswap_stats
+{
+        uint64_t swap_ins;                      /* LoadContext of a swapped out key */
+        uint64_t swap_outs;                     /* SaveContext and evict */
+        uint64_t pinned_swap_outs;              /* swap outs of pinned keys */
+};
+
+
+uint32_t TSS_KeyPin(uint32_t keyhandle);
+
+
+uint32_t TSS_KeyUnpin(uint32_t keyhandle);
+
+
+uint32_t TSS_KeySwapStats(struct tss_keyswap_stats* stats);
+
+
+uint32_t TSS_KeyCache_Lookup(uint32_t parent, const unsigned char* digest,
+                             uint32_t* handle);
+
+
+void TSS_KeyCache_Add(uint32_t parent, const unsigned char* digest,
+                      uint32_t handle);
+
+
+void TSS_KeyCache_Evicted(uint32_t handle);
+
+
+void TSS_KeySwap_Free(struct tss_keyswap* ks);
+
+
+void TSS_HMAC_Free(struct tss_hmac_keys* keys);
+
+
+void TSS_Nonce_Free(struct tss_nonce_pool* pool);
+
+
+void TSS_BufferArena_Free(struct tss_buffer_arena* arena);
+
+
 #endif
@@ -0,0 +1,184 @@
+/********************************************************************************/
+/*										*/
+/*                         TPM Broker Socket Transport                          */
+/*										*/
+/********************************************************************************/
+
+/* Client side of the tpmkeyd broker and the tpmvmux vTPM multiplexer.
+   Commands are passed unchanged over a Unix stream socket; the TPM
+   paramSize in each header frames the packets.  With use_vtpm set every
+   packet carries the 4 byte instance in front.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "tpm.h"
+#include "tpm_constants.h"
+#include "tpmutil.h"
+#include "tpm_lowlevel.h"
+
+
+static uint32_t TPM_OpenClientUnixIO(int* sock_fd);
+
+
+static uint32_t TPM_CloseClientUnixIO(int sock_fd);
+
+
+static uint32_t TPM_TransmitUnixIO(int sock_fd, struct tpm_buffer* tb,
+                                   const char* msg);
+
+
+static uint32_t TPM_ReceiveUnixIO(int sock_fd, struct tpm_buffer* tb);
+
+
+static struct tpm_transport unixio_transport = {
+        .open = TPM_OpenClientUnixIO,
+        .close = TPM_CloseClientUnixIO,
+        .send = TPM_TransmitUnixIO,
+        .recv  = TPM_ReceiveUnixIO,
+};
+
+void TPM_LowLevel_TransportUnixIO_Set(void)
+{
+        TPM_LowLevel_Transport_Set(&unixio_transport);
+}
+
+/****************************************************************************/
+/*                                                                          */
+/* Connect to the broker                                                    */
+/*                                                                          */
+/* Fails silently, callers usually fall back to the character device.       */
+/*                                                                          */
+/****************************************************************************/
+static uint32_t TPM_OpenClientUnixIO(int* sock_fd)
+{
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        char* path = TSS_Ctx_Get()->transport_data;
+
+        if (path == NULL) {
+                path = getenv("TPM_BROKER_SOCKET");
+        }
+        if (path == NULL) {
+                path = TPM_BROKER_SOCKET;
+        }
+        if (strlen(path) >= sizeof(addr.sun_path)) {
+                return ERR_BAD_ARG;
+        }
+        strcpy(addr.sun_path, path);
+
+        *sock_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (*sock_fd < 0) {
+                return ERR_IO;
+        }
+        if (connect(*sock_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+                close(*sock_fd);
+                *sock_fd = -1;
+                return ERR_IO;
+        }
+        return 0;
+}
+
+static uint32_t TPM_CloseClientUnixIO(int sock_fd)
+{
+        close(sock_fd);
+        return 0;
+}
+
+/* write a TPM packet to the broker */
+static uint32_t TPM_TransmitUnixIO(int sock_fd, struct tpm_buffer* tb,
+                                   const char* msg)
+{
+        uint32_t prefix = TSS_Ctx_Get()->use_vtpm ? TPM_U32_SIZE : 0;
+        uint32_t nbytes = 0;
+        uint32_t ret;
+
+        (void)msg;
+        ret = tpm_buffer_load32(tb, prefix + TPM_PARAMSIZE_OFFSET, &nbytes);
+        if ((ret & ERR_MASK)) {
+                return ret;
+        }
+        showBuff(tb->buffer, "TPM_TransmitUnixIO: To broker");
+        return TSS_WritePacket(sock_fd, tb->buffer, prefix + nbytes);
+}
+
+/* read a TPM packet from the broker */
+static uint32_t TPM_ReceiveUnixIO(int sock_fd, struct tpm_buffer* tb)
+{
+        uint32_t prefix = TSS_Ctx_Get()->use_vtpm ? TPM_U32_SIZE : 0;
+        uint32_t rc;
+
+        rc = TSS_ReadPacket(sock_fd, tb, prefix);
+        if (rc == 0) {
+                showBuff(tb->buffer, "TPM_ReceiveUnixIO: From broker");
+                tpm_buffer_load32(tb, prefix + TPM_RETURN_OFFSET, &rc);
+        }
+        return rc;
+}
+
+/****************************************************************************/
+/*                                                                          */
+/* Write / read one complete TPM packet on a stream                         */
+/*                                                                          */
+/* Shared by the broker and its clients.  prefix is the number of bytes     */
+/* in front of the TPM header, 4 for vTPM instance tagged packets.          */
+/*                                                                          */
+/****************************************************************************/
+uint32_t TSS_WritePacket(int fd, const unsigned char* buffer, uint32_t len)
+{
+        ssize_t nwritten;
+
+        while (len > 0) {
+                nwritten = write(fd, buffer, len);
+                if (nwritten < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        return ERR_IO;
+                }
+                len -= nwritten;
+                buffer += nwritten;
+        }
+        return 0;
+}
+
+static uint32_t read_bytes(int fd, unsigned char* buffer, uint32_t len)
+{
+        ssize_t nread;
+
+        while (len > 0) {
+                nread = read(fd, buffer, len);
+                if (nread < 0 && errno == EINTR)
+                        continue;
+                if (nread <= 0)
+                        return ERR_IO;
+                len -= nread;
+                buffer += nread;
+        }
+        return 0;
+}
+
+uint32_t TSS_ReadPacket(int fd, struct tpm_buffer* tb, uint32_t prefix)
+{
+        uint32_t header = prefix + TPM_U16_SIZE + TPM_U32_SIZE;
+        uint32_t paramSize;
+        uint32_t rc;
+
+        rc = read_bytes(fd, tb->buffer, header);
+        if (rc != 0) {
+                return rc;
+        }
+        paramSize = LOAD32(tb->buffer, prefix + TPM_PARAMSIZE_OFFSET);
+        if (paramSize < TPM_U16_SIZE + 2 * TPM_U32_SIZE || prefix + paramSize > tb->size) {
+                return ERR_BAD_RESP;
+        }
+        rc = read_bytes(fd, tb->buffer + header, prefix + paramSize - header);
+        if (rc == 0) {
+                tb->used = prefix + paramSize;
+        }
+        return rc;
+}
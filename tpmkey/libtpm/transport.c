@@ -51,20 +51,17 @@
 #include <tpm_types.h>
 #include <tpm_constants.h>
 #include "tpmutil.h"
+#include "tpmcrypto.h"
 
-uint32_t g_num_transports;
-
-uint32_t (* g_transportFunction[TPM_MAX_TRANSPORTS])(struct tpm_buffer* tb, const char* msg);
-
-static session* g_transSession[TPM_MAX_TRANSPORTS];
-
-/**
- *  Get the appropriate filename for the transDigest to write out to
- *  for the TPM_INSTANCE that the library is currently using.
- **/
+/*
+ * The transdigest and current ticks of a transport session are kept in
+ * its session structure.  They only go to files when an application
+ * hands the session over to another process with TSS_Transport_SaveState.
+ */
 static
-char* _get_transdigest_file(uint32_t handle) {
-        char* filename = malloc(50);
+void _get_transport_filenames(uint32_t handle,
+                              char* digestfile, char* ticksfile, size_t len)
+{
         char* instance = getenv("TPM_INSTANCE");
         int inst;
 
@@ -73,93 +70,42 @@ char* _get_transdigest_file(uint32_t handle) {
         }
         inst = atoi(instance);
 
-        sprintf(filename,"/tmp/.transdigest-%08x-%d", handle, inst);
-        return filename;
+        snprintf(digestfile, len, "/tmp/.transdigest-%08x-%d", handle, inst);
+        snprintf(ticksfile, len, "/tmp/.currentticks-%08x-%d", handle, inst);
 }
 
 /*
- * Read the value of the transdigest for the TPM_INSTANCE that the
- * library is currently using.
- */
-static
-uint32_t _read_transdigest(uint32_t handle, unsigned char* digest) {
-        uint32_t ret = 0;
-        char* filename = _get_transdigest_file(handle);
-
-        if (filename) {
-                FILE* file = fopen(filename, "r");
-
-                if (file != NULL) {
-                        if (1 != fread(digest, TPM_DIGEST_SIZE, 1, file)) {
-                                ret = ERR_IO;
-                        }
-                        fclose(file);
-                } else {
-                        ret = ERR_BAD_FILE;
-                }
-                free(filename);
-        } else {
-                ret = ERR_MEM_ERR;
-        }
-        return ret;
-}
-
-/*
- * Extend the transdigest by reading its current value from the
- * file for the TPM_INSTANCE that the library is currently using
- * and calculate
+ * Extend the transdigest of the given transport session:
  *  transdigest_new = SHA1(transdigest || data)
- * and write the new transdigest back into the file.
  */
 static
-uint32_t _extend_transdigest(uint32_t handle, struct tpm_buffer* data) {
-        uint32_t ret = 0;
-        char* filename = _get_transdigest_file(handle);
-
-        if (filename) {
-                FILE* file = fopen(filename, "r+");
-
-                STACK_TPM_BUFFER(buffer);
-                if (file != NULL) {
-                        if (1 != fread(buffer.buffer, TPM_DIGEST_SIZE, 1, file)) {
-                                ret = ERR_IO;
-                        } else {
-                                TPM_DIGEST digest;
+uint32_t _extend_transdigest(session* transSess, struct tpm_buffer* data) {
+        unsigned char* transdigest = transSess->type.tran.transdigest;
+        struct tss_iovec parts[2] = {
+                { transdigest, TPM_DIGEST_SIZE },
+                { data->buffer, data->used }
+        };
 
 #if 0
-                                print_array("_extend_transdigest: transdigest in: ", buffer.buffer, TPM_DIGEST_SIZE);
+        print_array("_extend_transdigest: transdigest in: ", transdigest, TPM_DIGEST_SIZE);
 #endif
-                                buffer.used = TPM_DIGEST_SIZE;
-                                tpm_buffer_store(&buffer, data, 0, data->used);
-                                TSS_sha1(buffer.buffer, buffer.used, digest);
-                                //printf("20 %d \n",data->used);
+        if (TSS_Crypto_Get()->sha1(transdigest, parts, 2) != 0) {
+                return ERR_CRYPT_ERR;
+        }
 #if 0
-                                print_array("_extend_transdigest: transdigest out: ",digest,20);
+        print_array("_extend_transdigest: transdigest out: ", transdigest, TPM_DIGEST_SIZE);
 #endif
-                                fseek(file, 0, SEEK_SET);
-                                if (1 != fwrite(digest, TPM_DIGEST_SIZE, 1, file)) {
-                                        ret = ERR_IO;
-                                }
-                        }
-                        fclose(file);
-                } else {
-                        ret = ERR_BAD_FILE;
-                }
-                free(filename);
-        } else {
-                ret = ERR_MEM_ERR;
-        }
-        return ret;
+        return 0;
 }
 
 /*
  * Calculate the TPM_TRANSPORT_LOG_IN function that is calculated
- * as part of the TPM_ExecuteTransport ordinal. Extend the TPM_INSTANCE's
- * given transport session's transdigest with the resulting value.
+ * as part of the TPM_ExecuteTransport ordinal. Extend the given
+ * transport session's transdigest with the resulting value.
  */
 static
 uint32_t _calc_login_exec(unsigned char* H1,
-                          uint32_t handle) {
+                          session* transSess) {
         uint32_t ret = 0;
         TPM_TRANSPORT_LOG_IN ttli;
 
@@ -176,20 +122,20 @@ uint32_t _calc_login_exec(unsigned char* H1,
         if ((ret & ERR_MASK)) {
                 return ret;
         }
-        ret = _extend_transdigest(handle, &ttli_ser);
+        ret = _extend_transdigest(transSess, &ttli_ser);
         return ret;
 }
 
 /*
  * Calculate the TPM_TRANSPORT_LOG_OUT function that is calculated
- * as part of the TPM_ExecuteTransport ordinal. Extend the TPM_INSTANCE's
- * given transport session's transdigest with the resulting value.
+ * as part of the TPM_ExecuteTransport ordinal. Extend the given
+ * transport session's transdigest with the resulting value.
  */
 static
 uint32_t _calc_logout_exec(unsigned char* H2,
                            TPM_CURRENT_TICKS* currentticks,
                            uint32_t locality,
-                           uint32_t handle) {
+                           session* transSess) {
         uint32_t ret;
         TPM_TRANSPORT_LOG_OUT ttlo;
 
@@ -207,24 +153,21 @@ uint32_t _calc_logout_exec(unsigned char* H2,
 
         //printf("logout exec:\n");
         //print_array("ttlo_ser:",ttlo_ser.buffer,ttlo_ser.used);
-        ret = _extend_transdigest(handle, &ttlo_ser);
-
-        //char buffer[10];
-        //scanf("%s",buffer);
+        ret = _extend_transdigest(transSess, &ttlo_ser);
         return ret;
 }
 
 /*
  * Calculate the TPM_TRANSPORT_LOG_OUT function that is calculated
- * as part of the TPM_ReleaseTransportSigned ordinal. Extend the TPM_INSTANCE's
- * given transport session's transdigest with the resulting value.
+ * as part of the TPM_ReleaseTransportSigned ordinal. Extend the given
+ * transport session's transdigest with the resulting value.
  */
 static
 uint32_t _calc_logout_release(uint32_t ordinal,
                               uint32_t locality,
                               TPM_CURRENT_TICKS* currentticks,
                               unsigned char* antiReplay,
-                              uint32_t handle) {
+                              session* transSess) {
         uint32_t ret = 0;
         TPM_TRANSPORT_LOG_OUT ttlo;
 
@@ -247,129 +190,127 @@ uint32_t _calc_logout_release(uint32_t ordinal,
 
         //printf("logout exec:\n");
         //print_array("ttlo_ser:",ttlo_ser.buffer,ttlo_ser.used);
-        ret = _extend_transdigest(handle, &ttlo_ser);
-
-        //char buf[10];
-        //scanf("%s",buf);
+        ret = _extend_transdigest(transSess, &ttlo_ser);
         return ret;
 }
 
 /*
- * Permanently delete the TPM_INSTANCE's given transport session's
- * transdigest by removing its file.
+ * Update the current ticks of the given transport session with the
+ * 'second' and 'microsecond' data taken from the given buffer at the
+ * given offset and return them in tct
  */
 static
-uint32_t _delete_transdigest(uint32_t handle) {
-        uint32_t ret = 0;
-        char* filename = _get_transdigest_file(handle);
+uint32_t _create_currentticks(session* transSess,
+                              TPM_CURRENT_TICKS* tct,
+                              struct tpm_buffer* buffer, uint32_t offset)
+{
+        TPM_CURRENT_TICKS* ticks = &transSess->type.tran.currentticks;
 
-        if (filename) {
-                unlink(filename);
-                free(filename);
+        if (offset + sizeof(uint32_t) + sizeof(uint32_t) > buffer->used) {
+                return ERR_BUFFER;
         }
-        return ret;
+
+        ticks->currentTicks.sec  = LOAD32(buffer->buffer, offset);
+        ticks->currentTicks.usec = LOAD32(buffer->buffer, offset +
+                                          sizeof(uint32_t));
+        memcpy(tct, ticks, sizeof(*tct));
+        return 0;
 }
 
 /*
- * Get the filename of the TPM_INSTANCE's given transport session's
- * current ticks file.
+ * Remove the files a transport session may have been saved to.
  */
 static
-char* _get_currentticks_filename(uint32_t handle)
-{
-        char* filename = malloc(60);
-        char* instance = getenv("TPM_INSTANCE");
-        int inst;
+void _delete_saved_state(session* transSess) {
+        char digestfile[64];
+        char ticksfile[64];
 
-        if (instance == NULL) {
-                instance = "0";
+        if (!transSess->type.tran.saved) {
+                return;
         }
-        inst = atoi(instance);
-        sprintf(filename,"/tmp/.currentticks-%08x-%d", handle, inst);
-        return filename;
+        _get_transport_filenames(TSS_Session_GetHandle(transSess),
+                                 digestfile, ticksfile, sizeof(digestfile));
+        unlink(digestfile);
+        unlink(ticksfile);
+        transSess->type.tran.saved = 0;
 }
 
 /*
- * Read the current ticks from the TPM_INSTANCE's given transport
- * session's file.
+ * Write the transdigest and current ticks of a transport session to
+ * the files of the TPM_INSTANCE the library is currently using.
  */
-static
-uint32_t _read_currentticks(uint32_t handle, TPM_CURRENT_TICKS* tct)
+uint32_t TSS_Transport_SaveState(session* transSess)
 {
-        uint32_t ret = 0;
-        char* filename = _get_currentticks_filename(handle);
-        FILE* file;
-
-        if (filename == NULL) {
-                return ERR_BAD_FILE;
-        }
+        char digestfile[64];
+        char ticksfile[64];
 
-        file = fopen(filename, "r");
-        if (file != NULL) {
-                STACK_TPM_BUFFER(tct_ser);
+        STACK_TPM_BUFFER(tct_ser);
+        uint32_t ret;
 
-                tct_ser.used = 32;
-                if (1 != fread(tct_ser.buffer, tct_ser.used, 1, file)) {
-                        ret = ERR_BAD_FILE;
-                } else {
-                        ret = TPM_ReadCurrentTicks(&tct_ser, 0, tct);
-                        if ((ret & ERR_MASK)) {
-                                return ret;
-                        }
-                        ret = 0;
-                }
-                fclose(file);
-        } else {
-                ret = ERR_BAD_FILE;
+        if (transSess == NULL || transSess->sess_type != SESSION_TRAN) {
+                return ERR_BAD_ARG;
+        }
+        _get_transport_filenames(TSS_Session_GetHandle(transSess),
+                                 digestfile, ticksfile, sizeof(digestfile));
+        ret = TPM_WriteCurrentTicks(&tct_ser, &transSess->type.tran.currentticks);
+        if ((ret & ERR_MASK)) {
+                return ret;
+        }
+        ret = TPM_WriteFile(digestfile, transSess->type.tran.transdigest, TPM_DIGEST_SIZE);
+        if (ret == 0) {
+                ret = TPM_WriteFile(ticksfile, tct_ser.buffer, tct_ser.used);
+        }
+        if (ret == 0) {
+                transSess->type.tran.saved = 1;
         }
-        free(filename);
-
         return ret;
 }
 
 /*
- * Create the current ticks structure with 'second' and 'microsecond'
- * data taken from the given buffer at the given offset
+ * Restore the transdigest and current ticks of a transport session
+ * that another process saved with TSS_Transport_SaveState.
  */
-static
-uint32_t _create_currentticks(uint32_t handle,
-                              TPM_CURRENT_TICKS* tct,
-                              struct tpm_buffer* buffer, uint32_t offset)
+uint32_t TSS_Transport_LoadState(session* transSess)
 {
+        char digestfile[64];
+        char ticksfile[64];
+        unsigned char* data = NULL;
+        uint32_t datalen;
+
+        STACK_TPM_BUFFER(tct_ser);
         uint32_t ret;
 
-        ret = _read_currentticks(handle, tct);
+        if (transSess == NULL || transSess->sess_type != SESSION_TRAN) {
+                return ERR_BAD_ARG;
+        }
+        _get_transport_filenames(TSS_Session_GetHandle(transSess),
+                                 digestfile, ticksfile, sizeof(digestfile));
+        ret = TPM_ReadFile(digestfile, &data, &datalen);
         if ((ret & ERR_MASK)) {
                 return ret;
         }
-
-        if (offset + sizeof(uint32_t) + sizeof(uint32_t) > buffer->used) {
-                return ERR_BUFFER;
+        if (datalen != TPM_DIGEST_SIZE) {
+                free(data);
+                return ERR_BAD_FILE;
         }
+        memcpy(transSess->type.tran.transdigest, data, TPM_DIGEST_SIZE);
+        free(data);
 
-        tct->currentTicks.sec  = LOAD32(buffer->buffer, offset);
-        tct->currentTicks.usec = LOAD32(buffer->buffer, offset +
-                                        sizeof(uint32_t));
-
-        ret = 0;
-        return ret;
-}
-
-/*
- * Delete the TPM_INSTANCE's current ticks file associated with the
- * given transport session (handle).
- */
-static
-uint32_t _delete_currentticks(uint32_t handle) {
-        uint32_t ret = 0;
-        char* filename = _get_currentticks_filename(handle);
-
-        if (filename == NULL) {
+        ret = TPM_ReadFile(ticksfile, &data, &datalen);
+        if ((ret & ERR_MASK)) {
+                return ret;
+        }
+        ret = TSS_SetTPMBuffer(&tct_ser, data, datalen);
+        free(data);
+        if (ret != datalen) {
                 return ERR_BAD_FILE;
         }
-        unlink(filename);
-        free(filename);
-        return ret;
+        ret = TPM_ReadCurrentTicks(&tct_ser, 0, &transSess->type.tran.currentticks);
+        if ((ret & ERR_MASK)) {
+                return ret;
+        }
+        transSess->type.tran.saved = 1;
+        return 0;
 }
 
 /*
@@ -381,10 +322,11 @@ uint32_t _delete_currentticks(uint32_t handle) {
 void* TSS_SetTransportFunction(uint32_t (* function)(struct tpm_buffer* tb,
                                                      const char* msg))
 {
-        void* old_function = g_transportFunction[0];
+        struct tss_ctx* ctx = TSS_Ctx_Get();
+        void* old_function = ctx->transport_function[0];
 
-        g_transportFunction[0] = function;
-        g_num_transports = 1;
+        ctx->transport_function[0] = function;
+        ctx->num_transports = 1;
         return old_function;
 }
 
@@ -397,9 +339,11 @@ void* TSS_PushTransportFunction(uint32_t (* function)(struct tpm_buffer* tb,
                                                       const char* msg),
                                 uint32_t* idx)
 {
-        g_transportFunction[g_num_transports] = function;
-        *idx = g_num_transports;
-        g_num_transports++;
+        struct tss_ctx* ctx = TSS_Ctx_Get();
+
+        ctx->transport_function[ctx->num_transports] = function;
+        *idx = ctx->num_transports;
+        ctx->num_transports++;
         return NULL;
 }
 
@@ -409,12 +353,13 @@ void* TSS_PushTransportFunction(uint32_t (* function)(struct tpm_buffer* tb,
  */
 void* TSS_PopTransportFunction(uint32_t* idx)
 {
+        struct tss_ctx* ctx = TSS_Ctx_Get();
         void* oldfunction = NULL;
 
-        if (g_num_transports > 0) {
-                g_num_transports--;
-                oldfunction = g_transportFunction[g_num_transports];
-                *idx = g_num_transports;
+        if (ctx->num_transports > 0) {
+                ctx->num_transports--;
+                oldfunction = ctx->transport_function[ctx->num_transports];
+                *idx = ctx->num_transports;
         } else {
                 *idx = 0;
         }
@@ -426,8 +371,10 @@ void* TSS_PopTransportFunction(uint32_t* idx)
  */
 void TSS_ClearTransports(void)
 {
-        g_num_transports = 0;
-        g_transportFunction[0] = NULL;
+        struct tss_ctx* ctx = TSS_Ctx_Get();
+
+        ctx->num_transports = 0;
+        ctx->transport_function[0] = NULL;
 }
 
 /*
@@ -440,7 +387,7 @@ uint32_t TSS_SetTransportParameters(session* transSession,
         if (idx >= TPM_MAX_TRANSPORTS) {
                 return ERR_BAD_ARG;
         }
-        g_transSession[idx] = transSession;
+        TSS_Ctx_Get()->trans_session[idx] = transSession;
         return 0;
 }
 
@@ -651,13 +598,16 @@ static uint32_t encWrappedCommand(struct tpm_buffer* tb,
         uint16_t tag;
         uint32_t i;
 
-        STACK_TPM_BUFFER(seed)
+        POOL_TPM_BUFFER(seed, 2 * TPM_NONCE_SIZE + TPM_HASH_SIZE + sizeof("out"))
         uint32_t tail = 0;
 
-        STACK_TPM_BUFFER(buffer)
+        POOL_TPM_BUFFER(buffer, TPM_MAX_BUFF_SIZE)
         unsigned char* x1 = NULL;
 
 //printf("1. encWrappedCommand!\n");
+        if (seed == NULL || buffer == NULL) {
+                return ERR_MEM_ERR;
+        }
         ret = tpm_buffer_load32(tb, 6, wrapped_ord);
 
         if ((ret & ERR_MASK)) {
@@ -713,7 +663,7 @@ static uint32_t encWrappedCommand(struct tpm_buffer* tb,
                         /*
                          * Encrypt MGF1
                          */
-                        ret = TSS_buildbuff("% % % %", &seed,
+                        ret = TSS_buildbuff("% % % %", seed,
                                             TPM_NONCE_SIZE, TSS_Session_GetENonce(sess),
                                             TPM_NONCE_SIZE, transNonceOdd,
                                             sizeof("in") - 1, "in",
@@ -725,8 +675,8 @@ static uint32_t encWrappedCommand(struct tpm_buffer* tb,
 
                         TSS_MGF1(x1,
                                  enc_len,
-                                 seed.buffer,
-                                 seed.used);
+                                 seed->buffer,
+                                 seed->used);
 #if 0
                         {
                                 int j = 0;
@@ -749,7 +699,7 @@ static uint32_t encWrappedCommand(struct tpm_buffer* tb,
                         unsigned char iv[TPM_AES_BLOCK_SIZE];
 
                         // int num;
-                        ret = TSS_buildbuff("% % %", &seed,
+                        ret = TSS_buildbuff("% % %", seed,
                                             TPM_NONCE_SIZE, TSS_Session_GetENonce(sess),
                                             TPM_NONCE_SIZE, transNonceOdd,
                                             sizeof("in") - 1, "in");
@@ -759,8 +709,8 @@ static uint32_t encWrappedCommand(struct tpm_buffer* tb,
 
                         TSS_MGF1(iv,
                                  sizeof(iv),
-                                 seed.buffer,
-                                 seed.used);
+                                 seed->buffer,
+                                 seed->used);
 #if 0
                         {
                                 int j = 0;
@@ -782,28 +732,27 @@ static uint32_t encWrappedCommand(struct tpm_buffer* tb,
                                                        TPM_AES_BITS,
                                                        iv);
                         } else {
-                                gcry_cipher_hd_t aes;
-
-                                gcry_cipher_open(&aes, GCRY_CIPHER_AES128, GCRY_CIPHER_MODE_OFB, 0);
-                                gcry_cipher_setiv(aes, iv, 16);
-                                gcry_cipher_setkey(aes, TSS_Session_GetAuth(sess), TPM_AES_BITS);
-                                gcry_cipher_encrypt(aes, &enc->buffer[enc_start], enc_len, &tb->buffer[enc_start], enc_len);
-                                gcry_cipher_close(aes);
+                                TPM_AES_ofb128_Encrypt(&enc->buffer[enc_start], /* out */
+                                                       &tb->buffer[enc_start],  /* in */
+                                                       enc_len,
+                                                       TSS_Session_GetAuth(sess),
+                                                       TPM_AES_BITS,
+                                                       iv);
                         }
                 } else {
                         SET_TPM_BUFFER(enc,tb->buffer,tb->used);
                 } /* if (algId == ... ) ... else ... */
-                ret = TSS_buildbuff("L %", &buffer,
+                ret = TSS_buildbuff("L %", buffer,
                                     *wrapped_ord,
                                     enc_len, &tb->buffer[enc_start]);
         } else {
                 SET_TPM_BUFFER(enc,tb->buffer,tb->used);
-                ret = TSS_buildbuff("L", &buffer,
+                ret = TSS_buildbuff("L", buffer,
                                     *wrapped_ord);
 #if 0
                 printf("NOT ENCRYPTING FOR ORD %X (used=%d,ret=%x).\n",
                        *wrapped_ord,
-                       buffer.used,
+                       buffer->used,
                        ret);
 #endif
         }
@@ -812,7 +761,7 @@ static uint32_t encWrappedCommand(struct tpm_buffer* tb,
                 goto exit;
         }
 
-        TSS_sha1(buffer.buffer, buffer.used, H1);
+        TSS_sha1(buffer->buffer, buffer->used, H1);
 
 #if 0
         {
@@ -851,13 +800,16 @@ static uint32_t decWrappedCommand(struct tpm_buffer* tb,
         uint16_t tag;
         uint32_t enc_start;
 
-        STACK_TPM_BUFFER(seed)
+        POOL_TPM_BUFFER(seed, 2 * TPM_NONCE_SIZE + TPM_HASH_SIZE + sizeof("out"))
         uint8_t rhandles;
 
-        STACK_TPM_BUFFER(buffer)
+        POOL_TPM_BUFFER(buffer, TPM_MAX_BUFF_SIZE)
         uint32_t ret_inner = 0;
         uint32_t inner_len;
 
+        if (seed == NULL || buffer == NULL) {
+                return ERR_MEM_ERR;
+        }
         ret = tpm_buffer_load32(tb, offset, &inner_len);
         enc_len = inner_len;
         if ((ret & ERR_MASK)) {
@@ -878,10 +830,10 @@ static uint32_t decWrappedCommand(struct tpm_buffer* tb,
         if (ret_inner) {
                 SET_TPM_BUFFER(res, &tb->buffer[offset], inner_len);
 //printf("Inner return value = %x.\n",ret_inner);
-                ret = TSS_buildbuff("L L", &buffer,
+                ret = TSS_buildbuff("L L", buffer,
                                     ret_inner,
                                     wrapped_ord);
-                TSS_sha1(buffer.buffer, buffer.used, H2);
+                TSS_sha1(buffer->buffer, buffer->used, H2);
 #if 0
                 {
                         uint32_t j = 0;
@@ -940,7 +892,7 @@ static uint32_t decWrappedCommand(struct tpm_buffer* tb,
                         /*
                          * Encrypt MGF1
                          */
-                        ret = TSS_buildbuff("% % % %", &seed,
+                        ret = TSS_buildbuff("% % % %", seed,
                                             TPM_NONCE_SIZE, TSS_Session_GetENonce(sess),
                                             TPM_NONCE_SIZE, transNonceOdd,
                                             sizeof("out") - 1, "out",
@@ -951,8 +903,8 @@ static uint32_t decWrappedCommand(struct tpm_buffer* tb,
 
                         TSS_MGF1(x1,
                                  enc_len,
-                                 seed.buffer,
-                                 seed.used);
+                                 seed->buffer,
+                                 seed->used);
 
                         SET_TPM_BUFFER(res, &tb->buffer[offset], inner_len);
                         for (i = 0; i < enc_len; i++) {
@@ -964,7 +916,7 @@ static uint32_t decWrappedCommand(struct tpm_buffer* tb,
                         unsigned char iv[TPM_AES_BLOCK_SIZE];
 
                         // int num;
-                        ret = TSS_buildbuff("% % %", &seed,
+                        ret = TSS_buildbuff("% % %", seed,
                                             TPM_NONCE_SIZE, TSS_Session_GetENonce(sess),
                                             TPM_NONCE_SIZE, transNonceOdd,
                                             sizeof("out") - 1, "out");
@@ -974,8 +926,8 @@ static uint32_t decWrappedCommand(struct tpm_buffer* tb,
 
                         TSS_MGF1(iv,
                                  sizeof(iv),
-                                 seed.buffer,
-                                 seed.used);
+                                 seed->buffer,
+                                 seed->used);
 #if 0
                         {
                                 int j = 0;
@@ -998,31 +950,30 @@ static uint32_t decWrappedCommand(struct tpm_buffer* tb,
                                                        TPM_AES_BITS,
                                                        iv);
                         } else {
-                                gcry_cipher_hd_t aes;
-
-                                gcry_cipher_open(&aes, GCRY_CIPHER_AES128, GCRY_CIPHER_MODE_OFB, 0);
-                                gcry_cipher_setiv(aes, iv, 16);
-                                gcry_cipher_setkey(aes, TSS_Session_GetAuth(sess), TPM_AES_BITS);
-                                gcry_cipher_encrypt(aes, &res->buffer[enc_start], enc_len, &tb->buffer[enc_start], enc_len);
-                                gcry_cipher_close(aes);
+                                TPM_AES_ofb128_Encrypt(&res->buffer[enc_start], /* out */
+                                                       &tb->buffer[enc_start],  /* in */
+                                                       enc_len,
+                                                       TSS_Session_GetAuth(sess),
+                                                       TPM_AES_BITS,
+                                                       iv);
                         }
                 } else {
                         SET_TPM_BUFFER(res, &tb->buffer[offset], inner_len);
                 }
 
-                ret = TSS_buildbuff("l L %", &buffer,
+                ret = TSS_buildbuff("l L %", buffer,
                                     ret_inner,
                                     wrapped_ord,
                                     enc_len, &res->buffer[plain]);
         } else {
                 SET_TPM_BUFFER(res, &tb->buffer[offset], inner_len);
-                ret = TSS_buildbuff("l L", &buffer,
+                ret = TSS_buildbuff("l L", buffer,
                                     ret_inner,
                                     wrapped_ord);
 #if 0
                 printf("NOT DECRYPTING FOR ORDINAL %X (used=%d,ret=%x).\n",
                        wrapped_ord,
-                       buffer.used,
+                       buffer->used,
                        ret);
 #endif
         }
@@ -1030,7 +981,7 @@ static uint32_t decWrappedCommand(struct tpm_buffer* tb,
         if ((ret & ERR_MASK)) {
                 goto exit;
         }
-        TSS_sha1(buffer.buffer, buffer.used, H2);
+        TSS_sha1(buffer->buffer, buffer->used, H2);
 
 #if 0
         {
@@ -1074,14 +1025,14 @@ uint32_t _TPM_ExecuteTransport(struct tpm_buffer* tb,
         uint32_t wrappedCommandRetSize_no = htonl(tb->used);
         uint32_t len;
 
-        STACK_TPM_BUFFER(encbuffer);
+        POOL_TPM_BUFFER(encbuffer, TPM_MAX_BUFF_SIZE)
         uint32_t wrappedOrd;
         char message[1024];
         uint32_t in_ordinal;
         TPM_CURRENT_TICKS currentticks;
         uint32_t locality;
 
-        if (NULL == tpmdata) {
+        if (NULL == tpmdata || NULL == encbuffer) {
                 ret = ERR_MEM_ERR;
                 goto exit;
         }
@@ -1101,7 +1052,7 @@ uint32_t _TPM_ExecuteTransport(struct tpm_buffer* tb,
         TSS_gennonce(nonceodd);
 
         ret = encWrappedCommand(tb,
-                                &encbuffer,
+                                encbuffer,
                                 transSess,
                                 nonceodd,
                                 &wrappedOrd,
@@ -1111,7 +1062,7 @@ uint32_t _TPM_ExecuteTransport(struct tpm_buffer* tb,
         }
 
         //_TPM_AuditInputstream(tb,1);
-        _calc_login_exec(H1, TSS_Session_GetHandle(transSess));
+        _calc_login_exec(H1, transSess);
 
         /* move Network byte order data to variable for hmac calculation */
         c = 1;
@@ -1128,7 +1079,7 @@ uint32_t _TPM_ExecuteTransport(struct tpm_buffer* tb,
         /* build the request buffer */
         ret = TSS_buildbuff("00 c2 T l @ L % o %", tpmdata,
                             ordinal_no,
-                            encbuffer.used, encbuffer.buffer,
+                            encbuffer->used, encbuffer->buffer,
                             TSS_Session_GetHandle(transSess),
                             TPM_HASH_SIZE, nonceodd,
                             c,
@@ -1159,7 +1110,7 @@ uint32_t _TPM_ExecuteTransport(struct tpm_buffer* tb,
         TSS_Session_SetENonce(transSess,
                               &tpmdata->buffer[TPM_DATA_OFFSET + 8 + 4 + 4 + len]);
 
-        ret = _create_currentticks(TSS_Session_GetHandle(transSess),
+        ret = _create_currentticks(transSess,
                                    &currentticks, tpmdata, TPM_DATA_OFFSET);
         if ((ret & ERR_MASK)) {
                 goto exit;
@@ -1198,7 +1149,7 @@ uint32_t _TPM_ExecuteTransport(struct tpm_buffer* tb,
         _calc_logout_exec(H2,
                           &currentticks,
                           locality,
-                          TSS_Session_GetHandle(transSess));
+                          transSess);
 
         /*
          * I must get the return code of the inner command now.
@@ -1216,14 +1167,18 @@ exit:
 uint32_t TPM_ExecuteTransport(struct tpm_buffer* tb, const char* msg)
 {
         uint32_t ret;
+        struct tss_ctx* ctx = TSS_Ctx_Get();
 
-        STACK_TPM_BUFFER (result)
+        POOL_TPM_BUFFER(result, TPM_MAX_BUFF_SIZE)
+        if (result == NULL) {
+                return ERR_MEM_ERR;
+        }
         ret = _TPM_ExecuteTransport(tb,
-                                    g_transSession[g_num_transports],
+                                    ctx->trans_session[ctx->num_transports],
                                     NULL,
-                                    &result,
+                                    result,
                                     msg);
-        SET_TPM_BUFFER(tb, result.buffer, result.used);
+        SET_TPM_BUFFER(tb, result->buffer, result->used);
         return ret;
 }
 
@@ -1305,8 +1260,7 @@ uint32_t TPM_ReleaseTransportSigned(uint32_t keyhandle,
 
         if ((ret & ERR_MASK) != 0) {
                 TSS_SessionClose(&sess);
-                _delete_transdigest(TSS_Session_GetHandle(transSess));
-                _delete_currentticks(TSS_Session_GetHandle(transSess));
+                _delete_saved_state(transSess);
                 needKeysRoom_Stacked_Undo(keyhandle, orig_keyhandle);
                 return ret;
         }
@@ -1319,8 +1273,7 @@ uint32_t TPM_ReleaseTransportSigned(uint32_t keyhandle,
         TSS_SessionClose(&sess);
 
         if (0 != ret) {
-                _delete_transdigest(TSS_Session_GetHandle(transSess));
-                _delete_currentticks(TSS_Session_GetHandle(transSess));
+                _delete_saved_state(transSess);
                 return ret;
         }
 
@@ -1329,8 +1282,7 @@ uint32_t TPM_ReleaseTransportSigned(uint32_t keyhandle,
                                 &len);
 
         if ((ret & ERR_MASK)) {
-                _delete_transdigest(TSS_Session_GetHandle(transSess));
-                _delete_currentticks(TSS_Session_GetHandle(transSess));
+                _delete_saved_state(transSess);
                 return ret;
         }
 
@@ -1360,17 +1312,16 @@ uint32_t TPM_ReleaseTransportSigned(uint32_t keyhandle,
                              locality,
                              &tct,
                              antiReplay,
-                             TSS_Session_GetHandle(transSess));
+                             transSess);
 
         if (transDigest != NULL) {
-                _read_transdigest(TSS_Session_GetHandle(transSess), transDigest);
+                memcpy(transDigest, transSess->type.tran.transdigest, TPM_DIGEST_SIZE);
         }
         //print_array("transDigest: ",transDigest, 20);
         //char buffer[20];
         //scanf("%s",buffer);
 
-        _delete_transdigest(TSS_Session_GetHandle(transSess));
-        _delete_currentticks(TSS_Session_GetHandle(transSess));
+        _delete_saved_state(transSess);
 
         return ret;
 }
@@ -2,59 +2,322 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
-#include <limits.h>
+#include <ctype.h>
 
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
 #include <keyutils.h>
-#include <gcrypt.h>
 #include <tpmfunc.h>
+#include <tpmutil.h>
+#include <tpm_error.h>
+#include <tpm_lowlevel.h>
+#include <eventlog.h>
 
-static inline void init_gcrypt() {
-        if (!gcry_check_version (GCRYPT_VERSION)) {
-                fputs("libgcrypt version mismatch: compiled for version " GCRYPT_VERSION "\n", stderr);
-                exit(2);
+/**
+ * Memory for secrets, locked so it is never swapped out and wiped when freed
+ */
+static void* secure_alloc(size_t length) {
+        size_t* p = malloc(sizeof(size_t) + length);
+
+        if (!p)
+                return NULL;
+        *p = sizeof(size_t) + length;
+        mlock(p, *p);
+        return p + 1;
+}
+
+static void secure_free(void* buffer) {
+        size_t* p = buffer;
+
+        if (!p)
+                return;
+        p--;
+        explicit_bzero(p, *p);
+        munlock(p, *p);
+        free(p);
+}
+
+/**
+ * Talk to tpmkeyd when it is running, otherwise open the TPM device.
+ * An explicit TPM_DEVICE always means direct access.
+ */
+static void select_transport() {
+        struct tss_ctx* ctx = TSS_Ctx_Get();
+
+        if (getenv("TPM_DEVICE"))
+                return;
+        TPM_LowLevel_Transport_Init(TPM_LOWLEVEL_TRANSPORT_UNIXIO);
+        if (ctx->transport->open(&ctx->fd) != 0) {
+                ctx->fd = -1;
+                TPM_LowLevel_Transport_Init(TPM_LOWLEVEL_TRANSPORT_CHARDEV);
         }
+}
 
-        gcry_control(GCRYCTL_SUSPEND_SECMEM_WARN);
-        gcry_control(GCRYCTL_INIT_SECMEM, 16 * 1024, 0);
-        gcry_control(GCRYCTL_RESUME_SECMEM_WARN);
-        gcry_control(GCRYCTL_INITIALIZATION_FINISHED, 0);
+/**
+ * The key secrets are sealed with: the SRK, or the storage key whose wrapped
+ * blob TPM_PARENT_KEY names, loaded under the SRK with the well known password
+ */
+static bool parent_key(uint32_t* handle) {
+        const char* filename = getenv("TPM_PARENT_KEY");
+        unsigned char* blob = NULL;
+        unsigned char pass[20] = {0};
+        uint32_t blob_length, err;
+
+        *handle = TPM_KH_SRK;
+        if (!filename)
+                return true;
+        err = TPM_ReadFile(filename, &blob, &blob_length);
+        if ((err & ERR_MASK)) {
+                fprintf(stderr, "Could not read parent key from '%s'\n", filename);
+                return false;
+        }
+        err = TPM_LoadKey2Blob(TPM_KH_SRK, pass, blob, blob_length, handle);
+        free(blob);
+        if (err) {
+                fprintf(stderr, "Error from TPM_LoadKey2: %s\n", TPM_GetErrMsg(err));
+                return false;
+        }
+        return true;
 }
 
 /**
- * Unseal with TPM from TPM NVRAM
+ * Evict a key loaded by parent_key, TPM key slots would run out otherwise
  */
-static bool unseal_nv(uint32_t address, uint8_t** buffer, size_t* out_length) {
-        uint8_t* blob = NULL;
-        uint32_t blob_length = 0, length = 0, err;
-        uint32_t parent_key_handle = TPM_KH_SRK;
+static void release_parent_key(uint32_t handle) {
+        if (handle != TPM_KH_SRK)
+                TPM_EvictKey(handle);
+}
+
+/**
+ * Public data of an NV index, asked from the TPM once
+ */
+static const TPM_NV_DATA_PUBLIC* nv_public(uint32_t address) {
+        static TPM_NV_DATA_PUBLIC cached;
+        static bool valid = false;
+        uint32_t err;
+
+        if (valid && cached.nvIndex == address)
+                return &cached;
+        valid = false;
+        err = TPM_NV_GetDataPublic(address, &cached);
+        if (err) {
+                fprintf(stderr, "Error reading public data of NV index 0x%08x: %s\n", address, TPM_GetErrMsg(err));
+                return NULL;
+        }
+        valid = true;
+        return &cached;
+}
+
+/**
+ * Read *length bytes at offset of an NV index, with the authorization its
+ * attributes ask for
+ */
+static uint32_t nv_read(const TPM_NV_DATA_PUBLIC* pub, uint32_t offset, uint8_t* data, uint32_t* length) {
+        uint32_t attributes = pub->permission.attributes;
         // well known password
         unsigned char pass[20] = {0};
 
-        blob_length = 330;
+        if (attributes & TPM_NV_PER_AUTHREAD)
+                return TPM_NV_ReadValueAuth(pub->nvIndex, offset, *length, data, length, pass);
+        if (attributes & TPM_NV_PER_OWNERREAD)
+                return TPM_NV_ReadValue(pub->nvIndex, offset, *length, data, length, pass);
+        return TPM_NV_ReadValue(pub->nvIndex, offset, *length, data, length, NULL);
+}
+
+/**
+ * Length of the TPM_STORED_DATA at the start of blob, 0 if it is malformed
+ */
+static uint32_t stored_data_size(const uint8_t* blob, uint32_t length) {
+        uint32_t size, enc_size;
+
+        if (length < 3 * TPM_U32_SIZE)
+                return 0;
+        size = LOAD32(blob, TPM_U32_SIZE);
+        if (size > length - 3 * TPM_U32_SIZE)
+                return 0;
+        size += 2 * TPM_U32_SIZE;
+        enc_size = LOAD32(blob, size);
+        if (enc_size > length - size - TPM_U32_SIZE)
+                return 0;
+        return size + TPM_U32_SIZE + enc_size;
+}
+
+/**
+ * Unseal the first of the TPM_STORED_DATA packed in blob whose PCR policy
+ * matches; buffer must hold blob_length bytes
+ */
+static uint32_t unseal_blobs(uint32_t parent_key_handle, uint8_t* blob, uint32_t blob_length, uint8_t* buffer, uint32_t* length) {
+        uint32_t offset, size, err = TPM_NOTSEALED_BLOB;
+        // well known password
+        unsigned char pass[20] = {0};
+
+        for (offset = 0; offset < blob_length; offset += size) {
+                size = stored_data_size(blob + offset, blob_length - offset);
+                if (size == 0)
+                        return TPM_NOTSEALED_BLOB;
+                *length = blob_length;
+                err = TPM_Unseal(parent_key_handle, pass, NULL, blob + offset, size, buffer, length);
+                if (err != TPM_WRONGPCRVAL)
+                        break;
+        }
+        return err;
+}
+
+/*
+ * Key table: the sealed blobs of several volumes in one NV index.
+ *
+ *   header    "TPMK", version, reserved, number of slots (16 bit)
+ *   slots     SHA-1 of the LUKS UUID (first 8 bytes), offset and size of
+ *             the blobs in the area (16 bit each)
+ *   blobs     what "tpmkey seal" wrote for each volume, packed
+ *
+ * Numbers are big-endian.
+ */
+#define NV_TABLE_MAGIC          0x54504d4b
+#define NV_TABLE_VERSION        1
+#define NV_TABLE_HEADER_SIZE    8
+#define NV_TABLE_HASH_SIZE      8
+#define NV_TABLE_SLOT_SIZE      (NV_TABLE_HASH_SIZE + 2 * TPM_U16_SIZE)
+
+/* slots read together with the header, more need another read */
+#define NV_TABLE_FIRST_SLOTS    10
+
+/**
+ * Slot key of a volume, the case of the UUID does not matter
+ */
+static void uuid_hash(const char* uuid, unsigned char hash[NV_TABLE_HASH_SIZE]) {
+        unsigned char digest[TPM_HASH_SIZE];
+        char lower[strlen(uuid) + 1];
+        size_t i;
+
+        for (i = 0; uuid[i]; i++)
+                lower[i] = tolower((unsigned char) uuid[i]);
+        TSS_sha1(lower, i, digest);
+        memcpy(hash, digest, NV_TABLE_HASH_SIZE);
+}
+
+/**
+ * Find the slot of a volume in the key table of an NV index
+ */
+static bool nv_table_slot(const TPM_NV_DATA_PUBLIC* pub, const char* uuid, uint32_t* offset, uint32_t* size) {
+        uint8_t header[NV_TABLE_HEADER_SIZE + NV_TABLE_FIRST_SLOTS * NV_TABLE_SLOT_SIZE];
+        uint8_t* slots = header + NV_TABLE_HEADER_SIZE;
+        unsigned char hash[NV_TABLE_HASH_SIZE];
+        uint32_t length = sizeof(header), count, first, i, err;
+        bool found = false;
+
+        if (length > pub->dataSize)
+                length = pub->dataSize;
+        err = nv_read(pub, 0, header, &length);
+        if (err) {
+                fprintf(stderr, "Error from TPM_NV_ReadValue: %s\n", TPM_GetErrMsg(err));
+                return false;
+        }
+        count = length >= NV_TABLE_HEADER_SIZE ? LOAD16(header, 6) : 0;
+        first = count < NV_TABLE_FIRST_SLOTS ? count : NV_TABLE_FIRST_SLOTS;
+        if (length < NV_TABLE_HEADER_SIZE + first * NV_TABLE_SLOT_SIZE ||
+            LOAD32(header, 0) != NV_TABLE_MAGIC || header[4] != NV_TABLE_VERSION ||
+            NV_TABLE_HEADER_SIZE + count * NV_TABLE_SLOT_SIZE > pub->dataSize) {
+                fprintf(stderr, "NV index 0x%08x does not hold a key table.\n", pub->nvIndex);
+                return false;
+        }
+
+        if (count > first) {
+                slots = (uint8_t*) malloc(count * NV_TABLE_SLOT_SIZE);
+                if (!slots) {
+                        fprintf(stderr, "Could not allocate the key table of NV index 0x%08x.\n", pub->nvIndex);
+                        return false;
+                }
+                memcpy(slots, header + NV_TABLE_HEADER_SIZE, first * NV_TABLE_SLOT_SIZE);
+                length = (count - first) * NV_TABLE_SLOT_SIZE;
+                err = nv_read(pub, sizeof(header), slots + first * NV_TABLE_SLOT_SIZE, &length);
+                if (err || length != (count - first) * NV_TABLE_SLOT_SIZE) {
+                        fprintf(stderr, "Error from TPM_NV_ReadValue: %s\n", TPM_GetErrMsg(err ? err : TPM_BAD_DATASIZE));
+                        free(slots);
+                        return false;
+                }
+        }
+
+        uuid_hash(uuid, hash);
+        for (i = 0; i < count; i++) {
+                const uint8_t* slot = slots + i * NV_TABLE_SLOT_SIZE;
+
+                if (memcmp(slot, hash, NV_TABLE_HASH_SIZE) == 0) {
+                        *offset = LOAD16(slot, NV_TABLE_HASH_SIZE);
+                        *size = LOAD16(slot, NV_TABLE_HASH_SIZE + TPM_U16_SIZE);
+                        found = *offset + *size <= pub->dataSize;
+                        break;
+                }
+        }
+        if (slots != header + NV_TABLE_HEADER_SIZE)
+                free(slots);
+        if (!found)
+                fprintf(stderr, "No key for '%s' in NV index 0x%08x.\n", uuid, pub->nvIndex);
+        return found;
+}
+
+/**
+ * Unseal with TPM from TPM NVRAM, from the slot of a volume if uuid is set
+ */
+static bool unseal_nv(uint32_t address, const char* uuid, uint8_t** buffer, size_t* out_length) {
+        const TPM_NV_DATA_PUBLIC* pub;
+        uint8_t* blob = NULL;
+        uint32_t blob_length = 0, length = 0, offset = 0, size, err;
+        uint32_t parent_key_handle;
+
+        pub = nv_public(address);
+        if (!pub)
+                return false;
+        blob_length = pub->dataSize;
+        if (uuid && !nv_table_slot(pub, uuid, &offset, &blob_length))
+                return false;
+
+        /* only the area or the slot is read, whatever its size */
         blob = (uint8_t*) malloc(blob_length);
-        err = TPM_NV_ReadValue(address, 0, blob_length, blob, &blob_length, NULL);
+        if (!blob) {
+                fprintf(stderr, "Could not allocate %u bytes for NV index 0x%08x.\n", blob_length, address);
+                return false;
+        }
+        err = nv_read(pub, offset, blob, &blob_length);
         if (err) {
                 free(blob);
                 fprintf(stderr, "Error from TPM_NV_ReadValue: %s\n", TPM_GetErrMsg(err));
                 return false;
         }
 
-        length = blob_length;
-        *buffer = (uint8_t*) gcry_malloc_secure(length);
-        
-        err = TPM_Unseal(parent_key_handle, pass, NULL, blob, blob_length, *buffer, &length);
+        /* a slot may hold blobs for several PCR policies, a whole area only one */
+        size = uuid ? blob_length : stored_data_size(blob, blob_length);
+        if (size == 0) {
+                free(blob);
+                fprintf(stderr, "Error from TPM_Unseal: %s\n", TPM_GetErrMsg(TPM_NOTSEALED_BLOB));
+                return false;
+        }
+
+        if (!parent_key(&parent_key_handle)) {
+                free(blob);
+                return false;
+        }
+        *buffer = (uint8_t*) secure_alloc(size + 1);
+        if (!*buffer) {
+                release_parent_key(parent_key_handle);
+                free(blob);
+                fprintf(stderr, "Could not allocate memory for the secret.\n");
+                return false;
+        }
+
+        err = unseal_blobs(parent_key_handle, blob, size, *buffer, &length);
+        release_parent_key(parent_key_handle);
         free(blob);
-        (*buffer)[length] = '\0';
 
         if (!err) {
+                (*buffer)[length] = '\0';
                 *out_length = length;
         } else {
-                gcry_free(*buffer);
+                secure_free(*buffer);
                 fprintf(stderr, "Error from TPM_Unseal: %s\n", TPM_GetErrMsg(err));
                 return false;
         }
@@ -70,9 +333,7 @@ static bool unseal_file(const char* filename, uint8_t** buffer, size_t* out_leng
         uint32_t blob_length = 0, length = 0, err;
         int fd;
         struct stat st = { 0 };
-        uint32_t parent_key_handle = TPM_KH_SRK;
-        // well known password
-        unsigned char pass[20] = {0};
+        uint32_t parent_key_handle;
 
         fd = open(filename, O_RDONLY);
         if (fd < 0) {
@@ -82,8 +343,9 @@ static bool unseal_file(const char* filename, uint8_t** buffer, size_t* out_leng
 
         fstat(fd, &st);
         blob_length = st.st_size;
-        if (blob_length > 330) {
+        if (blob_length > TPM_MAX_BUFF_SIZE) {
                 fprintf(stderr, "File '%s' is too large to be a TPM key blob.\n", filename);
+                close(fd);
                 return false;
         }
         blob = (uint8_t*) malloc(blob_length);
@@ -96,17 +358,22 @@ static bool unseal_file(const char* filename, uint8_t** buffer, size_t* out_leng
         }
         close(fd);
 
-        length = blob_length;
-        *buffer = (uint8_t*) gcry_malloc_secure(length);
-        
-        err = TPM_Unseal(parent_key_handle, pass, NULL, blob, blob_length, *buffer, &length);
+        if (!parent_key(&parent_key_handle)) {
+                free(blob);
+                return false;
+        }
+        *buffer = (uint8_t*) secure_alloc(blob_length + 1);
+
+        /* the file may hold several blobs sealed to different PCR policies */
+        err = unseal_blobs(parent_key_handle, blob, blob_length, *buffer, &length);
+        release_parent_key(parent_key_handle);
         free(blob);
-        (*buffer)[length] = '\0';
 
         if (!err) {
+                (*buffer)[length] = '\0';
                 *out_length = length;
         } else {
-                gcry_free(*buffer);
+                secure_free(*buffer);
                 fprintf(stderr, "Error from TPM_Unseal: %s\n", TPM_GetErrMsg(err));
                 return false;
         }
@@ -114,8 +381,263 @@ static bool unseal_file(const char* filename, uint8_t** buffer, size_t* out_leng
         return true;
 }
 
+/**
+ * Build a serialized TPM_PCR_INFO for a seal policy
+ *
+ * A policy is either "none" or a comma separated list of PCRs. Without
+ * substitutions the current PCR values are used. Each "@PCR:OLD:NEW" suffix
+ * replaces the component with SHA1 digest OLD in the measurement log by one
+ * with digest NEW, and the values are predicted by replaying the log.
+ */
+static bool policy_pcrinfo(const char* policy, uint8_t* pcrinfo, uint32_t* pcrinfo_length) {
+        TPM_PCR_SELECTION selection = { .sizeOfSelect = TPM_NUM_PCR / 8 };
+        TPM_PCR_INFO info = { 0 };
+        struct tpm_eventlog log;
+        unsigned char values[TPM_NUM_PCR * TPM_HASH_SIZE];
+        const char* p = policy;
+        char* ep;
+        uint32_t err;
+        STACK_TPM_BUFFER(serInfo)
+
+        if (strcmp(policy, "none") == 0) {
+                *pcrinfo_length = 0;
+                return true;
+        }
+
+        do {
+                unsigned long pcr = strtoul(p, &ep, 10);
+                if (ep == p || pcr >= TPM_NUM_PCR) {
+                        fprintf(stderr, "Illegal PCR in policy '%s'\n", policy);
+                        return false;
+                }
+                selection.pcrSelect[pcr / 8] |= 1 << (pcr % 8);
+                p = ep + 1;
+        } while (*ep == ',');
+
+        if (*ep == '\0') {
+                info.pcrSelection = selection;
+                err = TPM_PcrReadMany(&selection, values, NULL);
+                if (!err)
+                        err = TSS_PCRComposite(&selection, values, info.digestAtRelease);
+                if (err) {
+                        fprintf(stderr, "Error reading PCRs: %s\n", TPM_GetErrMsg(err));
+                        return false;
+                }
+                memcpy(info.digestAtCreation, info.digestAtRelease, TPM_HASH_SIZE);
+        } else {
+                err = TSS_EventLogRead(NULL, &log);
+                if (err) {
+                        fprintf(stderr, "Error reading measurement log: %s\n", TPM_GetErrMsg(err));
+                        return false;
+                }
+                while (*ep == '@') {
+                        unsigned char digest[2][TPM_HASH_SIZE];
+                        unsigned long pcr = strtoul(ep + 1, &ep, 10);
+
+                        for (int d = 0; d < 2; d++) {
+                                if (*ep++ != ':')
+                                        goto illegal;
+                                for (int i = 0; i < TPM_HASH_SIZE; i++, ep += 2) {
+                                        if (sscanf(ep, "%2hhx", &digest[d][i]) != 1)
+                                                goto illegal;
+                                }
+                        }
+                        err = TSS_EventLogSubstitute(&log, pcr, digest[0], digest[1], NULL);
+                        if (err) {
+                                fprintf(stderr, "No measurement to replace in PCR %lu of policy '%s'\n", pcr, policy);
+                                TSS_EventLogFree(&log);
+                                return false;
+                        }
+                }
+                if (*ep != '\0')
+                        goto illegal;
+                err = TSS_EventLogPCRInfo(&log, &selection, &info);
+                TSS_EventLogFree(&log);
+                if (err) {
+                        fprintf(stderr, "Error predicting PCRs: %s\n", TPM_GetErrMsg(err));
+                        return false;
+                }
+        }
+
+        err = TPM_WritePCRInfo(&serInfo, &info);
+        if ((err & ERR_MASK)) {
+                fprintf(stderr, "Error serializing PCR info: %s\n", TPM_GetErrMsg(err));
+                return false;
+        }
+        memcpy(pcrinfo, serInfo.buffer, serInfo.used);
+        *pcrinfo_length = serInfo.used;
+        return true;
+
+illegal:
+        fprintf(stderr, "Illegal substitution in policy '%s'\n", policy);
+        TSS_EventLogFree(&log);
+        return false;
+}
+
+/**
+ * Seal a secret to one or more PCR policies into one file
+ *
+ * tpmkey seal [--policy POLICY]... INPUT OUTPUT
+ */
+static int seal_main(int argc, char* argv[]) {
+        unsigned char* pcrinfo[argc];
+        uint32_t pcrinfo_length[argc];
+        uint32_t count = 0, err;
+        uint8_t* secret;
+        ssize_t length;
+        uint32_t parent_key_handle;
+        int fd, i, ret = 1;
+        // well known password
+        unsigned char pass[20] = {0};
+        STACK_TPM_BUFFER(blobs)
+
+        for (i = 1; i + 1 < argc && strcmp(argv[i], "--policy") == 0; i += 2) {
+                pcrinfo[count] = (unsigned char*) malloc(TPM_MAX_BUFF_SIZE);
+                if (!policy_pcrinfo(argv[i + 1], pcrinfo[count], &pcrinfo_length[count])) {
+                        free(pcrinfo[count]);
+                        goto out;
+                }
+                count++;
+        }
+        if (argc - i != 2) {
+                fprintf(stderr, "Usage: tpmkey seal [--policy POLICY]... INPUT OUTPUT\n");
+                goto out;
+        }
+        if (count == 0) {
+                pcrinfo[count] = NULL;
+                pcrinfo_length[count++] = 0;
+        }
+
+        fd = open(argv[i], O_RDONLY);
+        if (fd < 0) {
+                fprintf(stderr, "Could not open secret from '%s': %m\n", argv[i]);
+                goto out;
+        }
+        secret = (uint8_t*) secure_alloc(TPM_MAX_BUFF_SIZE);
+        length = read(fd, secret, TPM_MAX_BUFF_SIZE);
+        close(fd);
+        if (length <= 0) {
+                fprintf(stderr, "Could not read secret from '%s': %m\n", argv[i]);
+                secure_free(secret);
+                goto out;
+        }
+
+        if (!parent_key(&parent_key_handle)) {
+                secure_free(secret);
+                goto out;
+        }
+        err = TSS_SealMany(parent_key_handle, count, pcrinfo, pcrinfo_length, pass, NULL, secret, length, &blobs);
+        release_parent_key(parent_key_handle);
+        secure_free(secret);
+        if (err) {
+                fprintf(stderr, "Error from TPM_Seal: %s\n", TPM_GetErrMsg(err));
+                goto out;
+        }
+
+        fd = open(argv[i + 1], O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if (fd < 0) {
+                fprintf(stderr, "Could not open '%s' for writing: %m\n", argv[i + 1]);
+                goto out;
+        }
+        if (write(fd, blobs.buffer, blobs.used) != (ssize_t) blobs.used) {
+                fprintf(stderr, "Could not write '%s': %m\n", argv[i + 1]);
+                unlink(argv[i + 1]);
+        } else {
+                ret = 0;
+        }
+        close(fd);
+
+out:
+        for (uint32_t j = 0; j < count; j++)
+                free(pcrinfo[j]);
+        return ret;
+}
+
+/**
+ * Pack the files written by "tpmkey seal" into a key table for one NV index
+ *
+ * tpmkey table OUTPUT UUID=BLOB...
+ */
+static int table_main(int argc, char* argv[]) {
+        uint32_t count = argc - 2, offset, i;
+        struct stat st = { 0 };
+        int fd, ret = 1;
+        STACK_TPM_BUFFER(table)
+
+        if (argc < 3) {
+                fprintf(stderr, "Usage: tpmkey table OUTPUT UUID=BLOB...\n");
+                return 1;
+        }
+        offset = NV_TABLE_HEADER_SIZE + count * NV_TABLE_SLOT_SIZE;
+        if (offset > TPM_MAX_BUFF_SIZE) {
+                fprintf(stderr, "Too many keys for one NV index.\n");
+                return 1;
+        }
+        STORE32(table.buffer, 0, NV_TABLE_MAGIC);
+        table.buffer[4] = NV_TABLE_VERSION;
+        table.buffer[5] = 0;
+        STORE16(table.buffer, 6, count);
+
+        for (i = 0; i < count; i++) {
+                uint8_t* slot = table.buffer + NV_TABLE_HEADER_SIZE + i * NV_TABLE_SLOT_SIZE;
+                char* arg = argv[i + 2];
+                char* blob = strchr(arg, '=');
+                ssize_t length;
+
+                if (!blob || blob == arg) {
+                        fprintf(stderr, "Expected UUID=BLOB instead of '%s'\n", arg);
+                        return 1;
+                }
+                *blob++ = '\0';
+                uuid_hash(arg, slot);
+                for (uint32_t j = 0; j < i; j++) {
+                        if (memcmp(table.buffer + NV_TABLE_HEADER_SIZE + j * NV_TABLE_SLOT_SIZE, slot, NV_TABLE_HASH_SIZE) == 0) {
+                                fprintf(stderr, "Key for '%s' given twice.\n", arg);
+                                return 1;
+                        }
+                }
+
+                fd = open(blob, O_RDONLY);
+                if (fd < 0 || fstat(fd, &st) < 0) {
+                        fprintf(stderr, "Could not open '%s': %m\n", blob);
+                        if (fd >= 0)
+                                close(fd);
+                        return 1;
+                }
+                if (st.st_size <= 0 || st.st_size > TPM_MAX_BUFF_SIZE - offset) {
+                        fprintf(stderr, "Keys do not fit into one NV index.\n");
+                        close(fd);
+                        return 1;
+                }
+                length = read(fd, table.buffer + offset, st.st_size);
+                close(fd);
+                if (length != st.st_size || stored_data_size(table.buffer + offset, length) == 0) {
+                        fprintf(stderr, "'%s' is not a sealed key.\n", blob);
+                        return 1;
+                }
+                STORE16(slot, NV_TABLE_HASH_SIZE, offset);
+                STORE16(slot, NV_TABLE_HASH_SIZE + TPM_U16_SIZE, length);
+                offset += length;
+        }
+        table.used = offset;
+
+        fd = open(argv[1], O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if (fd < 0) {
+                fprintf(stderr, "Could not open '%s' for writing: %m\n", argv[1]);
+                return 1;
+        }
+        if (write(fd, table.buffer, table.used) != (ssize_t) table.used) {
+                fprintf(stderr, "Could not write '%s': %m\n", argv[1]);
+                unlink(argv[1]);
+        } else {
+                ret = 0;
+        }
+        close(fd);
+        return ret;
+}
+
 int main (int argc, char* argv[]) {
-        char* keyfilename = NULL, * outfile = NULL;
+        char* keyfilename = NULL, * outfile = NULL, * uuid = NULL;
         uint32_t nv_address = (uint32_t) -1;
         FILE* output = stdout;
         uint8_t* buffer;
@@ -123,27 +645,33 @@ int main (int argc, char* argv[]) {
         int ret = 1;
         bool unseal;
 
+        if (argc >= 2 && strcmp(argv[1], "seal") == 0) {
+                select_transport();
+                return seal_main(argc - 1, argv + 1);
+        }
+        if (argc >= 2 && strcmp(argv[1], "table") == 0)
+                return table_main(argc - 1, argv + 1);
+
         if (2 > argc || argc > 4) {
                 fprintf(stderr, "Illegal number of arguments.");
                 return 1;
         }
-        if (argc == 2) {
-                if (strncmp(argv[1], "nv:", 3) == 0) {
-                        errno = 0;
-                        char* ep;
-                        long value = strtol(argv[1] + 5, &ep, 16);
-                        if ((errno == ERANGE && (value == LONG_MAX || value == LONG_MIN)) || (errno != 0 && value == 0)) {
-                                fprintf(stderr, "Illegal NV address\n");
-                                return 1;
-                        } else if (value < 0 && value > UINT32_MAX) {
-                                fprintf(stderr, "Illegal NV address\n");
-                                return 1;
-                        } else {
-                                nv_address = (uint32_t) value;
-                        }
-                } else {
-                        keyfilename = argv[1];
+        if (strncmp(argv[1], "nv:", 3) == 0) {
+                char* ep;
+                unsigned long value;
+
+                errno = 0;
+                value = strtoul(argv[1] + 3, &ep, 16);
+                /* nv:ADDRESS:UUID selects the key of one volume in a key table */
+                if (*ep == ':' && ep[1] != '\0')
+                        uuid = ep + 1;
+                if (errno != 0 || ep == argv[1] + 3 || (*ep != '\0' && !uuid) || value > UINT32_MAX) {
+                        fprintf(stderr, "Illegal NV address\n");
+                        return 1;
                 }
+                nv_address = (uint32_t) value;
+        } else {
+                keyfilename = argv[1];
         }
         if (argc == 3) {
                 if (strncmp(argv[2], "key:", 4) == 0) {
@@ -159,12 +687,12 @@ int main (int argc, char* argv[]) {
                 }
         }
 
-        init_gcrypt();
+        select_transport();
 
         if (keyfilename) {
                 unseal = unseal_file(keyfilename, &buffer, &length);
         } else {
-                unseal = unseal_nv(nv_address, &buffer, &length);
+                unseal = unseal_nv(nv_address, uuid, &buffer, &length);
         }
         if (unseal) {
                 ret = 0;
@@ -181,7 +709,7 @@ int main (int argc, char* argv[]) {
                                 keyctl_setperm(key_id, (key_perm_t) 0x3f000000);
                         }
                 }
-                gcry_free(buffer);
+                secure_free(buffer);
         }
 
         if (outfile && output) {
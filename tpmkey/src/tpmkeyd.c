@@ -0,0 +1,360 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <tpm.h>
+#include <tpmutil.h>
+#include <tpm_constants.h>
+#include <tpm_error.h>
+#include <tpm_lowlevel.h>
+#include <tpmqueue.h>
+#include <marshal.h>
+
+/* handles a client may leave behind when it dies */
+#define MAX_CLIENT_HANDLES 16
+
+/* first file descriptor passed by systemd socket activation */
+#define LISTEN_FDS_START 3
+
+struct client {
+        int fd;
+        unsigned int num_handles;
+        struct {
+                uint32_t handle;
+                uint32_t type;
+        } handles[MAX_CLIENT_HANDLES];
+};
+
+static struct tpm_queue* queue;
+
+/* LoadContext request: entity handle, keepHandle, size, then the blob */
+#define LOADCONTEXT_BLOB_OFFSET (TPM_DATA_OFFSET + TPM_U32_SIZE + 1 + TPM_U32_SIZE)
+
+/**
+ * Only the commands needed to unseal, read NV and PCRs, get random numbers
+ * and swap keys are forwarded; everything else is answered with
+ * TPM_BAD_ORDINAL.
+ */
+static bool allowed_ordinal(uint32_t ordinal) {
+        switch (ordinal) {
+        case TPM_ORD_OIAP:
+        case TPM_ORD_OSAP:
+        case TPM_ORD_Unseal:
+        case TPM_ORD_Seal:
+        case TPM_ORD_LoadKey2:
+        case TPM_ORD_FlushSpecific:
+        case TPM_ORD_NV_ReadValue:
+        case TPM_ORD_NV_ReadValueAuth:
+        case TPM_ORD_PcrRead:
+        case TPM_ORD_GetRandom:
+        case TPM_ORD_GetCapability:
+        case TPM_ORD_ReadPubek:
+        case TPM_ORD_SaveContext:
+        case TPM_ORD_LoadContext:
+                return true;
+        }
+        return false;
+}
+
+/**
+ * Replace the request in tb by an error response
+ */
+static void error_response(struct tpm_buffer* tb, uint32_t rc) {
+        TSS_MarshalHeader(tb, TPM_TAG_RSP_COMMAND, TPM_DATA_OFFSET, rc);
+}
+
+static bool track_handle(struct client* c, uint32_t handle, uint32_t type) {
+        if (c->num_handles == MAX_CLIENT_HANDLES)
+                return false;
+        c->handles[c->num_handles].handle = handle;
+        c->handles[c->num_handles].type = type;
+        c->num_handles++;
+        return true;
+}
+
+static bool owns_handle(const struct client* c, uint32_t handle, uint32_t type) {
+        for (unsigned int i = 0; i < c->num_handles; i++) {
+                if (c->handles[i].handle == handle && c->handles[i].type == type)
+                        return true;
+        }
+        return false;
+}
+
+/**
+ * Keys a client may use: its own and the permanent ones like the SRK
+ */
+static bool may_use_key(const struct client* c, uint32_t handle) {
+        if (handle >= TPM_KH_SRK && handle <= TPM_KH_EK)
+                return true;
+        return owns_handle(c, handle, TPM_RT_KEY);
+}
+
+static void untrack_handle(struct client* c, uint32_t handle) {
+        for (unsigned int i = 0; i < c->num_handles; i++) {
+                if (c->handles[i].handle == handle) {
+                        c->handles[i] = c->handles[--c->num_handles];
+                        return;
+                }
+        }
+}
+
+static void flush_handle(uint32_t handle, uint32_t type) {
+        STACK_TPM_BUFFER(tb)
+
+        TSS_MarshalFlushSpecific(&tb, handle, type);
+        TSS_Queue_Transmit(queue, &tb, "FlushSpecific");
+}
+
+/**
+ * Flush the sessions and keys a client did not flush itself
+ */
+static void flush_handles(struct client* c) {
+        for (unsigned int i = 0; i < c->num_handles; i++)
+                flush_handle(c->handles[i].handle, c->handles[i].type);
+        c->num_handles = 0;
+}
+
+/**
+ * Authorization sessions of a request with their continueAuthSession flags
+ */
+static unsigned int request_auths(const struct tpm_buffer* tb, uint32_t handles[2], bool cont[2]) {
+        uint16_t tag = LOAD16(tb->buffer, 0);
+        unsigned int n = tag == TPM_TAG_RQU_AUTH2_COMMAND ? 2 : tag == TPM_TAG_RQU_AUTH1_COMMAND ? 1 : 0;
+
+        if (tb->used < TPM_DATA_OFFSET + n * TPM_REQ_AUTH_SIZE)
+                return 0;
+        for (unsigned int i = 0; i < n; i++) {
+                uint32_t offset = tb->used - (n - i) * TPM_REQ_AUTH_SIZE;
+
+                handles[i] = LOAD32(tb->buffer, offset);
+                cont[i] = tb->buffer[offset + TPM_U32_SIZE + TPM_NONCE_SIZE] != 0;
+        }
+        return n;
+}
+
+/**
+ * Whether a request only touches handles the client owns; the key of
+ * Unseal, Seal, LoadKey2 and OSAP, the handle of FlushSpecific and
+ * SaveContext and the authorization sessions are checked, and only key
+ * contexts may be saved and loaded.
+ */
+static uint32_t check_handles(const struct client* c, const struct tpm_buffer* tb, uint32_t ordinal,
+                              const uint32_t* auths, unsigned int num_auths) {
+        uint32_t type;
+
+        switch (ordinal) {
+        case TPM_ORD_Unseal:
+        case TPM_ORD_Seal:
+        case TPM_ORD_LoadKey2:
+                /* keyHandle, parentHandle for LoadKey2 */
+                if (tb->used < TPM_DATA_OFFSET + TPM_U32_SIZE)
+                        return TPM_BAD_PARAMETER;
+                if (!may_use_key(c, LOAD32(tb->buffer, TPM_DATA_OFFSET)))
+                        return TPM_INVALID_KEYHANDLE;
+                break;
+        case TPM_ORD_OSAP:
+                if (tb->used < TPM_DATA_OFFSET + TPM_U16_SIZE + TPM_U32_SIZE)
+                        return TPM_BAD_PARAMETER;
+                /* the high byte of the entity type selects the ADIP encryption */
+                if ((LOAD16(tb->buffer, TPM_DATA_OFFSET) & 0xff) == TPM_ET_KEYHANDLE &&
+                    !may_use_key(c, LOAD32(tb->buffer, TPM_DATA_OFFSET + TPM_U16_SIZE)))
+                        return TPM_INVALID_KEYHANDLE;
+                break;
+        case TPM_ORD_FlushSpecific:
+        case TPM_ORD_SaveContext:
+                if (tb->used < TPM_DATA_OFFSET + 2 * TPM_U32_SIZE)
+                        return TPM_BAD_PARAMETER;
+                type = LOAD32(tb->buffer, TPM_DATA_OFFSET + TPM_U32_SIZE);
+                if (ordinal == TPM_ORD_SaveContext && type != TPM_RT_KEY)
+                        return TPM_INVALID_RESOURCE;
+                if (!owns_handle(c, LOAD32(tb->buffer, TPM_DATA_OFFSET), type))
+                        return type == TPM_RT_AUTH ? TPM_INVALID_AUTHHANDLE : TPM_INVALID_KEYHANDLE;
+                break;
+        case TPM_ORD_LoadContext:
+                if (tb->used < LOADCONTEXT_BLOB_OFFSET + TPM_U16_SIZE + TPM_U32_SIZE)
+                        return TPM_BAD_PARAMETER;
+                if (LOAD32(tb->buffer, LOADCONTEXT_BLOB_OFFSET + TPM_U16_SIZE) != TPM_RT_KEY)
+                        return TPM_INVALID_RESOURCE;
+                break;
+        }
+        for (unsigned int i = 0; i < num_auths; i++) {
+                if (!owns_handle(c, auths[i], TPM_RT_AUTH))
+                        return TPM_INVALID_AUTHHANDLE;
+        }
+        return 0;
+}
+
+/**
+ * Forward one request of a client to the TPM
+ */
+static void serve_request(struct client* c, struct tpm_buffer* tb) {
+        uint32_t ordinal = LOAD32(tb->buffer, TPM_U16_SIZE + TPM_U32_SIZE);
+        uint32_t handle = 0, auths[2], type, ret;
+        bool cont[2];
+        unsigned int num_auths;
+
+        if (!allowed_ordinal(ordinal)) {
+                error_response(tb, TPM_BAD_ORDINAL);
+                return;
+        }
+        num_auths = request_auths(tb, auths, cont);
+        ret = check_handles(c, tb, ordinal, auths, num_auths);
+        if (ret != 0) {
+                error_response(tb, ret);
+                return;
+        }
+        if (ordinal == TPM_ORD_FlushSpecific)
+                handle = LOAD32(tb->buffer, TPM_DATA_OFFSET);
+
+        ret = TSS_Queue_Transmit(queue, tb, "tpmkeyd");
+
+        /* the handle is gone or was never valid, whatever the TPM answered */
+        if (ordinal == TPM_ORD_FlushSpecific)
+                untrack_handle(c, handle);
+        /* the TPM ends the sessions of a failed command and those not continued */
+        for (unsigned int i = 0; i < num_auths; i++) {
+                if ((ret & ERR_MASK))
+                        flush_handle(auths[i], TPM_RT_AUTH);
+                if (ret != 0 || !cont[i])
+                        untrack_handle(c, auths[i]);
+        }
+        if ((ret & ERR_MASK)) {
+                error_response(tb, TPM_FAIL);
+                return;
+        }
+        if (ret != 0)
+                return;
+
+        switch (ordinal) {
+        case TPM_ORD_OIAP:
+        case TPM_ORD_OSAP:
+                type = TPM_RT_AUTH;
+                break;
+        case TPM_ORD_LoadKey2:
+        case TPM_ORD_LoadContext:
+                type = TPM_RT_KEY;
+                break;
+        default:
+                return;
+        }
+        handle = LOAD32(tb->buffer, TPM_DATA_OFFSET);
+        if (!track_handle(c, handle, type)) {
+                /* never leave a handle behind that would not be flushed */
+                flush_handle(handle, type);
+                error_response(tb, TPM_RESOURCES);
+        }
+}
+
+static void* client_thread(void* arg) {
+        struct client* c = arg;
+        STACK_TPM_BUFFER(tb)
+
+        while (TSS_ReadPacket(c->fd, &tb, 0) == 0) {
+                serve_request(c, &tb);
+                if (TSS_WritePacket(c->fd, tb.buffer, LOAD32(tb.buffer, TPM_PARAMSIZE_OFFSET)) != 0)
+                        break;
+        }
+        flush_handles(c);
+        close(c->fd);
+        free(c);
+        return NULL;
+}
+
+/**
+ * Take the socket from systemd or create it
+ */
+static int listen_socket(const char* path) {
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        const char* e = getenv("LISTEN_PID");
+        int fd;
+
+        if (e && strtol(e, NULL, 10) == getpid()) {
+                e = getenv("LISTEN_FDS");
+                if (e && strtol(e, NULL, 10) >= 1)
+                        return LISTEN_FDS_START;
+        }
+
+        if (strlen(path) >= sizeof(addr.sun_path)) {
+                fprintf(stderr, "Socket path '%s' too long\n", path);
+                return -1;
+        }
+        strcpy(addr.sun_path, path);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+                fprintf(stderr, "Could not create socket: %m\n");
+                return -1;
+        }
+        unlink(path);
+        mode_t mask = umask(0077);
+        if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+                fprintf(stderr, "Could not listen on '%s': %m\n", path);
+                umask(mask);
+                close(fd);
+                return -1;
+        }
+        umask(mask);
+        return fd;
+}
+
+int main (int argc, char* argv[]) {
+        const char* path = TPM_BROKER_SOCKET;
+        pthread_attr_t attr;
+        int lfd;
+
+        if (argc > 2) {
+                fprintf(stderr, "Usage: tpmkeyd [SOCKET]\n");
+                return 1;
+        }
+        if (argc == 2)
+                path = argv[1];
+
+        signal(SIGPIPE, SIG_IGN);
+        lfd = listen_socket(path);
+        if (lfd < 0)
+                return 1;
+
+        /* the queue thread owns /dev/tpm0 for the lifetime of the daemon */
+        queue = TSS_Queue_Start(16);
+        if (!queue) {
+                fprintf(stderr, "Could not start TPM queue\n");
+                return 1;
+        }
+        TSS_Queue_SetFreshness(queue, TPM_ORD_GetCapability, 1000000);
+        TSS_Queue_SetFreshness(queue, TPM_ORD_ReadPubek, 1000000);
+
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        for (;;) {
+                pthread_t thread;
+                struct client* c;
+                int fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+
+                if (fd < 0) {
+                        if (errno == EINTR || errno == ECONNABORTED)
+                                continue;
+                        fprintf(stderr, "accept failed: %m\n");
+                        break;
+                }
+                c = calloc(1, sizeof(struct client));
+                if (!c) {
+                        close(fd);
+                        continue;
+                }
+                c->fd = fd;
+                if (pthread_create(&thread, &attr, client_thread, c) != 0) {
+                        close(fd);
+                        free(c);
+                }
+        }
+        TSS_Queue_Stop(queue);
+        return 1;
+}
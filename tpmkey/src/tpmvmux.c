@@ -0,0 +1,442 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include <tpm.h>
+#include <tpmutil.h>
+#include <tpm_constants.h>
+#include <tpm_error.h>
+#include <tpm_lowlevel.h>
+#include <tpmqueue.h>
+#include <marshal.h>
+
+/* bits 31-29 of the instance word carry the locality */
+#define INSTANCE_MASK 0x1fffffff
+
+#define INSTANCE_BUCKETS 256
+
+/* default for -n, every instance holds a backend connection */
+#define DEFAULT_MAX_INSTANCES 1024
+
+/* default for -w, backend round trips in flight at once */
+#define DEFAULT_WORKERS 8
+
+/* a hung backend gives its worker back after this */
+#define BACKEND_TIMEOUT_SECS 120
+
+/* instances without requests for that long are stopped */
+#define INSTANCE_IDLE_SECS 300
+
+#define DEFAULT_BACKEND_DIR "/var/vtpm"
+
+struct request {
+        struct tpm_buffer* tb;
+        uint32_t result;
+        struct timespec submitted;
+        sem_t done;
+        struct request* next;
+};
+
+struct instance {
+        uint32_t id;
+        char backend[sizeof(((struct sockaddr_un*) 0)->sun_path)];
+        int fd;                         /* backend connection, -1 until used */
+        struct request* head;           /* requests waiting, served in order */
+        struct request** tail;
+        bool runnable;                  /* in the run queue or being served */
+        unsigned int active;            /* requests submitted, not answered */
+        struct timespec last_used;
+        struct tpm_queue_stats stats;
+        struct instance* next;
+        struct instance* run_next;
+};
+
+static const char* backend_dir = DEFAULT_BACKEND_DIR;
+static const char* emulator;
+static unsigned int max_instances = DEFAULT_MAX_INSTANCES;
+static unsigned int num_workers = DEFAULT_WORKERS;
+static pthread_mutex_t instances_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t instances_runnable = PTHREAD_COND_INITIALIZER;
+static struct instance* instances[INSTANCE_BUCKETS];
+static struct instance* run_head;
+static struct instance** run_tail = &run_head;
+static unsigned int num_instances;
+static struct timespec started;
+
+static uint64_t usecs_between(const struct timespec* from, const struct timespec* to) {
+        return (to->tv_sec - from->tv_sec) * 1000000ULL + (to->tv_nsec - from->tv_nsec) / 1000;
+}
+
+/**
+ * Find the instance or add it.  An instance with its own socket
+ * <dir>/vtpm-<instance>.socket is served by it, any other by the local
+ * emulator given with -e.  Both receive the instance tagged packets
+ * unchanged, so the locality reaches the backend.  At most max_instances
+ * are kept.  Call with instances_lock held.
+ */
+static struct instance* get_instance(uint32_t id) {
+        struct instance** bucket = &instances[id % INSTANCE_BUCKETS];
+        struct instance* inst;
+        struct stat st;
+
+        for (inst = *bucket; inst; inst = inst->next) {
+                if (inst->id == id)
+                        return inst;
+        }
+        if (num_instances >= max_instances)
+                return NULL;
+        inst = calloc(1, sizeof(struct instance));
+        if (!inst)
+                return NULL;
+        inst->id = id;
+        inst->fd = -1;
+        inst->tail = &inst->head;
+        snprintf(inst->backend, sizeof(inst->backend), "%s/vtpm-%u.socket", backend_dir, id);
+        if (stat(inst->backend, &st) < 0 || !S_ISSOCK(st.st_mode)) {
+                if (!emulator) {
+                        free(inst);
+                        return NULL;
+                }
+                snprintf(inst->backend, sizeof(inst->backend), "%s", emulator);
+        }
+        inst->next = *bucket;
+        *bucket = inst;
+        num_instances++;
+        return inst;
+}
+
+/**
+ * Stop the instances that served no request for INSTANCE_IDLE_SECS
+ */
+static void reap_instances(void) {
+        struct instance* idle = NULL;
+        struct instance* inst;
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        pthread_mutex_lock(&instances_lock);
+        for (unsigned int i = 0; i < INSTANCE_BUCKETS; i++) {
+                struct instance** pp = &instances[i];
+
+                while ((inst = *pp)) {
+                        if (inst->active == 0 && now.tv_sec - inst->last_used.tv_sec >= INSTANCE_IDLE_SECS) {
+                                *pp = inst->next;
+                                inst->next = idle;
+                                idle = inst;
+                                num_instances--;
+                        } else {
+                                pp = &inst->next;
+                        }
+                }
+        }
+        pthread_mutex_unlock(&instances_lock);
+
+        while ((inst = idle)) {
+                idle = inst->next;
+                if (inst->fd >= 0)
+                        close(inst->fd);
+                free(inst);
+        }
+}
+
+static int connect_backend(const char* path) {
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        struct timeval timeout = { .tv_sec = BACKEND_TIMEOUT_SECS };
+        int fd;
+
+        strcpy(addr.sun_path, path);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+                return -1;
+        if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+                close(fd);
+                return -1;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        return fd;
+}
+
+/**
+ * Send one tagged packet to the instance's backend and read the tagged
+ * response into the same buffer.  Only the worker serving the instance
+ * uses its connection.  A broken connection is dropped and opened again
+ * by the next request.
+ */
+static uint32_t backend_transmit(struct instance* inst, struct tpm_buffer* tb) {
+        uint32_t tag = LOAD32(tb->buffer, 0);
+        uint32_t ret;
+
+        if (inst->fd < 0)
+                inst->fd = connect_backend(inst->backend);
+        if (inst->fd < 0)
+                return ERR_IO;
+        ret = TSS_WritePacket(inst->fd, tb->buffer, tb->used);
+        if (ret == 0)
+                ret = TSS_ReadPacket(inst->fd, tb, TPM_U32_SIZE);
+        if (ret == 0 && (LOAD32(tb->buffer, 0) & INSTANCE_MASK) != (tag & INSTANCE_MASK))
+                ret = ERR_BAD_RESP;
+        if (ret != 0) {
+                close(inst->fd);
+                inst->fd = -1;
+        }
+        return ret;
+}
+
+static void run_push(struct instance* inst) {
+        inst->run_next = NULL;
+        *run_tail = inst;
+        run_tail = &inst->run_next;
+}
+
+/**
+ * Serve the run queue.  A worker takes the first instance, sends one of
+ * its requests and puts it back at the end if more are waiting, so the
+ * instances take turns and one busy guest holds at most one worker.
+ */
+static void* worker_thread(void* arg) {
+        struct instance* inst;
+        struct request* req;
+        struct timespec start, end;
+
+        (void) arg;
+        pthread_mutex_lock(&instances_lock);
+        for (;;) {
+                while (!run_head)
+                        pthread_cond_wait(&instances_runnable, &instances_lock);
+                inst = run_head;
+                run_head = inst->run_next;
+                if (!run_head)
+                        run_tail = &run_head;
+                req = inst->head;
+                inst->head = req->next;
+                if (!inst->head)
+                        inst->tail = &inst->head;
+                pthread_mutex_unlock(&instances_lock);
+
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                req->result = backend_transmit(inst, req->tb);
+                clock_gettime(CLOCK_MONOTONIC, &end);
+
+                pthread_mutex_lock(&instances_lock);
+                inst->stats.requests++;
+                inst->stats.wait_usecs += usecs_between(&req->submitted, &start);
+                inst->stats.busy_usecs += usecs_between(&start, &end);
+                if (usecs_between(&req->submitted, &start) > inst->stats.max_wait_usecs)
+                        inst->stats.max_wait_usecs = usecs_between(&req->submitted, &start);
+                inst->active--;
+                inst->last_used = end;
+                if (inst->head)
+                        run_push(inst);
+                else
+                        inst->runnable = false;
+                sem_post(&req->done);
+        }
+        return NULL;
+}
+
+/**
+ * Queue the packet for its instance and wait for a worker to answer it
+ */
+static uint32_t submit(struct tpm_buffer* tb) {
+        struct request req = { .tb = tb };
+        struct instance* inst;
+
+        sem_init(&req.done, 0, 0);
+        clock_gettime(CLOCK_MONOTONIC, &req.submitted);
+        pthread_mutex_lock(&instances_lock);
+        inst = get_instance(LOAD32(tb->buffer, 0) & INSTANCE_MASK);
+        if (!inst) {
+                pthread_mutex_unlock(&instances_lock);
+                sem_destroy(&req.done);
+                return ERR_MEM_ERR;
+        }
+        *inst->tail = &req;
+        inst->tail = &req.next;
+        inst->active++;
+        if (!inst->runnable) {
+                inst->runnable = true;
+                run_push(inst);
+                pthread_cond_signal(&instances_runnable);
+        }
+        pthread_mutex_unlock(&instances_lock);
+
+        while (sem_wait(&req.done) != 0 && errno == EINTR)
+                ;
+        sem_destroy(&req.done);
+        return req.result;
+}
+
+/**
+ * Route one instance tagged packet; on return tb holds the tagged response
+ */
+static void serve_request(struct tpm_buffer* tb) {
+        uint32_t tag = LOAD32(tb->buffer, 0);
+
+        if ((submit(tb) & ERR_MASK)) {
+                STORE16(tb->buffer, TPM_U32_SIZE, TPM_TAG_RSP_COMMAND);
+                STORE32(tb->buffer, TPM_U32_SIZE + TPM_PARAMSIZE_OFFSET, TPM_DATA_OFFSET);
+                STORE32(tb->buffer, TPM_U32_SIZE + TPM_RETURN_OFFSET, TPM_FAIL);
+                tb->used = TPM_U32_SIZE + TPM_DATA_OFFSET;
+        }
+        STORE32(tb->buffer, 0, tag);
+}
+
+static void* client_thread(void* arg) {
+        int fd = (int) (intptr_t) arg;
+        STACK_TPM_BUFFER(tb)
+
+        while (TSS_ReadPacket(fd, &tb, TPM_U32_SIZE) == 0) {
+                serve_request(&tb);
+                if (TSS_WritePacket(fd, tb.buffer, tb.used) != 0)
+                        break;
+        }
+        close(fd);
+        return NULL;
+}
+
+/**
+ * Print throughput and latency of every instance
+ */
+static void report(void) {
+        struct timespec now;
+        double uptime;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        uptime = (now.tv_sec - started.tv_sec) + (now.tv_nsec - started.tv_nsec) / 1e9;
+
+        pthread_mutex_lock(&instances_lock);
+        for (unsigned int i = 0; i < INSTANCE_BUCKETS; i++) {
+                for (struct instance* inst = instances[i]; inst; inst = inst->next) {
+                        struct tpm_queue_stats* s = &inst->stats;
+
+                        fprintf(stderr, "instance %u: %llu requests, %.1f/s, latency %llu us avg, wait %llu us max\n",
+                                inst->id, (unsigned long long) s->requests,
+                                uptime > 0 ? s->requests / uptime : 0.0,
+                                s->requests ? (unsigned long long) ((s->wait_usecs + s->busy_usecs) / s->requests) : 0,
+                                (unsigned long long) s->max_wait_usecs);
+                }
+        }
+        pthread_mutex_unlock(&instances_lock);
+}
+
+static void* signal_thread(void* arg) {
+        sigset_t* set = arg;
+        struct timespec timeout = { .tv_sec = INSTANCE_IDLE_SECS / 4 };
+
+        for (;;) {
+                if (sigtimedwait(set, NULL, &timeout) == SIGUSR1)
+                        report();
+                reap_instances();
+        }
+        return NULL;
+}
+
+static int listen_socket(const char* path) {
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        int fd;
+
+        if (strlen(path) >= sizeof(addr.sun_path)) {
+                fprintf(stderr, "Socket path '%s' too long\n", path);
+                return -1;
+        }
+        strcpy(addr.sun_path, path);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+                fprintf(stderr, "Could not create socket: %m\n");
+                return -1;
+        }
+        unlink(path);
+        mode_t mask = umask(0077);
+        if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0 || listen(fd, 128) < 0) {
+                fprintf(stderr, "Could not listen on '%s': %m\n", path);
+                umask(mask);
+                close(fd);
+                return -1;
+        }
+        umask(mask);
+        return fd;
+}
+
+int main (int argc, char* argv[]) {
+        const char* path = TPM_VTPM_SOCKET;
+        static sigset_t set;
+        pthread_attr_t attr;
+        pthread_t thread;
+        int opt, lfd;
+
+        while ((opt = getopt(argc, argv, "b:e:n:w:")) != -1) {
+                switch (opt) {
+                case 'b':
+                        backend_dir = optarg;
+                        break;
+                case 'e':
+                        emulator = optarg;
+                        break;
+                case 'n':
+                        max_instances = strtoul(optarg, NULL, 0);
+                        break;
+                case 'w':
+                        num_workers = strtoul(optarg, NULL, 0);
+                        break;
+                default:
+                        fprintf(stderr, "Usage: tpmvmux [-b BACKEND_DIR] [-e EMULATOR_SOCKET] [-n MAX_INSTANCES] [-w WORKERS] [SOCKET]\n");
+                        return 1;
+                }
+        }
+        if (emulator && strlen(emulator) >= sizeof(((struct sockaddr_un*) 0)->sun_path)) {
+                fprintf(stderr, "Socket path '%s' too long\n", emulator);
+                return 1;
+        }
+        if (num_workers == 0) {
+                fprintf(stderr, "At least one worker is needed\n");
+                return 1;
+        }
+        if (optind < argc)
+                path = argv[optind];
+
+        signal(SIGPIPE, SIG_IGN);
+        sigemptyset(&set);
+        sigaddset(&set, SIGUSR1);
+        pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+        lfd = listen_socket(path);
+        if (lfd < 0)
+                return 1;
+        clock_gettime(CLOCK_MONOTONIC, &started);
+
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        pthread_create(&thread, &attr, signal_thread, &set);
+        for (unsigned int i = 0; i < num_workers; i++) {
+                if (pthread_create(&thread, &attr, worker_thread, NULL) != 0) {
+                        fprintf(stderr, "Could not start workers\n");
+                        return 1;
+                }
+        }
+        for (;;) {
+                int fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+
+                if (fd < 0) {
+                        if (errno == EINTR || errno == ECONNABORTED)
+                                continue;
+                        fprintf(stderr, "accept failed: %m\n");
+                        break;
+                }
+                if (pthread_create(&thread, &attr, client_thread, (void*) (intptr_t) fd) != 0)
+                        close(fd);
+        }
+        return 1;
+}